@@ -0,0 +1,693 @@
+/*
+ *  This file is part of vban.
+ *  Copyright (c) 2015 by Benoît Quiniou <quiniouben@yahoo.fr>
+ *
+ *  vban is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  vban is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with vban.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include "vban/vban.h"
+#include "common/version.h"
+#include "common/audio.h"
+#include "common/convert.h"
+#include "common/logger.h"
+#include "common/packet.h"
+#include "common/socket.h"
+#include "common/stream.h"
+
+#define BENCH_STREAM_NAME       "Bench"
+#define BENCH_SAMPLE_RATE       48000
+#define BENCH_PORT              6990
+#define BENCH_OUTPUT_SIZE       256
+
+enum bench_suite
+{
+    BENCH_PACKET    = 1 << 0,
+    BENCH_MAP       = 1 << 1,
+    BENCH_JACK      = 1 << 2,
+    BENCH_SOCKET    = 1 << 3,
+    BENCH_ALL       = BENCH_PACKET | BENCH_MAP | BENCH_JACK | BENCH_SOCKET,
+};
+
+struct config_t
+{
+    size_t          channels[VBAN_CHANNELS_MAX_NB];
+    size_t          nb_channel_counts;
+    size_t          nb_frames;
+    size_t          iterations;
+    unsigned int    suites;
+    short           port;
+    char            output[BENCH_OUTPUT_SIZE];
+};
+
+/** keeps the compiler from optimizing the benchmarked work away */
+static volatile float BenchSink;
+
+/** machine readable copy of the results, if asked. Readable results go to stderr when it is stdout */
+static FILE* BenchOutput = 0;
+static FILE* BenchLog = 0;
+
+void usage()
+{
+    printf("\nUsage: vban_bench [OPTIONS]...\n\n");
+    printf("-n, --nbchannels=LIST   : comma separated list of channel counts to sweep. default 1,2,8,32\n");
+    printf("-f, --frames=VALUE      : number of frames per jack period. default 128\n");
+    printf("-i, --iterations=VALUE  : number of packets processed per measure. default 20000\n");
+    printf("-s, --suites=LIST       : comma separated list of benchmarks to run among packet, map, jack, socket. default all of them\n");
+    printf("-p, --port=VALUE        : udp port used on the loopback by the socket benchmark. default 6990\n");
+    printf("-o, --output=FILE       : also write the results as csv to FILE, - for standard output\n");
+    printf("-h, --help              : display this message\n\n");
+}
+
+static double bench_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+/**
+ * Print one result, and write it to the csv output if any.
+ * A packet is the unit processed by one call: a vban packet, or a jack period for the jack benchmarks.
+ */
+static void bench_report(char const* name, enum VBanBitResolution bit_fmt, size_t nb_channels, size_t nb_frames, double ns)
+{
+    double const samples_per_second = (double)(nb_channels * nb_frames) * 1e9 / ns;
+
+    fprintf(BenchLog, "%-24s %-4s %3zu ch %4zu frames : %10.1f ns/packet %14.0f samples/s\n",
+        name, stream_print_bit_fmt(bit_fmt), nb_channels, nb_frames, ns, samples_per_second);
+
+    if (BenchOutput != 0)
+    {
+        fprintf(BenchOutput, "%s,%s,%zu,%zu,%.1f,%.0f\n",
+            name, stream_print_bit_fmt(bit_fmt), nb_channels, nb_frames, ns, samples_per_second);
+    }
+}
+
+/** frames in the biggest packet the tools send for this format */
+static size_t bench_packet_frames(enum VBanBitResolution bit_fmt, size_t nb_channels)
+{
+    size_t const nb_frames = VBAN_DATA_MAX_SIZE / (VBanBitResolutionSize[bit_fmt] * nb_channels);
+
+    return (nb_frames < VBAN_SAMPLES_MAX_NB) ? nb_frames : VBAN_SAMPLES_MAX_NB;
+}
+
+static void bench_fill(char* buffer, size_t size, enum VBanBitResolution bit_fmt)
+{
+    size_t index;
+    float value;
+
+    for (index = 0; index != size; ++index)
+    {
+        buffer[index] = (char)rand();
+    }
+    if (bit_fmt == VBAN_BITFMT_32_FLOAT)
+    {
+        for (index = 0; index != size / sizeof(float); ++index)
+        {
+            value = (float)rand() / (float)RAND_MAX - 0.5f;
+            memcpy(buffer + (index * sizeof(float)), &value, sizeof(float));
+        }
+    }
+}
+
+static int bench_packet_init(char* buffer, enum VBanBitResolution bit_fmt, size_t nb_channels, size_t* size)
+{
+    struct stream_config_t stream_config;
+    size_t const payload_size = bench_packet_frames(bit_fmt, nb_channels) * VBanBitResolutionSize[bit_fmt] * nb_channels;
+    int ret;
+
+    stream_config.nb_channels   = nb_channels;
+    stream_config.sample_rate   = BENCH_SAMPLE_RATE;
+    stream_config.bit_fmt       = bit_fmt;
+    stream_config.nb_samples    = 0;
+
+    ret = packet_init_header(buffer, &stream_config, BENCH_STREAM_NAME);
+    if (ret != 0)
+    {
+        return ret;
+    }
+
+    bench_fill(buffer + VBAN_HEADER_SIZE, payload_size, bit_fmt);
+    *size = VBAN_HEADER_SIZE + payload_size;
+
+    return packet_set_new_content(buffer, payload_size);
+}
+
+/** parsing and header work done for each packet received or sent */
+static int bench_packet(struct config_t const* config, enum VBanBitResolution bit_fmt, size_t nb_channels)
+{
+    size_t const nb_frames = bench_packet_frames(bit_fmt, nb_channels);
+    char buffer[VBAN_PROTOCOL_MAX_SIZE];
+    struct stream_config_t stream_config;
+    enum packet_invalid reason;
+    size_t size;
+    size_t index;
+    double start;
+    int nb_errors = 0;
+
+    if (bench_packet_init(buffer, bit_fmt, nb_channels, &size) != 0)
+    {
+        fprintf(stderr, "packet %s: could not build packet\n", stream_print_bit_fmt(bit_fmt));
+        return 1;
+    }
+
+    start = bench_now();
+    for (index = 0; index != config->iterations; ++index)
+    {
+        nb_errors += (packet_check(BENCH_STREAM_NAME, buffer, size, &reason) != 0);
+    }
+    bench_report("packet_check", bit_fmt, nb_channels, nb_frames, (bench_now() - start) / (double)config->iterations);
+
+    start = bench_now();
+    for (index = 0; index != config->iterations; ++index)
+    {
+        nb_errors += (packet_get_stream_config(buffer, &stream_config) != 0);
+    }
+    bench_report("packet_get_stream_config", bit_fmt, nb_channels, nb_frames, (bench_now() - start) / (double)config->iterations);
+
+    start = bench_now();
+    for (index = 0; index != config->iterations; ++index)
+    {
+        nb_errors += (packet_set_new_content(buffer, size - VBAN_HEADER_SIZE) != 0);
+    }
+    bench_report("packet_set_new_content", bit_fmt, nb_channels, nb_frames, (bench_now() - start) / (double)config->iterations);
+
+    if (nb_errors != 0)
+    {
+        fprintf(stderr, "packet %s: %d calls failed\n", stream_print_bit_fmt(bit_fmt), nb_errors);
+        return 1;
+    }
+
+    return 0;
+}
+
+static int bench_map_open(audio_handle_t* handle, struct audio_map_config_t const* map, struct stream_config_t const* stream_config)
+{
+    struct audio_config_t audio_config;
+    int ret;
+
+    memset(&audio_config, 0, sizeof(struct audio_config_t));
+    audio_config.direction      = AUDIO_OUT;
+    audio_config.buffer_size    = 8 * VBAN_PROTOCOL_MAX_SIZE;
+    strcpy(audio_config.backend_name, "null");
+    strcpy(audio_config.stream_name, BENCH_STREAM_NAME);
+
+    ret = audio_init(handle, &audio_config);
+    if (ret == 0)
+    {
+        ret = audio_set_map_config(*handle, map);
+    }
+    if (ret == 0)
+    {
+        ret = audio_set_stream_config(*handle, stream_config);
+    }
+
+    return ret;
+}
+
+/** audio_write of a packet to the null backend, without and with a channel map (reversing the channels) */
+static int bench_map(struct config_t const* config, enum VBanBitResolution bit_fmt, size_t nb_channels)
+{
+    size_t const nb_frames = bench_packet_frames(bit_fmt, nb_channels);
+    size_t const size = nb_frames * VBanBitResolutionSize[bit_fmt] * nb_channels;
+    char buffer[VBAN_DATA_MAX_SIZE];
+    struct stream_config_t stream_config;
+    struct audio_map_config_t maps[2];
+    char const* const names[2] = {"audio_write", "audio_write_map"};
+    audio_handle_t audio = 0;
+    size_t map;
+    size_t index;
+    double start;
+    int nb_errors = 0;
+    int ret = 0;
+
+    stream_config.nb_channels   = nb_channels;
+    stream_config.sample_rate   = BENCH_SAMPLE_RATE;
+    stream_config.bit_fmt       = bit_fmt;
+    stream_config.nb_samples    = 0;
+
+    memset(maps, 0, sizeof(maps));
+    for (index = 0; index != nb_channels; ++index)
+    {
+        maps[1].channels[index] = (unsigned char)(nb_channels - 1 - index);
+    }
+    maps[1].nb_channels = nb_channels;
+
+    bench_fill(buffer, size, bit_fmt);
+
+    for (map = 0; map != 2; ++map)
+    {
+        ret = bench_map_open(&audio, &maps[map], &stream_config);
+        if (ret != 0)
+        {
+            fprintf(stderr, "map %s: could not open null backend\n", stream_print_bit_fmt(bit_fmt));
+            audio_release(&audio);
+            return 1;
+        }
+
+        start = bench_now();
+        for (index = 0; index != config->iterations; ++index)
+        {
+            nb_errors += (audio_write(audio, buffer, size) != (int)size);
+        }
+        bench_report(names[map], bit_fmt, nb_channels, nb_frames, (bench_now() - start) / (double)config->iterations);
+
+        audio_release(&audio);
+    }
+
+    if (nb_errors != 0)
+    {
+        fprintf(stderr, "map %s: %d writes failed\n", stream_print_bit_fmt(bit_fmt), nb_errors);
+        return 1;
+    }
+
+    return 0;
+}
+
+
+/**
+ * Per sample conversion, as jack_process_cb used to do it.
+ * Kept here as the baseline of the jack playback benchmark.
+ */
+static float legacy_convert_sample(char const* ptr, enum VBanBitResolution bit_fmt)
+{
+    int value;
+
+    switch (bit_fmt)
+    {
+        case VBAN_BITFMT_8_INT:
+            return (float)(*((int8_t const*)ptr)) / (float)(1 << 7);
+
+        case VBAN_BITFMT_16_INT:
+            return (float)(*((int16_t const*)ptr)) / (float)(1 << 15);
+
+        case VBAN_BITFMT_24_INT:
+            value = (ptr[2] << 16) | ((unsigned char)ptr[1] << 8) | (unsigned char)ptr[0];
+            return (float)value / (float)(1 << 23);
+
+        case VBAN_BITFMT_32_INT:
+            return (float)*((int32_t const*)ptr) / 2147483648.0f;
+
+        case VBAN_BITFMT_32_FLOAT:
+            return *(float const*)ptr;
+
+        case VBAN_BITFMT_64_FLOAT:
+        default:
+            return 0.0;
+    }
+}
+
+static void legacy_deinterleave(float* const* buffers, struct convert_segment_t const* rb_data, enum VBanBitResolution bit_fmt, size_t nb_channels, size_t nframes)
+{
+    size_t const sampleSize = VBanBitResolutionSize[bit_fmt];
+    char const* ptr = rb_data[0].buf;
+    size_t len = 0;
+    size_t index = 0;
+    size_t sample;
+    size_t channel;
+    size_t part;
+    char sampleParts[8];
+
+    for (sample = 0; sample != nframes; ++sample)
+    {
+        for (channel = 0; channel != nb_channels; ++channel)
+        {
+            if (index == 0)
+            {
+                if ((len + sampleSize) > rb_data[0].len)
+                {
+                    part = 0;
+                    while (ptr != (rb_data[0].buf + rb_data[0].len))
+                    {
+                        sampleParts[part++] = *(ptr++);
+                    }
+                    ptr = rb_data[1].buf;
+                    for (; part < sampleSize; ++part, ++ptr)
+                    {
+                        sampleParts[part] = *ptr;
+                    }
+
+                    buffers[channel][sample] = legacy_convert_sample((char const*)sampleParts, bit_fmt);
+                    len += sampleSize;
+                    index = 1;
+                    continue;
+                }
+                if (len == rb_data[0].len)
+                {
+                    ptr = rb_data[1].buf;
+                    index = 1;
+                }
+            }
+
+            buffers[channel][sample] = legacy_convert_sample(ptr, bit_fmt);
+            ptr += sampleSize;
+            len += sampleSize;
+        }
+    }
+}
+
+/** ring buffer to jack float ports and back, the ring wrapping in the middle of a sample */
+static int bench_jack(struct config_t const* config, enum VBanBitResolution bit_fmt, size_t nb_channels)
+{
+    size_t const frame_size = VBanBitResolutionSize[bit_fmt] * nb_channels;
+    size_t const period_size = frame_size * config->nb_frames;
+    struct convert_segment_t segments[2];
+    char* ring = 0;
+    float* planes = 0;
+    float* legacy_planes = 0;
+    float* buffers[VBAN_CHANNELS_MAX_NB];
+    float* legacy_buffers[VBAN_CHANNELS_MAX_NB];
+    char bounce[VBAN_CHANNELS_MAX_NB * sizeof(double)];
+    size_t index;
+    double start;
+    int ret = 0;
+
+    ring            = malloc(period_size);
+    planes          = malloc(nb_channels * config->nb_frames * sizeof(float));
+    legacy_planes   = malloc(nb_channels * config->nb_frames * sizeof(float));
+    if ((ring == 0) || (planes == 0) || (legacy_planes == 0))
+    {
+        fprintf(stderr, "could not allocate memory\n");
+        ret = 1;
+        goto end;
+    }
+
+    bench_fill(ring, period_size, bit_fmt);
+
+    for (index = 0; index != nb_channels; ++index)
+    {
+        buffers[index]          = planes + (index * config->nb_frames);
+        legacy_buffers[index]   = legacy_planes + (index * config->nb_frames);
+    }
+
+    segments[0].buf = ring;
+    segments[0].len = (period_size / 2) + 1;
+    segments[1].buf = ring + segments[0].len;
+    segments[1].len = period_size - segments[0].len;
+
+    start = bench_now();
+    for (index = 0; index != config->iterations; ++index)
+    {
+        legacy_deinterleave(legacy_buffers, segments, bit_fmt, nb_channels, config->nb_frames);
+        BenchSink = legacy_planes[index % config->nb_frames];
+    }
+    bench_report("jack_playback_legacy", bit_fmt, nb_channels, config->nb_frames, (bench_now() - start) / (double)config->iterations);
+
+    start = bench_now();
+    for (index = 0; index != config->iterations; ++index)
+    {
+        convert_deinterleave_segments(buffers, segments, bounce, bit_fmt, nb_channels, config->nb_frames);
+        BenchSink = planes[index % config->nb_frames];
+    }
+    bench_report("jack_playback", bit_fmt, nb_channels, config->nb_frames, (bench_now() - start) / (double)config->iterations);
+
+    if (memcmp(planes, legacy_planes, nb_channels * config->nb_frames * sizeof(float)))
+    {
+        fprintf(stderr, "jack playback %s: kernel output differs from legacy output\n", stream_print_bit_fmt(bit_fmt));
+        ret = 1;
+    }
+
+    start = bench_now();
+    for (index = 0; index != config->iterations; ++index)
+    {
+        convert_interleave_segments(segments, bounce, bit_fmt, (float const* const*)buffers, nb_channels, config->nb_frames);
+        BenchSink = (float)ring[index % period_size];
+    }
+    bench_report("jack_capture", bit_fmt, nb_channels, config->nb_frames, (bench_now() - start) / (double)config->iterations);
+
+end:
+    free(ring);
+    free(planes);
+    free(legacy_planes);
+    return ret;
+}
+
+/** one packet sent and received back on the loopback interface */
+static int bench_socket(struct config_t const* config, enum VBanBitResolution bit_fmt, size_t nb_channels)
+{
+    size_t const nb_frames = bench_packet_frames(bit_fmt, nb_channels);
+    char buffer[VBAN_PROTOCOL_MAX_SIZE];
+    char received[VBAN_PROTOCOL_MAX_SIZE];
+    struct socket_config_t socket_config;
+    socket_handle_t socket_in = 0;
+    socket_handle_t socket_out = 0;
+    size_t size;
+    size_t index;
+    double start;
+    int ret = 0;
+
+    if (bench_packet_init(buffer, bit_fmt, nb_channels, &size) != 0)
+    {
+        fprintf(stderr, "socket %s: could not build packet\n", stream_print_bit_fmt(bit_fmt));
+        return 1;
+    }
+
+    memset(&socket_config, 0, sizeof(struct socket_config_t));
+    strcpy(socket_config.ip_address, "127.0.0.1");
+    socket_config.port      = config->port;
+    socket_config.direction = SOCKET_IN;
+    ret = socket_init(&socket_in, &socket_config);
+    if (ret == 0)
+    {
+        socket_config.direction = SOCKET_OUT;
+        ret = socket_init(&socket_out, &socket_config);
+    }
+    if (ret != 0)
+    {
+        fprintf(stderr, "socket: could not open the loopback sockets on port %d\n", config->port);
+        ret = 1;
+        goto end;
+    }
+
+    start = bench_now();
+    for (index = 0; index != config->iterations; ++index)
+    {
+        if ((socket_write(socket_out, buffer, size) != (int)size)
+            || (socket_read(socket_in, received, sizeof(received)) != (int)size))
+        {
+            fprintf(stderr, "socket %s: round trip failed\n", stream_print_bit_fmt(bit_fmt));
+            ret = 1;
+            goto end;
+        }
+    }
+    bench_report("socket_roundtrip", bit_fmt, nb_channels, nb_frames, (bench_now() - start) / (double)config->iterations);
+
+end:
+    if (socket_out != 0)
+    {
+        socket_release(&socket_out);
+    }
+    if (socket_in != 0)
+    {
+        socket_release(&socket_in);
+    }
+    return ret;
+}
+
+static int parse_channels(struct config_t* config, char* argv)
+{
+    char* token;
+    int value;
+
+    config->nb_channel_counts = 0;
+
+    for (token = strtok(argv, ","); token != 0; token = strtok(0, ","))
+    {
+        value = atoi(token);
+        if ((value <= 0) || (value > VBAN_CHANNELS_MAX_NB) || (config->nb_channel_counts == VBAN_CHANNELS_MAX_NB))
+        {
+            return -1;
+        }
+        config->channels[config->nb_channel_counts++] = value;
+    }
+
+    return (config->nb_channel_counts != 0) ? 0 : -1;
+}
+
+static int parse_suites(struct config_t* config, char* argv)
+{
+    char* token;
+
+    config->suites = 0;
+
+    for (token = strtok(argv, ","); token != 0; token = strtok(0, ","))
+    {
+        if (!strcmp(token, "packet"))
+            config->suites |= BENCH_PACKET;
+        else if (!strcmp(token, "map"))
+            config->suites |= BENCH_MAP;
+        else if (!strcmp(token, "jack"))
+            config->suites |= BENCH_JACK;
+        else if (!strcmp(token, "socket"))
+            config->suites |= BENCH_SOCKET;
+        else
+            return -1;
+    }
+
+    return (config->suites != 0) ? 0 : -1;
+}
+
+int get_options(struct config_t* config, int argc, char* const* argv)
+{
+    int c = 0;
+    int ret = 0;
+
+    static const struct option options[] =
+    {
+        {"nbchannels",  required_argument,  0, 'n'},
+        {"frames",      required_argument,  0, 'f'},
+        {"iterations",  required_argument,  0, 'i'},
+        {"suites",      required_argument,  0, 's'},
+        {"port",        required_argument,  0, 'p'},
+        {"output",      required_argument,  0, 'o'},
+        {"help",        no_argument,        0, 'h'},
+        {0,             0,                  0,  0 }
+    };
+
+    config->channels[0]         = 1;
+    config->channels[1]         = 2;
+    config->channels[2]         = 8;
+    config->channels[3]         = 32;
+    config->nb_channel_counts   = 4;
+    config->nb_frames           = 128;
+    config->iterations          = 20000;
+    config->suites              = BENCH_ALL;
+    config->port                = BENCH_PORT;
+
+    while (1)
+    {
+        c = getopt_long(argc, argv, "n:f:i:s:p:o:h", options, 0);
+        if (c == -1)
+            break;
+
+        switch (c)
+        {
+            case 'n':
+                ret |= parse_channels(config, optarg);
+                break;
+
+            case 'f':
+                config->nb_frames = atoi(optarg);
+                break;
+
+            case 'i':
+                config->iterations = atoi(optarg);
+                break;
+
+            case 's':
+                ret |= parse_suites(config, optarg);
+                break;
+
+            case 'p':
+                config->port = atoi(optarg);
+                break;
+
+            case 'o':
+                strncpy(config->output, optarg, BENCH_OUTPUT_SIZE-1);
+                break;
+
+            case 'h':
+            default:
+                usage();
+                return 1;
+        }
+    }
+
+    if ((ret != 0) || (config->nb_frames == 0) || (config->iterations == 0) || (config->port <= 0))
+    {
+        fprintf(stderr, "invalid parameters\n");
+        usage();
+        return 1;
+    }
+
+    return 0;
+}
+
+int main(int argc, char* const* argv)
+{
+    int ret = 0;
+    struct config_t config;
+    enum VBanBitResolution bit_fmt;
+    size_t index;
+    size_t nb_channels;
+
+    memset(&config, 0, sizeof(struct config_t));
+
+    ret = get_options(&config, argc, argv);
+    if (ret != 0)
+    {
+        return ret;
+    }
+
+    BenchLog = stdout;
+    if (!strcmp(config.output, "-"))
+    {
+        BenchOutput = stdout;
+        BenchLog    = stderr;
+    }
+    else if (config.output[0] != 0)
+    {
+        BenchOutput = fopen(config.output, "w");
+        if (BenchOutput == 0)
+        {
+            fprintf(stderr, "could not open %s\n", config.output);
+            return 1;
+        }
+    }
+    fprintf(BenchLog, "vban_bench version %s\n\n", VBAN_VERSION);
+    if (BenchOutput != 0)
+    {
+        fprintf(BenchOutput, "bench,format,channels,frames,ns_per_packet,samples_per_second\n");
+    }
+
+    for (index = 0; index != config.nb_channel_counts; ++index)
+    {
+        nb_channels = config.channels[index];
+
+        for (bit_fmt = VBAN_BITFMT_8_INT; bit_fmt <= VBAN_BITFMT_64_FLOAT; ++bit_fmt)
+        {
+            if (config.suites & BENCH_PACKET)
+            {
+                ret |= bench_packet(&config, bit_fmt, nb_channels);
+            }
+            if (config.suites & BENCH_MAP)
+            {
+                ret |= bench_map(&config, bit_fmt, nb_channels);
+            }
+            /* the legacy conversion stops at 32 bits float */
+            if ((config.suites & BENCH_JACK) && (bit_fmt <= VBAN_BITFMT_32_FLOAT))
+            {
+                ret |= bench_jack(&config, bit_fmt, nb_channels);
+            }
+            if (config.suites & BENCH_SOCKET)
+            {
+                ret |= bench_socket(&config, bit_fmt, nb_channels);
+            }
+        }
+    }
+
+    if ((BenchOutput != 0) && (BenchOutput != stdout))
+    {
+        fclose(BenchOutput);
+    }
+
+    return ret;
+}
@@ -16,28 +16,118 @@
  *  along with vban.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
 #include "audio.h"
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include "backend/audio_backend.h"
+#include "common/convert.h"
 #include "common/logger.h"
 
 #define AUDIO_DEVICE        "default"
+#define AUDIO_CONVERT_FRAMES    256
+/* conversion buffers are part of the handle, so that a stream change never allocates on the audio thread */
+#define AUDIO_CONVERT_SAMPLES   VBAN_DATA_MAX_SIZE
+#define AUDIO_RESAMPLE_SAMPLES  8192
+#define AUDIO_SAMPLE_SIZE_MAX   8
+#define AUDIO_CROSSFADE_MS      10
+/* how many times a full device is waited for before its fade out is given up */
+#define AUDIO_FADE_OUT_TRIES    50
 
 struct audio_t
 {
     struct audio_config_t       config;
     struct stream_config_t      stream;
+    /* map in use: the configured one, or the identity on the device channels when it absorbs a channel count change */
     struct audio_map_config_t   map;
+    struct audio_map_config_t   user_map;
 
     audio_backend_handle_t      backend;
+    struct stats_stream_t*      stats;
+    /* config the device is open with, zeroed when closed */
+    struct stream_config_t      device;
     /* only used if there is a map configured */
     char                        buffer[VBAN_DATA_MAX_SIZE];
+
+    /* only used if the device does not run the stream format or rate, or while fading in */
+    int                         convert_needed;
+    int                         convert_active;
+    size_t                      convert_frames;
+    size_t                      convert_out_frames;
+    float                       convert_samples[AUDIO_CONVERT_SAMPLES];
+    float                       resample_samples[AUDIO_RESAMPLE_SAMPLES];
+    float*                      convert_planes[VBAN_CHANNELS_MAX_NB];
+    float*                      resample_planes[VBAN_CHANNELS_MAX_NB];
+    char                        convert_buffer[AUDIO_RESAMPLE_SAMPLES * AUDIO_SAMPLE_SIZE_MAX];
+    size_t                      pending_offset;
+    size_t                      pending_size;
+
+    /* linear resampler from the stream rate to the device rate */
+    double                      resample_step;
+    double                      resample_pos;
+    float                       resample_prev[VBAN_CHANNELS_MAX_NB];
+
+    /* crossfade when the device has to be reopened */
+    size_t                      fade_frames;
+    size_t                      fade_left;
+    int                         has_last_frame;
+    float                       last_frame[VBAN_CHANNELS_MAX_NB];
+
+    /* ramp of the old device down to silence. When both devices could be opened, the old one plays it
+       while the new one fades in, and is closed once the ramp has been played */
+    audio_backend_handle_t      fade_out_backend;
+    struct stream_config_t      fade_out_device;
+    float                       fade_out_frame[VBAN_CHANNELS_MAX_NB];
+    size_t                      fade_out_frames;
+    size_t                      fade_out_done;
+    size_t                      fade_out_offset;
+    size_t                      fade_out_size;
+    long long                   fade_out_end_ns;
+    float                       fade_out_samples[AUDIO_CONVERT_SAMPLES];
+    char                        fade_out_buffer[AUDIO_CONVERT_SAMPLES * AUDIO_SAMPLE_SIZE_MAX];
 };
 
+/* closest formats to fall back to, in order of preference, when the device does not support the stream one */
+static enum VBanBitResolution const audio_fallback_formats[VBAN_BIT_RESOLUTION_MAX][VBAN_BIT_RESOLUTION_MAX] =
+{
+    /* VBAN_BITFMT_8_INT */     {VBAN_BITFMT_16_INT, VBAN_BITFMT_24_INT, VBAN_BITFMT_32_INT, VBAN_BITFMT_32_FLOAT, VBAN_BITFMT_64_FLOAT, VBAN_BIT_RESOLUTION_MAX},
+    /* VBAN_BITFMT_16_INT */    {VBAN_BITFMT_24_INT, VBAN_BITFMT_32_INT, VBAN_BITFMT_32_FLOAT, VBAN_BITFMT_64_FLOAT, VBAN_BIT_RESOLUTION_MAX},
+    /* VBAN_BITFMT_24_INT */    {VBAN_BITFMT_32_INT, VBAN_BITFMT_32_FLOAT, VBAN_BITFMT_64_FLOAT, VBAN_BITFMT_16_INT, VBAN_BIT_RESOLUTION_MAX},
+    /* VBAN_BITFMT_32_INT */    {VBAN_BITFMT_64_FLOAT, VBAN_BITFMT_32_FLOAT, VBAN_BITFMT_24_INT, VBAN_BITFMT_16_INT, VBAN_BIT_RESOLUTION_MAX},
+    /* VBAN_BITFMT_32_FLOAT */  {VBAN_BITFMT_64_FLOAT, VBAN_BITFMT_32_INT, VBAN_BITFMT_24_INT, VBAN_BITFMT_16_INT, VBAN_BIT_RESOLUTION_MAX},
+    /* VBAN_BITFMT_64_FLOAT */  {VBAN_BITFMT_32_FLOAT, VBAN_BITFMT_32_INT, VBAN_BITFMT_24_INT, VBAN_BITFMT_16_INT, VBAN_BIT_RESOLUTION_MAX},
+    /* VBAN_BITFMT_12_INT */    {VBAN_BIT_RESOLUTION_MAX},
+    /* VBAN_BITFMT_10_INT */    {VBAN_BIT_RESOLUTION_MAX},
+};
+
+static long long audio_now_ns(void);
 static void get_device_config(audio_handle_t handle, struct stream_config_t* device_config);
-static int audio_map_channels(audio_handle_t handle, char* buffer, size_t size, char reverse);
+static int audio_map_channels(audio_handle_t handle, char* dst, char const* src, size_t size);
+static int audio_write_direct(audio_handle_t handle, char const* buffer, size_t size);
+static int audio_read_direct(audio_handle_t handle, char* buffer, size_t size);
+static int audio_query_caps(audio_handle_t handle, audio_backend_handle_t backend, struct audio_caps_t* caps);
+static int audio_check_caps(audio_handle_t handle, struct audio_caps_t const* caps, struct stream_config_t* device_config, size_t* buffer_size);
+static unsigned int audio_pick_rate(audio_handle_t handle, struct audio_caps_t const* caps, unsigned int rate);
+static int audio_can_absorb(audio_handle_t handle, struct stream_config_t const* config);
+static int audio_absorb(audio_handle_t handle, struct stream_config_t const* config);
+static int audio_reopen(audio_handle_t handle, struct stream_config_t const* config);
+static int audio_open_backend(audio_handle_t handle, audio_backend_handle_t backend, int parallel, struct stream_config_t* device_config);
+static int audio_setup_conversion(audio_handle_t handle);
+static void audio_release_conversion(audio_handle_t handle);
+static int audio_write_converted(audio_handle_t handle, char const* buffer, size_t size);
+static int audio_write_pending(audio_handle_t handle);
+static size_t audio_resample(audio_handle_t handle, size_t nb_channels, size_t nb_frames);
+static void audio_keep_last_frame(audio_handle_t handle, char const* buffer, size_t size);
+static void audio_fade_out_start(audio_handle_t handle);
+static int audio_fade_out_write(audio_handle_t handle, audio_backend_handle_t backend);
+static unsigned long audio_fade_out_time_us(audio_handle_t handle, audio_backend_handle_t backend);
+static void audio_fade_out_drain(audio_handle_t handle, audio_backend_handle_t backend);
+static void audio_fade_out_poll(audio_handle_t handle);
+static void audio_fade_out_close(audio_handle_t handle);
+static int audio_read_converted(audio_handle_t handle, char* buffer, size_t size);
 
 #define AUDIO_MAP_OUTPUT_SIZE(_handle, _size) ((_handle->map.nb_channels != 0) ? ((_size * _handle->map.nb_channels) / (_handle->stream.nb_channels)) : _size)
 #define AUDIO_MAP_REVERSE_INPUT_SIZE(_handle, _size) ((_handle->map.nb_channels != 0) ? ((_size * _handle->stream.nb_channels) / (_handle->map.nb_channels)) : _size)
@@ -97,8 +187,8 @@ int audio_init(audio_handle_t* handle, struct audio_config_t const* config)
 
     (*handle)->config       = *config;
 
-    logger_log(LOG_INFO, "%s: config is direction %s, backend %s, device %s, buffer size %d",
-        __func__, (config->direction == AUDIO_IN) ? "in" : "out", config->backend_name, config->device_name, config->buffer_size);
+    logger_log(LOG_INFO, "%s: config is direction %s, backend %s, device %s, stream %s, buffer size %d",
+        __func__, (config->direction == AUDIO_IN) ? "in" : "out", config->backend_name, config->device_name, config->stream_name, config->buffer_size);
     
     ret = audio_backend_get_by_name(config->backend_name, &((*handle)->backend));
     if (ret != 0)
@@ -109,6 +199,11 @@ int audio_init(audio_handle_t* handle, struct audio_config_t const* config)
         return -ENODEV;
     }
 
+    if (config->nonblock && ((*handle)->backend->set_nonblock != 0))
+    {
+        ret = (*handle)->backend->set_nonblock((*handle)->backend, 1);
+    }
+
     return ret;
 }
 
@@ -124,7 +219,10 @@ int audio_release(audio_handle_t* handle)
 
     if (*handle != 0)
     {
+        audio_fade_out_close(*handle);
         ret = (*handle)->backend->close((*handle)->backend);
+        audio_backend_release(&(*handle)->backend);
+        audio_release_conversion(*handle);
         free(*handle);
         *handle = 0;
     }
@@ -132,6 +230,14 @@ int audio_release(audio_handle_t* handle)
     return ret;
 }
 
+long long audio_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((long long)ts.tv_sec * 1000000000LL) + ts.tv_nsec;
+}
+
 void get_device_config(audio_handle_t handle, struct stream_config_t* device_config)
 {
     *device_config = handle->stream;
@@ -145,7 +251,6 @@ void get_device_config(audio_handle_t handle, struct stream_config_t* device_con
 int audio_set_stream_config(audio_handle_t handle, struct stream_config_t const* config)
 {
     int ret = 0;
-    struct stream_config_t device_config;
 
     if ((handle == 0) || (config == 0))
     {
@@ -164,160 +269,1200 @@ int audio_set_stream_config(audio_handle_t handle, struct stream_config_t const*
     logger_log(LOG_INFO, "%s: new stream config is nb channels %d, sample rate %d, bit_fmt %s",
         __func__, config->nb_channels, config->sample_rate, stream_print_bit_fmt(config->bit_fmt));
 
-    ret = handle->backend->close(handle->backend);
+    /* a playing device keeps running if the conversion stage can take the change */
+    if (audio_can_absorb(handle, config))
+    {
+        return audio_absorb(handle, config);
+    }
+
+    return audio_reopen(handle, config);
+}
+
+int audio_can_absorb(audio_handle_t handle, struct stream_config_t const* config)
+{
+    int const convertible = convert_is_supported(config->bit_fmt) && convert_is_supported(handle->device.bit_fmt);
+
+    if ((handle->config.direction != AUDIO_OUT) || (handle->device.sample_rate == 0))
+    {
+        return 0;
+    }
+
+    if ((config->bit_fmt != handle->device.bit_fmt) && !convertible)
+    {
+        return 0;
+    }
+
+    if ((config->sample_rate != handle->device.sample_rate) && !convertible)
+    {
+        return 0;
+    }
+
+    /* never drop channels that the device could play after a reopen */
+    return (handle->user_map.nb_channels != 0) || (config->nb_channels <= handle->device.nb_channels);
+}
+
+int audio_absorb(audio_handle_t handle, struct stream_config_t const* config)
+{
+    int ret = 0;
+    size_t chan = 0;
+
+    audio_release_conversion(handle);
+    handle->stream = *config;
+    handle->map = handle->user_map;
+
+    if ((handle->map.nb_channels == 0) && (config->nb_channels != handle->device.nb_channels))
+    {
+        /* missing channels are played as silence */
+        handle->map.nb_channels = handle->device.nb_channels;
+        for (chan = 0; chan != handle->map.nb_channels; ++chan)
+        {
+            handle->map.channels[chan] = (unsigned char)chan;
+        }
+    }
+
+    ret = audio_setup_conversion(handle);
     if (ret < 0)
     {
-        logger_log(LOG_ERROR, "%s: could not close backend", __func__);
         return ret;
     }
 
+    logger_log(LOG_INFO, "%s: device kept open with nb channels %d, sample rate %d, bit_fmt %s", __func__,
+        handle->device.nb_channels, handle->device.sample_rate, stream_print_bit_fmt(handle->device.bit_fmt));
+
+    return 0;
+}
+
+int audio_reopen(audio_handle_t handle, struct stream_config_t const* config)
+{
+    int ret = -EBUSY;
+    int const fade = (handle->device.sample_rate != 0) && (handle->config.direction == AUDIO_OUT);
+    struct stream_config_t device_config;
+    audio_backend_handle_t backend = 0;
+
+    /* a device still fading out from a previous switch is cut short */
+    audio_fade_out_close(handle);
+
     handle->stream = *config;
-    get_device_config(handle, &device_config);
+    handle->map = handle->user_map;
+
+    /* open the new device while the old one still plays, then the old one fades out while the new one fades in.
+       A blocking open could wait for the old device to be released, so this is only tried in non blocking mode */
+    if (fade && handle->config.nonblock && (audio_backend_get_by_name(handle->config.backend_name, &backend) == 0))
+    {
+        backend->stats = handle->stats;
+        if (backend->set_nonblock != 0)
+        {
+            backend->set_nonblock(backend, 1);
+        }
+
+        ret = audio_open_backend(handle, backend, 1, &device_config);
+        if (ret == 0)
+        {
+            audio_fade_out_start(handle);
+            handle->fade_out_backend = handle->backend;
+            handle->backend = backend;
+            audio_fade_out_poll(handle);
+        }
+        else
+        {
+            logger_log(LOG_INFO, "%s: new device can not be opened along the current one, reopening it", __func__);
+            audio_backend_release(&backend);
+        }
+    }
+
+    if (ret != 0)
+    {
+        if (fade)
+        {
+            /* the old device is played to its end before it is closed */
+            audio_fade_out_start(handle);
+            audio_fade_out_drain(handle, handle->backend);
+        }
+
+        ret = handle->backend->close(handle->backend);
+        if (ret < 0)
+        {
+            logger_log(LOG_ERROR, "%s: could not close backend", __func__);
+            return ret;
+        }
+
+        memset(&handle->device, 0, sizeof(handle->device));
+        ret = audio_open_backend(handle, handle->backend, 0, &device_config);
+        if (ret < 0)
+        {
+            audio_release_conversion(handle);
+            memset(&handle->stream, 0, sizeof(handle->stream));
+            return ret;
+        }
+    }
+
+    audio_release_conversion(handle);
+    handle->device = device_config;
 
-    ret = handle->backend->open(handle->backend, handle->config.device_name, handle->config.direction, handle->config.buffer_size, &device_config);
+    /* fade the new device in, so that the switch does not click */
+    handle->fade_frames = fade ? ((size_t)device_config.sample_rate * AUDIO_CROSSFADE_MS) / 1000 : 0;
+    handle->fade_left = handle->fade_frames;
+    handle->has_last_frame = 0;
+
+    ret = audio_setup_conversion(handle);
     if (ret < 0)
     {
+        handle->backend->close(handle->backend);
         memset(&handle->stream, 0, sizeof(handle->stream));
-        logger_log(LOG_ERROR, "%s: could not open backend with new config", __func__);
-        return ret;
+        memset(&handle->device, 0, sizeof(handle->device));
     }
 
     return ret;
 }
 
-int audio_get_stream_config(audio_handle_t handle, struct stream_config_t* config)
+int audio_open_backend(audio_handle_t handle, audio_backend_handle_t backend, int parallel, struct stream_config_t* device_config)
 {
     int ret = 0;
+    struct audio_caps_t caps;
+    size_t buffer_size = 0;
 
-    if ((handle == 0) || (config == 0))
+    get_device_config(handle, device_config);
+
+    /* choose the device format and buffer before opening it, rather than reopening until it works */
+    ret = audio_query_caps(handle, backend, &caps);
+    if (ret < 0)
     {
-        logger_log(LOG_FATAL, "%s: null pointer argument", __func__);
-        return -EINVAL;
+        return ret;
     }
 
-    *config = handle->stream;
+    if (parallel && !caps.has_clock)
+    {
+        /* files and pipes can not be opened twice */
+        return -EBUSY;
+    }
 
-    if ((handle->config.direction == AUDIO_IN) && (handle->map.nb_channels != 0))
+    ret = audio_check_caps(handle, &caps, device_config, &buffer_size);
+    if (ret < 0)
     {
-        config->nb_channels = handle->map.nb_channels;
+        return ret;
     }
 
-    return ret;
+    ret = backend->open(backend, handle->config.device_name, handle->config.stream_name, handle->config.direction, buffer_size, device_config);
+    if (ret < 0)
+    {
+        backend->close(backend);
+        if (!parallel)
+        {
+            logger_log(LOG_ERROR, "%s: could not open backend with new config", __func__);
+        }
+        return ret;
+    }
+
+    return 0;
 }
 
-int audio_set_map_config(audio_handle_t handle, struct audio_map_config_t const* config)
+int audio_get_caps(audio_handle_t handle, struct audio_caps_t* caps)
 {
-    int ret = 0;
-
-    if ((handle == 0) || (config == 0))
+    if ((handle == 0) || (caps == 0))
     {
         logger_log(LOG_FATAL, "%s: null pointer argument", __func__);
         return -EINVAL;
     }
 
-    logger_log(LOG_INFO, "%s: new map config is nb channels %d", __func__, config->nb_channels);
-
-    handle->map = *config;
-
-    return ret;
+    return audio_query_caps(handle, handle->backend, caps);
 }
 
-int audio_write(audio_handle_t handle, char const* buffer, size_t size)
+int audio_query_caps(audio_handle_t handle, audio_backend_handle_t backend, struct audio_caps_t* caps)
 {
     int ret = 0;
+    enum VBanBitResolution bit_fmt;
 
-    logger_log(LOG_DEBUG, "%s invoked with size %d", __func__, size);
-
-    if ((handle == 0) || (buffer == 0))
+    /* what the backend does not fill keeps these permissive defaults */
+    memset(caps, 0, sizeof(*caps));
+    for (bit_fmt = VBAN_BITFMT_8_INT; bit_fmt != VBAN_BIT_RESOLUTION_MAX; ++bit_fmt)
     {
-        logger_log(LOG_FATAL, "%s: null pointer argument", __func__);
-        return -EINVAL;
+        caps->formats |= AUDIO_CAPS_FORMAT(bit_fmt);
     }
+    caps->rate_min      = 1;
+    caps->rate_max      = UINT_MAX;
+    caps->channels_min  = 1;
+    caps->channels_max  = VBAN_CHANNELS_MAX_NB;
+    caps->has_clock     = 1;
 
-    // the cast here is armless, just easier than doing some "overload" of audio_map_channels
-    ret = audio_map_channels(handle, (char *)buffer, size, 0);
-    if (ret < 0)
+    if (backend->query_caps != 0)
     {
-        logger_log(LOG_ERROR, "%s: audio_map_channels failed", __func__);
-        return ret;
+        ret = backend->query_caps(backend, handle->config.device_name, handle->config.direction, caps);
+        if (ret < 0)
+        {
+            logger_log(LOG_ERROR, "%s: could not query backend capabilities", __func__);
+        }
     }
 
-    return AUDIO_MAP_REVERSE_INPUT_SIZE(handle, handle->backend->write(handle->backend, AUDIO_MAP_OUTPUT_PTR(handle, buffer), AUDIO_MAP_OUTPUT_SIZE(handle, size)));
+    return ret;
 }
 
-int audio_read(audio_handle_t handle, char* buffer, size_t size)
+int audio_check_caps(audio_handle_t handle, struct audio_caps_t const* caps, struct stream_config_t* device_config, size_t* buffer_size)
 {
-    int ret = 0;
+    size_t index = 0;
+    size_t frame_size = 0;
+    size_t min_size = 0;
+    unsigned int rate = 0;
+    enum VBanBitResolution const stream_bit_fmt = device_config->bit_fmt;
 
-    logger_log(LOG_DEBUG, "%s invoked with size %d", __func__, size);
+    if ((device_config->sample_rate < caps->rate_min) || (device_config->sample_rate > caps->rate_max))
+    {
+        rate = audio_pick_rate(handle, caps, device_config->sample_rate);
+        if (rate == 0)
+        {
+            logger_log(LOG_ERROR, "%s: sample rate %u not supported by device (%u - %u) and can not be converted", __func__,
+                device_config->sample_rate, caps->rate_min, caps->rate_max);
+            return -EINVAL;
+        }
 
-    if ((handle == 0) || (buffer == 0))
+        logger_log(LOG_WARNING, "%s: sample rate %u not supported by device (%u - %u), running it at %u", __func__,
+            device_config->sample_rate, caps->rate_min, caps->rate_max, rate);
+        device_config->sample_rate = rate;
+
+        if (handle->config.direction == AUDIO_IN)
+        {
+            /* capture is not resampled: the stream is sent at the device rate */
+            handle->stream.sample_rate = rate;
+        }
+    }
+
+    if ((device_config->nb_channels < caps->channels_min) || (device_config->nb_channels > caps->channels_max))
     {
-        logger_log(LOG_FATAL, "%s: null pointer argument", __func__);
+        logger_log(LOG_ERROR, "%s: %u channels not supported by device (%u - %u)", __func__, device_config->nb_channels, caps->channels_min, caps->channels_max);
         return -EINVAL;
     }
 
-    ret = handle->backend->read(handle->backend, AUDIO_MAP_REVERSE_INPUT_PTR(handle, buffer), AUDIO_MAP_REVERSE_INPUT_SIZE(handle, size));
-    if (ret < 0)
+    if (!(caps->formats & AUDIO_CAPS_FORMAT(stream_bit_fmt)))
     {
-        logger_log(LOG_ERROR, "%s: backend read failed", __func__);
-        return ret;
+        while ((audio_fallback_formats[stream_bit_fmt][index] != VBAN_BIT_RESOLUTION_MAX)
+            && !(caps->formats & AUDIO_CAPS_FORMAT(audio_fallback_formats[stream_bit_fmt][index])))
+        {
+            ++index;
+        }
+
+        if (audio_fallback_formats[stream_bit_fmt][index] == VBAN_BIT_RESOLUTION_MAX)
+        {
+            logger_log(LOG_ERROR, "%s: bit format %s not supported by device and can not be converted", __func__, stream_print_bit_fmt(stream_bit_fmt));
+            return -ENOTSUP;
+        }
+
+        device_config->bit_fmt = audio_fallback_formats[stream_bit_fmt][index];
+        logger_log(LOG_WARNING, "%s: bit format %s not supported by device, converting to %s", __func__,
+            stream_print_bit_fmt(stream_bit_fmt), stream_print_bit_fmt(device_config->bit_fmt));
     }
-    
-    size = ret;
 
-    ret = audio_map_channels(handle, buffer, size, 1);
-    if (ret < 0)
+    /* buffer_size is given in bytes of the device format: not less than the device can do, and whole periods */
+    frame_size = VBanBitResolutionSize[device_config->bit_fmt] * device_config->nb_channels;
+    *buffer_size = handle->config.buffer_size;
+
+    if (caps->latency_min_us != 0)
     {
-        logger_log(LOG_ERROR, "%s: audio_map_channels failed", __func__);
-        return ret;
+        min_size = (size_t)(((unsigned long long)caps->latency_min_us * device_config->sample_rate) / 1000000) * frame_size;
+        if (*buffer_size < min_size)
+        {
+            logger_log(LOG_INFO, "%s: buffer size raised from %lu to %lu to match device minimum latency", __func__, (unsigned long)*buffer_size, (unsigned long)min_size);
+            *buffer_size = min_size;
+        }
     }
 
-    return AUDIO_MAP_OUTPUT_SIZE(handle, size);
+    if ((caps->period_frames != 0) && (frame_size != 0))
+    {
+        min_size = caps->period_frames * frame_size;
+        *buffer_size = ((*buffer_size + min_size - 1) / min_size) * min_size;
+    }
+
+    return 0;
 }
 
-int audio_map_channels(audio_handle_t handle, char* buffer, size_t size, char reverse)
+unsigned int audio_pick_rate(audio_handle_t handle, struct audio_caps_t const* caps, unsigned int rate)
 {
-    int ret = 0;
-    size_t const sample_size = VBanBitResolutionSize[handle->stream.bit_fmt];
-    size_t stream_frame_size, map_frame_size;
-    char* dest_ptr;
-    char const* orig_ptr;
+    size_t index = 0;
+    unsigned int best = 0;
+    unsigned int candidate = 0;
+
+    if (handle->config.direction == AUDIO_OUT)
+    {
+        /* the resampler of the conversion stage plays the stream at the closest rate the device can do */
+        if (!convert_is_supported(handle->stream.bit_fmt))
+        {
+            return 0;
+        }
+        return (rate < caps->rate_min) ? caps->rate_min : caps->rate_max;
+    }
+
+    /* the captured stream has to be sent at a rate vban knows */
+    for (index = 0; index != VBAN_SR_MAXNUMBER; ++index)
+    {
+        candidate = (unsigned int)VBanSRList[index];
+        if ((candidate < caps->rate_min) || (candidate > caps->rate_max))
+        {
+            continue;
+        }
+
+        if ((best == 0) || (((candidate > rate) ? candidate - rate : rate - candidate) < ((best > rate) ? best - rate : rate - best)))
+        {
+            best = candidate;
+        }
+    }
+
+    return best;
+}
 
+int audio_setup_conversion(audio_handle_t handle)
+{
     size_t chan = 0;
-    size_t frame = 0;
+    size_t max_channels = (handle->map.nb_channels > handle->stream.nb_channels) ? handle->map.nb_channels : handle->stream.nb_channels;
+    size_t const nb_channels = handle->device.nb_channels;
+    size_t max_out_frames = 0;
+    int const convertible = convert_is_supported(handle->stream.bit_fmt) && convert_is_supported(handle->device.bit_fmt);
 
-    if (buffer == 0)
+    handle->convert_needed = (handle->device.bit_fmt != handle->stream.bit_fmt) || (handle->device.sample_rate != handle->stream.sample_rate);
+    if (!convertible)
     {
-        logger_log(LOG_FATAL, "%s: handle or buffer pointer is null", __func__);
-        return -EINVAL;
+        /* audio_check_caps only falls back to convertible formats */
+        handle->fade_left = 0;
     }
 
-    if (handle->map.nb_channels == 0)
+    if (!handle->convert_needed && (handle->fade_left == 0))
     {
-        /** nothing todo */
         return 0;
     }
 
-    stream_frame_size = sample_size * handle->stream.nb_channels;
-    map_frame_size = sample_size * handle->map.nb_channels;
+    max_channels = (nb_channels > max_channels) ? nb_channels : max_channels;
 
-    memset((reverse == 1) ? buffer : handle->buffer, 0, size);
+    /* a chunk of stream data has to fit the map buffer, and so the conversion planes */
+    handle->convert_frames = VBAN_DATA_MAX_SIZE / (VBanBitResolutionSize[handle->stream.bit_fmt] * max_channels);
+    if (handle->convert_frames > AUDIO_CONVERT_FRAMES)
+    {
+        handle->convert_frames = AUDIO_CONVERT_FRAMES;
+    }
 
-    /* TODO: can this be optimized ? */
-    for (chan = 0; chan != handle->map.nb_channels; ++chan)
+    /* resampling gives at most one more frame than the rate ratio, which has to fit the resample planes */
+    handle->resample_step = (double)handle->stream.sample_rate / (double)handle->device.sample_rate;
+    handle->resample_pos = 1.0;
+    if (handle->resample_step != 1.0)
     {
-        if (handle->map.channels[chan] < handle->stream.nb_channels)
+        max_out_frames = AUDIO_RESAMPLE_SAMPLES / nb_channels;
+        max_out_frames = (max_out_frames > 2) ? ((max_out_frames - 2) * handle->stream.sample_rate) / handle->device.sample_rate : 0;
+        if (handle->convert_frames > max_out_frames)
         {
-            for (frame = 0; frame != (size / stream_frame_size); ++frame)
-            {
-                orig_ptr = ((reverse == 1) ? handle->buffer : buffer) + (frame * stream_frame_size) + (handle->map.channels[chan] * sample_size);
-                dest_ptr = ((reverse == 1) ? buffer : handle->buffer) + (frame * map_frame_size) + (chan * sample_size);
-                memcpy(dest_ptr, orig_ptr, sample_size);
-            }
+            handle->convert_frames = max_out_frames;
         }
     }
-    
+
+    if (handle->convert_frames == 0)
+    {
+        logger_log(LOG_ERROR, "%s: stream frame too big for conversion", __func__);
+        return -EINVAL;
+    }
+
+    handle->convert_out_frames = (handle->resample_step != 1.0)
+        ? ((handle->convert_frames * handle->device.sample_rate) / handle->stream.sample_rate) + 2
+        : handle->convert_frames;
+
+    for (chan = 0; chan != nb_channels; ++chan)
+    {
+        handle->convert_planes[chan] = handle->convert_samples + (chan * handle->convert_frames);
+        handle->resample_planes[chan] = handle->resample_samples + (chan * handle->convert_out_frames);
+    }
+    handle->convert_active = 1;
+
+    if (handle->convert_needed)
+    {
+        logger_log(LOG_INFO, "%s: converting %s %dHz to %s %dHz", __func__, stream_print_bit_fmt(handle->stream.bit_fmt), handle->stream.sample_rate,
+            stream_print_bit_fmt(handle->device.bit_fmt), handle->device.sample_rate);
+    }
+
+    return 0;
+}
+
+void audio_release_conversion(audio_handle_t handle)
+{
+    handle->convert_active = 0;
+    handle->convert_frames = 0;
+    handle->pending_offset = 0;
+    handle->pending_size = 0;
+}
+
+int audio_probe_stream_config(audio_handle_t handle, struct stream_config_t* config)
+{
+    if ((handle == 0) || (config == 0))
+    {
+        logger_log(LOG_FATAL, "%s: null pointer argument", __func__);
+        return -EINVAL;
+    }
+
+    if (handle->backend->probe_config == 0)
+    {
+        return -ENOTSUP;
+    }
+
+    return handle->backend->probe_config(handle->backend, handle->config.device_name, config);
+}
+
+int audio_get_stream_config(audio_handle_t handle, struct stream_config_t* config)
+{
+    int ret = 0;
+
+    if ((handle == 0) || (config == 0))
+    {
+        logger_log(LOG_FATAL, "%s: null pointer argument", __func__);
+        return -EINVAL;
+    }
+
+    *config = handle->stream;
+
+    if ((handle->config.direction == AUDIO_IN) && (handle->map.nb_channels != 0))
+    {
+        config->nb_channels = handle->map.nb_channels;
+    }
+
     return ret;
 }
 
+int audio_set_map_config(audio_handle_t handle, struct audio_map_config_t const* config)
+{
+    int ret = 0;
+
+    if ((handle == 0) || (config == 0))
+    {
+        logger_log(LOG_FATAL, "%s: null pointer argument", __func__);
+        return -EINVAL;
+    }
+
+    logger_log(LOG_INFO, "%s: new map config is nb channels %d", __func__, config->nb_channels);
+
+    handle->map = *config;
+    handle->user_map = *config;
+
+    return ret;
+}
+
+int audio_set_stats(audio_handle_t handle, struct stats_stream_t* stats)
+{
+    if (handle == 0)
+    {
+        logger_log(LOG_FATAL, "%s: null handle", __func__);
+        return -EINVAL;
+    }
+
+    handle->stats = stats;
+    handle->backend->stats = stats;
+
+    return 0;
+}
+
+int audio_set_frame(audio_handle_t handle, uint32_t nu_frame)
+{
+    if (handle == 0)
+    {
+        logger_log(LOG_FATAL, "%s: null handle", __func__);
+        return -EINVAL;
+    }
+
+    if (handle->backend->set_frame != 0)
+    {
+        handle->backend->set_frame(handle->backend, nu_frame);
+    }
+
+    return 0;
+}
+
+int audio_write(audio_handle_t handle, char const* buffer, size_t size)
+{
+    int ret = 0;
+
+    logger_log(LOG_DEBUG, "%s invoked with size %d", __func__, size);
+
+    if ((handle == 0) || (buffer == 0))
+    {
+        logger_log(LOG_FATAL, "%s: null pointer argument", __func__);
+        return -EINVAL;
+    }
+
+    audio_fade_out_poll(handle);
+
+    if (handle->convert_active)
+    {
+        return audio_write_converted(handle, buffer, size);
+    }
+
+    audio_keep_last_frame(handle, buffer, size);
+
+    if (handle->backend->begin != 0)
+    {
+        return audio_write_direct(handle, buffer, size);
+    }
+
+    ret = audio_map_channels(handle, handle->buffer, buffer, size);
+    if (ret < 0)
+    {
+        logger_log(LOG_ERROR, "%s: audio_map_channels failed", __func__);
+        return ret;
+    }
+
+    ret = handle->backend->write(handle->backend, AUDIO_MAP_OUTPUT_PTR(handle, buffer), AUDIO_MAP_OUTPUT_SIZE(handle, size));
+    if (ret < 0)
+    {
+        return ret;
+    }
+
+    return AUDIO_MAP_REVERSE_INPUT_SIZE(handle, ret);
+}
+
+int audio_read(audio_handle_t handle, char* buffer, size_t size)
+{
+    int ret = 0;
+
+    logger_log(LOG_DEBUG, "%s invoked with size %d", __func__, size);
+
+    if ((handle == 0) || (buffer == 0))
+    {
+        logger_log(LOG_FATAL, "%s: null pointer argument", __func__);
+        return -EINVAL;
+    }
+
+    if (handle->convert_active)
+    {
+        return audio_read_converted(handle, buffer, size);
+    }
+
+    if (handle->backend->begin != 0)
+    {
+        return audio_read_direct(handle, buffer, size);
+    }
+
+    ret = handle->backend->read(handle->backend, AUDIO_MAP_REVERSE_INPUT_PTR(handle, buffer), AUDIO_MAP_REVERSE_INPUT_SIZE(handle, size));
+    if (ret < 0)
+    {
+        if (ret != -EAGAIN)
+        {
+            logger_log(LOG_ERROR, "%s: backend read failed", __func__);
+        }
+        return ret;
+    }
+    
+    size = ret;
+
+    ret = audio_map_channels(handle, buffer, handle->buffer, size);
+    if (ret < 0)
+    {
+        logger_log(LOG_ERROR, "%s: audio_map_channels failed", __func__);
+        return ret;
+    }
+
+    return AUDIO_MAP_OUTPUT_SIZE(handle, size);
+}
+
+int audio_get_poll_fds(audio_handle_t handle, struct pollfd* fds, size_t nb_fds)
+{
+    if ((handle == 0) || (fds == 0))
+    {
+        logger_log(LOG_FATAL, "%s: null pointer argument", __func__);
+        return -EINVAL;
+    }
+
+    if (handle->backend->get_poll_fds == 0)
+    {
+        return 0;
+    }
+
+    return handle->backend->get_poll_fds(handle->backend, fds, nb_fds);
+}
+
+int audio_get_latency(audio_handle_t handle, unsigned long* latency_us)
+{
+    if ((handle == 0) || (latency_us == 0))
+    {
+        logger_log(LOG_FATAL, "%s: null pointer argument", __func__);
+        return -EINVAL;
+    }
+
+    if (handle->backend->get_latency == 0)
+    {
+        return -ENOTSUP;
+    }
+
+    return handle->backend->get_latency(handle->backend, latency_us);
+}
+
+int audio_write_direct(audio_handle_t handle, char const* buffer, size_t size)
+{
+    int ret = 0;
+    size_t const stream_frame_size = VBanBitResolutionSize[handle->stream.bit_fmt] * handle->stream.nb_channels;
+    size_t const device_frame_size = AUDIO_MAP_OUTPUT_SIZE(handle, stream_frame_size);
+    size_t const nb_frames = (stream_frame_size != 0) ? size / stream_frame_size : 0;
+    size_t frame = 0;
+    size_t area_size = 0;
+    char* area = 0;
+
+    /* map or copy straight into the device buffer */
+    while (frame != nb_frames)
+    {
+        area_size = (nb_frames - frame) * device_frame_size;
+        ret = handle->backend->begin(handle->backend, &area, &area_size);
+        if ((ret == -EAGAIN) && (frame != 0))
+        {
+            /* non blocking device is full / empty: report what has been done */
+            break;
+        }
+        else if (ret < 0)
+        {
+            if (ret != -EAGAIN)
+            {
+                logger_log(LOG_ERROR, "%s: backend begin failed", __func__);
+            }
+            return ret;
+        }
+
+        /* only whole frames: an area smaller than one would never let the loop end */
+        area_size -= area_size % device_frame_size;
+        if (area_size == 0)
+        {
+            handle->backend->commit(handle->backend, 0);
+            if (frame != 0)
+            {
+                break;
+            }
+            if (!handle->config.nonblock)
+            {
+                logger_log(LOG_ERROR, "%s: backend gave an area smaller than one frame", __func__);
+                return -EIO;
+            }
+            return -EAGAIN;
+        }
+
+        if (handle->map.nb_channels != 0)
+        {
+            audio_map_channels(handle, area, buffer + (frame * stream_frame_size), (area_size / device_frame_size) * stream_frame_size);
+        }
+        else
+        {
+            memcpy(area, buffer + (frame * stream_frame_size), area_size);
+        }
+
+        ret = handle->backend->commit(handle->backend, area_size);
+        if ((ret == -EAGAIN) && (frame != 0))
+        {
+            /* non blocking device did not take the area: report what has been done */
+            break;
+        }
+        else if (ret < 0)
+        {
+            if (ret != -EAGAIN)
+            {
+                logger_log(LOG_ERROR, "%s: backend commit failed", __func__);
+            }
+            return ret;
+        }
+
+        frame += area_size / device_frame_size;
+    }
+
+    return frame * stream_frame_size;
+}
+
+int audio_read_direct(audio_handle_t handle, char* buffer, size_t size)
+{
+    int ret = 0;
+    size_t const device_frame_size = VBanBitResolutionSize[handle->stream.bit_fmt] * handle->stream.nb_channels;
+    size_t const output_frame_size = AUDIO_MAP_OUTPUT_SIZE(handle, device_frame_size);
+    size_t const nb_frames = (output_frame_size != 0) ? size / output_frame_size : 0;
+    size_t frame = 0;
+    size_t area_size = 0;
+    char* area = 0;
+
+    /* map or copy straight from the device buffer */
+    while (frame != nb_frames)
+    {
+        area_size = (nb_frames - frame) * device_frame_size;
+        ret = handle->backend->begin(handle->backend, &area, &area_size);
+        if ((ret == -EAGAIN) && (frame != 0))
+        {
+            /* non blocking device is full / empty: report what has been done */
+            break;
+        }
+        else if (ret < 0)
+        {
+            if (ret != -EAGAIN)
+            {
+                logger_log(LOG_ERROR, "%s: backend begin failed", __func__);
+            }
+            return ret;
+        }
+
+        /* only whole frames: an area smaller than one would never let the loop end */
+        area_size -= area_size % device_frame_size;
+        if (area_size == 0)
+        {
+            handle->backend->commit(handle->backend, 0);
+            if (frame != 0)
+            {
+                break;
+            }
+            if (!handle->config.nonblock)
+            {
+                logger_log(LOG_ERROR, "%s: backend gave an area smaller than one frame", __func__);
+                return -EIO;
+            }
+            return -EAGAIN;
+        }
+
+        if (handle->map.nb_channels != 0)
+        {
+            audio_map_channels(handle, buffer + (frame * output_frame_size), area, area_size);
+        }
+        else
+        {
+            memcpy(buffer + (frame * output_frame_size), area, area_size);
+        }
+
+        ret = handle->backend->commit(handle->backend, area_size);
+        if (ret < 0)
+        {
+            logger_log(LOG_ERROR, "%s: backend commit failed", __func__);
+            return ret;
+        }
+
+        frame += area_size / device_frame_size;
+    }
+
+    return frame * output_frame_size;
+}
+
+int audio_write_converted(audio_handle_t handle, char const* buffer, size_t size)
+{
+    int ret = 0;
+    size_t const stream_frame_size = VBanBitResolutionSize[handle->stream.bit_fmt] * handle->stream.nb_channels;
+    size_t const nb_channels = handle->device.nb_channels;
+    size_t const device_frame_size = VBanBitResolutionSize[handle->device.bit_fmt] * nb_channels;
+    size_t const nb_frames = (stream_frame_size != 0) ? size / stream_frame_size : 0;
+    size_t frame = 0;
+    size_t chunk = 0;
+    size_t out = 0;
+    size_t index = 0;
+    size_t chan = 0;
+    float gain = 0.0f;
+    float** planes = 0;
+    char const* src = 0;
+
+    /* what the device did not take last time goes first */
+    ret = audio_write_pending(handle);
+    if (ret < 0)
+    {
+        return ret;
+    }
+
+    /* map, then convert to the device format and rate by chunks through the float planes */
+    while ((frame != nb_frames) && (handle->pending_size == 0))
+    {
+        chunk = ((nb_frames - frame) < handle->convert_frames) ? (nb_frames - frame) : handle->convert_frames;
+        src = buffer + (frame * stream_frame_size);
+
+        if (handle->map.nb_channels != 0)
+        {
+            audio_map_channels(handle, handle->buffer, src, chunk * stream_frame_size);
+            src = handle->buffer;
+        }
+
+        convert_deinterleave_to_float(handle->convert_planes, 0, src, handle->stream.bit_fmt, nb_channels, chunk);
+        planes = handle->convert_planes;
+        out = chunk;
+
+        if (handle->resample_step != 1.0)
+        {
+            out = audio_resample(handle, nb_channels, chunk);
+            planes = handle->resample_planes;
+        }
+
+        for (index = 0; (index != out) && (handle->fade_left != 0); ++index, --handle->fade_left)
+        {
+            gain = (float)(handle->fade_frames - handle->fade_left) / (float)handle->fade_frames;
+            for (chan = 0; chan != nb_channels; ++chan)
+            {
+                planes[chan][index] *= gain;
+            }
+        }
+
+        if (out != 0)
+        {
+            for (chan = 0; chan != nb_channels; ++chan)
+            {
+                handle->last_frame[chan] = planes[chan][out - 1];
+            }
+            handle->has_last_frame = 1;
+        }
+
+        convert_interleave_from_float(handle->convert_buffer, handle->device.bit_fmt, (float const* const*)planes, 0, nb_channels, out);
+        frame += chunk;
+
+        /* the chunk is consumed, what the device does not take now is kept for the next call */
+        handle->pending_offset = 0;
+        handle->pending_size = out * device_frame_size;
+        ret = audio_write_pending(handle);
+        if ((ret < 0) && (ret != -EAGAIN))
+        {
+            return ret;
+        }
+    }
+
+    if (!handle->convert_needed && (handle->fade_left == 0) && (handle->pending_size == 0))
+    {
+        /* fade in is over: back to the direct path */
+        audio_release_conversion(handle);
+    }
+
+    return frame * stream_frame_size;
+}
+
+int audio_write_pending(audio_handle_t handle)
+{
+    int ret = 0;
+
+    while (handle->pending_size != 0)
+    {
+        ret = handle->backend->write(handle->backend, handle->convert_buffer + handle->pending_offset, handle->pending_size);
+        if (ret < 0)
+        {
+            return ret;
+        }
+        else if (ret == 0)
+        {
+            return -EAGAIN;
+        }
+
+        handle->pending_offset += ret;
+        handle->pending_size -= ret;
+    }
+
+    return 0;
+}
+
+size_t audio_resample(audio_handle_t handle, size_t nb_channels, size_t nb_frames)
+{
+    size_t chan = 0;
+    size_t out = 0;
+    size_t index = 0;
+    double pos = 0.0;
+    float prev = 0.0f;
+    float const* in;
+    float* dst;
+
+    /* position pos is counted from the last frame of the previous chunk, linear interpolation between its 2 neighbours */
+    for (chan = 0; chan != nb_channels; ++chan)
+    {
+        in = handle->convert_planes[chan];
+        dst = handle->resample_planes[chan];
+        prev = handle->resample_prev[chan];
+
+        for (pos = handle->resample_pos, out = 0; pos < (double)nb_frames; pos += handle->resample_step, ++out)
+        {
+            index = (size_t)pos;
+            dst[out] = ((index != 0) ? in[index - 1] : prev) + (in[index] - ((index != 0) ? in[index - 1] : prev)) * (float)(pos - (double)index);
+        }
+
+        handle->resample_prev[chan] = in[nb_frames - 1];
+    }
+
+    handle->resample_pos = pos - (double)nb_frames;
+
+    return out;
+}
+
+void audio_keep_last_frame(audio_handle_t handle, char const* buffer, size_t size)
+{
+    size_t const stream_frame_size = VBanBitResolutionSize[handle->stream.bit_fmt] * handle->stream.nb_channels;
+    size_t chan = 0;
+    float samples[VBAN_CHANNELS_MAX_NB];
+    float* planes[VBAN_CHANNELS_MAX_NB];
+
+    /* remembered to fade the device out if it has to be reopened */
+    if ((handle->config.direction != AUDIO_OUT) || (stream_frame_size == 0) || (size < stream_frame_size)
+        || !convert_is_supported(handle->stream.bit_fmt))
+    {
+        return;
+    }
+
+    for (chan = 0; chan != handle->stream.nb_channels; ++chan)
+    {
+        planes[chan] = samples + chan;
+    }
+
+    convert_deinterleave_to_float(planes, 0, buffer + (((size / stream_frame_size) - 1) * stream_frame_size), handle->stream.bit_fmt, handle->stream.nb_channels, 1);
+
+    for (chan = 0; chan != handle->device.nb_channels; ++chan)
+    {
+        if (handle->map.nb_channels == 0)
+        {
+            handle->last_frame[chan] = (chan < handle->stream.nb_channels) ? samples[chan] : 0.0f;
+        }
+        else
+        {
+            handle->last_frame[chan] = (handle->map.channels[chan] < handle->stream.nb_channels) ? samples[handle->map.channels[chan]] : 0.0f;
+        }
+    }
+
+    handle->has_last_frame = 1;
+}
+
+void audio_fade_out_start(audio_handle_t handle)
+{
+    /* what the old device did not take of the last chunk goes before its ramp */
+    audio_write_pending(handle);
+
+    handle->fade_out_device = handle->device;
+    handle->fade_out_frames = (handle->has_last_frame && convert_is_supported(handle->device.bit_fmt))
+        ? ((size_t)handle->device.sample_rate * AUDIO_CROSSFADE_MS) / 1000 : 0;
+    handle->fade_out_done = 0;
+    handle->fade_out_offset = 0;
+    handle->fade_out_size = 0;
+    handle->fade_out_end_ns = 0;
+    memcpy(handle->fade_out_frame, handle->last_frame, sizeof(handle->fade_out_frame));
+    handle->has_last_frame = 0;
+}
+
+int audio_fade_out_write(audio_handle_t handle, audio_backend_handle_t backend)
+{
+    int ret = 0;
+    size_t const nb_channels = handle->fade_out_device.nb_channels;
+    size_t const device_frame_size = VBanBitResolutionSize[handle->fade_out_device.bit_fmt] * nb_channels;
+    size_t const nb_frames = handle->fade_out_frames;
+    size_t chunk = 0;
+    size_t chan = 0;
+    size_t frame = 0;
+    float* planes[VBAN_CHANNELS_MAX_NB];
+
+    /* ramp from the last frame played down to silence, rendered by chunks as the device takes them */
+    while ((handle->fade_out_size != 0) || (handle->fade_out_done != nb_frames))
+    {
+        if (handle->fade_out_size == 0)
+        {
+            chunk = AUDIO_CONVERT_SAMPLES / nb_channels;
+            chunk = ((nb_frames - handle->fade_out_done) < chunk) ? (nb_frames - handle->fade_out_done) : chunk;
+
+            for (chan = 0; chan != nb_channels; ++chan)
+            {
+                planes[chan] = handle->fade_out_samples + (chan * chunk);
+                for (frame = 0; frame != chunk; ++frame)
+                {
+                    planes[chan][frame] = handle->fade_out_frame[chan] * (float)(nb_frames - handle->fade_out_done - frame - 1) / (float)nb_frames;
+                }
+            }
+
+            convert_interleave_from_float(handle->fade_out_buffer, handle->fade_out_device.bit_fmt, (float const* const*)planes, 0, nb_channels, chunk);
+            handle->fade_out_done += chunk;
+            handle->fade_out_offset = 0;
+            handle->fade_out_size = chunk * device_frame_size;
+        }
+
+        ret = backend->write(backend, handle->fade_out_buffer + handle->fade_out_offset, handle->fade_out_size);
+        if (ret < 0)
+        {
+            return ret;
+        }
+        else if (ret == 0)
+        {
+            return -EAGAIN;
+        }
+
+        handle->fade_out_offset += ret;
+        handle->fade_out_size -= ret;
+    }
+
+    return 0;
+}
+
+unsigned long audio_fade_out_time_us(audio_handle_t handle, audio_backend_handle_t backend)
+{
+    unsigned long latency_us = 0;
+    size_t const device_frame_size = VBanBitResolutionSize[handle->fade_out_device.bit_fmt] * handle->fade_out_device.nb_channels;
+
+    if ((backend->get_latency != 0) && (backend->get_latency(backend, &latency_us) == 0))
+    {
+        return latency_us;
+    }
+
+    /* without a report, the whole buffer may still be queued before the ramp */
+    latency_us = AUDIO_CROSSFADE_MS * 1000;
+    if ((device_frame_size != 0) && (handle->fade_out_device.sample_rate != 0))
+    {
+        latency_us += (unsigned long)(((unsigned long long)(handle->config.buffer_size / device_frame_size) * 1000000ULL) / handle->fade_out_device.sample_rate);
+    }
+
+    return latency_us;
+}
+
+void audio_fade_out_drain(audio_handle_t handle, audio_backend_handle_t backend)
+{
+    int ret = 0;
+    int nb_fds = 0;
+    int tries = 0;
+    struct pollfd fds[AUDIO_POLL_FDS_MAX];
+
+    /* a non blocking device is waited for until it has taken the whole ramp */
+    ret = audio_fade_out_write(handle, backend);
+    for (tries = 0; (ret == -EAGAIN) && (tries != AUDIO_FADE_OUT_TRIES); ++tries)
+    {
+        nb_fds = (backend->get_poll_fds != 0) ? backend->get_poll_fds(backend, fds, AUDIO_POLL_FDS_MAX) : 0;
+        poll(fds, (nb_fds > 0) ? (nfds_t)nb_fds : 0, AUDIO_CROSSFADE_MS);
+        ret = audio_fade_out_write(handle, backend);
+    }
+
+    if (ret < 0)
+    {
+        logger_log(LOG_WARNING, "%s: device did not take its fade out", __func__);
+        return;
+    }
+
+    if (backend->drain != 0)
+    {
+        backend->drain(backend);
+        return;
+    }
+
+    poll(fds, 0, (int)(audio_fade_out_time_us(handle, backend) / 1000));
+}
+
+void audio_fade_out_poll(audio_handle_t handle)
+{
+    int ret = 0;
+
+    if (handle->fade_out_backend == 0)
+    {
+        return;
+    }
+
+    /* feed the old device as it takes the ramp, without waiting for it, then give it time to play what it holds */
+    if (handle->fade_out_end_ns == 0)
+    {
+        ret = audio_fade_out_write(handle, handle->fade_out_backend);
+        if (ret == -EAGAIN)
+        {
+            return;
+        }
+        else if (ret < 0)
+        {
+            audio_fade_out_close(handle);
+            return;
+        }
+
+        handle->fade_out_end_ns = audio_now_ns() + (1000LL * (long long)audio_fade_out_time_us(handle, handle->fade_out_backend));
+    }
+
+    if (audio_now_ns() >= handle->fade_out_end_ns)
+    {
+        audio_fade_out_close(handle);
+    }
+}
+
+void audio_fade_out_close(audio_handle_t handle)
+{
+    if (handle->fade_out_backend == 0)
+    {
+        return;
+    }
+
+    handle->fade_out_backend->close(handle->fade_out_backend);
+    audio_backend_release(&handle->fade_out_backend);
+}
+
+int audio_read_converted(audio_handle_t handle, char* buffer, size_t size)
+{
+    int ret = 0;
+    size_t const nb_channels = handle->stream.nb_channels;
+    size_t const stream_frame_size = VBanBitResolutionSize[handle->stream.bit_fmt] * nb_channels;
+    size_t const device_frame_size = VBanBitResolutionSize[handle->device.bit_fmt] * nb_channels;
+    size_t const output_frame_size = AUDIO_MAP_OUTPUT_SIZE(handle, stream_frame_size);
+    size_t const nb_frames = (output_frame_size != 0) ? size / output_frame_size : 0;
+    size_t frame = 0;
+    size_t requested = 0;
+    size_t chunk = 0;
+    char* dst = 0;
+
+    /* convert from the device format by chunks through the float planes, then map */
+    while (frame != nb_frames)
+    {
+        requested = ((nb_frames - frame) < handle->convert_frames) ? (nb_frames - frame) : handle->convert_frames;
+
+        ret = handle->backend->read(handle->backend, handle->convert_buffer, requested * device_frame_size);
+        if ((ret == -EAGAIN) && (frame != 0))
+        {
+            break;
+        }
+        else if (ret < 0)
+        {
+            if (ret != -EAGAIN)
+            {
+                logger_log(LOG_ERROR, "%s: backend read failed", __func__);
+            }
+            return ret;
+        }
+
+        chunk = ret / device_frame_size;
+        dst = (handle->map.nb_channels != 0) ? handle->buffer : buffer + (frame * output_frame_size);
+
+        convert_deinterleave_to_float(handle->convert_planes, 0, handle->convert_buffer, handle->device.bit_fmt, nb_channels, chunk);
+        convert_interleave_from_float(dst, handle->stream.bit_fmt, (float const* const*)handle->convert_planes, 0, nb_channels, chunk);
+
+        if (handle->map.nb_channels != 0)
+        {
+            audio_map_channels(handle, buffer + (frame * output_frame_size), handle->buffer, chunk * stream_frame_size);
+        }
+
+        frame += chunk;
+        if ((size_t)ret < requested * device_frame_size)
+        {
+            /* short read: end of source or device drained */
+            break;
+        }
+    }
+
+    return frame * output_frame_size;
+}
+
+int audio_map_channels(audio_handle_t handle, char* dst, char const* src, size_t size)
+{
+    int ret = 0;
+    size_t const sample_size = VBanBitResolutionSize[handle->stream.bit_fmt];
+    size_t stream_frame_size, map_frame_size, nb_frames;
+    char* dest_ptr;
+    char const* orig_ptr;
+
+    size_t chan = 0;
+    size_t frame = 0;
+
+    if ((dst == 0) || (src == 0))
+    {
+        logger_log(LOG_FATAL, "%s: buffer pointer is null", __func__);
+        return -EINVAL;
+    }
+
+    if (handle->map.nb_channels == 0)
+    {
+        /** nothing todo */
+        return 0;
+    }
+
+    /* src is laid out as the stream, dst as the map */
+    stream_frame_size = sample_size * handle->stream.nb_channels;
+    map_frame_size = sample_size * handle->map.nb_channels;
+    nb_frames = size / stream_frame_size;
+
+    memset(dst, 0, nb_frames * map_frame_size);
+
+    for (chan = 0; chan != handle->map.nb_channels; ++chan)
+    {
+        if (handle->map.channels[chan] < handle->stream.nb_channels)
+        {
+            orig_ptr = src + (handle->map.channels[chan] * sample_size);
+            dest_ptr = dst + (chan * sample_size);
+            for (frame = 0; frame != nb_frames; ++frame)
+            {
+                memcpy(dest_ptr, orig_ptr, sample_size);
+                orig_ptr += stream_frame_size;
+                dest_ptr += map_frame_size;
+            }
+        }
+    }
+    
+    return ret;
+}
@@ -21,8 +21,14 @@
 
 #include "vban/vban.h"
 #include "stream.h"
+#include "stats.h"
 #include <stddef.h>
 #include <errno.h>
+#ifndef _WIN32
+#include <poll.h>
+#else
+#include <winsock2.h>
+#endif
 
 /**
  * Maximum number of characters of audio device name
@@ -34,6 +40,28 @@
  */
 #define AUDIO_BACKEND_NAME_SIZE     32
 
+/**
+ * Maximum number of poll descriptors of an audio device
+ */
+#define AUDIO_POLL_FDS_MAX          16
+
+/**
+ * Audio device capabilities, as far as the backend can tell before opening it
+ */
+struct audio_caps_t
+{
+    unsigned int            formats;            /* mask of AUDIO_CAPS_FORMAT() of the supported bit formats */
+    unsigned int            rate_min;
+    unsigned int            rate_max;
+    unsigned int            channels_min;
+    unsigned int            channels_max;
+    size_t                  period_frames;      /* granularity of the device transfers, 0 if none */
+    unsigned long           latency_min_us;     /* lowest latency the device can run at, 0 if unknown */
+    int                     has_clock;          /* the device plays / captures at the sample rate by itself */
+};
+
+#define AUDIO_CAPS_FORMAT(_bit_fmt)     (1u << (_bit_fmt))
+
 /**
  * Channel map config
  */
@@ -68,7 +96,9 @@ struct audio_config_t
     enum audio_direction            direction;
     char                            backend_name[AUDIO_BACKEND_NAME_SIZE];
     char                            device_name[AUDIO_DEVICE_NAME_SIZE];
+    char                            stream_name[VBAN_STREAM_NAME_SIZE];
     size_t                          buffer_size;
+    int                             nonblock;
 };
 
 /**
@@ -96,12 +126,33 @@ int audio_release(audio_handle_t* handle);
  * Set the stream configuration.
  * The stream configuration is what comes from vban, before the channel map, or what comes from audio 
  * before the channel map, depending on the direction used.
+ * For playback, a device already open is kept if the change can be converted to its format, rate and channels,
+ * otherwise it is reopened with a short crossfade.
  * @param handle object handle
  * @param config stream configuration to use
  * @return 0 upon success, negative value otherwise
  */
 int audio_set_stream_config(audio_handle_t handle, struct stream_config_t const* config);
 
+/**
+ * Get the stream configuration imposed by the audio device, if the backend knows it before
+ * opening (a wav file to read for instance). It can then be given to audio_set_stream_config.
+ * @param handle object handle
+ * @param config stream configuration to fill
+ * @return 0 upon success, -ENOTSUP if the backend can not tell, negative value otherwise
+ */
+int audio_probe_stream_config(audio_handle_t handle, struct stream_config_t* config);
+
+/**
+ * Get the capabilities of the audio device. Backends that can not tell report everything as supported.
+ * audio_set_stream_config uses them to reject what can not be opened, convert to a supported
+ * bit format and size the buffer, before opening the device.
+ * @param handle object handle
+ * @param caps capabilities to fill
+ * @return 0 upon success, negative value otherwise
+ */
+int audio_get_caps(audio_handle_t handle, struct audio_caps_t* caps);
+
 /**
  * Get the current stream configuration
  * The stream configuration is what comes from vban, before the channel map, or what comes from audio 
@@ -120,6 +171,22 @@ int audio_get_stream_config(audio_handle_t handle, struct stream_config_t* confi
  */
 int audio_set_map_config(audio_handle_t handle, struct audio_map_config_t const* config);
 
+/**
+ * Set the counters the device updates (xruns, short transfers), for this device and the ones it is reopened with
+ * @param handle object handle
+ * @param stats stream counters, may be null
+ * @return 0 upon success, negative value otherwise
+ */
+int audio_set_stats(audio_handle_t handle, struct stats_stream_t* stats);
+
+/**
+ * Tell the device the frame counter of the packet whose payload is given to the next audio_write calls
+ * @param handle object handle
+ * @param nu_frame vban frame counter of the packet
+ * @return 0 upon success, negative value otherwise
+ */
+int audio_set_frame(audio_handle_t handle, uint32_t nu_frame);
+
 /**
  * Write data to audio
  * @param handle object handle
@@ -138,4 +205,22 @@ int audio_write(audio_handle_t handle, char const* buffer, size_t size);
  */
 int audio_read(audio_handle_t handle, char* buffer, size_t size);
 
+/**
+ * Get the descriptors to poll before retrying a write or read that returned -EAGAIN.
+ * Only backends supporting non blocking operation (see audio_config_t nonblock) have some.
+ * @param handle object handle
+ * @param fds array to fill
+ * @param nb_fds size of @p fds array
+ * @return number of descriptors filled (0 if the device can not be polled), negative value otherwise
+ */
+int audio_get_poll_fds(audio_handle_t handle, struct pollfd* fds, size_t nb_fds);
+
+/**
+ * Get the current latency of the audio device, as reported by the backend
+ * @param handle object handle
+ * @param latency_us latency in microseconds
+ * @return 0 upon success, -ENOTSUP if the backend can not tell, negative value otherwise
+ */
+int audio_get_latency(audio_handle_t handle, unsigned long* latency_us);
+
 #endif /*__AUDIO_H__*/
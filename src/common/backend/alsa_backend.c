@@ -1,20 +1,41 @@
 #include "alsa_backend.h"
 #include <alsa/asoundlib.h>
 #include "common/logger.h"
+#include "common/stats.h"
 
 #define ALSA_DEVICE_NAME_DEFAULT   "default"
+#define ALSA_PERIODS_NB            4
+#define ALSA_PERIOD_FRAMES_MIN     32
 
 struct alsa_backend_t
 {
     struct audio_backend_t  parent;
     snd_pcm_t*              alsa_handle;
     size_t                  frame_size;
+    snd_pcm_access_t        access;
+    enum audio_direction    direction;
+    snd_pcm_uframes_t       mmap_offset;
+    snd_pcm_uframes_t       mmap_frames;
+    snd_pcm_uframes_t       buffer_frames;
+    snd_pcm_uframes_t       period_frames;
+    snd_pcm_uframes_t       start_threshold;
+    int                     nonblock;
+    unsigned int            sample_rate;
 };
 
-static int alsa_open(audio_backend_handle_t handle, char const* output_name, enum audio_direction direction, size_t buffer_size, struct stream_config_t const* config);
+static int alsa_open(audio_backend_handle_t handle, char const* output_name, char const* stream_name, enum audio_direction direction, size_t buffer_size, struct stream_config_t const* config);
 static int alsa_close(audio_backend_handle_t handle);
 static int alsa_write(audio_backend_handle_t handle, char const* data, size_t size);
 static int alsa_read(audio_backend_handle_t handle, char* data, size_t size);
+static int alsa_begin(audio_backend_handle_t handle, char** data, size_t* size);
+static int alsa_commit(audio_backend_handle_t handle, size_t size);
+static int alsa_recover(struct alsa_backend_t* alsa_backend, int err);
+static int alsa_set_nonblock(audio_backend_handle_t handle, int nonblock);
+static int alsa_get_poll_fds(audio_backend_handle_t handle, struct pollfd* fds, size_t nb_fds);
+static int alsa_set_sw_params(struct alsa_backend_t* alsa_backend);
+static int alsa_get_latency(audio_backend_handle_t handle, unsigned long* latency_us);
+static int alsa_drain(audio_backend_handle_t handle);
+static int alsa_query_caps(audio_backend_handle_t handle, char const* output_name, enum audio_direction direction, struct audio_caps_t* caps);
 
 static snd_pcm_format_t vban_to_alsa_format(enum VBanBitResolution bit_resolution)
 {
@@ -27,7 +48,7 @@ static snd_pcm_format_t vban_to_alsa_format(enum VBanBitResolution bit_resolutio
             return SND_PCM_FORMAT_S16;
 
         case VBAN_BITFMT_24_INT:
-            return SND_PCM_FORMAT_S24;
+            return SND_PCM_FORMAT_S24_3LE;
 
         case VBAN_BITFMT_32_INT:
             return SND_PCM_FORMAT_S32;
@@ -64,6 +85,12 @@ int alsa_backend_init(audio_backend_handle_t* handle)
     alsa_backend->parent.close              = alsa_close;
     alsa_backend->parent.write              = alsa_write;
     alsa_backend->parent.read               = alsa_read;
+    alsa_backend->parent.set_nonblock       = alsa_set_nonblock;
+    alsa_backend->parent.get_poll_fds       = alsa_get_poll_fds;
+    alsa_backend->parent.get_latency        = alsa_get_latency;
+    alsa_backend->parent.drain              = alsa_drain;
+    alsa_backend->parent.query_caps         = alsa_query_caps;
+    alsa_backend->access                    = SND_PCM_ACCESS_RW_INTERLEAVED;
 
     *handle = (audio_backend_handle_t)alsa_backend;
 
@@ -71,11 +98,109 @@ int alsa_backend_init(audio_backend_handle_t* handle)
     
 }
 
-int alsa_open(audio_backend_handle_t handle, char const* output_name, enum audio_direction direction, size_t buffer_size, struct stream_config_t const* config)
+int alsa_mmap_backend_init(audio_backend_handle_t* handle)
+{
+    int ret;
+    struct alsa_backend_t* alsa_backend;
+
+    ret = alsa_backend_init(handle);
+    if (ret != 0)
+    {
+        return ret;
+    }
+
+    alsa_backend = (struct alsa_backend_t*)*handle;
+    alsa_backend->parent.begin              = alsa_begin;
+    alsa_backend->parent.commit             = alsa_commit;
+    alsa_backend->access                    = SND_PCM_ACCESS_MMAP_INTERLEAVED;
+
+    return 0;
+}
+
+int alsa_query_caps(audio_backend_handle_t handle, char const* output_name, enum audio_direction direction, struct audio_caps_t* caps)
+{
+    int ret;
+    struct alsa_backend_t* const alsa_backend = (struct alsa_backend_t*)handle;
+    snd_pcm_t* alsa_handle = 0;
+    snd_pcm_hw_params_t* hw_params = 0;
+    snd_pcm_uframes_t period_frames = 0;
+    unsigned int latency_us = 0;
+    enum VBanBitResolution bit_fmt;
+    int dir = 0;
+
+    if ((handle == 0) || (caps == 0))
+    {
+        logger_log(LOG_FATAL, "%s: null pointer argument", __func__);
+        return -EINVAL;
+    }
+
+    /* non blocking so that a busy device does not hang the query, it is closed right after */
+    ret = snd_pcm_open(&alsa_handle, (output_name[0] == '\0') ? ALSA_DEVICE_NAME_DEFAULT : output_name,
+        (direction == AUDIO_OUT) ? SND_PCM_STREAM_PLAYBACK : SND_PCM_STREAM_CAPTURE, SND_PCM_NONBLOCK);
+    if (ret < 0)
+    {
+        logger_log(LOG_ERROR, "%s: open error: %s", __func__, snd_strerror(ret));
+        return ret;
+    }
+
+    ret = snd_pcm_hw_params_malloc(&hw_params);
+    if (ret == 0)
+    {
+        ret = snd_pcm_hw_params_any(alsa_handle, hw_params);
+    }
+    if (ret == 0)
+    {
+        ret = snd_pcm_hw_params_set_access(alsa_handle, hw_params, alsa_backend->access);
+    }
+    if (ret < 0)
+    {
+        logger_log(LOG_ERROR, "%s: cannot get hardware parameters (%s)", __func__, snd_strerror(ret));
+        snd_pcm_hw_params_free(hw_params);
+        snd_pcm_close(alsa_handle);
+        return ret;
+    }
+
+    caps->formats = 0;
+    for (bit_fmt = VBAN_BITFMT_8_INT; bit_fmt != VBAN_BIT_RESOLUTION_MAX; ++bit_fmt)
+    {
+        if ((vban_to_alsa_format(bit_fmt) != SND_PCM_FORMAT_UNKNOWN)
+            && (snd_pcm_hw_params_test_format(alsa_handle, hw_params, vban_to_alsa_format(bit_fmt)) == 0))
+        {
+            caps->formats |= AUDIO_CAPS_FORMAT(bit_fmt);
+        }
+    }
+
+    snd_pcm_hw_params_get_rate_min(hw_params, &caps->rate_min, &dir);
+    snd_pcm_hw_params_get_rate_max(hw_params, &caps->rate_max, &dir);
+    snd_pcm_hw_params_get_channels_min(hw_params, &caps->channels_min);
+    snd_pcm_hw_params_get_channels_max(hw_params, &caps->channels_max);
+
+    if (snd_pcm_hw_params_get_period_size_min(hw_params, &period_frames, &dir) == 0)
+    {
+        caps->period_frames = period_frames;
+    }
+
+    if (snd_pcm_hw_params_get_buffer_time_min(hw_params, &latency_us, &dir) == 0)
+    {
+        caps->latency_min_us = latency_us;
+    }
+
+    caps->has_clock = 1;
+
+    snd_pcm_hw_params_free(hw_params);
+    snd_pcm_close(alsa_handle);
+
+    return 0;
+}
+
+int alsa_open(audio_backend_handle_t handle, char const* output_name, char const* stream_name, enum audio_direction direction, size_t buffer_size, struct stream_config_t const* config)
 {
     int ret;
     struct alsa_backend_t* const alsa_backend = (struct alsa_backend_t*)handle;
     snd_pcm_hw_params_t *hw_params;
+    int dir = 0;
+
+    (void)stream_name;
 
     if (handle == 0)
     {
@@ -84,8 +209,10 @@ int alsa_open(audio_backend_handle_t handle, char const* output_name, enum audio
     }
 
     alsa_backend->frame_size = VBanBitResolutionSize[config->bit_fmt] * config->nb_channels;
+    alsa_backend->direction = direction;
+    alsa_backend->sample_rate = config->sample_rate;
     ret = snd_pcm_open(&alsa_backend->alsa_handle, (output_name[0] == '\0') ? ALSA_DEVICE_NAME_DEFAULT : output_name, 
-        (direction == AUDIO_OUT) ? SND_PCM_STREAM_PLAYBACK : SND_PCM_STREAM_CAPTURE, 0);
+        (direction == AUDIO_OUT) ? SND_PCM_STREAM_PLAYBACK : SND_PCM_STREAM_CAPTURE, alsa_backend->nonblock ? SND_PCM_NONBLOCK : 0);
     if (ret < 0)
     {
         logger_log(LOG_FATAL, "%s: open error: %s", __func__, snd_strerror(ret));
@@ -105,47 +232,74 @@ int alsa_open(audio_backend_handle_t handle, char const* output_name, enum audio
     if ((ret = snd_pcm_hw_params_any (alsa_backend->alsa_handle, hw_params)) < 0) {
         logger_log(LOG_FATAL, "cannot initialize hardware parameter structure (%s)\n",
                 snd_strerror (ret));
-        alsa_close(handle);
-        return ret;
+        goto error;
     }
 
-    if ((ret = snd_pcm_hw_params_set_access (alsa_backend->alsa_handle, hw_params, SND_PCM_ACCESS_RW_INTERLEAVED)) < 0) {
+    if ((ret = snd_pcm_hw_params_set_access (alsa_backend->alsa_handle, hw_params, alsa_backend->access)) < 0) {
         logger_log(LOG_FATAL, "cannot set access type (%s)\n",
                 snd_strerror (ret));
-        alsa_close(handle);
-        return ret;
+        goto error;
     }
 
     if ((ret = snd_pcm_hw_params_set_format (alsa_backend->alsa_handle, hw_params, vban_to_alsa_format(config->bit_fmt))) < 0) {
         logger_log(LOG_FATAL, "cannot set sample format (%s)\n",
                 snd_strerror (ret));
-        alsa_close(handle);
-        return ret;
+        goto error;
     }
 
     if ((ret = snd_pcm_hw_params_set_rate(alsa_backend->alsa_handle, hw_params, config->sample_rate, 0)) < 0) {
         logger_log(LOG_FATAL, "cannot set sample rate (%s)\n",
                 snd_strerror (ret));
-        alsa_close(handle);
-        return ret;
+        goto error;
     }
 
     if ((ret = snd_pcm_hw_params_set_channels (alsa_backend->alsa_handle, hw_params, config->nb_channels)) < 0) {
         logger_log(LOG_FATAL, "cannot set channel count (%s)\n",
                 snd_strerror (ret));
-        alsa_close(handle);
-        return ret;
+        goto error;
+    }
+
+    /* buffer_size is the latency target, split in ALSA_PERIODS_NB periods */
+    alsa_backend->buffer_frames = buffer_size / alsa_backend->frame_size;
+    if (alsa_backend->buffer_frames < (ALSA_PERIODS_NB * ALSA_PERIOD_FRAMES_MIN))
+    {
+        alsa_backend->buffer_frames = ALSA_PERIODS_NB * ALSA_PERIOD_FRAMES_MIN;
+    }
+
+    if ((ret = snd_pcm_hw_params_set_buffer_size_near (alsa_backend->alsa_handle, hw_params, &alsa_backend->buffer_frames)) < 0) {
+        logger_log(LOG_FATAL, "cannot set buffer size (%s)\n",
+                snd_strerror (ret));
+        goto error;
+    }
+
+    alsa_backend->period_frames = alsa_backend->buffer_frames / ALSA_PERIODS_NB;
+    if ((ret = snd_pcm_hw_params_set_period_size_near (alsa_backend->alsa_handle, hw_params, &alsa_backend->period_frames, &dir)) < 0) {
+        logger_log(LOG_FATAL, "cannot set period size (%s)\n",
+                snd_strerror (ret));
+        goto error;
     }
 
     if ((ret = snd_pcm_hw_params (alsa_backend->alsa_handle, hw_params)) < 0) {
         logger_log(LOG_FATAL, "cannot set parameters (%s)\n",
                 snd_strerror (ret));
-        alsa_close(handle);
-        return ret;
+        goto error;
     }
 
+    /* the driver may have adjusted them */
+    snd_pcm_hw_params_get_buffer_size(hw_params, &alsa_backend->buffer_frames);
+    snd_pcm_hw_params_get_period_size(hw_params, &alsa_backend->period_frames, &dir);
     snd_pcm_hw_params_free (hw_params);
 
+    logger_log(LOG_INFO, "%s: buffer %lu frames (%lu ms), period %lu frames", __func__, alsa_backend->buffer_frames,
+        (alsa_backend->buffer_frames * 1000) / config->sample_rate, alsa_backend->period_frames);
+
+    ret = alsa_set_sw_params(alsa_backend);
+    if (ret < 0)
+    {
+        alsa_close(handle);
+        return ret;
+    }
+
     ret = snd_pcm_prepare(alsa_backend->alsa_handle);
     if (ret < 0)
     {
@@ -155,6 +309,11 @@ int alsa_open(audio_backend_handle_t handle, char const* output_name, enum audio
     }
 
     return 0;
+
+error:
+    snd_pcm_hw_params_free(hw_params);
+    alsa_close(handle);
+    return ret;
 }
 
 int alsa_close(audio_backend_handle_t handle)
@@ -200,11 +359,18 @@ int alsa_write(audio_backend_handle_t handle, char const* data, size_t size)
 
     nb_frame = size / alsa_backend->frame_size;
     
-    ret = snd_pcm_writei(alsa_backend->alsa_handle, data, nb_frame);
-    if (ret < 0)
+    ret = (alsa_backend->access == SND_PCM_ACCESS_MMAP_INTERLEAVED)
+        ? snd_pcm_mmap_writei(alsa_backend->alsa_handle, data, nb_frame)
+        : snd_pcm_writei(alsa_backend->alsa_handle, data, nb_frame);
+    if (ret == -EAGAIN)
+    {
+        /* non blocking mode and device is full */
+        return ret;
+    }
+    else if (ret < 0)
     {
         logger_log(LOG_ERROR, "%s: snd_pcm_writei failed: %s", __func__, snd_strerror(ret));
-        ret = snd_pcm_recover(alsa_backend->alsa_handle, ret, 0);
+        ret = alsa_recover(alsa_backend, ret);
         if (ret < 0)
         {
             logger_log(LOG_ERROR, "%s: snd_pcm_recover failed: %s", __func__, snd_strerror(ret));
@@ -213,6 +379,7 @@ int alsa_write(audio_backend_handle_t handle, char const* data, size_t size)
     else if (ret > 0 && ret < nb_frame)
     {
         logger_log(LOG_ERROR, "%s: short write (expected %lu, wrote %i)", __func__, nb_frame, ret);
+        STATS_ADD(alsa_backend->parent.stats, short_transfers, 1);
     }
 
     return ret * alsa_backend->frame_size;
@@ -238,21 +405,311 @@ int alsa_read(audio_backend_handle_t handle, char* data, size_t size)
 
     nb_frame = size / alsa_backend->frame_size;
 
-    ret = snd_pcm_readi(alsa_backend->alsa_handle, data, nb_frame);
-    if (ret < 0)
+    ret = (alsa_backend->access == SND_PCM_ACCESS_MMAP_INTERLEAVED)
+        ? snd_pcm_mmap_readi(alsa_backend->alsa_handle, data, nb_frame)
+        : snd_pcm_readi(alsa_backend->alsa_handle, data, nb_frame);
+    if (ret == -EAGAIN)
     {
-        logger_log(LOG_ERROR, "%s: snd_pcm_writei failed: %s", __func__, snd_strerror(ret));
-        ret = snd_pcm_recover(alsa_backend->alsa_handle, ret, 0);
+        /* non blocking mode and nothing captured yet */
+        return ret;
+    }
+    else if (ret < 0)
+    {
+        logger_log(LOG_ERROR, "%s: snd_pcm_readi failed: %s", __func__, snd_strerror(ret));
+        ret = alsa_recover(alsa_backend, ret);
         if (ret < 0)
         {
-            logger_log(LOG_ERROR, "%s: snd_pcm_writei failed: %s", __func__, snd_strerror(ret));
+            logger_log(LOG_ERROR, "%s: snd_pcm_recover failed: %s", __func__, snd_strerror(ret));
         }
     }
     else if (ret > 0 && ret < nb_frame)
     {
         logger_log(LOG_ERROR, "%s: short read (expected %lu, wrote %i)", __func__, nb_frame, ret);
+        STATS_ADD(alsa_backend->parent.stats, short_transfers, 1);
     }
 
     return ret * alsa_backend->frame_size;
 }
 
+
+int alsa_begin(audio_backend_handle_t handle, char** data, size_t* size)
+{
+    int ret = 0;
+    struct alsa_backend_t* const alsa_backend = (struct alsa_backend_t*)handle;
+    snd_pcm_channel_area_t const* areas;
+    snd_pcm_sframes_t avail;
+    snd_pcm_uframes_t frames;
+
+    if ((handle == 0) || (data == 0) || (size == 0))
+    {
+        logger_log(LOG_ERROR, "%s: handle or data pointer is null", __func__);
+        return -EINVAL;
+    }
+
+    if (alsa_backend->alsa_handle == 0)
+    {
+        logger_log(LOG_ERROR, "%s: device not open", __func__);
+        return -ENODEV;
+    }
+
+    frames = *size / alsa_backend->frame_size;
+    if (frames == 0)
+    {
+        return -EINVAL;
+    }
+
+    while (1)
+    {
+        if ((alsa_backend->direction == AUDIO_IN) && (snd_pcm_state(alsa_backend->alsa_handle) == SND_PCM_STATE_PREPARED))
+        {
+            /* in mmap mode, capture has to be started explicitly, also after an xrun */
+            snd_pcm_start(alsa_backend->alsa_handle);
+        }
+
+        avail = snd_pcm_avail_update(alsa_backend->alsa_handle);
+        if (avail < 0)
+        {
+            logger_log(LOG_ERROR, "%s: snd_pcm_avail_update failed: %s", __func__, snd_strerror(avail));
+            ret = alsa_recover(alsa_backend, avail);
+            if (ret < 0)
+            {
+                logger_log(LOG_ERROR, "%s: snd_pcm_recover failed: %s", __func__, snd_strerror(ret));
+                return ret;
+            }
+            continue;
+        }
+
+        if (avail != 0)
+        {
+            break;
+        }
+
+        if ((alsa_backend->direction == AUDIO_OUT) && (snd_pcm_state(alsa_backend->alsa_handle) == SND_PCM_STATE_PREPARED))
+        {
+            /* buffer is full and playback not started yet: start it now */
+            snd_pcm_start(alsa_backend->alsa_handle);
+        }
+
+        if (alsa_backend->nonblock)
+        {
+            return -EAGAIN;
+        }
+
+        ret = snd_pcm_wait(alsa_backend->alsa_handle, -1);
+        if (ret < 0)
+        {
+            ret = alsa_recover(alsa_backend, ret);
+            if (ret < 0)
+            {
+                logger_log(LOG_ERROR, "%s: snd_pcm_recover failed: %s", __func__, snd_strerror(ret));
+                return ret;
+            }
+        }
+    }
+
+    if (frames > (snd_pcm_uframes_t)avail)
+    {
+        frames = avail;
+    }
+
+    ret = snd_pcm_mmap_begin(alsa_backend->alsa_handle, &areas, &alsa_backend->mmap_offset, &frames);
+    if (ret < 0)
+    {
+        logger_log(LOG_ERROR, "%s: snd_pcm_mmap_begin failed: %s", __func__, snd_strerror(ret));
+        return ret;
+    }
+
+    /* interleaved access: all channels share the area of the first one */
+    alsa_backend->mmap_frames = frames;
+    *data = (char*)areas[0].addr + (areas[0].first / 8) + (alsa_backend->mmap_offset * (areas[0].step / 8));
+    *size = frames * alsa_backend->frame_size;
+
+    return 0;
+}
+
+int alsa_commit(audio_backend_handle_t handle, size_t size)
+{
+    snd_pcm_sframes_t ret = 0;
+    struct alsa_backend_t* const alsa_backend = (struct alsa_backend_t*)handle;
+    snd_pcm_uframes_t const frames = size / alsa_backend->frame_size;
+
+    if (handle == 0)
+    {
+        logger_log(LOG_ERROR, "%s: handle pointer is null", __func__);
+        return -EINVAL;
+    }
+
+    if (alsa_backend->alsa_handle == 0)
+    {
+        logger_log(LOG_ERROR, "%s: device not open", __func__);
+        return -ENODEV;
+    }
+
+    if (frames > alsa_backend->mmap_frames)
+    {
+        logger_log(LOG_ERROR, "%s: commit of %lu frames exceeds the %lu frames area", __func__, frames, alsa_backend->mmap_frames);
+        return -EINVAL;
+    }
+
+    ret = snd_pcm_mmap_commit(alsa_backend->alsa_handle, alsa_backend->mmap_offset, frames);
+    alsa_backend->mmap_frames = 0;
+    if ((ret < 0) || ((snd_pcm_uframes_t)ret != frames))
+    {
+        logger_log(LOG_ERROR, "%s: snd_pcm_mmap_commit failed: %s", __func__, snd_strerror((ret < 0) ? ret : -EPIPE));
+        ret = alsa_recover(alsa_backend, (ret < 0) ? ret : -EPIPE);
+        if (ret < 0)
+        {
+            logger_log(LOG_ERROR, "%s: snd_pcm_recover failed: %s", __func__, snd_strerror(ret));
+            return ret;
+        }
+        /* data of this area is lost, but the stream goes on */
+        return 0;
+    }
+
+    if ((alsa_backend->direction == AUDIO_OUT)
+        && (snd_pcm_state(alsa_backend->alsa_handle) == SND_PCM_STATE_PREPARED)
+        && ((alsa_backend->buffer_frames - snd_pcm_avail_update(alsa_backend->alsa_handle)) >= alsa_backend->start_threshold))
+    {
+        /* mmap commit does not apply the start threshold, do it like rw access would */
+        snd_pcm_start(alsa_backend->alsa_handle);
+    }
+
+    return size;
+}
+
+int alsa_set_sw_params(struct alsa_backend_t* alsa_backend)
+{
+    int ret;
+    snd_pcm_sw_params_t* sw_params;
+
+    /* playback keeps half of the buffer as margin against network jitter before starting,
+       capture starts right away. Both wake up once per period. */
+    alsa_backend->start_threshold = (alsa_backend->direction == AUDIO_OUT) ? (alsa_backend->buffer_frames / 2) : 1;
+
+    if ((ret = snd_pcm_sw_params_malloc(&sw_params)) < 0)
+    {
+        logger_log(LOG_FATAL, "%s: cannot allocate software parameter structure (%s)", __func__, snd_strerror(ret));
+        return ret;
+    }
+
+    if (((ret = snd_pcm_sw_params_current(alsa_backend->alsa_handle, sw_params)) < 0)
+        || ((ret = snd_pcm_sw_params_set_avail_min(alsa_backend->alsa_handle, sw_params, alsa_backend->period_frames)) < 0)
+        || ((ret = snd_pcm_sw_params_set_start_threshold(alsa_backend->alsa_handle, sw_params, alsa_backend->start_threshold)) < 0)
+        || ((ret = snd_pcm_sw_params(alsa_backend->alsa_handle, sw_params)) < 0))
+    {
+        logger_log(LOG_FATAL, "%s: cannot set software parameters (%s)", __func__, snd_strerror(ret));
+    }
+
+    snd_pcm_sw_params_free(sw_params);
+
+    return ret;
+}
+
+int alsa_set_nonblock(audio_backend_handle_t handle, int nonblock)
+{
+    struct alsa_backend_t* const alsa_backend = (struct alsa_backend_t*)handle;
+
+    if (handle == 0)
+    {
+        logger_log(LOG_ERROR, "%s: handle pointer is null", __func__);
+        return -EINVAL;
+    }
+
+    alsa_backend->nonblock = nonblock;
+
+    if (alsa_backend->alsa_handle != 0)
+    {
+        return snd_pcm_nonblock(alsa_backend->alsa_handle, nonblock);
+    }
+
+    return 0;
+}
+
+int alsa_get_poll_fds(audio_backend_handle_t handle, struct pollfd* fds, size_t nb_fds)
+{
+    struct alsa_backend_t* const alsa_backend = (struct alsa_backend_t*)handle;
+
+    if ((handle == 0) || (fds == 0))
+    {
+        logger_log(LOG_ERROR, "%s: handle or fds pointer is null", __func__);
+        return -EINVAL;
+    }
+
+    if ((alsa_backend->alsa_handle == 0) || !alsa_backend->nonblock)
+    {
+        return 0;
+    }
+
+    return snd_pcm_poll_descriptors(alsa_backend->alsa_handle, fds, nb_fds);
+}
+
+int alsa_get_latency(audio_backend_handle_t handle, unsigned long* latency_us)
+{
+    int ret;
+    struct alsa_backend_t* const alsa_backend = (struct alsa_backend_t*)handle;
+    snd_pcm_sframes_t delay = 0;
+
+    if ((handle == 0) || (latency_us == 0))
+    {
+        logger_log(LOG_ERROR, "%s: handle or latency pointer is null", __func__);
+        return -EINVAL;
+    }
+
+    if (alsa_backend->alsa_handle == 0)
+    {
+        return -ENODEV;
+    }
+
+    ret = snd_pcm_delay(alsa_backend->alsa_handle, &delay);
+    if (ret < 0)
+    {
+        return ret;
+    }
+
+    *latency_us = (delay > 0) ? (unsigned long)((delay * 1000000LL) / alsa_backend->sample_rate) : 0;
+
+    return 0;
+}
+
+int alsa_drain(audio_backend_handle_t handle)
+{
+    int ret;
+    struct alsa_backend_t* const alsa_backend = (struct alsa_backend_t*)handle;
+
+    if (handle == 0)
+    {
+        logger_log(LOG_ERROR, "%s: handle pointer is null", __func__);
+        return -EINVAL;
+    }
+
+    if (alsa_backend->alsa_handle == 0)
+    {
+        return 0;
+    }
+
+    /* snd_pcm_drain only returns -EAGAIN in non blocking mode, the device is closed right after anyway */
+    if (alsa_backend->nonblock)
+    {
+        snd_pcm_nonblock(alsa_backend->alsa_handle, 0);
+    }
+
+    ret = snd_pcm_drain(alsa_backend->alsa_handle);
+    if (ret < 0)
+    {
+        logger_log(LOG_WARNING, "%s: drain error: %s", __func__, snd_strerror(ret));
+    }
+
+    return ret;
+}
+
+int alsa_recover(struct alsa_backend_t* alsa_backend, int err)
+{
+    int const ret = snd_pcm_recover(alsa_backend->alsa_handle, err, 0);
+
+    if ((ret == 0) && (err == -EPIPE))
+    {
+        STATS_ADD(alsa_backend->parent.stats, xruns, 1);
+    }
+
+    return ret;
+}
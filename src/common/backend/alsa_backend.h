@@ -3,9 +3,11 @@
 
 #include "audio_backend.h"
 
-#define ALSA_BACKEND_NAME   "alsa"
+#define ALSA_BACKEND_NAME       "alsa"
+#define ALSA_MMAP_BACKEND_NAME  "alsa_mmap"
 
 int alsa_backend_init(audio_backend_handle_t* handle);
+int alsa_mmap_backend_init(audio_backend_handle_t* handle);
 
 #endif /*__ALSA_BACKEND_H__*/
 
@@ -1,20 +1,30 @@
 #include "audio_backend.h"
 #include <errno.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include "common/logger.h"
 
 #include "pipe_backend.h"
 #include "file_backend.h"
+#include "wav_backend.h"
+#include "null_backend.h"
 #if ALSA
 #include "alsa_backend.h"
 #endif
 #if PULSEAUDIO
 #include "pulseaudio_backend.h"
+#include "pulseaudio_async_backend.h"
 #endif
 #if JACK
 #include "jack_backend.h"
 #endif
+#if PIPEWIRE
+#include "pipewire_backend.h"
+#endif
+#if SHM
+#include "shm_backend.h"
+#endif
 
 #define HELP_TEXT_LEN   2048
 
@@ -28,15 +38,26 @@ static struct backend_list_item_t const backend_list[] =
 {
     #if ALSA
     { ALSA_BACKEND_NAME, alsa_backend_init },
+    { ALSA_MMAP_BACKEND_NAME, alsa_mmap_backend_init },
     #endif
     #if PULSEAUDIO
     { PULSEAUDIO_BACKEND_NAME, pulseaudio_backend_init },
+    { PULSEAUDIO_ASYNC_BACKEND_NAME, pulseaudio_async_backend_init },
     #endif
     #if JACK
     { JACK_BACKEND_NAME, jack_backend_init },
     #endif
+    #if PIPEWIRE
+    { PIPEWIRE_BACKEND_NAME, pipewire_backend_init },
+    #endif
     { PIPE_BACKEND_NAME, pipe_backend_init },
-    { FILE_BACKEND_NAME, file_backend_init }
+    #if SHM
+    { SHM_BACKEND_NAME, shm_backend_init },
+    #endif
+    { FILE_BACKEND_NAME, file_backend_init },
+    { WAV_BACKEND_NAME, wav_backend_init },
+    { NULL_BACKEND_NAME, null_backend_init },
+    { SYNTH_BACKEND_NAME, synth_backend_init }
 };
 
 int audio_backend_get_by_name(char const* name, audio_backend_handle_t* backend)
@@ -63,6 +84,19 @@ int audio_backend_get_by_name(char const* name, audio_backend_handle_t* backend)
     return -EINVAL;
 }
 
+void audio_backend_release(audio_backend_handle_t* backend)
+{
+    if ((backend != 0) && (*backend != 0))
+    {
+        if ((*backend)->release != 0)
+        {
+            (*backend)->release(*backend);
+        }
+        free(*backend);
+        *backend = 0;
+    }
+}
+
 char const* audio_backend_get_help()
 {
     static char help_text[HELP_TEXT_LEN];
@@ -9,20 +9,91 @@ struct audio_backend_t;
 typedef struct audio_backend_t* audio_backend_handle_t;
 
 typedef int (*audio_backend_init_f) (audio_backend_handle_t* handle);
-typedef int (*audio_backend_open_f)     (audio_backend_handle_t handle, char const* output_name, enum audio_direction direction, size_t buffer_size, struct stream_config_t const* config);
+typedef int (*audio_backend_open_f)     (audio_backend_handle_t handle, char const* output_name, char const* stream_name, enum audio_direction direction, size_t buffer_size, struct stream_config_t const* config);
 typedef int (*audio_backend_close_f)    (audio_backend_handle_t handle);
 typedef int (*audio_backend_write_f)    (audio_backend_handle_t handle, char const* data, size_t size);
 typedef int (*audio_backend_read_f)     (audio_backend_handle_t handle, char* data, size_t size);
 
+/**
+ * Optional direct access to the device buffer.
+ * begin gives the next contiguous area of the device buffer, waiting until at least one frame is available.
+ * @p size is the maximum size wanted on input, and the size of the area on output (whole frames).
+ * commit tells that @p size bytes of this area have been written (playback) or consumed (capture).
+ * A non blocking device may refuse the whole area with -EAGAIN, which is then given again by the next begin.
+ * Backends that do not support it leave both entries null, and write / read are used.
+ */
+typedef int (*audio_backend_begin_f)    (audio_backend_handle_t handle, char** data, size_t* size);
+typedef int (*audio_backend_commit_f)   (audio_backend_handle_t handle, size_t size);
+
+/**
+ * Optional non blocking operation.
+ * set_nonblock is called before open, write / read / begin then return -EAGAIN instead of waiting.
+ * get_poll_fds fills @p fds with the descriptors to poll before retrying, and returns their number.
+ */
+typedef int (*audio_backend_set_nonblock_f) (audio_backend_handle_t handle, int nonblock);
+typedef int (*audio_backend_get_poll_fds_f) (audio_backend_handle_t handle, struct pollfd* fds, size_t nb_fds);
+
+/**
+ * Optional latency report: time for a sample written now to be played (playback),
+ * or time since the oldest sample not read yet was captured (capture).
+ */
+typedef int (*audio_backend_get_latency_f)  (audio_backend_handle_t handle, unsigned long* latency_us);
+
+/**
+ * Optional: wait until everything written so far has been played, called on a playback device before close when its end must be heard.
+ * Backends without it are given the time of their latency report instead.
+ */
+typedef int (*audio_backend_drain_f)        (audio_backend_handle_t handle);
+
+/**
+ * Optional stream configuration imposed by the device itself (e.g. the header of a file to read).
+ * Called before open, with the device name that will be given to open.
+ */
+typedef int (*audio_backend_probe_config_f) (audio_backend_handle_t handle, char const* output_name, struct stream_config_t* config);
+
+/**
+ * Optional capabilities query, for the device that would be opened with @p output_name in @p direction.
+ * Backends without it are assumed to support everything, with a clock.
+ */
+typedef int (*audio_backend_query_caps_f)   (audio_backend_handle_t handle, char const* output_name, enum audio_direction direction, struct audio_caps_t* caps);
+
+/**
+ * Optional: vban frame counter (nuFrame) of the packet the data written next comes from, for backends that pass it on.
+ */
+typedef void (*audio_backend_set_frame_f)       (audio_backend_handle_t handle, uint32_t nu_frame);
+
+/**
+ * Optional release of what the backend init took, called by audio_backend_release before freeing the backend.
+ */
+typedef void (*audio_backend_release_f)     (audio_backend_handle_t handle);
+
 struct audio_backend_t
 {
     audio_backend_open_f                open;
     audio_backend_close_f               close;
     audio_backend_write_f               write;
     audio_backend_read_f                read;
+    audio_backend_begin_f               begin;
+    audio_backend_commit_f              commit;
+    audio_backend_set_nonblock_f        set_nonblock;
+    audio_backend_get_poll_fds_f        get_poll_fds;
+    audio_backend_get_latency_f         get_latency;
+    audio_backend_drain_f               drain;
+    audio_backend_probe_config_f        probe_config;
+    audio_backend_query_caps_f          query_caps;
+    audio_backend_set_frame_f           set_frame;
+    audio_backend_release_f             release;
+
+    /* counters of the stream using the device, set by the audio layer, may be null */
+    struct stats_stream_t*              stats;
 };
 
 int audio_backend_get_by_name(char const* name, audio_backend_handle_t* backend);
+
+/**
+ * Free a backend got from audio_backend_get_by_name, once closed. @p backend is set to 0.
+ */
+void audio_backend_release(audio_backend_handle_t* backend);
 char const* audio_backend_get_help();
 
 #endif /*__AUDIO_BACKEND_H__*/
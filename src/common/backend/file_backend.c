@@ -34,10 +34,11 @@ struct file_backend_t
     int	fd;
 };
 
-static int file_open(audio_backend_handle_t handle, char const* output_name, enum audio_direction direction, size_t buffer_size, struct stream_config_t const* config);
+static int file_open(audio_backend_handle_t handle, char const* output_name, char const* stream_name, enum audio_direction direction, size_t buffer_size, struct stream_config_t const* config);
 static int file_close(audio_backend_handle_t handle);
 static int file_write(audio_backend_handle_t handle, char const* data, size_t size);
 static int file_read(audio_backend_handle_t handle, char* data, size_t size);
+static int file_query_caps(audio_backend_handle_t handle, char const* output_name, enum audio_direction direction, struct audio_caps_t* caps);
 
 int file_backend_init(audio_backend_handle_t* handle)
 {
@@ -60,6 +61,7 @@ int file_backend_init(audio_backend_handle_t* handle)
     file_backend->parent.close              = file_close;
     file_backend->parent.write              = file_write;
     file_backend->parent.read               = file_read;
+    file_backend->parent.query_caps         = file_query_caps;
 
     *handle = (audio_backend_handle_t)file_backend;
 
@@ -67,10 +69,30 @@ int file_backend_init(audio_backend_handle_t* handle)
     
 }
 
-int file_open(audio_backend_handle_t handle, char const* output_name, enum audio_direction direction, size_t buffer_size, struct stream_config_t const* config)
+int file_query_caps(audio_backend_handle_t handle, char const* output_name, enum audio_direction direction, struct audio_caps_t* caps)
+{
+    (void)handle;
+    (void)output_name;
+    (void)direction;
+
+    if (caps == 0)
+    {
+        logger_log(LOG_FATAL, "%s: null caps pointer", __func__);
+        return -EINVAL;
+    }
+
+    /* raw bytes in any format, at the pace of the other end */
+    caps->has_clock = 0;
+
+    return 0;
+}
+
+int file_open(audio_backend_handle_t handle, char const* output_name, char const* stream_name, enum audio_direction direction, size_t buffer_size, struct stream_config_t const* config)
 {
     struct file_backend_t* const file_backend = (struct file_backend_t*)handle;
 
+    (void)stream_name;
+
     if (handle == 0)
     {
         logger_log(LOG_FATAL, "%s: handle pointer is null", __func__);
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include "jack_backend.h"
 #include <jack/jack.h>
 #include <jack/ringbuffer.h>
@@ -5,51 +6,64 @@
 #include <stdio.h>
 #include <stddef.h>
 #include <string.h>
+#include <time.h>
+#include <semaphore.h>
 #include "common/logger.h"
+#include "common/stats.h"
+#include "common/convert.h"
+#include "jack_host.h"
 
 #define NB_BUFFERS  2
 
+/** how long jack_read waits for the process callback before checking the client again */
+#define READ_TIMEOUT_NS     100000000
+
 struct jack_backend_t
 {
     struct audio_backend_t  parent;
+    struct jack_host_t*     host;
     jack_client_t*          jack_client;
     jack_port_t*            ports[VBAN_CHANNELS_MAX_NB];
+    jack_default_audio_sample_t* buffers[VBAN_CHANNELS_MAX_NB];
     jack_ringbuffer_t*      ring_buffer;
     size_t                  buffer_size;
+    enum audio_direction    direction;
     enum VBanBitResolution  bit_fmt;
     unsigned int            nb_channels;
+    size_t                  frame_size;
+    /* set from the jack threads, read from the audio thread */
     int                     active;
+    int                     shutdown;
+    sem_t                   data_ready;
+    /* bounce buffer for the frame that straddles the two ring buffer segments */
+    char                    frame_buffer[VBAN_CHANNELS_MAX_NB * sizeof(double)];
 };
 
-static int jack_open(audio_backend_handle_t handle, char const* output_name, enum audio_direction direction, size_t buffer_size, struct stream_config_t const* config);
+static int jack_open(audio_backend_handle_t handle, char const* output_name, char const* stream_name, enum audio_direction direction, size_t buffer_size, struct stream_config_t const* config);
 static int jack_close(audio_backend_handle_t handle);
 static int jack_write(audio_backend_handle_t handle, char const* data, size_t nb_sample);
+static int jack_read(audio_backend_handle_t handle, char* data, size_t size);
+static int jack_query_caps(audio_backend_handle_t handle, char const* output_name, enum audio_direction direction, struct audio_caps_t* caps);
 
-static int jack_process_cb(jack_nframes_t nframes, void* arg);
+static void jack_process_cb(jack_nframes_t nframes, void* arg);
+static void jack_process_capture(struct jack_backend_t* jack_backend, jack_nframes_t nframes);
+static void jack_process_playback(struct jack_backend_t* jack_backend, jack_nframes_t nframes);
 static void jack_shutdown_cb(void* arg);
-static jack_default_audio_sample_t jack_convert_sample(char const* ptr, enum VBanBitResolution bit_fmt);
-static int jack_start(struct jack_backend_t* jack_backend)
+static int jack_start(struct jack_backend_t* jack_backend, char const* stream_name)
 {
     int ret = 0;
     size_t port;
-    char port_name[32];
+    char port_name[64];
     char const** ports;
     size_t port_id;
 
-    ret = jack_activate(jack_backend->jack_client);
-    if (ret)
-    {
-        logger_log(LOG_ERROR, "%s: can't activate client", __func__);
-        return ret;
-    }
-
-    logger_log(LOG_DEBUG, "%s: jack activated", __func__);
-
+    /* the client may be shared with other streams: prefix the ports with the stream name */
     for (port = 0; port != jack_backend->nb_channels; ++port)
     {
-        snprintf(port_name, sizeof(port_name)-1, "playback_%u", (unsigned int)(port+1));
+        snprintf(port_name, sizeof(port_name)-1, "%s%s%s_%u", stream_name, (stream_name[0] != '\0') ? "_" : "",
+            (jack_backend->direction == AUDIO_OUT) ? "playback" : "capture", (unsigned int)(port+1));
         jack_backend->ports[port] = jack_port_register(jack_backend->jack_client
-            , port_name, JACK_DEFAULT_AUDIO_TYPE, JackPortIsOutput, 0);
+            , port_name, JACK_DEFAULT_AUDIO_TYPE, (jack_backend->direction == AUDIO_OUT) ? JackPortIsOutput : JackPortIsInput, 0);
         if (jack_backend->ports[port] == 0)
         {
             logger_log(LOG_ERROR, "%s: impossible to set jack port for channel %d", __func__, port);
@@ -58,16 +72,25 @@ static int jack_start(struct jack_backend_t* jack_backend)
         }
     }
 
+    ret = jack_host_add_stream(jack_backend->host, jack_process_cb, jack_shutdown_cb, jack_backend);
+    if (ret < 0)
+    {
+        jack_close((audio_backend_handle_t)jack_backend);
+        return ret;
+    }
+
     //XXX do we really want to autoconnect ? this should be an option
     ports = jack_get_ports(jack_backend->jack_client, 0, 0,
-                JackPortIsPhysical|JackPortIsInput);
+                JackPortIsPhysical|((jack_backend->direction == AUDIO_OUT) ? JackPortIsInput : JackPortIsOutput));
 
     if (ports != 0)
     {
         port_id = 0;
         while ((ports[port_id] != 0) && (port_id != jack_backend->nb_channels))
         {
-            ret = jack_connect(jack_backend->jack_client, jack_port_name(jack_backend->ports[port_id]), ports[port_id]);
+            ret = (jack_backend->direction == AUDIO_OUT)
+                ? jack_connect(jack_backend->jack_client, jack_port_name(jack_backend->ports[port_id]), ports[port_id])
+                : jack_connect(jack_backend->jack_client, ports[port_id], jack_port_name(jack_backend->ports[port_id]));
             if (ret)
             {
                 logger_log(LOG_WARNING, "%s: could not autoconnect channel %d", __func__, port_id);
@@ -109,13 +132,68 @@ int jack_backend_init(audio_backend_handle_t* handle)
     jack_backend->parent.open               = jack_open;
     jack_backend->parent.close              = jack_close;
     jack_backend->parent.write              = jack_write;
+    jack_backend->parent.read               = jack_read;
+    jack_backend->parent.query_caps         = jack_query_caps;
+
+    if (sem_init(&jack_backend->data_ready, 0, 0) != 0)
+    {
+        logger_log(LOG_FATAL, "%s: could not init semaphore", __func__);
+        free(jack_backend);
+        return -errno;
+    }
 
     *handle = (audio_backend_handle_t)jack_backend;
 
     return 0;
 }
 
-int jack_open(audio_backend_handle_t handle, char const* output_name, enum audio_direction direction, size_t buffer_size, struct stream_config_t const* config)
+int jack_query_caps(audio_backend_handle_t handle, char const* output_name, enum audio_direction direction, struct audio_caps_t* caps)
+{
+    int ret;
+    struct jack_backend_t* const jack_backend = (struct jack_backend_t*)handle;
+    enum VBanBitResolution bit_fmt;
+
+    (void)direction;
+
+    if ((handle == 0) || (caps == 0))
+    {
+        logger_log(LOG_FATAL, "%s: null pointer argument", __func__);
+        return -EINVAL;
+    }
+
+    /* the client is kept for the following jack_open, jack_close releases it otherwise */
+    if (jack_backend->host == 0)
+    {
+        ret = jack_host_acquire((output_name[0] == '\0') ? "vban" : output_name, &jack_backend->host);
+        if (ret < 0)
+        {
+            logger_log(LOG_ERROR, "%s: could not open jack client", __func__);
+            return ret;
+        }
+        jack_backend->jack_client = jack_host_get_client(jack_backend->host);
+        __atomic_store_n(&jack_backend->shutdown, 0, __ATOMIC_RELEASE);
+    }
+
+    caps->formats = 0;
+    for (bit_fmt = VBAN_BITFMT_8_INT; bit_fmt != VBAN_BIT_RESOLUTION_MAX; ++bit_fmt)
+    {
+        if (convert_is_supported(bit_fmt))
+        {
+            caps->formats |= AUDIO_CAPS_FORMAT(bit_fmt);
+        }
+    }
+
+    /* jack does not resample: the stream has to run at the server rate */
+    caps->rate_min          = jack_get_sample_rate(jack_backend->jack_client);
+    caps->rate_max          = caps->rate_min;
+    caps->period_frames     = jack_get_buffer_size(jack_backend->jack_client);
+    caps->latency_min_us    = (caps->rate_min != 0) ? (unsigned long)(((unsigned long long)caps->period_frames * 1000000) / caps->rate_min) : 0;
+    caps->has_clock         = 1;
+
+    return 0;
+}
+
+int jack_open(audio_backend_handle_t handle, char const* output_name, char const* stream_name, enum audio_direction direction, size_t buffer_size, struct stream_config_t const* config)
 {
     int ret;
     struct jack_backend_t* const jack_backend = (struct jack_backend_t*)handle;
@@ -129,38 +207,56 @@ int jack_open(audio_backend_handle_t handle, char const* output_name, enum audio
         return -EINVAL;
     }
 
-    if (jack_backend->jack_client == 0)
+    if (jack_backend->host == 0)
     {
-        jack_backend->jack_client = jack_client_open((output_name[0] == '\0') ? "vban" : output_name, 0, 0);
-        if (jack_backend->jack_client == 0)
+        ret = jack_host_acquire((output_name[0] == '\0') ? "vban" : output_name, &jack_backend->host);
+        if (ret < 0)
         {
             logger_log(LOG_ERROR, "%s: could not open jack client", __func__);
-            return -ENODEV;
+            return ret;
         }
+        jack_backend->jack_client = jack_host_get_client(jack_backend->host);
+        __atomic_store_n(&jack_backend->shutdown, 0, __ATOMIC_RELEASE);
     }
 
-    jack_buffer_size            = jack_get_buffer_size(jack_backend->jack_client) * jack_backend->nb_channels * VBanBitResolutionSize[config->bit_fmt];
-    buffer_size                 = ((buffer_size > jack_buffer_size) ? buffer_size : jack_buffer_size) * NB_BUFFERS;
-    jack_backend->nb_channels   = config->nb_channels;
-    jack_backend->bit_fmt= config->bit_fmt;
+    if (!convert_is_supported(config->bit_fmt))
+    {
+        logger_log(LOG_ERROR, "%s: unsupported bit format %s", __func__, stream_print_bit_fmt(config->bit_fmt));
+        /* drops the client reference taken above or by jack_query_caps */
+        jack_close(handle);
+        return -EINVAL;
+    }
 
-    jack_backend->ring_buffer   = jack_ringbuffer_create(buffer_size);
+    jack_backend->direction     = direction;
+    jack_backend->nb_channels   = config->nb_channels;
+    jack_backend->bit_fmt       = config->bit_fmt;
+    jack_backend->frame_size    = jack_backend->nb_channels * VBanBitResolutionSize[config->bit_fmt];
 
-    char* const zeros = calloc(1, buffer_size / NB_BUFFERS);
-    jack_ringbuffer_write(jack_backend->ring_buffer, zeros, buffer_size / NB_BUFFERS);
-    free(zeros);
+    jack_buffer_size            = jack_get_buffer_size(jack_backend->jack_client) * jack_backend->frame_size;
+    buffer_size                 = ((buffer_size > jack_buffer_size) ? buffer_size : jack_buffer_size);
+    if (direction == AUDIO_IN)
+    {
+        /* jack_read must always be able to get a complete packet payload */
+        buffer_size += VBAN_DATA_MAX_SIZE;
+    }
+    buffer_size                 *= NB_BUFFERS;
 
-    ret = jack_set_process_callback(jack_backend->jack_client, jack_process_cb, jack_backend);
-    if (ret)
+    jack_backend->ring_buffer   = jack_ringbuffer_create(buffer_size);
+    if (jack_backend->ring_buffer == 0)
     {
-        logger_log(LOG_ERROR, "%s: impossible to set jack process callback", __func__);
+        logger_log(LOG_ERROR, "%s: could not create ring buffer", __func__);
         jack_close(handle);
-        return ret;
+        return -ENOMEM;
     }
 
-    jack_on_shutdown(jack_backend->jack_client, jack_shutdown_cb, jack_backend);
+    if (direction == AUDIO_OUT)
+    {
+        char* const zeros = calloc(1, buffer_size / NB_BUFFERS);
+        jack_ringbuffer_write(jack_backend->ring_buffer, zeros, buffer_size / NB_BUFFERS);
+        free(zeros);
+    }
 
-    ret = jack_start(jack_backend);
+    ret = jack_start(jack_backend, stream_name);
 
     return ret;
 }
@@ -168,6 +264,7 @@ int jack_open(audio_backend_handle_t handle, char const* output_name, enum audio
 int jack_close(audio_backend_handle_t handle)
 {
     int ret = 0;
+    size_t port;
     struct jack_backend_t* const jack_backend = (struct jack_backend_t*)handle;
 
     if (handle == 0)
@@ -176,29 +273,30 @@ int jack_close(audio_backend_handle_t handle)
         return -EINVAL;
     }
 
-    if (jack_backend->jack_client == 0)
+    if (jack_backend->host == 0)
     {
         /** nothing to do */
         return 0;
     }
 
-    jack_backend->active = 0;
+    /* after this, the shared process callback does not touch this backend anymore */
+    jack_host_remove_stream(jack_backend->host, jack_backend);
+    __atomic_store_n(&jack_backend->active, 0, __ATOMIC_RELEASE);
 
-    ret = jack_deactivate(jack_backend->jack_client);
-    if (ret)
+    for (port = 0; port != VBAN_CHANNELS_MAX_NB; ++port)
     {
-        logger_log(LOG_FATAL, "%s: jack_deactivate failed with error %d", __func__);
+        if ((jack_backend->ports[port] != 0) && !__atomic_load_n(&jack_backend->shutdown, __ATOMIC_ACQUIRE))
+        {
+            jack_port_unregister(jack_backend->jack_client, jack_backend->ports[port]);
+        }
     }
 
-    ret = jack_client_close(jack_backend->jack_client);
-    if (ret)
-    {
-        logger_log(LOG_FATAL, "%s: jack_client_close failed with error %d", __func__);
-    }
+    ret = jack_host_release(&jack_backend->host);
 
     if (jack_backend->ring_buffer != 0)
     {
         jack_ringbuffer_free(jack_backend->ring_buffer);
+        jack_backend->ring_buffer = 0;
     }
 
     jack_backend->jack_client = 0;
@@ -220,13 +318,13 @@ int jack_write(audio_backend_handle_t handle, char const* data, size_t size)
         return -EINVAL;
     }
 
-    if (jack_backend->jack_client == 0)
+    if ((jack_backend->jack_client == 0) || __atomic_load_n(&jack_backend->shutdown, __ATOMIC_ACQUIRE))
     {
         logger_log(LOG_ERROR, "%s: device not open", __func__);
         return -ENODEV;
     }
 
-    if (jack_backend->active == 0)
+    if (!__atomic_load_n(&jack_backend->active, __ATOMIC_ACQUIRE))
     {
         logger_log(LOG_DEBUG, "%s: server not active yet", __func__);
         return size;
@@ -235,6 +333,7 @@ int jack_write(audio_backend_handle_t handle, char const* data, size_t size)
     if (jack_ringbuffer_write_space(jack_backend->ring_buffer) < size)
     {
         logger_log(LOG_WARNING, "%s: short write", __func__);
+        STATS_ADD(jack_backend->parent.stats, short_transfers, 1);
         return 0;
     }
     
@@ -243,127 +342,141 @@ int jack_write(audio_backend_handle_t handle, char const* data, size_t size)
     return (ret < 0) ? ret : size;
 }
 
-int jack_process_cb(jack_nframes_t nframes, void* arg)
+int jack_read(audio_backend_handle_t handle, char* data, size_t size)
 {
-    struct jack_backend_t* const jack_backend = (struct jack_backend_t*)arg;
-    size_t channel;
-    size_t sample;
-    jack_ringbuffer_data_t rb_data[2];
-    static jack_default_audio_sample_t* buffers[VBAN_CHANNELS_MAX_NB];
-    char const* ptr;
-    size_t len;
-    size_t sampleSize;
-    size_t index = 0;
-    size_t part;
-    char sampleParts[8];
+    struct jack_backend_t* const jack_backend = (struct jack_backend_t*)handle;
+    struct timespec deadline;
 
-    if (arg == 0)
+    logger_log(LOG_DEBUG, "%s", __func__);
+
+    if ((handle == 0) || (data == 0))
     {
-        logger_log(LOG_ERROR, "%s: handle pointer is null", __func__);
+        logger_log(LOG_ERROR, "%s: handle or data pointer is null", __func__);
         return -EINVAL;
     }
 
-    logger_log(LOG_DEBUG, "%s", __func__);
+    /* only give complete frames to upper layer */
+    size -= size % jack_backend->frame_size;
 
-    sampleSize = VBanBitResolutionSize[jack_backend->bit_fmt];
-    jack_backend->active = 1;
+    while ((jack_backend->jack_client != 0) && !__atomic_load_n(&jack_backend->shutdown, __ATOMIC_ACQUIRE) && (jack_ringbuffer_read_space(jack_backend->ring_buffer) < size))
+    {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += READ_TIMEOUT_NS;
+        if (deadline.tv_nsec >= 1000000000)
+        {
+            deadline.tv_sec += 1;
+            deadline.tv_nsec -= 1000000000;
+        }
 
-    for (channel = 0; channel != jack_backend->nb_channels; ++channel)
+        if ((sem_timedwait(&jack_backend->data_ready, &deadline) != 0) && (errno != ETIMEDOUT) && (errno != EINTR))
+        {
+            logger_log(LOG_ERROR, "%s: sem_timedwait failed: %s", __func__, strerror(errno));
+            return -errno;
+        }
+    }
+
+    if ((jack_backend->jack_client == 0) || __atomic_load_n(&jack_backend->shutdown, __ATOMIC_ACQUIRE))
     {
-        buffers[channel] = (jack_default_audio_sample_t*)jack_port_get_buffer(jack_backend->ports[channel], nframes);
+        logger_log(LOG_ERROR, "%s: device not open", __func__);
+        return -ENODEV;
     }
 
-    jack_ringbuffer_get_read_vector(jack_backend->ring_buffer, rb_data);
+    jack_ringbuffer_read(jack_backend->ring_buffer, data, size);
+
+    return size;
+}
+
+/** the conversion kernels have their own segment type: copy, do not alias jack's */
+static void jack_get_segments(jack_ringbuffer_data_t const* rb_data, struct convert_segment_t* segments)
+{
+    segments[0].buf = rb_data[0].buf;
+    segments[0].len = rb_data[0].len;
+    segments[1].buf = rb_data[1].buf;
+    segments[1].len = rb_data[1].len;
+}
+
+void jack_process_capture(struct jack_backend_t* jack_backend, jack_nframes_t nframes)
+{
+    jack_ringbuffer_data_t rb_data[2];
+    struct convert_segment_t segments[2];
+
+    jack_ringbuffer_get_write_vector(jack_backend->ring_buffer, rb_data);
 
-    if ((rb_data[0].len + rb_data[1].len) < (nframes * jack_backend->nb_channels * sampleSize))
+    if ((rb_data[0].len + rb_data[1].len) < (nframes * jack_backend->frame_size))
     {
-        logger_log(LOG_WARNING, "%s: short read", __func__);
-        return 0;
+        /* reader is late: drop this period rather than blocking the graph */
+        STATS_ADD(jack_backend->parent.stats, short_transfers, 1);
+        return;
     }
 
-    ptr = rb_data[0].buf;
-    len = 0;
-    for (sample = 0; sample != nframes; ++sample)
+    jack_get_segments(rb_data, segments);
+    convert_interleave_segments(segments, jack_backend->frame_buffer, jack_backend->bit_fmt,
+        (float const* const*)jack_backend->buffers, jack_backend->nb_channels, nframes);
+
+    jack_ringbuffer_write_advance(jack_backend->ring_buffer, nframes * jack_backend->frame_size);
+    sem_post(&jack_backend->data_ready);
+}
+
+void jack_process_playback(struct jack_backend_t* jack_backend, jack_nframes_t nframes)
+{
+    jack_ringbuffer_data_t rb_data[2];
+    struct convert_segment_t segments[2];
+    size_t channel;
+
+    jack_ringbuffer_get_read_vector(jack_backend->ring_buffer, rb_data);
+
+    if ((rb_data[0].len + rb_data[1].len) < (nframes * jack_backend->frame_size))
     {
+        logger_log(LOG_WARNING, "%s: short read", __func__);
+        STATS_ADD(jack_backend->parent.stats, short_transfers, 1);
         for (channel = 0; channel != jack_backend->nb_channels; ++channel)
         {
-            if (index == 0)
-            {
-                if ((len + sampleSize) > rb_data[0].len)
-                {
-                    part = 0;
-                    while (ptr != (rb_data[0].buf + rb_data[0].len))
-                    {
-                        sampleParts[part++] = *(ptr++);
-                    }
-                    ptr = rb_data[1].buf;
-                    for (; part < VBanBitResolutionSize[jack_backend->bit_fmt]; ++part, ++ptr)
-                    {
-                        sampleParts[part] = *ptr;
-                    }
-
-                    buffers[channel][sample] = jack_convert_sample((char const*)sampleParts, jack_backend->bit_fmt);
-                    len += sampleSize;
-                    index = 1;
-                    continue;
-                }
-                if (len == rb_data[0].len)
-                {
-                    ptr = rb_data[1].buf;
-                    index = 1;
-                }
-            }
-
-            buffers[channel][sample] = jack_convert_sample(ptr, jack_backend->bit_fmt);
-            ptr += sampleSize;
-            len += sampleSize;
+            memset(jack_backend->buffers[channel], 0, nframes * sizeof(jack_default_audio_sample_t));
         }
+        return;
     }
 
-    jack_ringbuffer_read_advance(jack_backend->ring_buffer, len);
+    jack_get_segments(rb_data, segments);
+    convert_deinterleave_segments(jack_backend->buffers, segments, jack_backend->frame_buffer,
+        jack_backend->bit_fmt, jack_backend->nb_channels, nframes);
 
-    return 0;
+    jack_ringbuffer_read_advance(jack_backend->ring_buffer, nframes * jack_backend->frame_size);
 }
 
-void jack_shutdown_cb(void* arg)
+void jack_process_cb(jack_nframes_t nframes, void* arg)
 {
-    audio_backend_handle_t const jack_backend = (audio_backend_handle_t)arg;
+    struct jack_backend_t* const jack_backend = (struct jack_backend_t*)arg;
+    size_t channel;
 
-    if (arg == 0)
+    __atomic_store_n(&jack_backend->active, 1, __ATOMIC_RELEASE);
+
+    for (channel = 0; channel != jack_backend->nb_channels; ++channel)
     {
-        logger_log(LOG_ERROR, "%s: handle pointer is null");
-        return ;
+        jack_backend->buffers[channel] = (jack_default_audio_sample_t*)jack_port_get_buffer(jack_backend->ports[channel], nframes);
     }
 
-    jack_close(jack_backend);
-
-    /*XXX how to notify upper layer that we are done ?*/
+    if (jack_backend->direction == AUDIO_IN)
+    {
+        jack_process_capture(jack_backend, nframes);
+    }
+    else
+    {
+        jack_process_playback(jack_backend, nframes);
+    }
 }
 
-jack_default_audio_sample_t jack_convert_sample(char const* ptr, enum VBanBitResolution bit_fmt)
+void jack_shutdown_cb(void* arg)
 {
-    int value;
+    struct jack_backend_t* const jack_backend = (struct jack_backend_t*)arg;
 
-    switch (bit_fmt)
+    if (arg == 0)
     {
-        case VBAN_BITFMT_8_INT:
-            return (float)(*((int8_t const*)ptr)) / (float)(1 << 7);
-
-        case VBAN_BITFMT_16_INT:
-            return (float)(*((int16_t const*)ptr)) / (float)(1 << 15);
-
-        case VBAN_BITFMT_24_INT:
-            value = (ptr[2] << 16) | ((unsigned char)ptr[1] << 8) | (unsigned char)ptr[0];
-            return (float)value / (float)(1 << 23);
-
-        case VBAN_BITFMT_32_INT:
-            return (float)*((int32_t const*)ptr) / (float)(1 << 31);
-
-        case VBAN_BITFMT_32_FLOAT:
-            return *(float const*)ptr;
-
-        case VBAN_BITFMT_64_FLOAT:
-        default:
-            return 0.0;
+        logger_log(LOG_ERROR, "%s: handle pointer is null", __func__);
+        return ;
     }
+
+    /* the client is gone: read and write now fail, the upper layer closes us */
+    __atomic_store_n(&jack_backend->shutdown, 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&jack_backend->active, 0, __ATOMIC_RELEASE);
+    sem_post(&jack_backend->data_ready);
 }
@@ -0,0 +1,296 @@
+#define _GNU_SOURCE
+#include "jack_host.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "common/logger.h"
+
+#define JACK_HOST_NAME_SIZE     64
+
+/** jack_host_remove_stream polls the cycle counter every REMOVE_POLL_NS, for at most REMOVE_POLL_MAX times */
+#define REMOVE_POLL_NS          1000000
+#define REMOVE_POLL_MAX         1000
+
+struct jack_host_stream_t
+{
+    jack_host_process_f     process;
+    jack_host_shutdown_f    shutdown;
+    void*                   arg;
+    int                     active;
+};
+
+struct jack_host_t
+{
+    struct jack_host_t*     next;
+    char                    name[JACK_HOST_NAME_SIZE];
+    jack_client_t*          jack_client;
+    size_t                  ref_count;
+    int                     running;
+    unsigned int            cycle;
+    size_t                  nb_slots;
+    struct jack_host_stream_t streams[JACK_HOST_STREAMS_MAX];
+};
+
+/** protects HostList and all the non realtime accesses to the hosts */
+static pthread_mutex_t HostLock = PTHREAD_MUTEX_INITIALIZER;
+static struct jack_host_t* HostList = 0;
+
+static int jack_host_process_cb(jack_nframes_t nframes, void* arg);
+static void jack_host_shutdown_cb(void* arg);
+
+int jack_host_acquire(char const* client_name, struct jack_host_t** host)
+{
+    int ret = 0;
+    struct jack_host_t* item;
+
+    if ((client_name == 0) || (host == 0))
+    {
+        logger_log(LOG_FATAL, "%s: null pointer argument", __func__);
+        return -EINVAL;
+    }
+
+    pthread_mutex_lock(&HostLock);
+
+    for (item = HostList; item != 0; item = item->next)
+    {
+        if (!strncmp(item->name, client_name, JACK_HOST_NAME_SIZE) && __atomic_load_n(&item->running, __ATOMIC_ACQUIRE))
+        {
+            ++item->ref_count;
+            *host = item;
+            pthread_mutex_unlock(&HostLock);
+            logger_log(LOG_INFO, "%s: sharing jack client %s", __func__, client_name);
+            return 0;
+        }
+    }
+
+    item = calloc(1, sizeof(struct jack_host_t));
+    if (item == 0)
+    {
+        pthread_mutex_unlock(&HostLock);
+        logger_log(LOG_FATAL, "%s: could not allocate memory", __func__);
+        return -ENOMEM;
+    }
+
+    strncpy(item->name, client_name, JACK_HOST_NAME_SIZE - 1);
+
+    item->jack_client = jack_client_open(client_name, 0, 0);
+    if (item->jack_client == 0)
+    {
+        pthread_mutex_unlock(&HostLock);
+        logger_log(LOG_ERROR, "%s: could not open jack client", __func__);
+        free(item);
+        return -ENODEV;
+    }
+
+    ret = jack_set_process_callback(item->jack_client, jack_host_process_cb, item);
+    if (ret)
+    {
+        logger_log(LOG_ERROR, "%s: impossible to set jack process callback", __func__);
+        goto error;
+    }
+
+    jack_on_shutdown(item->jack_client, jack_host_shutdown_cb, item);
+
+    ret = jack_activate(item->jack_client);
+    if (ret)
+    {
+        logger_log(LOG_ERROR, "%s: can't activate client", __func__);
+        goto error;
+    }
+
+    logger_log(LOG_DEBUG, "%s: jack activated", __func__);
+
+    __atomic_store_n(&item->running, 1, __ATOMIC_RELEASE);
+    item->ref_count = 1;
+    item->next      = HostList;
+    HostList        = item;
+    *host           = item;
+
+    pthread_mutex_unlock(&HostLock);
+
+    return 0;
+
+error:
+    jack_client_close(item->jack_client);
+    free(item);
+    pthread_mutex_unlock(&HostLock);
+    return (ret < 0) ? ret : -ENODEV;
+}
+
+int jack_host_release(struct jack_host_t** host)
+{
+    int ret = 0;
+    struct jack_host_t** item;
+
+    if ((host == 0) || (*host == 0))
+    {
+        logger_log(LOG_FATAL, "%s: null host pointer", __func__);
+        return -EINVAL;
+    }
+
+    pthread_mutex_lock(&HostLock);
+
+    if (--(*host)->ref_count != 0)
+    {
+        pthread_mutex_unlock(&HostLock);
+        *host = 0;
+        return 0;
+    }
+
+    for (item = &HostList; *item != 0; item = &(*item)->next)
+    {
+        if (*item == *host)
+        {
+            *item = (*host)->next;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&HostLock);
+
+    if (__atomic_load_n(&(*host)->running, __ATOMIC_ACQUIRE))
+    {
+        ret = jack_deactivate((*host)->jack_client);
+        if (ret)
+        {
+            logger_log(LOG_ERROR, "%s: jack_deactivate failed with error %d", __func__, ret);
+        }
+    }
+
+    ret = jack_client_close((*host)->jack_client);
+    if (ret)
+    {
+        logger_log(LOG_ERROR, "%s: jack_client_close failed with error %d", __func__, ret);
+    }
+
+    free(*host);
+    *host = 0;
+
+    return ret;
+}
+
+jack_client_t* jack_host_get_client(struct jack_host_t* host)
+{
+    return (host != 0) ? host->jack_client : 0;
+}
+
+int jack_host_add_stream(struct jack_host_t* host, jack_host_process_f process, jack_host_shutdown_f shutdown, void* arg)
+{
+    size_t index;
+    struct jack_host_stream_t* stream;
+
+    if ((host == 0) || (process == 0) || (arg == 0))
+    {
+        logger_log(LOG_FATAL, "%s: null pointer argument", __func__);
+        return -EINVAL;
+    }
+
+    pthread_mutex_lock(&HostLock);
+
+    for (index = 0; index != JACK_HOST_STREAMS_MAX; ++index)
+    {
+        stream = &host->streams[index];
+        if ((stream->arg == 0) && !__atomic_load_n(&stream->active, __ATOMIC_ACQUIRE))
+        {
+            stream->process     = process;
+            stream->shutdown    = shutdown;
+            stream->arg         = arg;
+            if (index >= host->nb_slots)
+            {
+                __atomic_store_n(&host->nb_slots, index + 1, __ATOMIC_RELEASE);
+            }
+            /* publish the slot to the process callback once it is complete */
+            __atomic_store_n(&stream->active, 1, __ATOMIC_RELEASE);
+            pthread_mutex_unlock(&HostLock);
+            logger_log(LOG_DEBUG, "%s: stream added in slot %u", __func__, (unsigned int)index);
+            return 0;
+        }
+    }
+
+    pthread_mutex_unlock(&HostLock);
+    logger_log(LOG_ERROR, "%s: too many streams for jack client %s", __func__, host->name);
+
+    return -ENOSPC;
+}
+
+int jack_host_remove_stream(struct jack_host_t* host, void* arg)
+{
+    size_t index;
+    size_t poll;
+    unsigned int cycle;
+    struct jack_host_stream_t* stream;
+    struct timespec const delay = { 0, REMOVE_POLL_NS };
+
+    if ((host == 0) || (arg == 0))
+    {
+        logger_log(LOG_FATAL, "%s: null pointer argument", __func__);
+        return -EINVAL;
+    }
+
+    pthread_mutex_lock(&HostLock);
+
+    for (index = 0; index != host->nb_slots; ++index)
+    {
+        stream = &host->streams[index];
+        if (stream->arg == arg)
+        {
+            __atomic_store_n(&stream->active, 0, __ATOMIC_SEQ_CST);
+            cycle = __atomic_load_n(&host->cycle, __ATOMIC_SEQ_CST);
+
+            /* a cycle that saw the stream active may still be running: wait for it to end */
+            for (poll = 0; __atomic_load_n(&host->running, __ATOMIC_ACQUIRE) && (poll != REMOVE_POLL_MAX) && (__atomic_load_n(&host->cycle, __ATOMIC_ACQUIRE) == cycle); ++poll)
+            {
+                nanosleep(&delay, 0);
+            }
+
+            stream->process     = 0;
+            stream->shutdown    = 0;
+            stream->arg         = 0;
+            pthread_mutex_unlock(&HostLock);
+            return 0;
+        }
+    }
+
+    pthread_mutex_unlock(&HostLock);
+
+    return -ENOENT;
+}
+
+int jack_host_process_cb(jack_nframes_t nframes, void* arg)
+{
+    struct jack_host_t* const host = (struct jack_host_t*)arg;
+    size_t const nb_slots = __atomic_load_n(&host->nb_slots, __ATOMIC_ACQUIRE);
+    size_t index;
+
+    for (index = 0; index != nb_slots; ++index)
+    {
+        if (__atomic_load_n(&host->streams[index].active, __ATOMIC_ACQUIRE))
+        {
+            host->streams[index].process(nframes, host->streams[index].arg);
+        }
+    }
+
+    __atomic_add_fetch(&host->cycle, 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+void jack_host_shutdown_cb(void* arg)
+{
+    struct jack_host_t* const host = (struct jack_host_t*)arg;
+    size_t index;
+
+    logger_log(LOG_ERROR, "%s: jack server shut client %s down", __func__, host->name);
+
+    __atomic_store_n(&host->running, 0, __ATOMIC_RELEASE);
+
+    for (index = 0; index != host->nb_slots; ++index)
+    {
+        if (__atomic_load_n(&host->streams[index].active, __ATOMIC_ACQUIRE) && (host->streams[index].shutdown != 0))
+        {
+            host->streams[index].shutdown(host->streams[index].arg);
+        }
+    }
+}
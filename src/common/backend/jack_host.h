@@ -0,0 +1,57 @@
+#ifndef __JACK_HOST_H__
+#define __JACK_HOST_H__
+
+#include <jack/jack.h>
+
+/**
+ * A jack host owns one jack client and its process callback, and serves all the
+ * jack backends of the process opened with the same client name.
+ * Each backend registers its own ports on the shared client and is called from the
+ * single process callback, so N streams cost one client in the jack graph, not N.
+ */
+
+/**
+ * Maximum number of streams one host can serve
+ */
+#define JACK_HOST_STREAMS_MAX   64
+
+typedef void (*jack_host_process_f)  (jack_nframes_t nframes, void* arg);
+typedef void (*jack_host_shutdown_f) (void* arg);
+
+struct jack_host_t;
+
+/**
+ * Get the host for @p client_name, opening and activating the jack client on first use
+ * @param client_name jack client name
+ * @param host pointer filled with the host
+ * @return 0 upon success, negative value otherwise
+ */
+int jack_host_acquire(char const* client_name, struct jack_host_t** host);
+
+/**
+ * Drop a reference on the host, the jack client is closed with the last one
+ * @param host pointer to the host, set to 0
+ * @return 0 upon success, negative value otherwise
+ */
+int jack_host_release(struct jack_host_t** host);
+
+/**
+ * Get the jack client of the host, to register ports or query the server
+ */
+jack_client_t* jack_host_get_client(struct jack_host_t* host);
+
+/**
+ * Add a stream to the ones served by the process callback
+ * @param process called from the process callback, with @p arg
+ * @param shutdown called if the jack server shuts the client down, with @p arg
+ * @return 0 upon success, negative value otherwise
+ */
+int jack_host_add_stream(struct jack_host_t* host, jack_host_process_f process, jack_host_shutdown_f shutdown, void* arg);
+
+/**
+ * Remove a stream. When this returns, @p process is not running and won't be called again for @p arg
+ * @return 0 upon success, negative value otherwise
+ */
+int jack_host_remove_stream(struct jack_host_t* host, void* arg);
+
+#endif /*__JACK_HOST_H__*/
@@ -0,0 +1,688 @@
+#define _GNU_SOURCE
+#include "null_backend.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <time.h>
+#include "common/logger.h"
+#include "common/convert.h"
+
+#define NS_PER_S            1000000000LL
+#define OPTIONS_SIZE        AUDIO_DEVICE_NAME_SIZE
+#define SINE_FREQUENCY      440.0
+#define SIGNAL_AMPLITUDE    0.5
+#define PI                  3.14159265358979323846
+
+enum synth_signal
+{
+    SIGNAL_SILENCE,
+    SIGNAL_SINE,
+    SIGNAL_NOISE,
+    SIGNAL_IMPULSE,
+    SIGNAL_SEQ,
+};
+
+struct null_backend_t
+{
+    struct audio_backend_t  parent;
+    int                     is_synth;
+    enum audio_direction    direction;
+    enum VBanBitResolution  bit_fmt;
+    unsigned int            nb_channels;
+    unsigned int            sample_rate;
+    size_t                  sample_size;
+    size_t                  frame_size;
+    /* markers are integers in [0, marker_range[, exactly representable in every format */
+    unsigned long           marker_range;
+
+    /* options */
+    int                     clock;
+    int                     verify;
+    enum synth_signal       signal;
+    double                  frequency;
+    unsigned long           impulse_period;
+
+    /* clock */
+    long long               start_ns;
+    unsigned long long      frames;
+    size_t                  buffer_frames;
+    unsigned long           nb_xruns;
+
+    /* generator */
+    unsigned long long      position;
+    unsigned int            noise_state;
+    double                  sine_cos;
+    double                  sine_sin;
+    double                  step_cos;
+    double                  step_sin;
+
+    /* verification */
+    int                     synced;
+    unsigned long           expected;
+    unsigned long long      nb_frames_checked;
+    unsigned long           nb_discontinuities;
+    unsigned long long      nb_frames_lost;
+    unsigned long           nb_corrupted;
+};
+
+static int null_open(audio_backend_handle_t handle, char const* output_name, char const* stream_name, enum audio_direction direction, size_t buffer_size, struct stream_config_t const* config);
+static int null_close(audio_backend_handle_t handle);
+static int null_write(audio_backend_handle_t handle, char const* data, size_t size);
+static int null_read(audio_backend_handle_t handle, char* data, size_t size);
+static int null_get_latency(audio_backend_handle_t handle, unsigned long* latency_us);
+static int null_query_caps(audio_backend_handle_t handle, char const* output_name, enum audio_direction direction, struct audio_caps_t* caps);
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((long long)ts.tv_sec * NS_PER_S) + ts.tv_nsec;
+}
+
+static void sleep_until(long long deadline_ns)
+{
+    struct timespec ts;
+
+    ts.tv_sec   = deadline_ns / NS_PER_S;
+    ts.tv_nsec  = deadline_ns % NS_PER_S;
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0) == EINTR)
+    {
+    }
+}
+
+static long long frames_to_ns(struct null_backend_t const* null_backend, unsigned long long frames)
+{
+    unsigned long long const rate = null_backend->sample_rate;
+
+    /* split, so that frames * NS_PER_S does not overflow in long runs */
+    return (long long)(((frames / rate) * NS_PER_S) + (((frames % rate) * NS_PER_S) / rate));
+}
+
+static void put_int(char* ptr, size_t size, long long value)
+{
+    size_t byte;
+
+    for (byte = 0; byte != size; ++byte)
+    {
+        ptr[byte] = (char)((unsigned long long)value >> (8 * byte));
+    }
+}
+
+static long long get_int(char const* ptr, size_t size)
+{
+    size_t byte;
+    unsigned long long value = 0;
+
+    for (byte = 0; byte != size; ++byte)
+    {
+        value |= (unsigned long long)(unsigned char)ptr[byte] << (8 * byte);
+    }
+
+    if ((size < sizeof(value)) && (value & (1ULL << (8 * size - 1))))
+    {
+        value |= ~0ULL << (8 * size);
+    }
+
+    return (long long)value;
+}
+
+static void put_value(struct null_backend_t const* null_backend, char* ptr, double value)
+{
+    float fvalue;
+
+    switch (null_backend->bit_fmt)
+    {
+        case VBAN_BITFMT_32_FLOAT:
+            fvalue = (float)value;
+            memcpy(ptr, &fvalue, sizeof(fvalue));
+            break;
+
+        case VBAN_BITFMT_64_FLOAT:
+            memcpy(ptr, &value, sizeof(value));
+            break;
+
+        default:
+            put_int(ptr, null_backend->sample_size, (long long)(value * (double)((1LL << (8 * null_backend->sample_size - 1)) - 1)));
+            break;
+    }
+}
+
+/**
+ * Markers: integer k stored as k / marker_range, so that any lossless path gives it back exactly.
+ * Channel 0 holds the frame counter, the other channels a hash of it.
+ */
+static unsigned long marker_value(struct null_backend_t const* null_backend, unsigned long counter, size_t channel)
+{
+    if (channel == 0)
+    {
+        return counter & (null_backend->marker_range - 1);
+    }
+    return (unsigned long)(((unsigned long long)counter * 2654435761ULL + channel * 40503ULL) & (null_backend->marker_range - 1));
+}
+
+static void put_marker(struct null_backend_t const* null_backend, char* ptr, unsigned long marker)
+{
+    size_t const shift = 8 * null_backend->sample_size - 8 * ((null_backend->sample_size < 3) ? null_backend->sample_size : 3);
+
+    switch (null_backend->bit_fmt)
+    {
+        case VBAN_BITFMT_32_FLOAT:
+        case VBAN_BITFMT_64_FLOAT:
+            put_value(null_backend, ptr, (double)marker / null_backend->marker_range);
+            break;
+
+        default:
+            put_int(ptr, null_backend->sample_size, (long long)marker << shift);
+            break;
+    }
+}
+
+static long get_marker(struct null_backend_t const* null_backend, char const* ptr)
+{
+    size_t const shift = 8 * null_backend->sample_size - 8 * ((null_backend->sample_size < 3) ? null_backend->sample_size : 3);
+    long long value;
+    double dvalue;
+    float fvalue;
+
+    switch (null_backend->bit_fmt)
+    {
+        case VBAN_BITFMT_32_FLOAT:
+            memcpy(&fvalue, ptr, sizeof(fvalue));
+            dvalue = (double)fvalue * null_backend->marker_range;
+            break;
+
+        case VBAN_BITFMT_64_FLOAT:
+            memcpy(&dvalue, ptr, sizeof(dvalue));
+            dvalue *= null_backend->marker_range;
+            break;
+
+        default:
+            value = get_int(ptr, null_backend->sample_size);
+            if ((value < 0) || (value & ((1LL << shift) - 1)))
+            {
+                return -1;
+            }
+            return (long)(value >> shift);
+    }
+
+    if ((dvalue < 0) || (dvalue >= null_backend->marker_range) || (dvalue != (double)(long)dvalue))
+    {
+        return -1;
+    }
+    return (long)dvalue;
+}
+
+static void sin_cos(double angle, double* sine, double* cosine)
+{
+    /* taylor series, enough terms for |angle| <= pi, avoids linking libm */
+    double term = angle;
+    double s = 0;
+    double c = 0;
+    int n;
+
+    for (n = 1; n < 40; n += 2)
+    {
+        s += term;
+        term *= -angle * angle / ((n + 1) * (n + 2));
+    }
+
+    term = 1;
+    for (n = 0; n < 40; n += 2)
+    {
+        c += term;
+        term *= -angle * angle / ((n + 1) * (n + 2));
+    }
+
+    *sine = s;
+    *cosine = c;
+}
+
+static void synth_generate(struct null_backend_t* null_backend, char* data, size_t nb_frames)
+{
+    size_t frame;
+    size_t channel;
+    double value = 0;
+    double rotated;
+    char* ptr = data;
+
+    for (frame = 0; frame != nb_frames; ++frame, ++null_backend->position)
+    {
+        switch (null_backend->signal)
+        {
+            case SIGNAL_SEQ:
+                for (channel = 0; channel != null_backend->nb_channels; ++channel, ptr += null_backend->sample_size)
+                {
+                    put_marker(null_backend, ptr, marker_value(null_backend, (unsigned long)null_backend->position, channel));
+                }
+                continue;
+
+            case SIGNAL_IMPULSE:
+                for (channel = 0; channel != null_backend->nb_channels; ++channel, ptr += null_backend->sample_size)
+                {
+                    if ((null_backend->position % null_backend->impulse_period) == 0)
+                    {
+                        put_marker(null_backend, ptr, marker_value(null_backend, (unsigned long)null_backend->position, channel));
+                    }
+                    else
+                    {
+                        memset(ptr, 0, null_backend->sample_size);
+                    }
+                }
+                continue;
+
+            case SIGNAL_SINE:
+                value = SIGNAL_AMPLITUDE * null_backend->sine_sin;
+                rotated = null_backend->sine_cos * null_backend->step_cos - null_backend->sine_sin * null_backend->step_sin;
+                null_backend->sine_sin = null_backend->sine_sin * null_backend->step_cos + null_backend->sine_cos * null_backend->step_sin;
+                null_backend->sine_cos = rotated;
+                if ((null_backend->position & 0xFFF) == 0)
+                {
+                    /* keep the oscillator on the unit circle */
+                    rotated = (3.0 - (null_backend->sine_cos * null_backend->sine_cos + null_backend->sine_sin * null_backend->sine_sin)) / 2.0;
+                    null_backend->sine_cos *= rotated;
+                    null_backend->sine_sin *= rotated;
+                }
+                break;
+
+            case SIGNAL_NOISE:
+                /* xorshift32 */
+                null_backend->noise_state ^= null_backend->noise_state << 13;
+                null_backend->noise_state ^= null_backend->noise_state >> 17;
+                null_backend->noise_state ^= null_backend->noise_state << 5;
+                value = SIGNAL_AMPLITUDE * ((double)null_backend->noise_state / 2147483648.0 - 1.0);
+                break;
+
+            case SIGNAL_SILENCE:
+            default:
+                value = 0;
+                break;
+        }
+
+        for (channel = 0; channel != null_backend->nb_channels; ++channel, ptr += null_backend->sample_size)
+        {
+            put_value(null_backend, ptr, value);
+        }
+    }
+}
+
+static void null_verify(struct null_backend_t* null_backend, char const* data, size_t nb_frames)
+{
+    size_t frame;
+    size_t channel;
+    size_t byte;
+    long marker;
+    char const* ptr;
+    int corrupted;
+
+    for (frame = 0; frame != nb_frames; ++frame)
+    {
+        ptr = data + frame * null_backend->frame_size;
+
+        for (byte = 0; (byte != null_backend->frame_size) && (ptr[byte] == 0); ++byte)
+        {
+        }
+
+        if (byte == null_backend->frame_size)
+        {
+            /* silence between impulses */
+            null_backend->expected = (null_backend->expected + 1) & (null_backend->marker_range - 1);
+            continue;
+        }
+
+        marker = get_marker(null_backend, ptr);
+        corrupted = (marker < 0);
+        for (channel = 1; !corrupted && (channel != null_backend->nb_channels); ++channel)
+        {
+            corrupted = (get_marker(null_backend, ptr + channel * null_backend->sample_size) != (long)marker_value(null_backend, marker, channel));
+        }
+
+        if (corrupted)
+        {
+            ++null_backend->nb_corrupted;
+            null_backend->expected = (null_backend->expected + 1) & (null_backend->marker_range - 1);
+            continue;
+        }
+
+        if (null_backend->synced && ((unsigned long)marker != null_backend->expected))
+        {
+            ++null_backend->nb_discontinuities;
+            null_backend->nb_frames_lost += ((unsigned long)marker - null_backend->expected) & (null_backend->marker_range - 1);
+        }
+
+        null_backend->synced = 1;
+        null_backend->expected = (marker + 1) & (null_backend->marker_range - 1);
+        ++null_backend->nb_frames_checked;
+    }
+}
+
+static int null_parse_options(struct null_backend_t* null_backend, char const* output_name)
+{
+    char options[OPTIONS_SIZE];
+    char* token;
+    char* value;
+
+    strncpy(options, output_name, OPTIONS_SIZE - 1);
+    options[OPTIONS_SIZE - 1] = '\0';
+
+    for (token = strtok(options, ","); token != 0; token = strtok(0, ","))
+    {
+        value = strchr(token, '=');
+        if (value != 0)
+        {
+            *value++ = '\0';
+        }
+
+        if (!strcmp(token, "clock"))
+            null_backend->clock = 1;
+        else if (!strcmp(token, "verify"))
+            null_backend->verify = 1;
+        else if (!strcmp(token, "sine"))
+        {
+            null_backend->signal = SIGNAL_SINE;
+            null_backend->frequency = (value != 0) ? atof(value) : SINE_FREQUENCY;
+        }
+        else if (!strcmp(token, "noise"))
+            null_backend->signal = SIGNAL_NOISE;
+        else if (!strcmp(token, "impulse"))
+        {
+            null_backend->signal = SIGNAL_IMPULSE;
+            null_backend->impulse_period = (value != 0) ? strtoul(value, 0, 10) : 0;
+        }
+        else if (!strcmp(token, "seq"))
+            null_backend->signal = SIGNAL_SEQ;
+        else
+        {
+            logger_log(LOG_ERROR, "%s: unknown option %s", __func__, token);
+            return -EINVAL;
+        }
+    }
+
+    return 0;
+}
+
+static int null_backend_alloc(audio_backend_handle_t* handle, int is_synth)
+{
+    struct null_backend_t* null_backend = 0;
+
+    if (handle == 0)
+    {
+        logger_log(LOG_FATAL, "%s: null handle pointer", __func__);
+        return -EINVAL;
+    }
+
+    null_backend = calloc(1, sizeof(struct null_backend_t));
+    if (null_backend == 0)
+    {
+        logger_log(LOG_FATAL, "%s: could not allocate memory", __func__);
+        return -ENOMEM;
+    }
+
+    null_backend->parent.open               = null_open;
+    null_backend->parent.close              = null_close;
+    null_backend->parent.write              = null_write;
+    null_backend->parent.read               = null_read;
+    null_backend->parent.get_latency        = null_get_latency;
+    null_backend->parent.query_caps         = null_query_caps;
+    null_backend->is_synth                  = is_synth;
+
+    *handle = (audio_backend_handle_t)null_backend;
+
+    return 0;
+}
+
+int null_backend_init(audio_backend_handle_t* handle)
+{
+    return null_backend_alloc(handle, 0);
+}
+
+int synth_backend_init(audio_backend_handle_t* handle)
+{
+    return null_backend_alloc(handle, 1);
+}
+
+int null_query_caps(audio_backend_handle_t handle, char const* output_name, enum audio_direction direction, struct audio_caps_t* caps)
+{
+    int ret;
+    struct null_backend_t options;
+    enum VBanBitResolution bit_fmt;
+
+    (void)direction;
+
+    if ((handle == 0) || (caps == 0))
+    {
+        logger_log(LOG_FATAL, "%s: null pointer argument", __func__);
+        return -EINVAL;
+    }
+
+    /* parse in a scratch copy, not to disturb an open backend */
+    memset(&options, 0, sizeof(options));
+    ret = null_parse_options(&options, output_name);
+    if (ret != 0)
+    {
+        return ret;
+    }
+
+    caps->formats = 0;
+    for (bit_fmt = VBAN_BITFMT_8_INT; bit_fmt != VBAN_BIT_RESOLUTION_MAX; ++bit_fmt)
+    {
+        if (convert_is_supported(bit_fmt))
+        {
+            caps->formats |= AUDIO_CAPS_FORMAT(bit_fmt);
+        }
+    }
+
+    caps->has_clock = options.clock;
+
+    return 0;
+}
+
+int null_open(audio_backend_handle_t handle, char const* output_name, char const* stream_name, enum audio_direction direction, size_t buffer_size, struct stream_config_t const* config)
+{
+    int ret;
+    struct null_backend_t* const null_backend = (struct null_backend_t*)handle;
+    size_t const marker_bits = (VBanBitResolutionSize[config->bit_fmt] < 3) ? 8 * VBanBitResolutionSize[config->bit_fmt] : 24;
+
+    (void)stream_name;
+
+    if (handle == 0)
+    {
+        logger_log(LOG_FATAL, "%s: handle pointer is null", __func__);
+        return -EINVAL;
+    }
+
+    if (!convert_is_supported(config->bit_fmt) || (config->sample_rate == 0))
+    {
+        logger_log(LOG_ERROR, "%s: unsupported format %s", __func__, stream_print_bit_fmt(config->bit_fmt));
+        return -EINVAL;
+    }
+
+    /* back to the defaults of the backend, then apply the options */
+    memset((char*)null_backend + offsetof(struct null_backend_t, direction), 0, sizeof(struct null_backend_t) - offsetof(struct null_backend_t, direction));
+    null_backend->signal        = null_backend->is_synth ? SIGNAL_SINE : SIGNAL_SILENCE;
+    null_backend->frequency     = SINE_FREQUENCY;
+    null_backend->direction     = direction;
+    null_backend->bit_fmt       = config->bit_fmt;
+    null_backend->nb_channels   = config->nb_channels;
+    null_backend->sample_rate   = config->sample_rate;
+    null_backend->sample_size   = VBanBitResolutionSize[config->bit_fmt];
+    null_backend->frame_size    = null_backend->sample_size * config->nb_channels;
+    null_backend->marker_range  = 1UL << (marker_bits - 1);
+    null_backend->buffer_frames = buffer_size / null_backend->frame_size;
+    null_backend->noise_state   = 0x12345678;
+
+    ret = null_parse_options(null_backend, output_name);
+    if (ret != 0)
+    {
+        return ret;
+    }
+
+    if (!null_backend->is_synth && (null_backend->signal != SIGNAL_SILENCE))
+    {
+        logger_log(LOG_ERROR, "%s: signals are generated by the %s backend", __func__, SYNTH_BACKEND_NAME);
+        return -EINVAL;
+    }
+
+    if (null_backend->is_synth && (direction == AUDIO_OUT))
+    {
+        logger_log(LOG_ERROR, "%s: %s backend is a capture only backend, use %s for playback", __func__, SYNTH_BACKEND_NAME, NULL_BACKEND_NAME);
+        return -EINVAL;
+    }
+
+    if (null_backend->impulse_period == 0)
+    {
+        null_backend->impulse_period = (config->sample_rate / 10) ? (config->sample_rate / 10) : 1;
+    }
+
+    sin_cos(2.0 * PI * null_backend->frequency / config->sample_rate, &null_backend->step_sin, &null_backend->step_cos);
+    null_backend->sine_cos = 1.0;
+    null_backend->sine_sin = 0.0;
+
+    return 0;
+}
+
+int null_close(audio_backend_handle_t handle)
+{
+    struct null_backend_t* const null_backend = (struct null_backend_t*)handle;
+
+    if (handle == 0)
+    {
+        logger_log(LOG_FATAL, "%s: handle pointer is null", __func__);
+        return -EINVAL;
+    }
+
+    if (null_backend->clock && null_backend->nb_xruns)
+    {
+        logger_log(LOG_WARNING, "%s: %lu underruns", __func__, null_backend->nb_xruns);
+    }
+
+    if (null_backend->verify && (null_backend->nb_frames_checked != 0))
+    {
+        logger_log((null_backend->nb_discontinuities || null_backend->nb_corrupted) ? LOG_WARNING : LOG_INFO,
+            "%s: verified %llu frames, %lu discontinuities (%llu frames lost), %lu corrupted frames", __func__,
+            null_backend->nb_frames_checked, null_backend->nb_discontinuities, null_backend->nb_frames_lost, null_backend->nb_corrupted);
+    }
+
+    null_backend->nb_frames_checked = 0;
+    null_backend->nb_xruns = 0;
+
+    return 0;
+}
+
+int null_write(audio_backend_handle_t handle, char const* data, size_t size)
+{
+    struct null_backend_t* const null_backend = (struct null_backend_t*)handle;
+    size_t nb_frames;
+    long long now;
+    long long played;
+
+    if ((handle == 0) || (data == 0))
+    {
+        logger_log(LOG_ERROR, "%s: handle or data pointer is null", __func__);
+        return -EINVAL;
+    }
+
+    if (null_backend->frame_size == 0)
+    {
+        logger_log(LOG_ERROR, "%s: device not open", __func__);
+        return -ENODEV;
+    }
+
+    nb_frames = size / null_backend->frame_size;
+
+    if (null_backend->verify)
+    {
+        null_verify(null_backend, data, nb_frames);
+    }
+
+    if (null_backend->clock)
+    {
+        /* behave as a device playing at the sample rate, with a buffer of buffer_size */
+        now = now_ns();
+        if (null_backend->start_ns == 0)
+        {
+            null_backend->start_ns = now;
+        }
+
+        played = now - null_backend->start_ns;
+        if (played > frames_to_ns(null_backend, null_backend->frames))
+        {
+            if (null_backend->frames != 0)
+            {
+                ++null_backend->nb_xruns;
+            }
+            /* buffer ran dry: restart from empty */
+            null_backend->start_ns = now - frames_to_ns(null_backend, null_backend->frames);
+        }
+
+        if (null_backend->frames + nb_frames > null_backend->buffer_frames)
+        {
+            sleep_until(null_backend->start_ns + frames_to_ns(null_backend, null_backend->frames + nb_frames - null_backend->buffer_frames));
+        }
+    }
+
+    null_backend->frames += nb_frames;
+
+    return nb_frames * null_backend->frame_size;
+}
+
+int null_read(audio_backend_handle_t handle, char* data, size_t size)
+{
+    struct null_backend_t* const null_backend = (struct null_backend_t*)handle;
+    size_t nb_frames;
+
+    if ((handle == 0) || (data == 0))
+    {
+        logger_log(LOG_ERROR, "%s: handle or data pointer is null", __func__);
+        return -EINVAL;
+    }
+
+    if (null_backend->frame_size == 0)
+    {
+        logger_log(LOG_ERROR, "%s: device not open", __func__);
+        return -ENODEV;
+    }
+
+    nb_frames = size / null_backend->frame_size;
+
+    if (null_backend->clock)
+    {
+        /* samples are there once they have been "captured" */
+        if (null_backend->start_ns == 0)
+        {
+            null_backend->start_ns = now_ns();
+        }
+        sleep_until(null_backend->start_ns + frames_to_ns(null_backend, null_backend->frames + nb_frames));
+    }
+
+    synth_generate(null_backend, data, nb_frames);
+    null_backend->frames += nb_frames;
+
+    return nb_frames * null_backend->frame_size;
+}
+
+int null_get_latency(audio_backend_handle_t handle, unsigned long* latency_us)
+{
+    struct null_backend_t* const null_backend = (struct null_backend_t*)handle;
+    long long buffered;
+
+    if ((handle == 0) || (latency_us == 0))
+    {
+        logger_log(LOG_ERROR, "%s: null pointer argument", __func__);
+        return -EINVAL;
+    }
+
+    if (!null_backend->clock || (null_backend->direction != AUDIO_OUT) || (null_backend->start_ns == 0))
+    {
+        *latency_us = 0;
+        return 0;
+    }
+
+    buffered = frames_to_ns(null_backend, null_backend->frames) - (now_ns() - null_backend->start_ns);
+    *latency_us = (buffered > 0) ? (unsigned long)(buffered / 1000) : 0;
+
+    return 0;
+}
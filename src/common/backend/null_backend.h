@@ -0,0 +1,22 @@
+#ifndef __NULL_BACKEND_H__
+#define __NULL_BACKEND_H__
+
+#include "audio_backend.h"
+
+/**
+ * Hardware free backends, for benchmarks and tests.
+ * null drops what is written (or gives silence), synth generates a test signal.
+ * Both take a comma separated list of options as device name:
+ * clock            : consume / produce samples at the stream sample rate instead of as fast as possible
+ * verify           : (null) check the sequence markers generated by synth seq or impulse signals
+ * sine[=FREQ]      : (synth) sine wave, default 440Hz
+ * noise            : (synth) white noise
+ * impulse[=FRAMES] : (synth) one marker frame every FRAMES frames, silence in between, default rate/10
+ * seq              : (synth) a marker in every frame
+ */
+#define NULL_BACKEND_NAME   "null"
+#define SYNTH_BACKEND_NAME  "synth"
+int null_backend_init(audio_backend_handle_t* handle);
+int synth_backend_init(audio_backend_handle_t* handle);
+
+#endif /*__NULL_BACKEND_H__*/
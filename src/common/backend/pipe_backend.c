@@ -1,6 +1,8 @@
+#define _GNU_SOURCE
 #include "pipe_backend.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -17,16 +19,47 @@
 #define FIFO_FILENAME   "\\\\.\\pipe\\vban_0"
 #endif
 
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#define PIPE_SPLICE     1
+#endif
+
 struct pipe_backend_t
 {
     struct audio_backend_t  parent;
     int fd;
+    enum audio_direction direction;
+    int nonblock;
+    int created;
+    char path[AUDIO_DEVICE_NAME_SIZE];
+    size_t frame_size;
+    size_t capacity;
+
+    /* vmsplice arena: pages given to the pipe must not be touched until the reader consumed them,
+       so the arena is twice the pipe capacity and is used as a ring */
+    char* arena;
+    size_t arena_size;
+    size_t arena_offset;
+    size_t page_size;
+
+    /* backpressure accounting */
+    unsigned long long bytes_written;
+    unsigned long nb_full;
+    unsigned long nb_short;
 };
 
-static int pipe_open(audio_backend_handle_t handle, char const* output_name, enum audio_direction direction, size_t buffer_size, struct stream_config_t const* config);
+static int pipe_open(audio_backend_handle_t handle, char const* output_name, char const* stream_name, enum audio_direction direction, size_t buffer_size, struct stream_config_t const* config);
 static int pipe_close(audio_backend_handle_t handle);
 static int pipe_write(audio_backend_handle_t handle, char const* data, size_t size);
 static int pipe_read(audio_backend_handle_t handle, char* data, size_t size);
+static int pipe_query_caps(audio_backend_handle_t handle, char const* output_name, enum audio_direction direction, struct audio_caps_t* caps);
+static int pipe_set_nonblock(audio_backend_handle_t handle, int nonblock);
+static int pipe_get_poll_fds(audio_backend_handle_t handle, struct pollfd* fds, size_t nb_fds);
+#if PIPE_SPLICE
+static int pipe_begin(audio_backend_handle_t handle, char** data, size_t* size);
+static int pipe_commit(audio_backend_handle_t handle, size_t size);
+#endif
 
 int pipe_backend_init(audio_backend_handle_t* handle)
 {
@@ -49,6 +82,10 @@ int pipe_backend_init(audio_backend_handle_t* handle)
     pipe_backend->parent.close              = pipe_close;
     pipe_backend->parent.write              = pipe_write;
     pipe_backend->parent.read               = pipe_read;
+    pipe_backend->parent.query_caps         = pipe_query_caps;
+    pipe_backend->parent.set_nonblock       = pipe_set_nonblock;
+    pipe_backend->parent.get_poll_fds       = pipe_get_poll_fds;
+    pipe_backend->fd                        = -1;
 
     *handle = (audio_backend_handle_t)pipe_backend;
 
@@ -56,10 +93,242 @@ int pipe_backend_init(audio_backend_handle_t* handle)
 
 }
 
-int pipe_open(audio_backend_handle_t handle, char const* output_name, enum audio_direction direction, size_t buffer_size, struct stream_config_t const* config)
+int pipe_set_nonblock(audio_backend_handle_t handle, int nonblock)
+{
+    struct pipe_backend_t* const pipe_backend = (struct pipe_backend_t*)handle;
+
+    if (handle == 0)
+    {
+        logger_log(LOG_FATAL, "%s: handle pointer is null", __func__);
+        return -EINVAL;
+    }
+
+    pipe_backend->nonblock = nonblock;
+
+    return 0;
+}
+
+int pipe_get_poll_fds(audio_backend_handle_t handle, struct pollfd* fds, size_t nb_fds)
+{
+    struct pipe_backend_t* const pipe_backend = (struct pipe_backend_t*)handle;
+
+    if ((handle == 0) || (fds == 0))
+    {
+        logger_log(LOG_FATAL, "%s: null pointer argument", __func__);
+        return -EINVAL;
+    }
+
+    if ((pipe_backend->fd == -1) || (nb_fds == 0))
+    {
+        return 0;
+    }
+
+    fds[0].fd       = pipe_backend->fd;
+    fds[0].events   = (pipe_backend->direction == AUDIO_OUT) ? POLLOUT : POLLIN;
+    fds[0].revents  = 0;
+
+    return 1;
+}
+
+#ifndef _WIN32
+/**
+ * Use the fifo given by the user if it exists, create it otherwise.
+ * Only a fifo we created is removed on close.
+ */
+static int pipe_make_fifo(struct pipe_backend_t* pipe_backend)
+{
+    struct stat st;
+
+    if (stat(pipe_backend->path, &st) == 0)
+    {
+        if (!S_ISFIFO(st.st_mode))
+        {
+            logger_log(LOG_WARNING, "%s: %s exists and is not a fifo, using it as it is", __func__, pipe_backend->path);
+        }
+        pipe_backend->created = 0;
+        return 0;
+    }
+
+    if (mkfifo(pipe_backend->path, 0666) < 0)
+    {
+        logger_log(LOG_FATAL, "%s: could not create fifo %s: %s", __func__, pipe_backend->path, strerror(errno));
+        return -errno;
+    }
+
+    pipe_backend->created = 1;
+    return 0;
+}
+#endif
+
+#if PIPE_SPLICE
+/**
+ * Size the pipe after the latency target, and set the vmsplice path up for playback
+ */
+static int pipe_setup(struct pipe_backend_t* pipe_backend, enum audio_direction direction, size_t buffer_size)
 {
     int ret;
+    struct stat st;
+
+    if ((fstat(pipe_backend->fd, &st) != 0) || !S_ISFIFO(st.st_mode))
+    {
+        return 0;
+    }
+
+    if (fcntl(pipe_backend->fd, F_SETPIPE_SZ, (int)buffer_size) < 0)
+    {
+        logger_log(LOG_WARNING, "%s: could not set pipe size to %lu: %s", __func__, (unsigned long)buffer_size, strerror(errno));
+    }
+
+    ret = fcntl(pipe_backend->fd, F_GETPIPE_SZ);
+    pipe_backend->capacity = (ret > 0) ? (size_t)ret : buffer_size;
+    logger_log(LOG_INFO, "%s: pipe size is %lu", __func__, (unsigned long)pipe_backend->capacity);
+
+    if (direction != AUDIO_OUT)
+    {
+        return 0;
+    }
+
+    pipe_backend->page_size = sysconf(_SC_PAGESIZE);
+    pipe_backend->arena_size = 2 * pipe_backend->capacity;
+    pipe_backend->arena_size += pipe_backend->page_size - (pipe_backend->arena_size % pipe_backend->page_size);
+    pipe_backend->arena_offset = 0;
+
+    ret = posix_memalign((void**)&pipe_backend->arena, pipe_backend->page_size, pipe_backend->arena_size);
+    if (ret != 0)
+    {
+        pipe_backend->arena = 0;
+        logger_log(LOG_WARNING, "%s: could not allocate splice arena, using plain writes", __func__);
+        return 0;
+    }
+
+    /* begin / commit are looked up at each audio_write: enable them for this direction only */
+    pipe_backend->parent.begin  = pipe_begin;
+    pipe_backend->parent.commit = pipe_commit;
+
+    return 0;
+}
+
+int pipe_begin(audio_backend_handle_t handle, char** data, size_t* size)
+{
     struct pipe_backend_t* const pipe_backend = (struct pipe_backend_t*)handle;
+    struct pollfd fd;
+    size_t page_left;
+
+    if ((handle == 0) || (data == 0) || (size == 0))
+    {
+        logger_log(LOG_ERROR, "%s: null pointer argument", __func__);
+        return -EINVAL;
+    }
+
+    /* one area never crosses a page: it then takes exactly one pipe slot, and a writable
+       pipe (one free slot) takes it without blocking. Frames do not straddle pages either */
+    page_left = pipe_backend->page_size - (pipe_backend->arena_offset % pipe_backend->page_size);
+    if (page_left < pipe_backend->frame_size)
+    {
+        pipe_backend->arena_offset = (pipe_backend->arena_offset + page_left) % pipe_backend->arena_size;
+        page_left = pipe_backend->page_size;
+    }
+
+    if (pipe_backend->nonblock)
+    {
+        fd.fd       = pipe_backend->fd;
+        fd.events   = POLLOUT;
+        fd.revents  = 0;
+        if (poll(&fd, 1, 0) == 0)
+        {
+            ++pipe_backend->nb_full;
+            return -EAGAIN;
+        }
+    }
+
+    *size = (*size < page_left) ? *size : page_left;
+    *size -= *size % pipe_backend->frame_size;
+    *data = pipe_backend->arena + pipe_backend->arena_offset;
+
+    return 0;
+}
+
+int pipe_commit(audio_backend_handle_t handle, size_t size)
+{
+    struct pipe_backend_t* const pipe_backend = (struct pipe_backend_t*)handle;
+    struct iovec iov;
+    struct pollfd fd;
+    ssize_t ret;
+
+    if (handle == 0)
+    {
+        logger_log(LOG_ERROR, "%s: handle pointer is null", __func__);
+        return -EINVAL;
+    }
+
+    iov.iov_base    = pipe_backend->arena + pipe_backend->arena_offset;
+    iov.iov_len     = size;
+
+    while (iov.iov_len != 0)
+    {
+        ret = vmsplice(pipe_backend->fd, &iov, 1, 0);
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            if ((errno == EAGAIN) && (iov.iov_len == size))
+            {
+                /* nothing taken: the area is given again by the next begin */
+                ++pipe_backend->nb_full;
+                return -EAGAIN;
+            }
+
+            if (errno == EAGAIN)
+            {
+                /* the pipe took part of the area, the rest has to follow before any other data */
+                fd.fd       = pipe_backend->fd;
+                fd.events   = POLLOUT;
+                fd.revents  = 0;
+                poll(&fd, 1, -1);
+                continue;
+            }
+
+            logger_log(LOG_ERROR, "%s: vmsplice failed: %s", __func__, strerror(errno));
+            return -errno;
+        }
+        iov.iov_base = (char*)iov.iov_base + ret;
+        iov.iov_len -= ret;
+    }
+
+    pipe_backend->bytes_written += size;
+    pipe_backend->arena_offset = (pipe_backend->arena_offset + size) % pipe_backend->arena_size;
+
+    return 0;
+}
+#endif
+
+int pipe_query_caps(audio_backend_handle_t handle, char const* output_name, enum audio_direction direction, struct audio_caps_t* caps)
+{
+    (void)handle;
+    (void)output_name;
+    (void)direction;
+
+    if (caps == 0)
+    {
+        logger_log(LOG_FATAL, "%s: null caps pointer", __func__);
+        return -EINVAL;
+    }
+
+    /* raw bytes in any format, at the pace of the other end */
+    caps->has_clock = 0;
+
+    return 0;
+}
+
+int pipe_open(audio_backend_handle_t handle, char const* output_name, char const* stream_name, enum audio_direction direction, size_t buffer_size, struct stream_config_t const* config)
+{
+    int ret = 0;
+    struct pipe_backend_t* const pipe_backend = (struct pipe_backend_t*)handle;
+
+    (void)stream_name;
 
     if (handle == 0)
     {
@@ -67,47 +336,63 @@ int pipe_open(audio_backend_handle_t handle, char const* output_name, enum audio
         return -EINVAL;
     }
 
+    strncpy(pipe_backend->path, (output_name[0] == 0) ? FIFO_FILENAME : output_name, AUDIO_DEVICE_NAME_SIZE-1);
+    pipe_backend->direction     = direction;
+    pipe_backend->frame_size    = VBanBitResolutionSize[config->bit_fmt] * config->nb_channels;
+    pipe_backend->capacity      = 0;
+    pipe_backend->bytes_written = 0;
+    pipe_backend->nb_full       = 0;
+    pipe_backend->nb_short      = 0;
+    pipe_backend->parent.begin  = 0;
+    pipe_backend->parent.commit = 0;
+
 #ifndef _WIN32
-    ret = mkfifo(FIFO_FILENAME, 0666);
+    ret = pipe_make_fifo(pipe_backend);
     if (ret < 0)
     {
-        logger_log(LOG_FATAL, "%s: ???", __func__);
-        //todo:strerror
-        perror("mknod");
-        pipe_backend->fd = 0;
         return ret;
     }
 #else
     // Windows has no mkfifo function. Use named pipes instead
     HANDLE named_pipe = CreateNamedPipeA(
-        /* lpName */               FIFO_FILENAME,
+        /* lpName */               pipe_backend->path,
         /* dwOpenMode */           PIPE_ACCESS_DUPLEX,
         /* dwPipeMode */           PIPE_TYPE_MESSAGE, // or maybe PIPE_TYPE_BYTE, let's see
         /* nMaxInstances */        1,
-        /* nOutBufferSize */       0,
-        /* nInBufferSize */        0,
+        /* nOutBufferSize */       buffer_size,
+        /* nInBufferSize */        buffer_size,
         /* nDefaultTimeOut */      0,
         /* lpSecurityAttributes */ 0);
     if (named_pipe == INVALID_HANDLE_VALUE)
     {
-        logger_log(LOG_FATAL, "%s: ???", __func__);
-        //todo:strerror
-        perror("mknod");
-        pipe_backend->fd = 0;
+        logger_log(LOG_FATAL, "%s: could not create named pipe %s", __func__, pipe_backend->path);
         ret = GetLastError();
-        return ret;
+        return -ret;
     }
 #endif // _WIN32
 
-    pipe_backend->fd = open((output_name[0] == 0) ? FIFO_FILENAME : output_name, (direction == AUDIO_OUT) ? O_WRONLY : O_RDONLY);
+    /* opening a fifo waits for the other side */
+    pipe_backend->fd = open(pipe_backend->path, (direction == AUDIO_OUT) ? O_WRONLY : O_RDONLY);
     if (pipe_backend->fd == -1)
     {
-        logger_log(LOG_FATAL, "%s: open error", __func__); //
-        perror("open");
+        ret = -errno;
+        logger_log(LOG_FATAL, "%s: could not open %s: %s", __func__, pipe_backend->path, strerror(errno));
+        pipe_close(handle);
         return ret;
     }
 
-    return 0;
+#ifndef _WIN32
+    if (pipe_backend->nonblock)
+    {
+        fcntl(pipe_backend->fd, F_SETFL, fcntl(pipe_backend->fd, F_GETFL) | O_NONBLOCK);
+    }
+#endif
+
+#if PIPE_SPLICE
+    ret = pipe_setup(pipe_backend, direction, buffer_size);
+#endif
+
+    return ret;
 }
 
 int pipe_close(audio_backend_handle_t handle)
@@ -121,14 +406,28 @@ int pipe_close(audio_backend_handle_t handle)
         return -EINVAL;
     }
 
-    if (pipe_backend== 0)
+    if (pipe_backend->fd != -1)
     {
-        /** nothing to do */
-        return 0;
+        if (pipe_backend->bytes_written != 0)
+        {
+            logger_log(LOG_INFO, "%s: %llu bytes written, pipe full %lu times, %lu short writes", __func__,
+                pipe_backend->bytes_written, pipe_backend->nb_full, pipe_backend->nb_short);
+        }
+        ret = close(pipe_backend->fd);
+        pipe_backend->fd = -1;
+    }
+
+    if (pipe_backend->created)
+    {
+        unlink(pipe_backend->path);
+        pipe_backend->created = 0;
     }
 
-    ret = close(pipe_backend->fd);
-    unlink(FIFO_FILENAME);
+    free(pipe_backend->arena);
+    pipe_backend->arena = 0;
+    pipe_backend->parent.begin  = 0;
+    pipe_backend->parent.commit = 0;
+
     return ret;
 }
 
@@ -136,6 +435,9 @@ int pipe_write(audio_backend_handle_t handle, char const* data, size_t size)
 {
     int ret = 0;
     struct pipe_backend_t* const pipe_backend = (struct pipe_backend_t*)handle;
+#if PIPE_SPLICE
+    int used = 0;
+#endif
 
     if ((handle == 0) || (data == 0))
     {
@@ -143,12 +445,37 @@ int pipe_write(audio_backend_handle_t handle, char const* data, size_t size)
         return -EINVAL;
     }
 
+#if PIPE_SPLICE
+    /* do not let a non blocking write cut a frame: only write the whole frames that fit */
+    if (pipe_backend->nonblock && (pipe_backend->capacity != 0) && (ioctl(pipe_backend->fd, FIONREAD, &used) == 0))
+    {
+        if (pipe_backend->capacity - used < size)
+        {
+            size = (pipe_backend->capacity - used) - ((pipe_backend->capacity - used) % pipe_backend->frame_size);
+            if (size == 0)
+            {
+                ++pipe_backend->nb_full;
+                return -EAGAIN;
+            }
+            ++pipe_backend->nb_short;
+        }
+    }
+#endif
+
     ret = write(pipe_backend->fd, (const void *)data, size);
     if (ret < 0)
     {
-        logger_log(LOG_ERROR, "%s:", __func__);
-        perror("write");
+        if (errno == EAGAIN)
+        {
+            ++pipe_backend->nb_full;
+            return -EAGAIN;
+        }
+        logger_log(LOG_ERROR, "%s: write failed: %s", __func__, strerror(errno));
+        return -errno;
     }
+
+    pipe_backend->bytes_written += ret;
+
     return ret;
 }
 
@@ -166,8 +493,12 @@ int pipe_read(audio_backend_handle_t handle, char* data, size_t size)
     ret = read(pipe_backend->fd, (void *)data, size);
     if (ret < 0)
     {
-        logger_log(LOG_ERROR, "%s:", __func__);
-        perror("read");
+        if (errno == EAGAIN)
+        {
+            return -EAGAIN;
+        }
+        logger_log(LOG_ERROR, "%s: read failed: %s", __func__, strerror(errno));
+        return -errno;
     }
     return ret;
 }
@@ -0,0 +1,524 @@
+#define _GNU_SOURCE
+#include "pipewire_backend.h"
+#include <pipewire/pipewire.h>
+#include <spa/param/audio/format-utils.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include "common/logger.h"
+#include "common/convert.h"
+#include "common/ringbuffer.h"
+
+#define NB_BUFFERS  2
+
+/** how long pipewire_read waits for the process callback before checking the stream again */
+#define READ_TIMEOUT_NS     100000000
+
+/** pw_init / pw_deinit are done once for all the backends alive */
+static pthread_mutex_t pipewire_users_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int pipewire_users = 0;
+
+#ifndef PW_KEY_TARGET_OBJECT
+#define PW_KEY_TARGET_OBJECT    "target.object"
+#endif
+
+struct pipewire_backend_t
+{
+    struct audio_backend_t  parent;
+    struct pw_thread_loop*  loop;
+    struct pw_stream*       stream;
+    ringbuffer_handle_t     ring_buffer;
+    enum audio_direction    direction;
+    enum VBanBitResolution  bit_fmt;
+    unsigned int            nb_channels;
+    size_t                  frame_size;
+    /* set from the pipewire threads, read from the audio thread */
+    int                     active;
+    int                     shutdown;
+    sem_t                   data_ready;
+    /* plane pointers of the current buffer, given to the conversion kernels */
+    float*                  planes[VBAN_CHANNELS_MAX_NB];
+    /* bounce buffer for the frame that straddles the two ring buffer segments */
+    char                    frame_buffer[VBAN_CHANNELS_MAX_NB * sizeof(double)];
+};
+
+static int pipewire_open(audio_backend_handle_t handle, char const* output_name, char const* stream_name, enum audio_direction direction, size_t buffer_size, struct stream_config_t const* config);
+static int pipewire_close(audio_backend_handle_t handle);
+static int pipewire_write(audio_backend_handle_t handle, char const* data, size_t size);
+static int pipewire_read(audio_backend_handle_t handle, char* data, size_t size);
+static int pipewire_query_caps(audio_backend_handle_t handle, char const* output_name, enum audio_direction direction, struct audio_caps_t* caps);
+static void pipewire_release(audio_backend_handle_t handle);
+
+static void pipewire_process_cb(void* arg);
+static void pipewire_state_changed_cb(void* arg, enum pw_stream_state old, enum pw_stream_state state, char const* error);
+
+static struct pw_stream_events const stream_events =
+{
+    .version        = PW_VERSION_STREAM_EVENTS,
+    .state_changed  = pipewire_state_changed_cb,
+    .process        = pipewire_process_cb,
+};
+
+int pipewire_backend_init(audio_backend_handle_t* handle)
+{
+    struct pipewire_backend_t* pipewire_backend = 0;
+
+    if (handle == 0)
+    {
+        logger_log(LOG_FATAL, "%s: null handle pointer", __func__);
+        return -EINVAL;
+    }
+
+    pipewire_backend = calloc(1, sizeof(struct pipewire_backend_t));
+    if (pipewire_backend == 0)
+    {
+        logger_log(LOG_FATAL, "%s: could not allocate memory", __func__);
+        return -ENOMEM;
+    }
+
+    pipewire_backend->parent.open           = pipewire_open;
+    pipewire_backend->parent.close          = pipewire_close;
+    pipewire_backend->parent.write          = pipewire_write;
+    pipewire_backend->parent.read           = pipewire_read;
+    pipewire_backend->parent.query_caps     = pipewire_query_caps;
+    pipewire_backend->parent.release        = pipewire_release;
+
+    if (sem_init(&pipewire_backend->data_ready, 0, 0) != 0)
+    {
+        logger_log(LOG_FATAL, "%s: could not init semaphore", __func__);
+        free(pipewire_backend);
+        return -errno;
+    }
+
+    pthread_mutex_lock(&pipewire_users_lock);
+    if (pipewire_users++ == 0)
+    {
+        pw_init(0, 0);
+    }
+    pthread_mutex_unlock(&pipewire_users_lock);
+
+    *handle = (audio_backend_handle_t)pipewire_backend;
+
+    return 0;
+}
+
+void pipewire_release(audio_backend_handle_t handle)
+{
+    struct pipewire_backend_t* const pipewire_backend = (struct pipewire_backend_t*)handle;
+
+    sem_destroy(&pipewire_backend->data_ready);
+
+    pthread_mutex_lock(&pipewire_users_lock);
+    if (--pipewire_users == 0)
+    {
+        pw_deinit();
+    }
+    pthread_mutex_unlock(&pipewire_users_lock);
+}
+
+int pipewire_query_caps(audio_backend_handle_t handle, char const* output_name, enum audio_direction direction, struct audio_caps_t* caps)
+{
+    enum VBanBitResolution bit_fmt;
+
+    (void)handle;
+    (void)output_name;
+    (void)direction;
+
+    if (caps == 0)
+    {
+        logger_log(LOG_FATAL, "%s: null caps pointer", __func__);
+        return -EINVAL;
+    }
+
+    /* samples go through float dsp ports, and the graph resamples to its own rate */
+    caps->formats = 0;
+    for (bit_fmt = VBAN_BITFMT_8_INT; bit_fmt != VBAN_BIT_RESOLUTION_MAX; ++bit_fmt)
+    {
+        if (convert_is_supported(bit_fmt))
+        {
+            caps->formats |= AUDIO_CAPS_FORMAT(bit_fmt);
+        }
+    }
+
+    caps->channels_max  = SPA_AUDIO_MAX_CHANNELS;
+    caps->has_clock     = 1;
+
+    return 0;
+}
+
+int pipewire_open(audio_backend_handle_t handle, char const* output_name, char const* stream_name, enum audio_direction direction, size_t buffer_size, struct stream_config_t const* config)
+{
+    int ret;
+    struct pipewire_backend_t* const pipewire_backend = (struct pipewire_backend_t*)handle;
+    struct pw_properties* props;
+    struct spa_pod const* params[1];
+    uint8_t pod_buffer[1024];
+    struct spa_pod_builder builder = SPA_POD_BUILDER_INIT(pod_buffer, sizeof(pod_buffer));
+    struct spa_audio_info_raw info;
+    size_t quantum;
+    size_t channel;
+
+    logger_log(LOG_DEBUG, "%s", __func__);
+
+    if (handle == 0)
+    {
+        logger_log(LOG_ERROR, "%s: handle is null", __func__);
+        return -EINVAL;
+    }
+
+    if (!convert_is_supported(config->bit_fmt) || (config->nb_channels > SPA_AUDIO_MAX_CHANNELS))
+    {
+        logger_log(LOG_ERROR, "%s: unsupported format %s with %d channels", __func__, stream_print_bit_fmt(config->bit_fmt), config->nb_channels);
+        return -EINVAL;
+    }
+
+    pipewire_backend->direction     = direction;
+    pipewire_backend->nb_channels   = config->nb_channels;
+    pipewire_backend->bit_fmt       = config->bit_fmt;
+    pipewire_backend->frame_size    = pipewire_backend->nb_channels * VBanBitResolutionSize[config->bit_fmt];
+    __atomic_store_n(&pipewire_backend->active, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&pipewire_backend->shutdown, 0, __ATOMIC_RELEASE);
+
+    /* one graph cycle per vban packet, the biggest one this format allows if the stream did not tell */
+    quantum = config->nb_samples;
+    if (quantum == 0)
+    {
+        quantum = VBAN_DATA_MAX_SIZE / pipewire_backend->frame_size;
+        quantum = (quantum < VBAN_SAMPLES_MAX_NB) ? quantum : VBAN_SAMPLES_MAX_NB;
+    }
+
+    buffer_size = (buffer_size > (quantum * pipewire_backend->frame_size)) ? buffer_size : (quantum * pipewire_backend->frame_size);
+    if (direction == AUDIO_IN)
+    {
+        /* pipewire_read must always be able to get a complete packet payload */
+        buffer_size += VBAN_DATA_MAX_SIZE;
+    }
+
+    ret = ringbuffer_init(&pipewire_backend->ring_buffer, buffer_size * NB_BUFFERS);
+    if (ret != 0)
+    {
+        logger_log(LOG_ERROR, "%s: could not create ring buffer", __func__);
+        return ret;
+    }
+
+    if (direction == AUDIO_OUT)
+    {
+        char* const zeros = calloc(1, buffer_size);
+        ringbuffer_write(pipewire_backend->ring_buffer, zeros, buffer_size);
+        free(zeros);
+    }
+
+    pipewire_backend->loop = pw_thread_loop_new("vban", 0);
+    if (pipewire_backend->loop == 0)
+    {
+        logger_log(LOG_ERROR, "%s: could not create thread loop", __func__);
+        pipewire_close(handle);
+        return -ENOMEM;
+    }
+
+    props = pw_properties_new(PW_KEY_MEDIA_TYPE, "Audio",
+        PW_KEY_MEDIA_CATEGORY, (direction == AUDIO_OUT) ? "Playback" : "Capture",
+        PW_KEY_MEDIA_ROLE, "Music",
+        PW_KEY_APP_NAME, "vban",
+        (char const*)0);
+    pw_properties_setf(props, PW_KEY_NODE_LATENCY, "%u/%u", (unsigned int)quantum, config->sample_rate);
+    if (output_name[0] != '\0')
+    {
+        pw_properties_set(props, PW_KEY_TARGET_OBJECT, output_name);
+    }
+
+    /* dsp ports: one float plane per channel, converted from / to vban format in the process callback */
+    memset(&info, 0, sizeof(info));
+    info.format     = SPA_AUDIO_FORMAT_F32P;
+    info.rate       = config->sample_rate;
+    info.channels   = config->nb_channels;
+    for (channel = 0; channel != config->nb_channels; ++channel)
+    {
+        info.position[channel] = (config->nb_channels == 1) ? SPA_AUDIO_CHANNEL_MONO
+            : (config->nb_channels == 2) ? (SPA_AUDIO_CHANNEL_FL + channel)
+            : (SPA_AUDIO_CHANNEL_AUX0 + channel);
+    }
+    params[0] = spa_format_audio_raw_build(&builder, SPA_PARAM_EnumFormat, &info);
+
+    pw_thread_loop_lock(pipewire_backend->loop);
+
+    pipewire_backend->stream = pw_stream_new_simple(pw_thread_loop_get_loop(pipewire_backend->loop),
+        (stream_name[0] != '\0') ? stream_name : "vban", props, &stream_events, pipewire_backend);
+    if (pipewire_backend->stream == 0)
+    {
+        logger_log(LOG_ERROR, "%s: could not create stream", __func__);
+        pw_thread_loop_unlock(pipewire_backend->loop);
+        pipewire_close(handle);
+        return -ENOMEM;
+    }
+
+    ret = pw_stream_connect(pipewire_backend->stream, (direction == AUDIO_OUT) ? PW_DIRECTION_OUTPUT : PW_DIRECTION_INPUT, PW_ID_ANY,
+        (enum pw_stream_flags)(PW_STREAM_FLAG_AUTOCONNECT | PW_STREAM_FLAG_MAP_BUFFERS | PW_STREAM_FLAG_RT_PROCESS), params, 1);
+    if (ret < 0)
+    {
+        logger_log(LOG_ERROR, "%s: could not connect stream: %s", __func__, strerror(-ret));
+        pw_thread_loop_unlock(pipewire_backend->loop);
+        pipewire_close(handle);
+        return ret;
+    }
+
+    ret = pw_thread_loop_start(pipewire_backend->loop);
+    pw_thread_loop_unlock(pipewire_backend->loop);
+    if (ret < 0)
+    {
+        logger_log(LOG_ERROR, "%s: could not start thread loop", __func__);
+        pipewire_close(handle);
+        return ret;
+    }
+
+    logger_log(LOG_INFO, "%s: stream %s connected, quantum %u frames", __func__, (stream_name[0] != '\0') ? stream_name : "vban", (unsigned int)quantum);
+
+    return 0;
+}
+
+int pipewire_close(audio_backend_handle_t handle)
+{
+    struct pipewire_backend_t* const pipewire_backend = (struct pipewire_backend_t*)handle;
+
+    logger_log(LOG_DEBUG, "%s", __func__);
+
+    if (handle == 0)
+    {
+        logger_log(LOG_ERROR, "%s: handle pointer is null", __func__);
+        return -EINVAL;
+    }
+
+    __atomic_store_n(&pipewire_backend->active, 0, __ATOMIC_RELEASE);
+
+    if (pipewire_backend->loop != 0)
+    {
+        /* destroying the stream removes the process callback from the data thread */
+        pw_thread_loop_lock(pipewire_backend->loop);
+        if (pipewire_backend->stream != 0)
+        {
+            pw_stream_destroy(pipewire_backend->stream);
+            pipewire_backend->stream = 0;
+        }
+        pw_thread_loop_unlock(pipewire_backend->loop);
+
+        pw_thread_loop_stop(pipewire_backend->loop);
+        pw_thread_loop_destroy(pipewire_backend->loop);
+        pipewire_backend->loop = 0;
+    }
+
+    ringbuffer_release(&pipewire_backend->ring_buffer);
+
+    return 0;
+}
+
+int pipewire_write(audio_backend_handle_t handle, char const* data, size_t size)
+{
+    struct pipewire_backend_t* const pipewire_backend = (struct pipewire_backend_t*)handle;
+
+    logger_log(LOG_DEBUG, "%s", __func__);
+
+    if ((handle == 0) || (data == 0))
+    {
+        logger_log(LOG_ERROR, "%s: handle or data pointer is null", __func__);
+        return -EINVAL;
+    }
+
+    if ((pipewire_backend->stream == 0) || __atomic_load_n(&pipewire_backend->shutdown, __ATOMIC_ACQUIRE))
+    {
+        logger_log(LOG_ERROR, "%s: device not open", __func__);
+        return -ENODEV;
+    }
+
+    if (!__atomic_load_n(&pipewire_backend->active, __ATOMIC_ACQUIRE))
+    {
+        logger_log(LOG_DEBUG, "%s: stream not running yet", __func__);
+        return size;
+    }
+
+    if (ringbuffer_write_space(pipewire_backend->ring_buffer) < size)
+    {
+        logger_log(LOG_WARNING, "%s: short write", __func__);
+        return 0;
+    }
+
+    ringbuffer_write(pipewire_backend->ring_buffer, data, size);
+
+    return size;
+}
+
+int pipewire_read(audio_backend_handle_t handle, char* data, size_t size)
+{
+    struct pipewire_backend_t* const pipewire_backend = (struct pipewire_backend_t*)handle;
+    struct timespec deadline;
+
+    logger_log(LOG_DEBUG, "%s", __func__);
+
+    if ((handle == 0) || (data == 0))
+    {
+        logger_log(LOG_ERROR, "%s: handle or data pointer is null", __func__);
+        return -EINVAL;
+    }
+
+    /* only give complete frames to upper layer */
+    size -= size % pipewire_backend->frame_size;
+
+    while ((pipewire_backend->stream != 0) && !__atomic_load_n(&pipewire_backend->shutdown, __ATOMIC_ACQUIRE) && (ringbuffer_read_space(pipewire_backend->ring_buffer) < size))
+    {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += READ_TIMEOUT_NS;
+        if (deadline.tv_nsec >= 1000000000)
+        {
+            deadline.tv_sec += 1;
+            deadline.tv_nsec -= 1000000000;
+        }
+
+        if ((sem_timedwait(&pipewire_backend->data_ready, &deadline) != 0) && (errno != ETIMEDOUT) && (errno != EINTR))
+        {
+            logger_log(LOG_ERROR, "%s: sem_timedwait failed: %s", __func__, strerror(errno));
+            return -errno;
+        }
+    }
+
+    if ((pipewire_backend->stream == 0) || __atomic_load_n(&pipewire_backend->shutdown, __ATOMIC_ACQUIRE))
+    {
+        logger_log(LOG_ERROR, "%s: device not open", __func__);
+        return -ENODEV;
+    }
+
+    ringbuffer_read(pipewire_backend->ring_buffer, data, size);
+
+    return size;
+}
+
+/** the conversion kernels have their own segment type: copy, do not alias the ring buffer one */
+static void pipewire_get_segments(struct ringbuffer_data_t const* rb_data, struct convert_segment_t* segments)
+{
+    segments[0].buf = rb_data[0].buf;
+    segments[0].len = rb_data[0].len;
+    segments[1].buf = rb_data[1].buf;
+    segments[1].len = rb_data[1].len;
+}
+
+static void pipewire_process_capture(struct pipewire_backend_t* pipewire_backend, struct spa_buffer* buffer)
+{
+    struct ringbuffer_data_t rb_data[2];
+    struct convert_segment_t segments[2];
+    size_t const nframes = buffer->datas[0].chunk->size / sizeof(float);
+    size_t channel;
+
+    for (channel = 0; channel != pipewire_backend->nb_channels; ++channel)
+    {
+        pipewire_backend->planes[channel] = (float*)((char*)buffer->datas[channel].data + buffer->datas[channel].chunk->offset);
+    }
+
+    ringbuffer_get_write_vector(pipewire_backend->ring_buffer, rb_data);
+
+    if ((rb_data[0].len + rb_data[1].len) < (nframes * pipewire_backend->frame_size))
+    {
+        /* reader is late: drop this cycle rather than blocking the graph */
+        return;
+    }
+
+    pipewire_get_segments(rb_data, segments);
+    convert_interleave_segments(segments, pipewire_backend->frame_buffer, pipewire_backend->bit_fmt,
+        (float const* const*)pipewire_backend->planes, pipewire_backend->nb_channels, nframes);
+
+    ringbuffer_write_advance(pipewire_backend->ring_buffer, nframes * pipewire_backend->frame_size);
+    sem_post(&pipewire_backend->data_ready);
+}
+
+static void pipewire_process_playback(struct pipewire_backend_t* pipewire_backend, struct pw_buffer* b)
+{
+    struct spa_buffer* const buffer = b->buffer;
+    struct ringbuffer_data_t rb_data[2];
+    struct convert_segment_t segments[2];
+    size_t nframes = buffer->datas[0].maxsize / sizeof(float);
+    size_t channel;
+
+    if ((b->requested != 0) && (b->requested < nframes))
+    {
+        nframes = b->requested;
+    }
+
+    for (channel = 0; channel != pipewire_backend->nb_channels; ++channel)
+    {
+        pipewire_backend->planes[channel] = (float*)buffer->datas[channel].data;
+        buffer->datas[channel].chunk->offset    = 0;
+        buffer->datas[channel].chunk->stride    = sizeof(float);
+        buffer->datas[channel].chunk->size      = nframes * sizeof(float);
+    }
+
+    ringbuffer_get_read_vector(pipewire_backend->ring_buffer, rb_data);
+
+    if ((rb_data[0].len + rb_data[1].len) < (nframes * pipewire_backend->frame_size))
+    {
+        /* writer is late: play silence */
+        for (channel = 0; channel != pipewire_backend->nb_channels; ++channel)
+        {
+            memset(pipewire_backend->planes[channel], 0, nframes * sizeof(float));
+        }
+        return;
+    }
+
+    pipewire_get_segments(rb_data, segments);
+    convert_deinterleave_segments(pipewire_backend->planes, segments, pipewire_backend->frame_buffer,
+        pipewire_backend->bit_fmt, pipewire_backend->nb_channels, nframes);
+
+    ringbuffer_read_advance(pipewire_backend->ring_buffer, nframes * pipewire_backend->frame_size);
+}
+
+void pipewire_process_cb(void* arg)
+{
+    struct pipewire_backend_t* const pipewire_backend = (struct pipewire_backend_t*)arg;
+    struct pw_buffer* b;
+    size_t channel;
+
+    b = pw_stream_dequeue_buffer(pipewire_backend->stream);
+    if (b == 0)
+    {
+        return;
+    }
+
+    __atomic_store_n(&pipewire_backend->active, 1, __ATOMIC_RELEASE);
+
+    if (b->buffer->n_datas >= pipewire_backend->nb_channels)
+    {
+        for (channel = 0; (channel != pipewire_backend->nb_channels) && (b->buffer->datas[channel].data != 0); ++channel)
+        {
+        }
+
+        if (channel == pipewire_backend->nb_channels)
+        {
+            if (pipewire_backend->direction == AUDIO_IN)
+            {
+                pipewire_process_capture(pipewire_backend, b->buffer);
+            }
+            else
+            {
+                pipewire_process_playback(pipewire_backend, b);
+            }
+        }
+    }
+
+    pw_stream_queue_buffer(pipewire_backend->stream, b);
+}
+
+void pipewire_state_changed_cb(void* arg, enum pw_stream_state old, enum pw_stream_state state, char const* error)
+{
+    struct pipewire_backend_t* const pipewire_backend = (struct pipewire_backend_t*)arg;
+
+    (void)old;
+    logger_log(LOG_INFO, "%s: stream %s", __func__, pw_stream_state_as_string(state));
+
+    if (state == PW_STREAM_STATE_ERROR)
+    {
+        /* read and write now fail, the upper layer closes us */
+        logger_log(LOG_ERROR, "%s: stream error: %s", __func__, (error != 0) ? error : "unknown");
+        __atomic_store_n(&pipewire_backend->shutdown, 1, __ATOMIC_RELEASE);
+        __atomic_store_n(&pipewire_backend->active, 0, __ATOMIC_RELEASE);
+        sem_post(&pipewire_backend->data_ready);
+    }
+}
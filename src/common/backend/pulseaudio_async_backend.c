@@ -0,0 +1,809 @@
+#include "pulseaudio_async_backend.h"
+#include <pulse/pulseaudio.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include "common/logger.h"
+
+/**
+ * Pulseaudio backend built on pa_threaded_mainloop / pa_stream.
+ * Unlike the pa_simple one, it sets buffer attributes for both directions with
+ * PA_STREAM_ADJUST_LATENCY, writes when the server asks for data, and reports the
+ * stream latency. begin / commit give direct access to the server buffers
+ * (pa_stream_begin_write / pa_stream_peek).
+ * In non blocking mode, the mainloop callbacks write to a pipe whose read end is
+ * given to poll, so that the caller knows when to retry.
+ */
+
+struct pulseaudio_async_backend_t
+{
+    struct audio_backend_t  parent;
+    pa_threaded_mainloop*   mainloop;
+    pa_context*             context;
+    pa_stream*              stream;
+    enum audio_direction    direction;
+    size_t                  frame_size;
+
+    int                     nonblock;
+    int                     wake_fds[2];
+
+    /* playback area given by pa_stream_begin_write, written back by commit */
+    void*                   write_area;
+
+    /* capture fragment currently peeked, and how much of it has been consumed */
+    char const*             fragment;
+    size_t                  fragment_size;
+    size_t                  fragment_offset;
+
+    /* a frame split between two capture fragments, or bigger than the area begin_write gave */
+    char                    carry[VBAN_CHANNELS_MAX_NB * sizeof(double)];
+    size_t                  carry_size;
+    int                     carry_given;
+};
+
+static int pulseaudio_async_open(audio_backend_handle_t handle, char const* device_name, char const* stream_name, enum audio_direction direction, size_t buffer_size, struct stream_config_t const* config);
+static int pulseaudio_async_close(audio_backend_handle_t handle);
+static int pulseaudio_async_write(audio_backend_handle_t handle, char const* data, size_t size);
+static int pulseaudio_async_read(audio_backend_handle_t handle, char* data, size_t size);
+static int pulseaudio_async_begin(audio_backend_handle_t handle, char** data, size_t* size);
+static int pulseaudio_async_commit(audio_backend_handle_t handle, size_t size);
+static int pulseaudio_async_set_nonblock(audio_backend_handle_t handle, int nonblock);
+static int pulseaudio_async_get_poll_fds(audio_backend_handle_t handle, struct pollfd* fds, size_t nb_fds);
+static int pulseaudio_async_get_latency(audio_backend_handle_t handle, unsigned long* latency_us);
+static int pulseaudio_async_query_caps(audio_backend_handle_t handle, char const* device_name, enum audio_direction direction, struct audio_caps_t* caps);
+
+static enum pa_sample_format vban_to_pulseaudio_format(enum VBanBitResolution bit_resolution)
+{
+    switch (bit_resolution)
+    {
+        case VBAN_BITFMT_8_INT:
+            return PA_SAMPLE_U8;
+
+        case VBAN_BITFMT_16_INT:
+            return PA_SAMPLE_S16LE;
+
+        case VBAN_BITFMT_24_INT:
+            return PA_SAMPLE_S24LE;
+
+        case VBAN_BITFMT_32_INT:
+            return PA_SAMPLE_S32LE;
+
+        case VBAN_BITFMT_32_FLOAT:
+            return PA_SAMPLE_FLOAT32LE;
+
+        case VBAN_BITFMT_64_FLOAT:
+        default:
+            return PA_SAMPLE_INVALID;
+    }
+}
+
+/* called from the mainloop thread: tells a non blocking caller to retry */
+static void wake_caller(struct pulseaudio_async_backend_t* backend)
+{
+    char const byte = 0;
+
+    pa_threaded_mainloop_signal(backend->mainloop, 0);
+    if ((backend->wake_fds[1] >= 0) && (write(backend->wake_fds[1], &byte, 1) < 0))
+    {
+        /* pipe already full: the caller will be woken anyway */
+    }
+}
+
+/* must be called with the mainloop locked, before checking if the stream is ready for more */
+static void clear_wake(struct pulseaudio_async_backend_t* backend)
+{
+    char bytes[64];
+
+    if (backend->wake_fds[0] >= 0)
+    {
+        while (read(backend->wake_fds[0], bytes, sizeof(bytes)) > 0)
+        {
+        }
+    }
+}
+
+static void context_state_cb(pa_context* context, void* arg)
+{
+    struct pulseaudio_async_backend_t* const backend = (struct pulseaudio_async_backend_t*)arg;
+
+    (void)context;
+    pa_threaded_mainloop_signal(backend->mainloop, 0);
+}
+
+static void stream_notify_cb(pa_stream* stream, void* arg)
+{
+    struct pulseaudio_async_backend_t* const backend = (struct pulseaudio_async_backend_t*)arg;
+
+    (void)stream;
+    wake_caller(backend);
+}
+
+static void stream_request_cb(pa_stream* stream, size_t nbytes, void* arg)
+{
+    struct pulseaudio_async_backend_t* const backend = (struct pulseaudio_async_backend_t*)arg;
+
+    (void)stream;
+    (void)nbytes;
+    wake_caller(backend);
+}
+
+static void stream_underflow_cb(pa_stream* stream, void* arg)
+{
+    (void)stream;
+    (void)arg;
+    logger_log(LOG_WARNING, "%s: playback underflow", __func__);
+}
+
+static void stream_overflow_cb(pa_stream* stream, void* arg)
+{
+    (void)stream;
+    (void)arg;
+    logger_log(LOG_WARNING, "%s: record overflow", __func__);
+}
+
+/* must be called with the mainloop locked */
+static int wait_stream_ready(struct pulseaudio_async_backend_t* backend)
+{
+    pa_stream_state_t state;
+
+    while ((state = pa_stream_get_state(backend->stream)) != PA_STREAM_READY)
+    {
+        if (!PA_STREAM_IS_GOOD(state))
+        {
+            logger_log(LOG_ERROR, "%s: stream failed: %s", __func__, pa_strerror(pa_context_errno(backend->context)));
+            return -EIO;
+        }
+        pa_threaded_mainloop_wait(backend->mainloop);
+    }
+
+    return 0;
+}
+
+int pulseaudio_async_backend_init(audio_backend_handle_t* handle)
+{
+    struct pulseaudio_async_backend_t* pulseaudio_backend = 0;
+
+    if (handle == 0)
+    {
+        logger_log(LOG_FATAL, "%s: null handle pointer", __func__);
+        return -EINVAL;
+    }
+
+    pulseaudio_backend = calloc(1, sizeof(struct pulseaudio_async_backend_t));
+    if (pulseaudio_backend == 0)
+    {
+        logger_log(LOG_FATAL, "%s: could not allocate memory", __func__);
+        return -ENOMEM;
+    }
+
+    pulseaudio_backend->parent.open         = pulseaudio_async_open;
+    pulseaudio_backend->parent.close        = pulseaudio_async_close;
+    pulseaudio_backend->parent.write        = pulseaudio_async_write;
+    pulseaudio_backend->parent.read         = pulseaudio_async_read;
+    pulseaudio_backend->parent.begin        = pulseaudio_async_begin;
+    pulseaudio_backend->parent.commit       = pulseaudio_async_commit;
+    pulseaudio_backend->parent.set_nonblock = pulseaudio_async_set_nonblock;
+    pulseaudio_backend->parent.get_poll_fds = pulseaudio_async_get_poll_fds;
+    pulseaudio_backend->parent.get_latency  = pulseaudio_async_get_latency;
+    pulseaudio_backend->parent.query_caps   = pulseaudio_async_query_caps;
+    pulseaudio_backend->wake_fds[0]         = -1;
+    pulseaudio_backend->wake_fds[1]         = -1;
+
+    *handle = (audio_backend_handle_t)pulseaudio_backend;
+
+    return 0;
+}
+
+int pulseaudio_async_set_nonblock(audio_backend_handle_t handle, int nonblock)
+{
+    struct pulseaudio_async_backend_t* const pulseaudio_backend = (struct pulseaudio_async_backend_t*)handle;
+
+    if (handle == 0)
+    {
+        logger_log(LOG_FATAL, "%s: handle pointer is null", __func__);
+        return -EINVAL;
+    }
+
+    if (pulseaudio_backend->mainloop != 0)
+    {
+        logger_log(LOG_ERROR, "%s: must be set before open", __func__);
+        return -EBUSY;
+    }
+
+    pulseaudio_backend->nonblock = nonblock;
+
+    return 0;
+}
+
+int pulseaudio_async_get_poll_fds(audio_backend_handle_t handle, struct pollfd* fds, size_t nb_fds)
+{
+    struct pulseaudio_async_backend_t* const pulseaudio_backend = (struct pulseaudio_async_backend_t*)handle;
+
+    if ((handle == 0) || (fds == 0))
+    {
+        logger_log(LOG_ERROR, "%s: handle or fds pointer is null", __func__);
+        return -EINVAL;
+    }
+
+    if ((pulseaudio_backend->wake_fds[0] < 0) || (nb_fds == 0))
+    {
+        return 0;
+    }
+
+    fds[0].fd       = pulseaudio_backend->wake_fds[0];
+    fds[0].events   = POLLIN;
+    fds[0].revents  = 0;
+
+    return 1;
+}
+
+int pulseaudio_async_query_caps(audio_backend_handle_t handle, char const* device_name, enum audio_direction direction, struct audio_caps_t* caps)
+{
+    (void)handle;
+    (void)device_name;
+    (void)direction;
+
+    if (caps == 0)
+    {
+        logger_log(LOG_FATAL, "%s: null caps pointer", __func__);
+        return -EINVAL;
+    }
+
+    /* PA_SAMPLE_U8 is unsigned: 8 bits streams are better converted than played with an offset */
+    caps->formats       = AUDIO_CAPS_FORMAT(VBAN_BITFMT_16_INT) | AUDIO_CAPS_FORMAT(VBAN_BITFMT_24_INT)
+                        | AUDIO_CAPS_FORMAT(VBAN_BITFMT_32_INT) | AUDIO_CAPS_FORMAT(VBAN_BITFMT_32_FLOAT);
+    caps->rate_max      = PA_RATE_MAX;
+    caps->channels_max  = PA_CHANNELS_MAX;
+    caps->has_clock     = 1;
+
+    return 0;
+}
+
+int pulseaudio_async_open(audio_backend_handle_t handle, char const* device_name, char const* stream_name, enum audio_direction direction, size_t buffer_size, struct stream_config_t const* config)
+{
+    int ret = 0;
+    struct pulseaudio_async_backend_t* const pulseaudio_backend = (struct pulseaudio_async_backend_t*)handle;
+    pa_context_state_t state;
+    pa_stream_flags_t const flags = (pa_stream_flags_t)(PA_STREAM_ADJUST_LATENCY | PA_STREAM_INTERPOLATE_TIMING | PA_STREAM_AUTO_TIMING_UPDATE);
+    pa_sample_spec const ss =
+    {
+        .format     = vban_to_pulseaudio_format(config->bit_fmt),
+        .rate       = config->sample_rate,
+        .channels   = config->nb_channels,
+    };
+
+    /* with ADJUST_LATENCY, tlength / fragsize are the overall latency asked to the server */
+    pa_buffer_attr const ba =
+    {
+        .maxlength  = (unsigned int)(-1),
+        .tlength    = (direction == AUDIO_OUT) ? buffer_size : (unsigned int)(-1),
+        .prebuf     = (direction == AUDIO_OUT) ? buffer_size / 2 : (unsigned int)(-1),
+        .minreq     = (unsigned int)(-1),
+        .fragsize   = (direction == AUDIO_IN) ? buffer_size : (unsigned int)(-1)
+    };
+
+    if (handle == 0)
+    {
+        logger_log(LOG_FATAL, "%s: handle pointer is null", __func__);
+        return -EINVAL;
+    }
+
+    pulseaudio_backend->direction   = direction;
+    pulseaudio_backend->frame_size  = VBanBitResolutionSize[config->bit_fmt] * config->nb_channels;
+    pulseaudio_backend->carry_size  = 0;
+    pulseaudio_backend->carry_given = 0;
+
+    if (pulseaudio_backend->nonblock)
+    {
+        if ((pipe(pulseaudio_backend->wake_fds) != 0)
+            || (fcntl(pulseaudio_backend->wake_fds[0], F_SETFL, O_NONBLOCK) != 0)
+            || (fcntl(pulseaudio_backend->wake_fds[1], F_SETFL, O_NONBLOCK) != 0))
+        {
+            ret = -errno;
+            logger_log(LOG_FATAL, "%s: could not create wake up pipe: %s", __func__, strerror(errno));
+            pulseaudio_async_close(handle);
+            return ret;
+        }
+    }
+
+    pulseaudio_backend->mainloop = pa_threaded_mainloop_new();
+    if (pulseaudio_backend->mainloop == 0)
+    {
+        logger_log(LOG_FATAL, "%s: could not create mainloop", __func__);
+        pulseaudio_async_close(handle);
+        return -ENOMEM;
+    }
+
+    pulseaudio_backend->context = pa_context_new(pa_threaded_mainloop_get_api(pulseaudio_backend->mainloop), "vban");
+    if (pulseaudio_backend->context == 0)
+    {
+        logger_log(LOG_FATAL, "%s: could not create context", __func__);
+        pulseaudio_async_close(handle);
+        return -ENOMEM;
+    }
+
+    pa_context_set_state_callback(pulseaudio_backend->context, context_state_cb, pulseaudio_backend);
+    if (pa_context_connect(pulseaudio_backend->context, 0, PA_CONTEXT_NOFLAGS, 0) < 0)
+    {
+        logger_log(LOG_FATAL, "%s: could not connect: %s", __func__, pa_strerror(pa_context_errno(pulseaudio_backend->context)));
+        pulseaudio_async_close(handle);
+        return -ECONNREFUSED;
+    }
+
+    pa_threaded_mainloop_lock(pulseaudio_backend->mainloop);
+
+    if (pa_threaded_mainloop_start(pulseaudio_backend->mainloop) < 0)
+    {
+        logger_log(LOG_FATAL, "%s: could not start mainloop", __func__);
+        pa_threaded_mainloop_unlock(pulseaudio_backend->mainloop);
+        pulseaudio_async_close(handle);
+        return -EIO;
+    }
+
+    while ((state = pa_context_get_state(pulseaudio_backend->context)) != PA_CONTEXT_READY)
+    {
+        if (!PA_CONTEXT_IS_GOOD(state))
+        {
+            logger_log(LOG_FATAL, "%s: connection failed: %s", __func__, pa_strerror(pa_context_errno(pulseaudio_backend->context)));
+            pa_threaded_mainloop_unlock(pulseaudio_backend->mainloop);
+            pulseaudio_async_close(handle);
+            return -ECONNREFUSED;
+        }
+        pa_threaded_mainloop_wait(pulseaudio_backend->mainloop);
+    }
+
+    pulseaudio_backend->stream = pa_stream_new(pulseaudio_backend->context,
+        (stream_name[0] != '\0') ? stream_name : ((direction == AUDIO_OUT) ? "playback": "record"), &ss, 0);
+    if (pulseaudio_backend->stream == 0)
+    {
+        logger_log(LOG_FATAL, "%s: could not create stream: %s", __func__, pa_strerror(pa_context_errno(pulseaudio_backend->context)));
+        pa_threaded_mainloop_unlock(pulseaudio_backend->mainloop);
+        pulseaudio_async_close(handle);
+        return -EINVAL;
+    }
+
+    pa_stream_set_state_callback(pulseaudio_backend->stream, stream_notify_cb, pulseaudio_backend);
+    if (direction == AUDIO_OUT)
+    {
+        pa_stream_set_write_callback(pulseaudio_backend->stream, stream_request_cb, pulseaudio_backend);
+        pa_stream_set_underflow_callback(pulseaudio_backend->stream, stream_underflow_cb, pulseaudio_backend);
+        ret = pa_stream_connect_playback(pulseaudio_backend->stream, (device_name[0] == '\0') ? 0 : device_name, &ba, flags, 0, 0);
+    }
+    else
+    {
+        pa_stream_set_read_callback(pulseaudio_backend->stream, stream_request_cb, pulseaudio_backend);
+        pa_stream_set_overflow_callback(pulseaudio_backend->stream, stream_overflow_cb, pulseaudio_backend);
+        ret = pa_stream_connect_record(pulseaudio_backend->stream, (device_name[0] == '\0') ? 0 : device_name, &ba, flags);
+    }
+
+    if ((ret < 0) || ((ret = wait_stream_ready(pulseaudio_backend)) < 0))
+    {
+        logger_log(LOG_FATAL, "%s: could not connect stream: %s", __func__, pa_strerror(pa_context_errno(pulseaudio_backend->context)));
+        pa_threaded_mainloop_unlock(pulseaudio_backend->mainloop);
+        pulseaudio_async_close(handle);
+        return -EIO;
+    }
+
+    logger_log(LOG_INFO, "%s: server granted tlength %u, fragsize %u, minreq %u", __func__,
+        pa_stream_get_buffer_attr(pulseaudio_backend->stream)->tlength,
+        pa_stream_get_buffer_attr(pulseaudio_backend->stream)->fragsize,
+        pa_stream_get_buffer_attr(pulseaudio_backend->stream)->minreq);
+
+    pa_threaded_mainloop_unlock(pulseaudio_backend->mainloop);
+
+    return 0;
+}
+
+int pulseaudio_async_close(audio_backend_handle_t handle)
+{
+    struct pulseaudio_async_backend_t* const pulseaudio_backend = (struct pulseaudio_async_backend_t*)handle;
+    size_t index;
+
+    if (handle == 0)
+    {
+        logger_log(LOG_FATAL, "%s: handle pointer is null", __func__);
+        return -EINVAL;
+    }
+
+    if (pulseaudio_backend->mainloop != 0)
+    {
+        pa_threaded_mainloop_lock(pulseaudio_backend->mainloop);
+
+        if (pulseaudio_backend->stream != 0)
+        {
+            pa_stream_disconnect(pulseaudio_backend->stream);
+            pa_stream_unref(pulseaudio_backend->stream);
+            pulseaudio_backend->stream = 0;
+        }
+
+        if (pulseaudio_backend->context != 0)
+        {
+            pa_context_disconnect(pulseaudio_backend->context);
+            pa_context_unref(pulseaudio_backend->context);
+            pulseaudio_backend->context = 0;
+        }
+
+        pa_threaded_mainloop_unlock(pulseaudio_backend->mainloop);
+        pa_threaded_mainloop_stop(pulseaudio_backend->mainloop);
+        pa_threaded_mainloop_free(pulseaudio_backend->mainloop);
+        pulseaudio_backend->mainloop = 0;
+    }
+
+    /* the mainloop thread that writes to it is gone */
+    for (index = 0; index != 2; ++index)
+    {
+        if (pulseaudio_backend->wake_fds[index] >= 0)
+        {
+            close(pulseaudio_backend->wake_fds[index]);
+            pulseaudio_backend->wake_fds[index] = -1;
+        }
+    }
+
+    pulseaudio_backend->fragment        = 0;
+    pulseaudio_backend->fragment_size   = 0;
+    pulseaudio_backend->fragment_offset = 0;
+    pulseaudio_backend->carry_size      = 0;
+    pulseaudio_backend->carry_given     = 0;
+
+    return 0;
+}
+
+/* must be called with the mainloop locked: makes sure there is a capture fragment with data left */
+static int peek_fragment(struct pulseaudio_async_backend_t* backend)
+{
+    void const* fragment = 0;
+    size_t available = 0;
+
+    while (backend->fragment == 0)
+    {
+        if (pa_stream_readable_size(backend->stream) == 0)
+        {
+            if (pa_stream_get_state(backend->stream) != PA_STREAM_READY)
+            {
+                return -EIO;
+            }
+            if (backend->nonblock)
+            {
+                return -EAGAIN;
+            }
+            pa_threaded_mainloop_wait(backend->mainloop);
+            continue;
+        }
+
+        if (pa_stream_peek(backend->stream, &fragment, &available) < 0)
+        {
+            return -EIO;
+        }
+
+        if (fragment == 0)
+        {
+            /* hole in the record stream: skip it */
+            if ((available != 0) && (pa_stream_drop(backend->stream) < 0))
+            {
+                return -EIO;
+            }
+        }
+        else if (available != 0)
+        {
+            backend->fragment           = (char const*)fragment;
+            backend->fragment_size      = available;
+            backend->fragment_offset    = 0;
+        }
+    }
+
+    return 0;
+}
+
+/* must be called with the mainloop locked */
+static int consume_fragment(struct pulseaudio_async_backend_t* backend, size_t size)
+{
+    backend->fragment_offset += size;
+    if (backend->fragment_offset >= backend->fragment_size)
+    {
+        backend->fragment = 0;
+        if (pa_stream_drop(backend->stream) < 0)
+        {
+            return -EIO;
+        }
+    }
+
+    return 0;
+}
+
+int pulseaudio_async_begin(audio_backend_handle_t handle, char** data, size_t* size)
+{
+    int ret = 0;
+    struct pulseaudio_async_backend_t* const pulseaudio_backend = (struct pulseaudio_async_backend_t*)handle;
+    size_t const frame_size = pulseaudio_backend->frame_size;
+    size_t available = 0;
+    size_t chunk = 0;
+
+    if ((handle == 0) || (data == 0) || (size == 0))
+    {
+        logger_log(LOG_ERROR, "%s: handle or data pointer is null", __func__);
+        return -EINVAL;
+    }
+
+    if (pulseaudio_backend->stream == 0)
+    {
+        logger_log(LOG_ERROR, "%s: device not open", __func__);
+        return -ENODEV;
+    }
+
+    /* the mainloop stays locked until commit */
+    pa_threaded_mainloop_lock(pulseaudio_backend->mainloop);
+    clear_wake(pulseaudio_backend);
+    pulseaudio_backend->carry_given = 0;
+
+    if (pulseaudio_backend->direction == AUDIO_OUT)
+    {
+        while ((available = pa_stream_writable_size(pulseaudio_backend->stream)) < frame_size)
+        {
+            if (pa_stream_get_state(pulseaudio_backend->stream) != PA_STREAM_READY)
+            {
+                ret = -EIO;
+                break;
+            }
+            if (pulseaudio_backend->nonblock)
+            {
+                ret = -EAGAIN;
+                break;
+            }
+            pa_threaded_mainloop_wait(pulseaudio_backend->mainloop);
+        }
+
+        if (ret == 0)
+        {
+            available = (available < *size) ? available : *size;
+            if (pa_stream_begin_write(pulseaudio_backend->stream, &pulseaudio_backend->write_area, &available) < 0)
+            {
+                ret = -EIO;
+            }
+            else if (available < frame_size)
+            {
+                /* the server area can not even hold a frame: give the carry buffer, pa_stream_write copies it */
+                pa_stream_cancel_write(pulseaudio_backend->stream);
+                pulseaudio_backend->write_area  = pulseaudio_backend->carry;
+                pulseaudio_backend->carry_given = 1;
+                available = frame_size;
+            }
+            *data = (char*)pulseaudio_backend->write_area;
+        }
+    }
+    else
+    {
+        while (ret == 0)
+        {
+            if (pulseaudio_backend->carry_size == frame_size)
+            {
+                pulseaudio_backend->carry_given = 1;
+                *data = pulseaudio_backend->carry;
+                available = frame_size;
+                break;
+            }
+
+            ret = peek_fragment(pulseaudio_backend);
+            if (ret < 0)
+            {
+                break;
+            }
+
+            available = pulseaudio_backend->fragment_size - pulseaudio_backend->fragment_offset;
+            if ((pulseaudio_backend->carry_size == 0) && (available >= frame_size))
+            {
+                available = (available < *size) ? available : *size;
+                *data = (char*)pulseaudio_backend->fragment + pulseaudio_backend->fragment_offset;
+                break;
+            }
+
+            /* a frame is split between two fragments: put it back together */
+            chunk = frame_size - pulseaudio_backend->carry_size;
+            chunk = (chunk < available) ? chunk : available;
+            memcpy(pulseaudio_backend->carry + pulseaudio_backend->carry_size, pulseaudio_backend->fragment + pulseaudio_backend->fragment_offset, chunk);
+            pulseaudio_backend->carry_size += chunk;
+            ret = consume_fragment(pulseaudio_backend, chunk);
+        }
+    }
+
+    if (ret < 0)
+    {
+        if (ret != -EAGAIN)
+        {
+            logger_log(LOG_ERROR, "%s: stream error: %s", __func__, pa_strerror(pa_context_errno(pulseaudio_backend->context)));
+        }
+        pa_threaded_mainloop_unlock(pulseaudio_backend->mainloop);
+        return ret;
+    }
+
+    *size = available - (available % frame_size);
+
+    return 0;
+}
+
+int pulseaudio_async_commit(audio_backend_handle_t handle, size_t size)
+{
+    int ret = 0;
+    struct pulseaudio_async_backend_t* const pulseaudio_backend = (struct pulseaudio_async_backend_t*)handle;
+
+    if (handle == 0)
+    {
+        logger_log(LOG_ERROR, "%s: handle pointer is null", __func__);
+        return -EINVAL;
+    }
+
+    if (pulseaudio_backend->stream == 0)
+    {
+        logger_log(LOG_ERROR, "%s: device not open", __func__);
+        return -ENODEV;
+    }
+
+    if (pulseaudio_backend->direction == AUDIO_OUT)
+    {
+        if (size == 0)
+        {
+            if (!pulseaudio_backend->carry_given)
+            {
+                pa_stream_cancel_write(pulseaudio_backend->stream);
+            }
+        }
+        /* writing back the area given by pa_stream_begin_write does not copy it, the carry buffer is copied */
+        else if (pa_stream_write(pulseaudio_backend->stream, pulseaudio_backend->write_area, size, 0, 0, PA_SEEK_RELATIVE) < 0)
+        {
+            ret = -EIO;
+        }
+        pulseaudio_backend->write_area = 0;
+    }
+    else if (pulseaudio_backend->carry_given)
+    {
+        if (size != 0)
+        {
+            pulseaudio_backend->carry_size = 0;
+        }
+    }
+    else
+    {
+        ret = consume_fragment(pulseaudio_backend, size);
+    }
+
+    pulseaudio_backend->carry_given = 0;
+
+    if (ret < 0)
+    {
+        logger_log(LOG_ERROR, "%s: stream error: %s", __func__, pa_strerror(pa_context_errno(pulseaudio_backend->context)));
+    }
+
+    pa_threaded_mainloop_unlock(pulseaudio_backend->mainloop);
+
+    return (ret < 0) ? ret : (int)size;
+}
+
+int pulseaudio_async_write(audio_backend_handle_t handle, char const* data, size_t size)
+{
+    int ret = 0;
+    size_t offset = 0;
+    size_t chunk = 0;
+    char* area = 0;
+
+    if ((handle == 0) || (data == 0))
+    {
+        logger_log(LOG_ERROR, "%s: handle or data pointer is null", __func__);
+        return -EINVAL;
+    }
+
+    while (offset != size)
+    {
+        chunk = size - offset;
+        ret = pulseaudio_async_begin(handle, &area, &chunk);
+        if ((ret == -EAGAIN) && (offset != 0))
+        {
+            /* non blocking: report what has been done */
+            break;
+        }
+        else if (ret < 0)
+        {
+            return ret;
+        }
+
+        if (chunk == 0)
+        {
+            /* less than a frame left */
+            pulseaudio_async_commit(handle, 0);
+            break;
+        }
+
+        memcpy(area, data + offset, chunk);
+
+        ret = pulseaudio_async_commit(handle, chunk);
+        if (ret < 0)
+        {
+            return ret;
+        }
+
+        offset += chunk;
+    }
+
+    return offset;
+}
+
+int pulseaudio_async_read(audio_backend_handle_t handle, char* data, size_t size)
+{
+    int ret = 0;
+    size_t offset = 0;
+    size_t chunk = 0;
+    char* area = 0;
+
+    if ((handle == 0) || (data == 0))
+    {
+        logger_log(LOG_ERROR, "%s: handle or data pointer is null", __func__);
+        return -EINVAL;
+    }
+
+    while (offset != size)
+    {
+        chunk = size - offset;
+        ret = pulseaudio_async_begin(handle, &area, &chunk);
+        if ((ret == -EAGAIN) && (offset != 0))
+        {
+            /* non blocking: report what has been done */
+            break;
+        }
+        else if (ret < 0)
+        {
+            return ret;
+        }
+
+        if (chunk == 0)
+        {
+            /* less than a frame left */
+            pulseaudio_async_commit(handle, 0);
+            break;
+        }
+
+        memcpy(data + offset, area, chunk);
+
+        ret = pulseaudio_async_commit(handle, chunk);
+        if (ret < 0)
+        {
+            return ret;
+        }
+
+        offset += chunk;
+    }
+
+    return offset;
+}
+
+int pulseaudio_async_get_latency(audio_backend_handle_t handle, unsigned long* latency_us)
+{
+    int ret = 0;
+    struct pulseaudio_async_backend_t* const pulseaudio_backend = (struct pulseaudio_async_backend_t*)handle;
+    pa_usec_t latency = 0;
+    int negative = 0;
+
+    if ((handle == 0) || (latency_us == 0))
+    {
+        logger_log(LOG_ERROR, "%s: handle or latency pointer is null", __func__);
+        return -EINVAL;
+    }
+
+    if (pulseaudio_backend->stream == 0)
+    {
+        return -ENODEV;
+    }
+
+    pa_threaded_mainloop_lock(pulseaudio_backend->mainloop);
+    ret = pa_stream_get_latency(pulseaudio_backend->stream, &latency, &negative);
+    pa_threaded_mainloop_unlock(pulseaudio_backend->mainloop);
+
+    if (ret < 0)
+    {
+        /* no timing info yet */
+        return -EAGAIN;
+    }
+
+    *latency_us = negative ? 0 : (unsigned long)latency;
+
+    return 0;
+}
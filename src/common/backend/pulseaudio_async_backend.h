@@ -0,0 +1,9 @@
+#ifndef __PULSEAUDIO_ASYNC_BACKEND_H__
+#define __PULSEAUDIO_ASYNC_BACKEND_H__
+
+#include "audio_backend.h"
+
+#define PULSEAUDIO_ASYNC_BACKEND_NAME   "pulseaudio_async"
+int pulseaudio_async_backend_init(audio_backend_handle_t* handle);
+
+#endif /*__PULSEAUDIO_ASYNC_BACKEND_H__*/
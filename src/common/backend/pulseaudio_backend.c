@@ -10,10 +10,12 @@ struct pulseaudio_backend_t
     pa_simple*              pulseaudio_handle;
 };
 
-static int pulseaudio_open(audio_backend_handle_t handle, char const* device_name, enum audio_direction direction, size_t buffer_size, struct stream_config_t const* config);
+static int pulseaudio_open(audio_backend_handle_t handle, char const* device_name, char const* stream_name, enum audio_direction direction, size_t buffer_size, struct stream_config_t const* config);
 static int pulseaudio_close(audio_backend_handle_t handle);
 static int pulseaudio_write(audio_backend_handle_t handle, char const* data, size_t size);
 static int pulseaudio_read(audio_backend_handle_t handle, char* data, size_t size);
+static int pulseaudio_drain(audio_backend_handle_t handle);
+static int pulseaudio_query_caps(audio_backend_handle_t handle, char const* device_name, enum audio_direction direction, struct audio_caps_t* caps);
 
 static enum pa_sample_format vban_to_pulseaudio_format(enum VBanBitResolution bit_resolution)
 {
@@ -61,6 +63,8 @@ int pulseaudio_backend_init(audio_backend_handle_t* handle)
     pulseaudio_backend->parent.close              = pulseaudio_close;
     pulseaudio_backend->parent.write              = pulseaudio_write;
     pulseaudio_backend->parent.read              = pulseaudio_read;
+    pulseaudio_backend->parent.drain             = pulseaudio_drain;
+    pulseaudio_backend->parent.query_caps        = pulseaudio_query_caps;
 
     *handle = (audio_backend_handle_t)pulseaudio_backend;
 
@@ -68,7 +72,29 @@ int pulseaudio_backend_init(audio_backend_handle_t* handle)
     
 }
 
-int pulseaudio_open(audio_backend_handle_t handle, char const* device_name, enum audio_direction direction, size_t buffer_size, struct stream_config_t const* config)
+int pulseaudio_query_caps(audio_backend_handle_t handle, char const* device_name, enum audio_direction direction, struct audio_caps_t* caps)
+{
+    (void)handle;
+    (void)device_name;
+    (void)direction;
+
+    if (caps == 0)
+    {
+        logger_log(LOG_FATAL, "%s: null caps pointer", __func__);
+        return -EINVAL;
+    }
+
+    /* PA_SAMPLE_U8 is unsigned: 8 bits streams are better converted than played with an offset */
+    caps->formats       = AUDIO_CAPS_FORMAT(VBAN_BITFMT_16_INT) | AUDIO_CAPS_FORMAT(VBAN_BITFMT_24_INT)
+                        | AUDIO_CAPS_FORMAT(VBAN_BITFMT_32_INT) | AUDIO_CAPS_FORMAT(VBAN_BITFMT_32_FLOAT);
+    caps->rate_max      = PA_RATE_MAX;
+    caps->channels_max  = PA_CHANNELS_MAX;
+    caps->has_clock     = 1;
+
+    return 0;
+}
+
+int pulseaudio_open(audio_backend_handle_t handle, char const* device_name, char const* stream_name, enum audio_direction direction, size_t buffer_size, struct stream_config_t const* config)
 {
     int ret;
     struct pulseaudio_backend_t* const pulseaudio_backend = (struct pulseaudio_backend_t*)handle;
@@ -95,7 +121,7 @@ int pulseaudio_open(audio_backend_handle_t handle, char const* device_name, enum
     }
 
     pulseaudio_backend->pulseaudio_handle = pa_simple_new(0, "vban", (direction == AUDIO_OUT) ? PA_STREAM_PLAYBACK : PA_STREAM_RECORD, (device_name[0] == '\0') ? 0 : device_name,
-        (direction == AUDIO_OUT) ? "playback": "record", &ss, 0, (direction == AUDIO_OUT) ? &ba : 0, &ret);
+        (stream_name[0] != '\0') ? stream_name : ((direction == AUDIO_OUT) ? "playback": "record"), &ss, 0, (direction == AUDIO_OUT) ? &ba : 0, &ret);
     if (pulseaudio_backend->pulseaudio_handle == 0)
     {
         logger_log(LOG_FATAL, "pulseaudio_open: open error: %s", pa_strerror(ret));
@@ -182,3 +208,28 @@ int pulseaudio_read(audio_backend_handle_t handle, char* data, size_t size)
     return (ret < 0) ? ret : size;
 }
 
+int pulseaudio_drain(audio_backend_handle_t handle)
+{
+    int ret = 0;
+    int error;
+    struct pulseaudio_backend_t* const pulseaudio_backend = (struct pulseaudio_backend_t*)handle;
+
+    if (handle == 0)
+    {
+        logger_log(LOG_ERROR, "%s: handle pointer is null", __func__);
+        return -EINVAL;
+    }
+
+    if (pulseaudio_backend->pulseaudio_handle == 0)
+    {
+        return 0;
+    }
+
+    ret = pa_simple_drain(pulseaudio_backend->pulseaudio_handle, &error);
+    if (ret < 0)
+    {
+        logger_log(LOG_WARNING, "%s: pa_simple_drain failed: %s", __func__, pa_strerror(error));
+    }
+
+    return ret;
+}
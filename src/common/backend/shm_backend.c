@@ -0,0 +1,653 @@
+#define _GNU_SOURCE
+#include "shm_backend.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "common/logger.h"
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+/* ring is the biggest of SHM_BUFFERS_NB times the buffer size and SHM_CAPACITY_MS of audio */
+#define SHM_BUFFERS_NB      8
+#define SHM_CAPACITY_MS     500
+/* a block written at once is at most capacity / SHM_GUARD_DIV */
+#define SHM_GUARD_DIV       4
+/* readers check the producer state at least that often while waiting */
+#define SHM_WAIT_NS         100000000
+/* waiting period without futex */
+#define SHM_POLL_NS         1000000
+/* object name and its options, leaving room for the leading slash of the name */
+#define SHM_OPTIONS_SIZE    (AUDIO_DEVICE_NAME_SIZE - 1)
+
+struct shm_backend_t
+{
+    struct audio_backend_t  parent;
+    enum audio_direction    direction;
+    int                     nonblock;
+    char                    name[AUDIO_DEVICE_NAME_SIZE];
+    /* an existing object is replaced instead of refused */
+    int                     replace;
+    struct shm_header_t*    header;
+    char*                   ring;
+    size_t                  map_size;
+
+    /* reader side */
+    uint64_t                read_index;
+    unsigned long           nb_overruns;
+    unsigned long long      bytes_lost;
+
+    /* writer side */
+    unsigned long long      bytes_written;
+    unsigned long           nb_blocks;
+    uint32_t                nu_frame;
+};
+
+static int shm_open_segment(audio_backend_handle_t handle, char const* output_name, char const* stream_name, enum audio_direction direction, size_t buffer_size, struct stream_config_t const* config);
+static int shm_close_segment(audio_backend_handle_t handle);
+static int shm_write(audio_backend_handle_t handle, char const* data, size_t size);
+static int shm_read(audio_backend_handle_t handle, char* data, size_t size);
+static int shm_begin(audio_backend_handle_t handle, char** data, size_t* size);
+static int shm_commit(audio_backend_handle_t handle, size_t size);
+static int shm_set_nonblock(audio_backend_handle_t handle, int nonblock);
+static int shm_probe_config(audio_backend_handle_t handle, char const* output_name, struct stream_config_t* config);
+static int shm_query_caps(audio_backend_handle_t handle, char const* output_name, enum audio_direction direction, struct audio_caps_t* caps);
+static void shm_set_frame(audio_backend_handle_t handle, uint32_t nu_frame);
+
+static int shm_futex_wait(uint32_t* futex, uint32_t value)
+{
+#ifdef __linux__
+    struct timespec const timeout = { 0, SHM_WAIT_NS };
+
+    /* not FUTEX_PRIVATE_FLAG: the word is shared between processes */
+    if (syscall(SYS_futex, futex, FUTEX_WAIT, value, &timeout, 0, 0) == -1)
+    {
+        return ((errno == EAGAIN) || (errno == ETIMEDOUT)) ? 0 : -errno;
+    }
+    return 0;
+#else
+    struct timespec const delay = { 0, SHM_POLL_NS };
+
+    (void)futex;
+    (void)value;
+    return (nanosleep(&delay, 0) == -1) ? -errno : 0;
+#endif
+}
+
+static void shm_futex_wake(uint32_t* futex)
+{
+#ifdef __linux__
+    syscall(SYS_futex, futex, FUTEX_WAKE, INT_MAX, 0, 0, 0);
+#else
+    (void)futex;
+#endif
+}
+
+/**
+ * Object name and options are given as name[,replace]
+ */
+static int shm_get_name(char* name, int* replace, char const* output_name)
+{
+    char options[SHM_OPTIONS_SIZE];
+    char* token;
+    char const* base;
+
+    strncpy(options, output_name, SHM_OPTIONS_SIZE - 1);
+    options[SHM_OPTIONS_SIZE - 1] = '\0';
+
+    token = strchr(options, ',');
+    if (token != 0)
+    {
+        *token++ = '\0';
+    }
+
+    base = (options[0] == '\0') ? SHM_NAME_DEFAULT : options;
+    /* portable shared memory object names start with a single slash */
+    snprintf(name, AUDIO_DEVICE_NAME_SIZE, "%s%s", (base[0] == '/') ? "" : "/", base);
+
+    *replace = 0;
+    for (token = (token != 0) ? strtok(token, ",") : 0; token != 0; token = strtok(0, ","))
+    {
+        if (!strcmp(token, "replace"))
+        {
+            *replace = 1;
+        }
+        else
+        {
+            logger_log(LOG_ERROR, "%s: unknown option %s", __func__, token);
+            return -EINVAL;
+        }
+    }
+
+    return 0;
+}
+
+static int shm_check_header(struct shm_header_t const* header, size_t map_size, char const* name)
+{
+    if ((map_size < sizeof(struct shm_header_t)) || (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC))
+    {
+        logger_log(LOG_ERROR, "%s: %s is not a vban shared memory ring", __func__, name);
+        return -EINVAL;
+    }
+
+    if ((header->version != SHM_VERSION) || (header->frame_size == 0) || (header->capacity == 0) || (header->guard >= header->capacity)
+        || ((size_t)header->header_size + header->capacity > map_size))
+    {
+        logger_log(LOG_ERROR, "%s: %s has an unsupported version or layout", __func__, name);
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+int shm_backend_init(audio_backend_handle_t* handle)
+{
+    struct shm_backend_t* shm_backend = 0;
+
+    if (handle == 0)
+    {
+        logger_log(LOG_FATAL, "%s: null handle pointer", __func__);
+        return -EINVAL;
+    }
+
+    shm_backend = calloc(1, sizeof(struct shm_backend_t));
+    if (shm_backend == 0)
+    {
+        logger_log(LOG_FATAL, "%s: could not allocate memory", __func__);
+        return -ENOMEM;
+    }
+
+    shm_backend->parent.open                = shm_open_segment;
+    shm_backend->parent.close               = shm_close_segment;
+    shm_backend->parent.write               = shm_write;
+    shm_backend->parent.read                = shm_read;
+    shm_backend->parent.set_nonblock        = shm_set_nonblock;
+    shm_backend->parent.probe_config        = shm_probe_config;
+    shm_backend->parent.query_caps          = shm_query_caps;
+    shm_backend->parent.set_frame           = shm_set_frame;
+
+    *handle = (audio_backend_handle_t)shm_backend;
+
+    return 0;
+}
+
+int shm_set_nonblock(audio_backend_handle_t handle, int nonblock)
+{
+    struct shm_backend_t* const shm_backend = (struct shm_backend_t*)handle;
+
+    if (handle == 0)
+    {
+        logger_log(LOG_FATAL, "%s: handle pointer is null", __func__);
+        return -EINVAL;
+    }
+
+    /* only matters for readers, the producer never waits */
+    shm_backend->nonblock = nonblock;
+
+    return 0;
+}
+
+int shm_query_caps(audio_backend_handle_t handle, char const* output_name, enum audio_direction direction, struct audio_caps_t* caps)
+{
+    (void)handle;
+    (void)output_name;
+
+    if (caps == 0)
+    {
+        logger_log(LOG_FATAL, "%s: null caps pointer", __func__);
+        return -EINVAL;
+    }
+
+    /* readers wait for the producer, that runs at the pace of its own source */
+    caps->has_clock = (direction == AUDIO_IN);
+
+    return 0;
+}
+
+void shm_set_frame(audio_backend_handle_t handle, uint32_t nu_frame)
+{
+    struct shm_backend_t* const shm_backend = (struct shm_backend_t*)handle;
+
+    shm_backend->nu_frame = nu_frame;
+}
+
+int shm_probe_config(audio_backend_handle_t handle, char const* output_name, struct stream_config_t* config)
+{
+    int ret = 0;
+    int fd;
+    char name[AUDIO_DEVICE_NAME_SIZE];
+    int replace = 0;
+    struct shm_header_t* header;
+    struct stat st;
+
+    if ((handle == 0) || (config == 0))
+    {
+        logger_log(LOG_FATAL, "%s: null pointer argument", __func__);
+        return -EINVAL;
+    }
+
+    ret = shm_get_name(name, &replace, output_name);
+    if (ret != 0)
+    {
+        return ret;
+    }
+
+    fd = shm_open(name, O_RDONLY, 0);
+    if (fd == -1)
+    {
+        /* nothing to probe before the producer is started */
+        return -ENOTSUP;
+    }
+
+    if ((fstat(fd, &st) == -1) || ((size_t)st.st_size < sizeof(struct shm_header_t)))
+    {
+        close(fd);
+        return -ENOTSUP;
+    }
+
+    header = (struct shm_header_t*)mmap(0, sizeof(struct shm_header_t), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (header == MAP_FAILED)
+    {
+        return -errno;
+    }
+
+    ret = shm_check_header(header, st.st_size, name);
+    if (ret == 0)
+    {
+        config->nb_channels = header->nb_channels;
+        config->sample_rate = header->sample_rate;
+        config->bit_fmt     = header->bit_fmt;
+    }
+
+    munmap(header, sizeof(struct shm_header_t));
+
+    return ret;
+}
+
+static int shm_create(struct shm_backend_t* shm_backend, size_t buffer_size, struct stream_config_t const* config)
+{
+    int fd;
+    int ret = 0;
+    size_t const frame_size = VBanBitResolutionSize[config->bit_fmt] * config->nb_channels;
+    size_t const header_size = sysconf(_SC_PAGESIZE);
+    size_t capacity = ((size_t)config->sample_rate * frame_size * SHM_CAPACITY_MS) / 1000;
+    size_t guard;
+    struct shm_header_t* header;
+
+    if (capacity < buffer_size * SHM_BUFFERS_NB)
+    {
+        capacity = buffer_size * SHM_BUFFERS_NB;
+    }
+    capacity = ((capacity + frame_size - 1) / frame_size) * frame_size;
+    guard = ((capacity / SHM_GUARD_DIV) / frame_size) * frame_size;
+    guard = (guard != 0) ? guard : frame_size;
+
+    /* a replaced segment may still be mapped by readers, they keep it until they see it inactive */
+    if (shm_backend->replace)
+    {
+        shm_unlink(shm_backend->name);
+    }
+
+    fd = shm_open(shm_backend->name, O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd == -1)
+    {
+        ret = -errno;
+        if (errno == EEXIST)
+        {
+            logger_log(LOG_FATAL, "%s: %s already exists, another producer may be running. Add ,replace to the device name to take it over", __func__, shm_backend->name);
+        }
+        else
+        {
+            logger_log(LOG_FATAL, "%s: could not create %s: %s", __func__, shm_backend->name, strerror(errno));
+        }
+        return ret;
+    }
+
+    shm_backend->map_size = header_size + capacity;
+    if (ftruncate(fd, shm_backend->map_size) == -1)
+    {
+        ret = -errno;
+        logger_log(LOG_FATAL, "%s: could not size %s: %s", __func__, shm_backend->name, strerror(errno));
+        close(fd);
+        shm_unlink(shm_backend->name);
+        return ret;
+    }
+
+    header = (struct shm_header_t*)mmap(0, shm_backend->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (header == MAP_FAILED)
+    {
+        ret = -errno;
+        logger_log(LOG_FATAL, "%s: could not map %s: %s", __func__, shm_backend->name, strerror(errno));
+        shm_unlink(shm_backend->name);
+        return ret;
+    }
+
+    header->version     = SHM_VERSION;
+    header->header_size = header_size;
+    header->capacity    = capacity;
+    header->guard       = guard;
+    header->sample_rate = config->sample_rate;
+    header->nb_channels = config->nb_channels;
+    header->bit_fmt     = config->bit_fmt;
+    header->frame_size  = frame_size;
+    header->active      = 1;
+    /* readers only trust the header once the magic is there */
+    __atomic_store_n(&header->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+
+    shm_backend->header = header;
+    shm_backend->ring   = (char*)header + header_size;
+
+    logger_log(LOG_INFO, "%s: %s created, ring of %lu bytes", __func__, shm_backend->name, (unsigned long)capacity);
+
+    return 0;
+}
+
+static int shm_attach(struct shm_backend_t* shm_backend, struct stream_config_t const* config)
+{
+    int fd;
+    int ret = 0;
+    struct stat st;
+    struct shm_header_t* header;
+
+    /* read write: readers register on the header to be woken up */
+    fd = shm_open(shm_backend->name, O_RDWR, 0);
+    if (fd == -1)
+    {
+        ret = -errno;
+        logger_log(LOG_FATAL, "%s: could not open %s: %s", __func__, shm_backend->name, strerror(errno));
+        return ret;
+    }
+
+    if (fstat(fd, &st) == -1)
+    {
+        ret = -errno;
+        close(fd);
+        return ret;
+    }
+
+    shm_backend->map_size = st.st_size;
+    header = (struct shm_header_t*)mmap(0, shm_backend->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (header == MAP_FAILED)
+    {
+        ret = -errno;
+        logger_log(LOG_FATAL, "%s: could not map %s: %s", __func__, shm_backend->name, strerror(errno));
+        return ret;
+    }
+
+    ret = shm_check_header(header, shm_backend->map_size, shm_backend->name);
+    if ((ret == 0) && ((header->nb_channels != config->nb_channels) || (header->sample_rate != config->sample_rate) || (header->bit_fmt != (uint32_t)config->bit_fmt)))
+    {
+        logger_log(LOG_ERROR, "%s: %s stream is nb channels %u, sample rate %u, bit_fmt %s", __func__, shm_backend->name,
+            header->nb_channels, header->sample_rate, stream_print_bit_fmt(header->bit_fmt));
+        ret = -EINVAL;
+    }
+
+    if (ret < 0)
+    {
+        munmap(header, shm_backend->map_size);
+        return ret;
+    }
+
+    shm_backend->header     = header;
+    shm_backend->ring       = (char*)header + header->header_size;
+    /* start with what comes next, not with what is already in the ring */
+    shm_backend->read_index = __atomic_load_n(&header->write_index, __ATOMIC_ACQUIRE);
+
+    return 0;
+}
+
+int shm_open_segment(audio_backend_handle_t handle, char const* output_name, char const* stream_name, enum audio_direction direction, size_t buffer_size, struct stream_config_t const* config)
+{
+    int ret = 0;
+    struct shm_backend_t* const shm_backend = (struct shm_backend_t*)handle;
+
+    (void)stream_name;
+
+    if ((handle == 0) || (config == 0))
+    {
+        logger_log(LOG_FATAL, "%s: null pointer argument", __func__);
+        return -EINVAL;
+    }
+
+    ret = shm_get_name(shm_backend->name, &shm_backend->replace, output_name);
+    if (ret != 0)
+    {
+        return ret;
+    }
+
+    shm_backend->direction      = direction;
+    shm_backend->nb_overruns    = 0;
+    shm_backend->bytes_lost     = 0;
+    shm_backend->bytes_written  = 0;
+    shm_backend->nb_blocks      = 0;
+    shm_backend->nu_frame       = 0;
+
+    if (direction == AUDIO_OUT)
+    {
+        ret = shm_create(shm_backend, buffer_size, config);
+        /* blocks are copied straight into the ring */
+        shm_backend->parent.begin   = (ret == 0) ? shm_begin : 0;
+        shm_backend->parent.commit  = (ret == 0) ? shm_commit : 0;
+    }
+    else
+    {
+        ret = shm_attach(shm_backend, config);
+    }
+
+    return ret;
+}
+
+int shm_close_segment(audio_backend_handle_t handle)
+{
+    struct shm_backend_t* const shm_backend = (struct shm_backend_t*)handle;
+
+    if (handle == 0)
+    {
+        logger_log(LOG_FATAL, "%s: handle pointer is null", __func__);
+        return -EINVAL;
+    }
+
+    if (shm_backend->header == 0)
+    {
+        /** nothing to do */
+        return 0;
+    }
+
+    if (shm_backend->direction == AUDIO_OUT)
+    {
+        logger_log(LOG_INFO, "%s: %llu bytes written in %lu blocks", __func__, shm_backend->bytes_written, shm_backend->nb_blocks);
+
+        /* let the readers drain what is left and stop */
+        __atomic_store_n(&shm_backend->header->active, 0, __ATOMIC_RELEASE);
+        __atomic_add_fetch(&shm_backend->header->futex, 1, __ATOMIC_SEQ_CST);
+        shm_futex_wake(&shm_backend->header->futex);
+        munmap(shm_backend->header, shm_backend->map_size);
+        shm_unlink(shm_backend->name);
+    }
+    else
+    {
+        if (shm_backend->nb_overruns != 0)
+        {
+            logger_log(LOG_INFO, "%s: reader overrun %lu times, %llu bytes lost", __func__, shm_backend->nb_overruns, shm_backend->bytes_lost);
+        }
+        munmap(shm_backend->header, shm_backend->map_size);
+    }
+
+    shm_backend->header         = 0;
+    shm_backend->ring           = 0;
+    shm_backend->parent.begin   = 0;
+    shm_backend->parent.commit  = 0;
+
+    return 0;
+}
+
+int shm_begin(audio_backend_handle_t handle, char** data, size_t* size)
+{
+    struct shm_backend_t* const shm_backend = (struct shm_backend_t*)handle;
+    struct shm_header_t* const header = shm_backend->header;
+    size_t const offset = header->write_index % header->capacity;
+    size_t length = header->capacity - offset;
+
+    /* contiguous up to the end of the ring, and never more than the guard readers account for */
+    length = (length < header->guard) ? length : header->guard;
+    length = (length < *size) ? length : *size;
+
+    *data = shm_backend->ring + offset;
+    *size = length - (length % header->frame_size);
+
+    return 0;
+}
+
+int shm_commit(audio_backend_handle_t handle, size_t size)
+{
+    struct shm_backend_t* const shm_backend = (struct shm_backend_t*)handle;
+    struct shm_header_t* const header = shm_backend->header;
+
+    /* readers seeing the new write index see the frame counter of its packet too */
+    __atomic_store_n(&header->nu_frame, shm_backend->nu_frame, __ATOMIC_RELAXED);
+    __atomic_store_n(&header->write_index, header->write_index + size, __ATOMIC_RELEASE);
+    /* full barrier: the next block is not written before this one is published */
+    __atomic_add_fetch(&header->futex, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&header->nb_waiters, __ATOMIC_SEQ_CST) != 0)
+    {
+        shm_futex_wake(&header->futex);
+    }
+
+    shm_backend->bytes_written += size;
+    ++shm_backend->nb_blocks;
+
+    return 0;
+}
+
+int shm_write(audio_backend_handle_t handle, char const* data, size_t size)
+{
+    struct shm_backend_t* const shm_backend = (struct shm_backend_t*)handle;
+    size_t done = 0;
+    size_t length = 0;
+    char* area = 0;
+
+    if ((handle == 0) || (data == 0))
+    {
+        logger_log(LOG_ERROR, "%s: handle or data pointer is null", __func__);
+        return -EINVAL;
+    }
+
+    if (shm_backend->header == 0)
+    {
+        return -EBADF;
+    }
+
+    while (done != size)
+    {
+        length = size - done;
+        shm_begin(handle, &area, &length);
+        if (length == 0)
+        {
+            break;
+        }
+        memcpy(area, data + done, length);
+        shm_commit(handle, length);
+        done += length;
+    }
+
+    return done;
+}
+
+int shm_read(audio_backend_handle_t handle, char* data, size_t size)
+{
+    int ret = 0;
+    struct shm_backend_t* const shm_backend = (struct shm_backend_t*)handle;
+    struct shm_header_t* header;
+    uint64_t write_index;
+    uint32_t futex;
+    size_t length;
+    size_t offset;
+    size_t first;
+
+    if ((handle == 0) || (data == 0))
+    {
+        logger_log(LOG_ERROR, "%s: handle or data pointer is null", __func__);
+        return -EINVAL;
+    }
+
+    header = shm_backend->header;
+    if (header == 0)
+    {
+        return -EBADF;
+    }
+
+    while (1)
+    {
+        futex = __atomic_load_n(&header->futex, __ATOMIC_ACQUIRE);
+        write_index = __atomic_load_n(&header->write_index, __ATOMIC_ACQUIRE);
+
+        if (write_index - shm_backend->read_index > header->capacity - header->guard)
+        {
+            /* the producer went over what was not read yet: follow it again */
+            ++shm_backend->nb_overruns;
+            shm_backend->bytes_lost += write_index - shm_backend->read_index;
+            shm_backend->read_index = write_index;
+            logger_log(LOG_WARNING, "%s: reader overrun", __func__);
+        }
+
+        if (write_index != shm_backend->read_index)
+        {
+            length = write_index - shm_backend->read_index;
+            length = (length < size) ? length : size;
+            length -= length % header->frame_size;
+            if (length == 0)
+            {
+                logger_log(LOG_ERROR, "%s: buffer smaller than a frame", __func__);
+                return -EINVAL;
+            }
+
+            offset = shm_backend->read_index % header->capacity;
+            first = ((header->capacity - offset) < length) ? (header->capacity - offset) : length;
+            memcpy(data, shm_backend->ring + offset, first);
+            memcpy(data + first, shm_backend->ring, length - first);
+
+            /* the copy is only good if the producer did not come over it meanwhile */
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            write_index = __atomic_load_n(&header->write_index, __ATOMIC_ACQUIRE);
+            if (write_index - shm_backend->read_index > header->capacity - header->guard)
+            {
+                continue;
+            }
+
+            shm_backend->read_index += length;
+            return length;
+        }
+
+        if (!__atomic_load_n(&header->active, __ATOMIC_ACQUIRE))
+        {
+            /* producer stopped and everything has been read */
+            return 0;
+        }
+
+        if (shm_backend->nonblock)
+        {
+            return -EAGAIN;
+        }
+
+        __atomic_add_fetch(&header->nb_waiters, 1, __ATOMIC_SEQ_CST);
+        ret = shm_futex_wait(&header->futex, futex);
+        __atomic_sub_fetch(&header->nb_waiters, 1, __ATOMIC_SEQ_CST);
+        if (ret < 0)
+        {
+            return ret;
+        }
+    }
+}
@@ -0,0 +1,46 @@
+#ifndef __SHM_BACKEND_H__
+#define __SHM_BACKEND_H__
+
+#include <stdint.h>
+#include "audio_backend.h"
+
+/**
+ * Shared memory ring, for local processes to get a stream without going through a pipe or a file.
+ * vban_receptor (or any producer) creates the POSIX shared memory object given by -d (default SHM_NAME_DEFAULT)
+ * and writes into it without ever blocking. It refuses to take over an existing object unless -d is name,replace. Any number of readers map the same object and follow the
+ * write index on their own: they do not slow down the producer nor each other.
+ *
+ * Segment layout: a struct shm_header_t, then the ring data at header_size.
+ * Byte n of the stream is at ring offset n % capacity. The producer copies a block of at most guard bytes
+ * at write_index, then sets nu_frame, publishes the block by moving write_index, increments futex, and wakes
+ * the readers waiting on futex if nb_waiters is not 0.
+ * A reader copies data from its own index, then reads write_index again: the copy is valid if it
+ * is still within capacity - guard bytes of write_index, otherwise the producer went over it
+ * and the reader has to start again from write_index.
+ */
+#define SHM_BACKEND_NAME    "shm"
+#define SHM_NAME_DEFAULT    "/vban_0"
+#define SHM_MAGIC           0x4D534256  /* "VBSM" */
+#define SHM_VERSION         1
+
+struct shm_header_t
+{
+    uint32_t    magic;
+    uint32_t    version;
+    uint32_t    header_size;    /* offset of the ring data in the segment */
+    uint32_t    capacity;       /* ring size in bytes, whole frames */
+    uint32_t    guard;          /* bytes the producer may be writing past write_index */
+    uint32_t    sample_rate;
+    uint32_t    nb_channels;
+    uint32_t    bit_fmt;        /* enum VBanBitResolution */
+    uint32_t    frame_size;
+    uint32_t    active;         /* cleared by the producer when it stops */
+    uint64_t    write_index;    /* total number of bytes written */
+    uint32_t    nu_frame;       /* vban frame counter of the packet the last block comes from, 0 if unknown */
+    uint32_t    futex;          /* incremented for each block */
+    uint32_t    nb_waiters;     /* readers sleeping on futex */
+};
+
+int shm_backend_init(audio_backend_handle_t* handle);
+
+#endif /*__SHM_BACKEND_H__*/
@@ -0,0 +1,687 @@
+#define _GNU_SOURCE
+#include "wav_backend.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include "common/logger.h"
+
+/** size of the write buffer: the file is written (and its header updated) once per buffer */
+#define WAV_WRITE_BUFFER_SIZE   (1024 * 1024)
+#define WAV_WRITE_BUFFER_ALIGN  4096
+
+/** RIFF header, JUNK chunk reserving room for a ds64 chunk, extensible fmt chunk and data chunk header */
+#define WAV_DS64_SIZE           28
+#define WAV_FMT_SIZE            16
+#define WAV_FMT_EXT_SIZE        40
+#define WAV_HEADER_MAX_SIZE     (12 + 8 + WAV_DS64_SIZE + 8 + WAV_FMT_EXT_SIZE + 8)
+
+#define WAV_FORMAT_PCM          0x0001
+#define WAV_FORMAT_FLOAT        0x0003
+#define WAV_FORMAT_EXTENSIBLE   0xFFFE
+
+#define WAV_SIZE_MAX            0xFFFFFFFFu
+
+struct wav_backend_t
+{
+    struct audio_backend_t  parent;
+    int                     fd;
+    enum audio_direction    direction;
+    size_t                  frame_size;
+
+    /* write side */
+    int                     seekable;
+    char*                   buffer;
+    size_t                  buffer_fill;
+    uint64_t                data_size;
+    char                    header[WAV_HEADER_MAX_SIZE];
+    size_t                  header_size;
+
+    /* read side */
+    char*                   map;
+    size_t                  map_size;
+    size_t                  read_offset;
+    size_t                  data_end;
+};
+
+static int wav_open(audio_backend_handle_t handle, char const* output_name, char const* stream_name, enum audio_direction direction, size_t buffer_size, struct stream_config_t const* config);
+static int wav_close(audio_backend_handle_t handle);
+static int wav_write(audio_backend_handle_t handle, char const* data, size_t size);
+static int wav_read(audio_backend_handle_t handle, char* data, size_t size);
+static int wav_probe_config(audio_backend_handle_t handle, char const* output_name, struct stream_config_t* config);
+static int wav_query_caps(audio_backend_handle_t handle, char const* output_name, enum audio_direction direction, struct audio_caps_t* caps);
+
+static void put_le16(char* ptr, uint16_t value)
+{
+    ptr[0] = (char)(value & 0xFF);
+    ptr[1] = (char)(value >> 8);
+}
+
+static void put_le32(char* ptr, uint32_t value)
+{
+    put_le16(ptr, (uint16_t)(value & 0xFFFF));
+    put_le16(ptr + 2, (uint16_t)(value >> 16));
+}
+
+static void put_le64(char* ptr, uint64_t value)
+{
+    put_le32(ptr, (uint32_t)(value & WAV_SIZE_MAX));
+    put_le32(ptr + 4, (uint32_t)(value >> 32));
+}
+
+static uint16_t get_le16(char const* ptr)
+{
+    return (uint16_t)((unsigned char)ptr[0] | ((unsigned char)ptr[1] << 8));
+}
+
+static uint32_t get_le32(char const* ptr)
+{
+    return (uint32_t)get_le16(ptr) | ((uint32_t)get_le16(ptr + 2) << 16);
+}
+
+static uint64_t get_le64(char const* ptr)
+{
+    return (uint64_t)get_le32(ptr) | ((uint64_t)get_le32(ptr + 4) << 32);
+}
+
+static int wav_format_from_bit_fmt(enum VBanBitResolution bit_fmt, uint16_t* format, uint16_t* bits)
+{
+    switch (bit_fmt)
+    {
+        case VBAN_BITFMT_16_INT:
+        case VBAN_BITFMT_24_INT:
+        case VBAN_BITFMT_32_INT:
+            *format = WAV_FORMAT_PCM;
+            break;
+
+        case VBAN_BITFMT_32_FLOAT:
+        case VBAN_BITFMT_64_FLOAT:
+            *format = WAV_FORMAT_FLOAT;
+            break;
+
+        /* 8 bits wav samples are unsigned, vban ones are signed */
+        case VBAN_BITFMT_8_INT:
+        case VBAN_BITFMT_12_INT:
+        case VBAN_BITFMT_10_INT:
+        default:
+            return -EINVAL;
+    }
+
+    *bits = (uint16_t)(VBanBitResolutionSize[bit_fmt] * 8);
+    return 0;
+}
+
+static int wav_format_to_bit_fmt(uint16_t format, uint16_t bits, enum VBanBitResolution* bit_fmt)
+{
+    if ((format == WAV_FORMAT_PCM) && (bits == 16))
+        *bit_fmt = VBAN_BITFMT_16_INT;
+    else if ((format == WAV_FORMAT_PCM) && (bits == 24))
+        *bit_fmt = VBAN_BITFMT_24_INT;
+    else if ((format == WAV_FORMAT_PCM) && (bits == 32))
+        *bit_fmt = VBAN_BITFMT_32_INT;
+    else if ((format == WAV_FORMAT_FLOAT) && (bits == 32))
+        *bit_fmt = VBAN_BITFMT_32_FLOAT;
+    else if ((format == WAV_FORMAT_FLOAT) && (bits == 64))
+        *bit_fmt = VBAN_BITFMT_64_FLOAT;
+    else
+        return -EINVAL;
+
+    return 0;
+}
+
+/**
+ * Build the header of a new file. The sizes are set by wav_update_header.
+ */
+static void wav_build_header(struct wav_backend_t* wav_backend, struct stream_config_t const* config, uint16_t format, uint16_t bits)
+{
+    char* ptr = wav_backend->header;
+    int const extensible = (config->nb_channels > 2) || (bits > 16);
+    static char const subformat_guid[14] = { 0x00, 0x00, 0x00, 0x00, 0x10, 0x00, (char)0x80, 0x00, 0x00, (char)0xAA, 0x00, 0x38, (char)0x9B, 0x71 };
+
+    memset(wav_backend->header, 0, sizeof(wav_backend->header));
+
+    memcpy(ptr, "RIFF", 4);
+    memcpy(ptr + 8, "WAVE", 4);
+    ptr += 12;
+
+    /* becomes a ds64 chunk if the file ever grows over 4GB */
+    memcpy(ptr, "JUNK", 4);
+    put_le32(ptr + 4, WAV_DS64_SIZE);
+    ptr += 8 + WAV_DS64_SIZE;
+
+    memcpy(ptr, "fmt ", 4);
+    put_le32(ptr + 4, extensible ? WAV_FMT_EXT_SIZE : WAV_FMT_SIZE);
+    put_le16(ptr + 8, extensible ? WAV_FORMAT_EXTENSIBLE : format);
+    put_le16(ptr + 10, (uint16_t)config->nb_channels);
+    put_le32(ptr + 12, config->sample_rate);
+    put_le32(ptr + 16, (uint32_t)(config->sample_rate * wav_backend->frame_size));
+    put_le16(ptr + 20, (uint16_t)wav_backend->frame_size);
+    put_le16(ptr + 22, bits);
+    if (extensible)
+    {
+        put_le16(ptr + 24, 22);
+        put_le16(ptr + 26, bits);
+        put_le32(ptr + 28, 0);
+        put_le16(ptr + 32, format);
+        memcpy(ptr + 34, subformat_guid, sizeof(subformat_guid));
+        ptr += 8 + WAV_FMT_EXT_SIZE;
+    }
+    else
+    {
+        ptr += 8 + WAV_FMT_SIZE;
+    }
+
+    memcpy(ptr, "data", 4);
+    ptr += 8;
+
+    wav_backend->header_size = ptr - wav_backend->header;
+}
+
+/**
+ * Set the sizes in the header, switching to RF64 when they do not fit in 32 bits anymore.
+ * When the output can not be seeked, sizes are left to the maximum value, as streaming writers do.
+ */
+static void wav_update_header(struct wav_backend_t* wav_backend)
+{
+    char* const header = wav_backend->header;
+    char* const data_chunk = header + wav_backend->header_size - 8;
+    uint64_t const riff_size = wav_backend->header_size - 8 + wav_backend->data_size + (wav_backend->data_size & 1);
+
+    if (!wav_backend->seekable)
+    {
+        put_le32(header + 4, WAV_SIZE_MAX);
+        put_le32(data_chunk + 4, WAV_SIZE_MAX);
+    }
+    else if (riff_size < WAV_SIZE_MAX)
+    {
+        put_le32(header + 4, (uint32_t)riff_size);
+        put_le32(data_chunk + 4, (uint32_t)wav_backend->data_size);
+    }
+    else
+    {
+        memcpy(header, "RF64", 4);
+        put_le32(header + 4, WAV_SIZE_MAX);
+        memcpy(header + 12, "ds64", 4);
+        put_le64(header + 20, riff_size);
+        put_le64(header + 28, wav_backend->data_size);
+        put_le64(header + 36, wav_backend->data_size / wav_backend->frame_size);
+        put_le32(header + 44, 0);
+        put_le32(data_chunk + 4, WAV_SIZE_MAX);
+    }
+}
+
+static int wav_write_all(int fd, char const* data, size_t size)
+{
+    ssize_t ret;
+
+    while (size != 0)
+    {
+        ret = write(fd, data, size);
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+        data += ret;
+        size -= ret;
+    }
+
+    return 0;
+}
+
+static int wav_flush(struct wav_backend_t* wav_backend)
+{
+    int ret;
+
+    ret = wav_write_all(wav_backend->fd, wav_backend->buffer, wav_backend->buffer_fill);
+    if (ret < 0)
+    {
+        logger_log(LOG_ERROR, "%s: write failed: %s", __func__, strerror(-ret));
+        return ret;
+    }
+
+    wav_backend->data_size += wav_backend->buffer_fill;
+    wav_backend->buffer_fill = 0;
+
+    /* header is only rewritten here, once per buffer, so that the file stays readable if we get killed */
+    if (wav_backend->seekable)
+    {
+        wav_update_header(wav_backend);
+        if (pwrite(wav_backend->fd, wav_backend->header, wav_backend->header_size, 0) != (ssize_t)wav_backend->header_size)
+        {
+            logger_log(LOG_WARNING, "%s: could not update header: %s", __func__, strerror(errno));
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Find the format and the data chunk of a mapped file.
+ */
+static int wav_parse(char const* map, size_t map_size, struct stream_config_t* config, size_t* data_offset, size_t* data_size)
+{
+    size_t pos = 12;
+    uint32_t chunk_size;
+    uint64_t ds64_data_size = 0;
+    int has_ds64 = 0;
+    int has_fmt = 0;
+    uint16_t format = 0;
+    uint16_t bits = 0;
+
+    if ((map_size < 12) || (memcmp(map, "RIFF", 4) && memcmp(map, "RF64", 4)) || memcmp(map + 8, "WAVE", 4))
+    {
+        logger_log(LOG_ERROR, "%s: not a wav file", __func__);
+        return -EINVAL;
+    }
+
+    while (pos + 8 <= map_size)
+    {
+        chunk_size = get_le32(map + pos + 4);
+
+        if (!memcmp(map + pos, "ds64", 4) && (chunk_size >= 16) && (pos + 8 + 16 <= map_size))
+        {
+            ds64_data_size = get_le64(map + pos + 16);
+            has_ds64 = 1;
+        }
+        else if (!memcmp(map + pos, "fmt ", 4) && (chunk_size >= WAV_FMT_SIZE) && (pos + 8 + chunk_size <= map_size))
+        {
+            format              = get_le16(map + pos + 8);
+            config->nb_channels = get_le16(map + pos + 10);
+            config->sample_rate = get_le32(map + pos + 12);
+            bits                = get_le16(map + pos + 22);
+            if ((format == WAV_FORMAT_EXTENSIBLE) && (chunk_size >= WAV_FMT_EXT_SIZE))
+            {
+                format = get_le16(map + pos + 32);
+            }
+            has_fmt = 1;
+        }
+        else if (!memcmp(map + pos, "data", 4))
+        {
+            *data_offset = pos + 8;
+            if ((chunk_size == WAV_SIZE_MAX) && has_ds64)
+            {
+                *data_size = ds64_data_size;
+            }
+            else
+            {
+                *data_size = chunk_size;
+            }
+
+            /* streamed or truncated file: take what is there */
+            if ((chunk_size == WAV_SIZE_MAX && !has_ds64) || (*data_offset + *data_size > map_size))
+            {
+                *data_size = map_size - *data_offset;
+            }
+            break;
+        }
+
+        if (chunk_size == WAV_SIZE_MAX)
+        {
+            break;
+        }
+        pos += 8 + chunk_size + (chunk_size & 1);
+    }
+
+    if (!has_fmt || (*data_offset == 0))
+    {
+        logger_log(LOG_ERROR, "%s: missing fmt or data chunk", __func__);
+        return -EINVAL;
+    }
+
+    if ((wav_format_to_bit_fmt(format, bits, &config->bit_fmt) != 0)
+        || (config->nb_channels == 0) || (config->nb_channels > VBAN_CHANNELS_MAX_NB))
+    {
+        logger_log(LOG_ERROR, "%s: unsupported format %u, %u bits, %u channels", __func__, format, bits, config->nb_channels);
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+static int wav_map(char const* output_name, char** map, size_t* map_size)
+{
+    int fd;
+    struct stat st;
+
+    fd = open(output_name, O_RDONLY);
+    if (fd == -1)
+    {
+        logger_log(LOG_ERROR, "%s: could not open %s: %s", __func__, output_name, strerror(errno));
+        return -errno;
+    }
+
+    if ((fstat(fd, &st) != 0) || (st.st_size == 0))
+    {
+        logger_log(LOG_ERROR, "%s: %s is empty or can not be stat", __func__, output_name);
+        close(fd);
+        return -EINVAL;
+    }
+
+    *map_size = st.st_size;
+    *map = mmap(0, *map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    /* the mapping keeps the file referenced */
+    close(fd);
+
+    if (*map == MAP_FAILED)
+    {
+        *map = 0;
+        logger_log(LOG_ERROR, "%s: mmap failed: %s", __func__, strerror(errno));
+        return -errno;
+    }
+
+    madvise(*map, *map_size, MADV_SEQUENTIAL);
+
+    return 0;
+}
+
+int wav_backend_init(audio_backend_handle_t* handle)
+{
+    struct wav_backend_t* wav_backend = 0;
+
+    if (handle == 0)
+    {
+        logger_log(LOG_FATAL, "%s: null handle pointer", __func__);
+        return -EINVAL;
+    }
+
+    wav_backend = calloc(1, sizeof(struct wav_backend_t));
+    if (wav_backend == 0)
+    {
+        logger_log(LOG_FATAL, "%s: could not allocate memory", __func__);
+        return -ENOMEM;
+    }
+
+    wav_backend->parent.open                = wav_open;
+    wav_backend->parent.close               = wav_close;
+    wav_backend->parent.write               = wav_write;
+    wav_backend->parent.read                = wav_read;
+    wav_backend->parent.probe_config        = wav_probe_config;
+    wav_backend->parent.query_caps          = wav_query_caps;
+    wav_backend->fd                         = -1;
+
+    *handle = (audio_backend_handle_t)wav_backend;
+
+    return 0;
+}
+
+int wav_query_caps(audio_backend_handle_t handle, char const* output_name, enum audio_direction direction, struct audio_caps_t* caps)
+{
+    enum VBanBitResolution bit_fmt;
+    uint16_t format = 0;
+    uint16_t bits = 0;
+
+    (void)handle;
+    (void)output_name;
+    (void)direction;
+
+    if (caps == 0)
+    {
+        logger_log(LOG_FATAL, "%s: null caps pointer", __func__);
+        return -EINVAL;
+    }
+
+    caps->formats = 0;
+    for (bit_fmt = VBAN_BITFMT_8_INT; bit_fmt != VBAN_BIT_RESOLUTION_MAX; ++bit_fmt)
+    {
+        if (wav_format_from_bit_fmt(bit_fmt, &format, &bits) == 0)
+        {
+            caps->formats |= AUDIO_CAPS_FORMAT(bit_fmt);
+        }
+    }
+
+    /* a file is read or written as fast as it is asked */
+    caps->has_clock = 0;
+
+    return 0;
+}
+
+int wav_probe_config(audio_backend_handle_t handle, char const* output_name, struct stream_config_t* config)
+{
+    int ret;
+    char* map = 0;
+    size_t map_size = 0;
+    size_t data_offset = 0;
+    size_t data_size = 0;
+
+    if ((handle == 0) || (config == 0))
+    {
+        logger_log(LOG_ERROR, "%s: handle or config pointer is null", __func__);
+        return -EINVAL;
+    }
+
+    ret = wav_map(output_name, &map, &map_size);
+    if (ret < 0)
+    {
+        return ret;
+    }
+
+    ret = wav_parse(map, map_size, config, &data_offset, &data_size);
+    munmap(map, map_size);
+
+    return ret;
+}
+
+int wav_open(audio_backend_handle_t handle, char const* output_name, char const* stream_name, enum audio_direction direction, size_t buffer_size, struct stream_config_t const* config)
+{
+    int ret;
+    struct wav_backend_t* const wav_backend = (struct wav_backend_t*)handle;
+    struct stream_config_t file_config;
+    size_t data_offset = 0;
+    size_t data_size = 0;
+    uint16_t format = 0;
+    uint16_t bits = 0;
+
+    (void)stream_name;
+    (void)buffer_size;
+
+    if (handle == 0)
+    {
+        logger_log(LOG_FATAL, "%s: handle pointer is null", __func__);
+        return -EINVAL;
+    }
+
+    wav_backend->direction  = direction;
+    wav_backend->frame_size = VBanBitResolutionSize[config->bit_fmt] * config->nb_channels;
+
+    if (direction == AUDIO_IN)
+    {
+        if (output_name[0] == '\0')
+        {
+            logger_log(LOG_ERROR, "%s: a file name is needed to read from", __func__);
+            return -EINVAL;
+        }
+
+        ret = wav_map(output_name, &wav_backend->map, &wav_backend->map_size);
+        if (ret < 0)
+        {
+            return ret;
+        }
+
+        ret = wav_parse(wav_backend->map, wav_backend->map_size, &file_config, &data_offset, &data_size);
+        if ((ret == 0) && ((file_config.nb_channels != config->nb_channels)
+            || (file_config.sample_rate != config->sample_rate)
+            || (file_config.bit_fmt != config->bit_fmt)))
+        {
+            logger_log(LOG_ERROR, "%s: stream config does not match %s header", __func__, output_name);
+            ret = -EINVAL;
+        }
+
+        if (ret < 0)
+        {
+            wav_close(handle);
+            return ret;
+        }
+
+        wav_backend->read_offset = data_offset;
+        wav_backend->data_end    = data_offset + data_size - (data_size % wav_backend->frame_size);
+
+        logger_log(LOG_INFO, "%s: %s has %lu frames", __func__, output_name, (unsigned long)(data_size / wav_backend->frame_size));
+        return 0;
+    }
+
+    if (wav_format_from_bit_fmt(config->bit_fmt, &format, &bits) != 0)
+    {
+        logger_log(LOG_ERROR, "%s: format %s can not be stored in a wav file", __func__, stream_print_bit_fmt(config->bit_fmt));
+        return -EINVAL;
+    }
+
+    if (output_name[0] != '\0')
+    {
+        wav_backend->fd = open(output_name, O_CREAT|O_WRONLY|O_TRUNC, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP);
+        if (wav_backend->fd == -1)
+        {
+            logger_log(LOG_FATAL, "%s: could not open %s: %s", __func__, output_name, strerror(errno));
+            return -errno;
+        }
+    }
+    else
+    {
+        wav_backend->fd = STDOUT_FILENO;
+    }
+
+    wav_backend->seekable = (lseek(wav_backend->fd, 0, SEEK_CUR) != (off_t)-1);
+
+    ret = posix_memalign((void**)&wav_backend->buffer, WAV_WRITE_BUFFER_ALIGN, WAV_WRITE_BUFFER_SIZE);
+    if (ret != 0)
+    {
+        logger_log(LOG_FATAL, "%s: could not allocate memory", __func__);
+        wav_backend->buffer = 0;
+        wav_close(handle);
+        return -ret;
+    }
+
+    wav_backend->buffer_fill = 0;
+    wav_backend->data_size   = 0;
+    wav_build_header(wav_backend, config, format, bits);
+    wav_update_header(wav_backend);
+
+    ret = wav_write_all(wav_backend->fd, wav_backend->header, wav_backend->header_size);
+    if (ret < 0)
+    {
+        logger_log(LOG_ERROR, "%s: could not write header: %s", __func__, strerror(-ret));
+        wav_close(handle);
+        return ret;
+    }
+
+    return 0;
+}
+
+int wav_close(audio_backend_handle_t handle)
+{
+    int ret = 0;
+    struct wav_backend_t* const wav_backend = (struct wav_backend_t*)handle;
+    char const pad = 0;
+
+    if (handle == 0)
+    {
+        logger_log(LOG_FATAL, "%s: handle pointer is null", __func__);
+        return -EINVAL;
+    }
+
+    if (wav_backend->map != 0)
+    {
+        munmap(wav_backend->map, wav_backend->map_size);
+        wav_backend->map = 0;
+    }
+
+    if (wav_backend->fd != -1)
+    {
+        if (wav_backend->buffer != 0)
+        {
+            ret = wav_flush(wav_backend);
+            /* chunks are word aligned */
+            if ((ret == 0) && (wav_backend->data_size & 1))
+            {
+                wav_write_all(wav_backend->fd, &pad, 1);
+            }
+        }
+
+        if (wav_backend->fd != STDOUT_FILENO)
+        {
+            close(wav_backend->fd);
+        }
+        wav_backend->fd = -1;
+    }
+
+    free(wav_backend->buffer);
+    wav_backend->buffer = 0;
+
+    return ret;
+}
+
+int wav_write(audio_backend_handle_t handle, char const* data, size_t size)
+{
+    int ret = 0;
+    struct wav_backend_t* const wav_backend = (struct wav_backend_t*)handle;
+    size_t const total = size;
+    size_t chunk;
+
+    if ((handle == 0) || (data == 0))
+    {
+        logger_log(LOG_ERROR, "%s: handle or data pointer is null", __func__);
+        return -EINVAL;
+    }
+
+    if (wav_backend->buffer == 0)
+    {
+        logger_log(LOG_ERROR, "%s: file not open", __func__);
+        return -ENODEV;
+    }
+
+    while (size != 0)
+    {
+        chunk = WAV_WRITE_BUFFER_SIZE - wav_backend->buffer_fill;
+        chunk = (chunk < size) ? chunk : size;
+        memcpy(wav_backend->buffer + wav_backend->buffer_fill, data, chunk);
+        wav_backend->buffer_fill += chunk;
+        data += chunk;
+        size -= chunk;
+
+        if (wav_backend->buffer_fill == WAV_WRITE_BUFFER_SIZE)
+        {
+            ret = wav_flush(wav_backend);
+            if (ret < 0)
+            {
+                return ret;
+            }
+        }
+    }
+
+    return total;
+}
+
+int wav_read(audio_backend_handle_t handle, char* data, size_t size)
+{
+    struct wav_backend_t* const wav_backend = (struct wav_backend_t*)handle;
+    size_t available;
+
+    if ((handle == 0) || (data == 0))
+    {
+        logger_log(LOG_ERROR, "%s: handle or data pointer is null", __func__);
+        return -EINVAL;
+    }
+
+    if (wav_backend->map == 0)
+    {
+        logger_log(LOG_ERROR, "%s: file not open", __func__);
+        return -ENODEV;
+    }
+
+    /* whole frames only, 0 at end of file */
+    available = wav_backend->data_end - wav_backend->read_offset;
+    size -= size % wav_backend->frame_size;
+    size = (size < available) ? size : available;
+
+    memcpy(data, wav_backend->map + wav_backend->read_offset, size);
+    wav_backend->read_offset += size;
+
+    return size;
+}
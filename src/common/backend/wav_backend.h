@@ -0,0 +1,9 @@
+#ifndef __WAV_BACKEND_H__
+#define __WAV_BACKEND_H__
+
+#include "audio_backend.h"
+
+#define WAV_BACKEND_NAME    "wav"
+int wav_backend_init(audio_backend_handle_t* handle);
+
+#endif /*__WAV_BACKEND_H__*/
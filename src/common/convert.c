@@ -0,0 +1,532 @@
+/*
+ *  This file is part of vban.
+ *  Copyright (c) 2015 by Benoît Quiniou <quiniouben@yahoo.fr>
+ *
+ *  vban is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  vban is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with vban.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "convert.h"
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/** largest float strictly below 1.0: keeps the 32 bits integer conversion from overflowing */
+#define CONVERT_FLOAT_MAX       0.99999994f
+#define CONVERT_FLOAT_MIN       -1.0f
+
+#define CONVERT_SCALE_8         128.0f
+#define CONVERT_SCALE_16        32768.0f
+#define CONVERT_SCALE_24        8388608.0f
+#define CONVERT_SCALE_32        2147483648.0f
+
+static inline float convert_clamp(float value)
+{
+    /* written so that NaN ends up on the max side instead of propagating */
+    return (value < CONVERT_FLOAT_MAX) ? ((value > CONVERT_FLOAT_MIN) ? value : CONVERT_FLOAT_MIN) : CONVERT_FLOAT_MAX;
+}
+
+static inline int32_t convert_round(float value)
+{
+    return (int32_t)((value < 0.0f) ? (value - 0.5f) : (value + 0.5f));
+}
+
+static inline int32_t convert_saturate(int32_t value, int32_t min, int32_t max)
+{
+    return (value < min) ? min : ((value > max) ? max : value);
+}
+
+static inline void convert_store_s24(char* ptr, int32_t value)
+{
+    ptr[0] = (char)(value & 0xFF);
+    ptr[1] = (char)((value >> 8) & 0xFF);
+    ptr[2] = (char)((value >> 16) & 0xFF);
+}
+
+static inline int32_t convert_load_s24(char const* ptr)
+{
+    return (int32_t)(((uint32_t)(unsigned char)ptr[0] << 8) | ((uint32_t)(unsigned char)ptr[1] << 16) | ((uint32_t)(unsigned char)ptr[2] << 24)) >> 8;
+}
+
+static inline int32_t convert_load_s16(char const* ptr)
+{
+    int16_t value;
+    memcpy(&value, ptr, sizeof(int16_t));
+    return value;
+}
+
+static inline int32_t convert_load_s32(char const* ptr)
+{
+    int32_t value;
+    memcpy(&value, ptr, sizeof(int32_t));
+    return value;
+}
+
+#if defined(__SSE2__)
+/** number of samples converted per simd iteration */
+#define CONVERT_SIMD_BLOCK      4
+
+static inline __m128i convert_load_epi32(float const* in, __m128 scale)
+{
+    __m128 value = _mm_loadu_ps(in);
+    value = _mm_min_ps(_mm_max_ps(value, _mm_set1_ps(CONVERT_FLOAT_MIN)), _mm_set1_ps(CONVERT_FLOAT_MAX));
+    return _mm_cvtps_epi32(_mm_mul_ps(value, scale));
+}
+#endif
+
+static void interleave_s8(char* out, float const* in, size_t stride, size_t nb_frames)
+{
+    size_t frame = 0;
+    int8_t value;
+#if defined(__SSE2__)
+    __m128 const scale = _mm_set1_ps(CONVERT_SCALE_8);
+    int32_t block[CONVERT_SIMD_BLOCK];
+    size_t index;
+
+    for (; frame + CONVERT_SIMD_BLOCK <= nb_frames; frame += CONVERT_SIMD_BLOCK)
+    {
+        _mm_storeu_si128((__m128i*)block, convert_load_epi32(in + frame, scale));
+        for (index = 0; index != CONVERT_SIMD_BLOCK; ++index, out += stride)
+        {
+            *out = (char)convert_saturate(block[index], INT8_MIN, INT8_MAX);
+        }
+    }
+#endif
+    for (; frame != nb_frames; ++frame, out += stride)
+    {
+        value = (int8_t)convert_saturate(convert_round(convert_clamp(in[frame]) * CONVERT_SCALE_8), INT8_MIN, INT8_MAX);
+        *out = (char)value;
+    }
+}
+
+static void interleave_s16(char* out, float const* in, size_t stride, size_t nb_frames)
+{
+    size_t frame = 0;
+    int16_t value;
+#if defined(__SSE2__)
+    __m128 const scale = _mm_set1_ps(CONVERT_SCALE_16);
+    int16_t block[2 * CONVERT_SIMD_BLOCK];
+    size_t index;
+
+    for (; frame + (2 * CONVERT_SIMD_BLOCK) <= nb_frames; frame += 2 * CONVERT_SIMD_BLOCK)
+    {
+        /* packs saturates 32768 (that 1.0 rounds to) back to 32767 */
+        _mm_storeu_si128((__m128i*)block, _mm_packs_epi32(convert_load_epi32(in + frame, scale),
+            convert_load_epi32(in + frame + CONVERT_SIMD_BLOCK, scale)));
+        for (index = 0; index != 2 * CONVERT_SIMD_BLOCK; ++index, out += stride)
+        {
+            memcpy(out, &block[index], sizeof(int16_t));
+        }
+    }
+#endif
+    for (; frame != nb_frames; ++frame, out += stride)
+    {
+        value = (int16_t)convert_saturate(convert_round(convert_clamp(in[frame]) * CONVERT_SCALE_16), INT16_MIN, INT16_MAX);
+        memcpy(out, &value, sizeof(int16_t));
+    }
+}
+
+static void interleave_s24(char* out, float const* in, size_t stride, size_t nb_frames)
+{
+    size_t frame = 0;
+#if defined(__SSE2__)
+    __m128 const scale = _mm_set1_ps(CONVERT_SCALE_24);
+    int32_t block[CONVERT_SIMD_BLOCK];
+    size_t index;
+
+    for (; frame + CONVERT_SIMD_BLOCK <= nb_frames; frame += CONVERT_SIMD_BLOCK)
+    {
+        _mm_storeu_si128((__m128i*)block, convert_load_epi32(in + frame, scale));
+        for (index = 0; index != CONVERT_SIMD_BLOCK; ++index, out += stride)
+        {
+            convert_store_s24(out, convert_saturate(block[index], -(1 << 23), (1 << 23) - 1));
+        }
+    }
+#endif
+    for (; frame != nb_frames; ++frame, out += stride)
+    {
+        convert_store_s24(out, convert_saturate(convert_round(convert_clamp(in[frame]) * CONVERT_SCALE_24), -(1 << 23), (1 << 23) - 1));
+    }
+}
+
+static void interleave_s32(char* out, float const* in, size_t stride, size_t nb_frames)
+{
+    size_t frame = 0;
+    int32_t value;
+#if defined(__SSE2__)
+    __m128 const scale = _mm_set1_ps(CONVERT_SCALE_32);
+    int32_t block[CONVERT_SIMD_BLOCK];
+    size_t index;
+
+    for (; frame + CONVERT_SIMD_BLOCK <= nb_frames; frame += CONVERT_SIMD_BLOCK)
+    {
+        _mm_storeu_si128((__m128i*)block, convert_load_epi32(in + frame, scale));
+        for (index = 0; index != CONVERT_SIMD_BLOCK; ++index, out += stride)
+        {
+            memcpy(out, &block[index], sizeof(int32_t));
+        }
+    }
+#endif
+    for (; frame != nb_frames; ++frame, out += stride)
+    {
+        value = convert_round(convert_clamp(in[frame]) * CONVERT_SCALE_32);
+        memcpy(out, &value, sizeof(int32_t));
+    }
+}
+
+static void interleave_f32(char* out, float const* in, size_t stride, size_t nb_frames)
+{
+    size_t frame;
+
+    if (stride == sizeof(float))
+    {
+        memcpy(out, in, nb_frames * sizeof(float));
+        return;
+    }
+
+    for (frame = 0; frame != nb_frames; ++frame, out += stride)
+    {
+        memcpy(out, &in[frame], sizeof(float));
+    }
+}
+
+static void interleave_f64(char* out, float const* in, size_t stride, size_t nb_frames)
+{
+    size_t frame;
+    double value;
+
+    for (frame = 0; frame != nb_frames; ++frame, out += stride)
+    {
+        value = (double)in[frame];
+        memcpy(out, &value, sizeof(double));
+    }
+}
+
+#if defined(__SSE2__)
+/** gather CONVERT_SIMD_BLOCK strided integer samples with @p load, scale them and store them as floats */
+#define CONVERT_DEINTERLEAVE_SIMD(_load, _scale)                                                    \
+    do                                                                                              \
+    {                                                                                               \
+        __m128 const scale = _mm_set1_ps(1.0f / (_scale));                                          \
+        for (; frame + CONVERT_SIMD_BLOCK <= nb_frames; frame += CONVERT_SIMD_BLOCK)                \
+        {                                                                                           \
+            __m128i const value = _mm_setr_epi32(_load(in), _load(in + stride),                     \
+                _load(in + (2 * stride)), _load(in + (3 * stride)));                                \
+            _mm_storeu_ps(out + frame, _mm_mul_ps(_mm_cvtepi32_ps(value), scale));                  \
+            in += CONVERT_SIMD_BLOCK * stride;                                                      \
+        }                                                                                           \
+    } while (0)
+#else
+#define CONVERT_DEINTERLEAVE_SIMD(_load, _scale)
+#endif
+
+static inline int32_t convert_load_s8(char const* ptr)
+{
+    return (int8_t)*ptr;
+}
+
+static void deinterleave_s8(float* out, char const* in, size_t stride, size_t nb_frames)
+{
+    size_t frame = 0;
+
+    CONVERT_DEINTERLEAVE_SIMD(convert_load_s8, CONVERT_SCALE_8);
+    for (; frame != nb_frames; ++frame, in += stride)
+    {
+        out[frame] = (float)convert_load_s8(in) * (1.0f / CONVERT_SCALE_8);
+    }
+}
+
+static void deinterleave_s16(float* out, char const* in, size_t stride, size_t nb_frames)
+{
+    size_t frame = 0;
+
+    CONVERT_DEINTERLEAVE_SIMD(convert_load_s16, CONVERT_SCALE_16);
+    for (; frame != nb_frames; ++frame, in += stride)
+    {
+        out[frame] = (float)convert_load_s16(in) * (1.0f / CONVERT_SCALE_16);
+    }
+}
+
+static void deinterleave_s24(float* out, char const* in, size_t stride, size_t nb_frames)
+{
+    size_t frame = 0;
+
+    CONVERT_DEINTERLEAVE_SIMD(convert_load_s24, CONVERT_SCALE_24);
+    for (; frame != nb_frames; ++frame, in += stride)
+    {
+        out[frame] = (float)convert_load_s24(in) * (1.0f / CONVERT_SCALE_24);
+    }
+}
+
+static void deinterleave_s32(float* out, char const* in, size_t stride, size_t nb_frames)
+{
+    size_t frame = 0;
+
+    CONVERT_DEINTERLEAVE_SIMD(convert_load_s32, CONVERT_SCALE_32);
+    for (; frame != nb_frames; ++frame, in += stride)
+    {
+        out[frame] = (float)convert_load_s32(in) * (1.0f / CONVERT_SCALE_32);
+    }
+}
+
+static inline float convert_load_f32(char const* ptr)
+{
+    float value;
+    memcpy(&value, ptr, sizeof(float));
+    return value;
+}
+
+static void deinterleave_f32(float* out, char const* in, size_t stride, size_t nb_frames)
+{
+    size_t frame = 0;
+
+    if (stride == sizeof(float))
+    {
+        memcpy(out, in, nb_frames * sizeof(float));
+        return;
+    }
+
+#if defined(__SSE2__)
+    for (; frame + CONVERT_SIMD_BLOCK <= nb_frames; frame += CONVERT_SIMD_BLOCK)
+    {
+        _mm_storeu_ps(out + frame, _mm_setr_ps(convert_load_f32(in), convert_load_f32(in + stride),
+            convert_load_f32(in + (2 * stride)), convert_load_f32(in + (3 * stride))));
+        in += CONVERT_SIMD_BLOCK * stride;
+    }
+#endif
+    for (; frame != nb_frames; ++frame, in += stride)
+    {
+        out[frame] = convert_load_f32(in);
+    }
+}
+
+static void deinterleave_f64(float* out, char const* in, size_t stride, size_t nb_frames)
+{
+    size_t frame;
+    double value;
+
+    for (frame = 0; frame != nb_frames; ++frame, in += stride)
+    {
+        memcpy(&value, in, sizeof(double));
+        out[frame] = (float)value;
+    }
+}
+
+int convert_is_supported(enum VBanBitResolution bit_fmt)
+{
+    switch (bit_fmt)
+    {
+        case VBAN_BITFMT_8_INT:
+        case VBAN_BITFMT_16_INT:
+        case VBAN_BITFMT_24_INT:
+        case VBAN_BITFMT_32_INT:
+        case VBAN_BITFMT_32_FLOAT:
+        case VBAN_BITFMT_64_FLOAT:
+            return 1;
+
+        case VBAN_BITFMT_12_INT:
+        case VBAN_BITFMT_10_INT:
+        default:
+            return 0;
+    }
+}
+
+int convert_interleave_from_float(char* dst, enum VBanBitResolution bit_fmt, float const* const* src, size_t offset, size_t nb_channels, size_t nb_frames)
+{
+    size_t channel;
+    size_t sample_size;
+    size_t stride;
+    char* out;
+    float const* in;
+
+    if ((dst == 0) || (src == 0) || !convert_is_supported(bit_fmt))
+    {
+        return -EINVAL;
+    }
+
+    sample_size = VBanBitResolutionSize[bit_fmt];
+    stride      = sample_size * nb_channels;
+
+    /* the format switch is hoisted out of the sample loops: one kernel call per channel */
+    for (channel = 0; channel != nb_channels; ++channel)
+    {
+        out = dst + (channel * sample_size);
+        in  = src[channel] + offset;
+
+        switch (bit_fmt)
+        {
+            case VBAN_BITFMT_8_INT:
+                interleave_s8(out, in, stride, nb_frames);
+                break;
+
+            case VBAN_BITFMT_16_INT:
+                interleave_s16(out, in, stride, nb_frames);
+                break;
+
+            case VBAN_BITFMT_24_INT:
+                interleave_s24(out, in, stride, nb_frames);
+                break;
+
+            case VBAN_BITFMT_32_INT:
+                interleave_s32(out, in, stride, nb_frames);
+                break;
+
+            case VBAN_BITFMT_32_FLOAT:
+                interleave_f32(out, in, stride, nb_frames);
+                break;
+
+            case VBAN_BITFMT_64_FLOAT:
+            default:
+                interleave_f64(out, in, stride, nb_frames);
+                break;
+        }
+    }
+
+    return 0;
+}
+
+int convert_deinterleave_to_float(float* const* dst, size_t offset, char const* src, enum VBanBitResolution bit_fmt, size_t nb_channels, size_t nb_frames)
+{
+    size_t channel;
+    size_t sample_size;
+    size_t stride;
+    float* out;
+    char const* in;
+
+    if ((dst == 0) || (src == 0) || !convert_is_supported(bit_fmt))
+    {
+        return -EINVAL;
+    }
+
+    sample_size = VBanBitResolutionSize[bit_fmt];
+    stride      = sample_size * nb_channels;
+
+    for (channel = 0; channel != nb_channels; ++channel)
+    {
+        out = dst[channel] + offset;
+        in  = src + (channel * sample_size);
+
+        switch (bit_fmt)
+        {
+            case VBAN_BITFMT_8_INT:
+                deinterleave_s8(out, in, stride, nb_frames);
+                break;
+
+            case VBAN_BITFMT_16_INT:
+                deinterleave_s16(out, in, stride, nb_frames);
+                break;
+
+            case VBAN_BITFMT_24_INT:
+                deinterleave_s24(out, in, stride, nb_frames);
+                break;
+
+            case VBAN_BITFMT_32_INT:
+                deinterleave_s32(out, in, stride, nb_frames);
+                break;
+
+            case VBAN_BITFMT_32_FLOAT:
+                deinterleave_f32(out, in, stride, nb_frames);
+                break;
+
+            case VBAN_BITFMT_64_FLOAT:
+            default:
+                deinterleave_f64(out, in, stride, nb_frames);
+                break;
+        }
+    }
+
+    return 0;
+}
+
+int convert_interleave_segments(struct convert_segment_t const* segments, char* bounce, enum VBanBitResolution bit_fmt, float const* const* src, size_t nb_channels, size_t nb_frames)
+{
+    size_t frame_size;
+    size_t count;
+    size_t rest;
+    char* second;
+
+    if ((segments == 0) || (bounce == 0) || !convert_is_supported(bit_fmt))
+    {
+        return -EINVAL;
+    }
+
+    frame_size = VBanBitResolutionSize[bit_fmt] * nb_channels;
+    if ((frame_size == 0) || ((segments[0].len + segments[1].len) < (nb_frames * frame_size)))
+    {
+        return -EINVAL;
+    }
+
+    count = segments[0].len / frame_size;
+    if (count >= nb_frames)
+    {
+        return convert_interleave_from_float(segments[0].buf, bit_fmt, src, 0, nb_channels, nb_frames);
+    }
+
+    convert_interleave_from_float(segments[0].buf, bit_fmt, src, 0, nb_channels, count);
+
+    second = segments[1].buf;
+    rest = segments[0].len - (count * frame_size);
+    if (rest != 0)
+    {
+        convert_interleave_from_float(bounce, bit_fmt, src, count, nb_channels, 1);
+        memcpy(segments[0].buf + (count * frame_size), bounce, rest);
+        memcpy(second, bounce + rest, frame_size - rest);
+        second += frame_size - rest;
+        ++count;
+    }
+
+    return convert_interleave_from_float(second, bit_fmt, src, count, nb_channels, nb_frames - count);
+}
+
+int convert_deinterleave_segments(float* const* dst, struct convert_segment_t const* segments, char* bounce, enum VBanBitResolution bit_fmt, size_t nb_channels, size_t nb_frames)
+{
+    size_t frame_size;
+    size_t count;
+    size_t rest;
+    char const* second;
+
+    if ((segments == 0) || (bounce == 0) || !convert_is_supported(bit_fmt))
+    {
+        return -EINVAL;
+    }
+
+    frame_size = VBanBitResolutionSize[bit_fmt] * nb_channels;
+    if ((frame_size == 0) || ((segments[0].len + segments[1].len) < (nb_frames * frame_size)))
+    {
+        return -EINVAL;
+    }
+
+    count = segments[0].len / frame_size;
+    if (count >= nb_frames)
+    {
+        return convert_deinterleave_to_float(dst, 0, segments[0].buf, bit_fmt, nb_channels, nb_frames);
+    }
+
+    convert_deinterleave_to_float(dst, 0, segments[0].buf, bit_fmt, nb_channels, count);
+
+    second = segments[1].buf;
+    rest = segments[0].len - (count * frame_size);
+    if (rest != 0)
+    {
+        memcpy(bounce, segments[0].buf + (count * frame_size), rest);
+        memcpy(bounce + rest, second, frame_size - rest);
+        convert_deinterleave_to_float(dst, count, bounce, bit_fmt, nb_channels, 1);
+        second += frame_size - rest;
+        ++count;
+    }
+
+    return convert_deinterleave_to_float(dst, count, second, bit_fmt, nb_channels, nb_frames - count);
+}
@@ -0,0 +1,92 @@
+/*
+ *  This file is part of vban.
+ *  Copyright (c) 2015 by Benoît Quiniou <quiniouben@yahoo.fr>
+ *
+ *  vban is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  vban is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with vban.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __CONVERT_H__
+#define __CONVERT_H__
+
+#include <stddef.h>
+#include "vban/vban.h"
+
+/**
+ * Sample conversion kernels between interleaved vban pcm data and planar float buffers.
+ * Integer formats are scaled to [-1.0, 1.0[ by 2^(bits-1), float values are clamped
+ * when converted back to integer formats.
+ * These functions do not allocate and do not log, so they are safe to be used from
+ * a realtime audio callback.
+ */
+
+/**
+ * Check if a bit format can be handled by the conversion kernels
+ * @param bit_fmt sample format
+ * @return 1 if supported, 0 otherwise
+ */
+int convert_is_supported(enum VBanBitResolution bit_fmt);
+
+/**
+ * Convert planar float buffers to interleaved samples of @p bit_fmt
+ * @param dst pointer to interleaved destination, big enough for @p nb_frames frames
+ * @param bit_fmt destination sample format
+ * @param src array of @p nb_channels planar float buffers
+ * @param offset index of the first frame to convert in each planar buffer
+ * @param nb_channels number of channels
+ * @param nb_frames number of frames to convert
+ * @return 0 upon success, negative value otherwise
+ */
+int convert_interleave_from_float(char* dst, enum VBanBitResolution bit_fmt, float const* const* src, size_t offset, size_t nb_channels, size_t nb_frames);
+
+/**
+ * Convert interleaved samples of @p bit_fmt to planar float buffers
+ * @param dst array of @p nb_channels planar float buffers
+ * @param offset index of the first frame to write in each planar buffer
+ * @param src pointer to interleaved source data
+ * @param bit_fmt source sample format
+ * @param nb_channels number of channels
+ * @param nb_frames number of frames to convert
+ * @return 0 upon success, negative value otherwise
+ */
+int convert_deinterleave_to_float(float* const* dst, size_t offset, char const* src, enum VBanBitResolution bit_fmt, size_t nb_channels, size_t nb_frames);
+
+/**
+ * A contiguous part of a ring buffer
+ */
+struct convert_segment_t
+{
+    char*   buf;
+    size_t  len;
+};
+
+/**
+ * Interleave @p nb_frames frames into the two segments of a ring buffer write vector.
+ * Whole frames are converted in place in each segment, the frame that wraps from the first
+ * segment to the second one goes through @p bounce.
+ * @param segments the 2 segments to fill, at least @p nb_frames frames long all together
+ * @param bounce scratch buffer of at least one frame
+ * @return 0 upon success, negative value otherwise
+ */
+int convert_interleave_segments(struct convert_segment_t const* segments, char* bounce, enum VBanBitResolution bit_fmt, float const* const* src, size_t nb_channels, size_t nb_frames);
+
+/**
+ * Deinterleave @p nb_frames frames from the two segments of a ring buffer read vector.
+ * Same wrap handling than convert_interleave_segments.
+ * @param segments the 2 segments to read, at least @p nb_frames frames long all together
+ * @param bounce scratch buffer of at least one frame
+ * @return 0 upon success, negative value otherwise
+ */
+int convert_deinterleave_segments(float* const* dst, struct convert_segment_t const* segments, char* bounce, enum VBanBitResolution bit_fmt, size_t nb_channels, size_t nb_frames);
+
+#endif /*__CONVERT_H__*/
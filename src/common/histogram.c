@@ -0,0 +1,111 @@
+/*
+ *  This file is part of vban.
+ *  Copyright (c) 2015 by Benoît Quiniou <quiniouben@yahoo.fr>
+ *
+ *  vban is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  vban is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with vban.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "histogram.h"
+
+static size_t histogram_index(unsigned long value)
+{
+    unsigned int msb = HISTOGRAM_SUB_BITS + 1;
+
+    if (value >> (HISTOGRAM_SUB_BITS + 1) == 0)
+    {
+        return value;
+    }
+
+    if (value > HISTOGRAM_VALUE_MAX)
+    {
+        value = HISTOGRAM_VALUE_MAX;
+    }
+
+    while ((value >> (msb + 1)) != 0)
+    {
+        ++msb;
+    }
+
+    /* the 32 buckets of the octave starting at 2^msb */
+    return (2u << HISTOGRAM_SUB_BITS) + (msb - HISTOGRAM_SUB_BITS - 1) * (1u << HISTOGRAM_SUB_BITS)
+        + ((value >> (msb - HISTOGRAM_SUB_BITS)) - (1u << HISTOGRAM_SUB_BITS));
+}
+
+static unsigned long histogram_highest_value(size_t index)
+{
+    size_t octave;
+    size_t sub;
+    unsigned int shift;
+
+    if (index < (2u << HISTOGRAM_SUB_BITS))
+    {
+        return index;
+    }
+
+    octave  = (index - (2u << HISTOGRAM_SUB_BITS)) >> HISTOGRAM_SUB_BITS;
+    sub     = (index - (2u << HISTOGRAM_SUB_BITS)) & ((1u << HISTOGRAM_SUB_BITS) - 1);
+    shift   = octave + 1;
+
+    return ((((1ul << HISTOGRAM_SUB_BITS) + sub + 1) << shift) - 1);
+}
+
+void histogram_record(struct histogram_t* histogram, unsigned long value)
+{
+    unsigned int* const bucket = &histogram->buckets[histogram_index(value)];
+
+    /* single writer: plain increments, only made atomic for the readers */
+    __atomic_store_n(bucket, __atomic_load_n(bucket, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&histogram->sum, __atomic_load_n(&histogram->sum, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+    __atomic_store_n(&histogram->count, __atomic_load_n(&histogram->count, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+}
+
+unsigned long histogram_quantile(struct histogram_t const* histogram, double quantile)
+{
+    size_t index;
+    unsigned long total = 0;
+    unsigned long seen = 0;
+    unsigned long rank;
+
+    /* the buckets, not count, which may be ahead or behind of them while recording goes on */
+    for (index = 0; index != HISTOGRAM_BUCKETS_NB; ++index)
+    {
+        total += __atomic_load_n(&histogram->buckets[index], __ATOMIC_RELAXED);
+    }
+
+    if (total == 0)
+    {
+        return 0;
+    }
+
+    rank = (unsigned long)(quantile * (double)total + 0.5);
+    if (rank == 0)
+    {
+        rank = 1;
+    }
+    else if (rank > total)
+    {
+        rank = total;
+    }
+
+    for (index = 0; index != HISTOGRAM_BUCKETS_NB; ++index)
+    {
+        seen += __atomic_load_n(&histogram->buckets[index], __ATOMIC_RELAXED);
+        if (seen >= rank)
+        {
+            break;
+        }
+    }
+
+    return histogram_highest_value(index);
+}
@@ -0,0 +1,58 @@
+/*
+ *  This file is part of vban.
+ *  Copyright (c) 2015 by Benoît Quiniou <quiniouben@yahoo.fr>
+ *
+ *  vban is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  vban is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with vban.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __HISTOGRAM_H__
+#define __HISTOGRAM_H__
+
+#include <stddef.h>
+
+/**
+ * Log-linear histogram of durations in microseconds, in the spirit of HDR histograms:
+ * values below 64 are counted exactly, above each power of 2 is split in 32 buckets,
+ * so a value is known within about 3%. Values beyond HISTOGRAM_VALUE_MAX (about 67 s) are counted as it.
+ * Recording is a few relaxed atomic operations without any fence, cheap enough to be always on.
+ * Each histogram must have only one thread recording into it; any thread can read it.
+ */
+#define HISTOGRAM_SUB_BITS      5
+#define HISTOGRAM_MAX_BITS      26
+#define HISTOGRAM_VALUE_MAX     ((1ul << HISTOGRAM_MAX_BITS) - 1)
+#define HISTOGRAM_BUCKETS_NB    ((2u << HISTOGRAM_SUB_BITS) + (HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS - 1) * (1u << HISTOGRAM_SUB_BITS))
+
+struct histogram_t
+{
+    unsigned long               count;
+    unsigned long long          sum;
+    unsigned int                buckets[HISTOGRAM_BUCKETS_NB];
+};
+
+/**
+ * Count a value. Only one thread may record into a given histogram.
+ * @param histogram histogram to update
+ * @param value duration in microseconds
+ */
+void histogram_record(struct histogram_t* histogram, unsigned long value);
+
+/**
+ * Value below which a proportion of the recorded values are (highest value of its bucket)
+ * @param histogram histogram to read
+ * @param quantile proportion, between 0 and 1 (0.99 for the 99th percentile)
+ * @return value in microseconds, 0 if nothing was recorded
+ */
+unsigned long histogram_quantile(struct histogram_t const* histogram, double quantile);
+
+#endif /*__HISTOGRAM_H__*/
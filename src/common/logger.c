@@ -1,45 +1,267 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <signal.h>
+#include <pthread.h>
+#include <semaphore.h>
 #include "logger.h"
 
-enum LogLevel LoggerOutputLevel = LOG_ERROR;
- 
-void logger_set_output_level(enum LogLevel level)
+/* messages are queued in a bounded multi-producer ring: each producer claims a slot by advancing
+   LoggerWriteIndex, formats into it, then publishes it through the slot sequence number.
+   Only the logger thread reads, so nobody ever waits on another thread nor on stdio */
+struct logger_message_t
 {
-    LoggerOutputLevel = level;
-}
+    size_t                  sequence;
+    enum LogLevel           level;
+    char                    text[LOGGER_MESSAGE_SIZE];
+};
 
-void logger_log(enum LogLevel msgLevel, const char* format, ... )
-{
-	va_list args;
-	FILE* const output = (msgLevel <= LOG_WARNING) ? stderr : stdout;
+enum LogLevel LoggerOutputLevel = LOG_ERROR;
 
-	if (msgLevel > LoggerOutputLevel) return;
-	
-	switch (msgLevel)
-	{
+static struct logger_message_t  LoggerMessages[LOGGER_MESSAGES_NB];
+static size_t                   LoggerWriteIndex = 0;
+static size_t                   LoggerReadIndex = 0;
+static unsigned long            LoggerNbDropped = 0;
+static int                      LoggerRunning = 0;
+static int                      LoggerStopping = 0;
+static int                      LoggerWaiting = 0;
+static int                      LoggerExitRegistered = 0;
+static pthread_t                LoggerThread;
+static sem_t                    LoggerReady;
+
+static char const* logger_prefix(enum LogLevel msgLevel)
+{
+    switch (msgLevel)
+    {
         case LOG_FATAL:
-            fprintf(output, "Fatal: ");
-            break;
+            return "Fatal: ";
         case LOG_ERROR:
-            fprintf(output, "Error: ");
-            break;
+            return "Error: ";
         case LOG_WARNING:
-            fprintf(output, "Warning: ");
-            break;
+            return "Warning: ";
         case LOG_INFO:
-            fprintf(output, "Info: ");
-            break;
+            return "Info: ";
         case LOG_DEBUG:
-            fprintf(output, "Debug: ");
-            break;
+            return "Debug: ";
         default:
-            return;
+            return 0;
     }
+}
+
+static void logger_print(enum LogLevel msgLevel, char const* text)
+{
+    FILE* const output = (msgLevel <= LOG_WARNING) ? stderr : stdout;
+    char const* const prefix = logger_prefix(msgLevel);
+
+    if (prefix == 0) return;
 
-	va_start(args, format);
-	vfprintf(output, format, args);
-	va_end(args);
-	fprintf(output, "\n" );
+    fprintf(output, "%s%s\n", prefix, text);
 }
 
+static int logger_flush(void)
+{
+    int nb = 0;
+    unsigned long nb_dropped;
+    struct logger_message_t* message;
+
+    for (;;)
+    {
+        message = &LoggerMessages[LoggerReadIndex % LOGGER_MESSAGES_NB];
+        if (__atomic_load_n(&message->sequence, __ATOMIC_ACQUIRE) != LoggerReadIndex + 1)
+        {
+            break;
+        }
+
+        logger_print(message->level, message->text);
+        __atomic_store_n(&message->sequence, LoggerReadIndex + LOGGER_MESSAGES_NB, __ATOMIC_RELEASE);
+        ++LoggerReadIndex;
+        ++nb;
+    }
+
+    nb_dropped = __atomic_exchange_n(&LoggerNbDropped, 0, __ATOMIC_RELAXED);
+    if (nb_dropped != 0)
+    {
+        fprintf(stderr, "Warning: %s: %lu messages dropped\n", __func__, nb_dropped);
+    }
+
+    if (nb != 0)
+    {
+        fflush(stdout);
+    }
+
+    return nb;
+}
+
+static int logger_pending(void)
+{
+    return __atomic_load_n(&LoggerMessages[LoggerReadIndex % LOGGER_MESSAGES_NB].sequence, __ATOMIC_SEQ_CST)
+        == LoggerReadIndex + 1;
+}
+
+static void* logger_thread(void* arg)
+{
+    (void)arg;
+
+    while (!__atomic_load_n(&LoggerStopping, __ATOMIC_ACQUIRE))
+    {
+        logger_flush();
+
+        __atomic_store_n(&LoggerWaiting, 1, __ATOMIC_SEQ_CST);
+        if (logger_pending() || __atomic_load_n(&LoggerStopping, __ATOMIC_SEQ_CST))
+        {
+            __atomic_store_n(&LoggerWaiting, 0, __ATOMIC_SEQ_CST);
+            continue;
+        }
+        sem_wait(&LoggerReady);
+    }
+
+    return 0;
+}
+
+static int logger_push(enum LogLevel msgLevel, const char* format, va_list args)
+{
+    size_t pos = __atomic_load_n(&LoggerWriteIndex, __ATOMIC_RELAXED);
+    struct logger_message_t* message;
+    intptr_t diff;
+
+    for (;;)
+    {
+        message = &LoggerMessages[pos % LOGGER_MESSAGES_NB];
+        diff = (intptr_t)__atomic_load_n(&message->sequence, __ATOMIC_ACQUIRE) - (intptr_t)pos;
+
+        if (diff == 0)
+        {
+            if (__atomic_compare_exchange_n(&LoggerWriteIndex, &pos, pos + 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                break;
+            }
+        }
+        else if (diff < 0)
+        {
+            /* full: the logger thread is late, better lose a message than block */
+            __atomic_add_fetch(&LoggerNbDropped, 1, __ATOMIC_RELAXED);
+            return -1;
+        }
+        else
+        {
+            pos = __atomic_load_n(&LoggerWriteIndex, __ATOMIC_RELAXED);
+        }
+    }
+
+    message->level = msgLevel;
+    vsnprintf(message->text, LOGGER_MESSAGE_SIZE, format, args);
+
+    /* sequentially consistent, so that the logger thread can not miss it after having said it waits */
+    __atomic_store_n(&message->sequence, pos + 1, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&LoggerWaiting, __ATOMIC_SEQ_CST) && __atomic_exchange_n(&LoggerWaiting, 0, __ATOMIC_SEQ_CST))
+    {
+        sem_post(&LoggerReady);
+    }
+
+    return 0;
+}
+
+void logger_set_output_level(enum LogLevel level)
+{
+    LoggerOutputLevel = level;
+}
+
+void logger_write(enum LogLevel msgLevel, const char* format, ... )
+{
+    va_list args;
+    FILE* output;
+    char const* prefix;
+
+    va_start(args, format);
+
+    if (__atomic_load_n(&LoggerRunning, __ATOMIC_ACQUIRE))
+    {
+        logger_push(msgLevel, format, args);
+        va_end(args);
+        return;
+    }
+
+    prefix = logger_prefix(msgLevel);
+    if (prefix != 0)
+    {
+        output = (msgLevel <= LOG_WARNING) ? stderr : stdout;
+        fputs(prefix, output);
+        vfprintf(output, format, args);
+        fputc('\n', output);
+    }
+
+    va_end(args);
+}
+
+int logger_start(void)
+{
+    size_t index;
+    int ret;
+#ifndef _WIN32
+    sigset_t mask;
+    sigset_t old_mask;
+#endif
+
+    if (LoggerRunning)
+    {
+        return 0;
+    }
+
+    for (index = 0; index != LOGGER_MESSAGES_NB; ++index)
+    {
+        LoggerMessages[index].sequence = LoggerWriteIndex + index;
+    }
+    LoggerReadIndex = LoggerWriteIndex;
+    LoggerStopping = 0;
+    LoggerWaiting = 0;
+    sem_init(&LoggerReady, 0, 0);
+
+#ifndef _WIN32
+    /* signals are for the main thread */
+    sigfillset(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+#endif
+
+    ret = pthread_create(&LoggerThread, 0, logger_thread, 0);
+
+#ifndef _WIN32
+    pthread_sigmask(SIG_SETMASK, &old_mask, 0);
+#endif
+
+    if (ret != 0)
+    {
+        sem_destroy(&LoggerReady);
+        logger_log(LOG_WARNING, "%s: could not create logger thread, messages are written directly", __func__);
+        return -ret;
+    }
+
+    if (!LoggerExitRegistered)
+    {
+        atexit(logger_stop);
+        LoggerExitRegistered = 1;
+    }
+
+    __atomic_store_n(&LoggerRunning, 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+void logger_stop(void)
+{
+    if (!__atomic_load_n(&LoggerRunning, __ATOMIC_ACQUIRE))
+    {
+        return;
+    }
+
+    __atomic_store_n(&LoggerRunning, 0, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&LoggerStopping, 1, __ATOMIC_SEQ_CST);
+    sem_post(&LoggerReady);
+    pthread_join(LoggerThread, 0);
+
+    /* what was queued while the thread was stopping */
+    logger_flush();
+    sem_destroy(&LoggerReady);
+}
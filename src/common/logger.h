@@ -28,8 +28,44 @@ enum LogLevel
     LOG_DEBUG
 };
 
+/**
+ * Maximum number of characters of a message, longer ones are truncated
+ */
+#define LOGGER_MESSAGE_SIZE     256
+
+/**
+ * Number of messages that can wait for the logger thread, more are dropped (and counted)
+ */
+#define LOGGER_MESSAGES_NB      256
+
+extern enum LogLevel LoggerOutputLevel;
+
 void logger_set_output_level(enum LogLevel level);
-void logger_log(enum LogLevel msgLevel, const char* format, ... );
 
-#endif /*__LOGGER_H__*/
+/**
+ * Log a message if its level is enabled.
+ * The level is checked at the call site, so a disabled message costs one branch and its arguments
+ * are not evaluated.
+ */
+#define logger_log(_level, ...) \
+    do { if ((_level) <= LoggerOutputLevel) logger_write((_level), __VA_ARGS__); } while (0)
 
+/**
+ * Write a message regardless of the output level. Use logger_log instead.
+ * Once logger_start succeeded, the message is only formatted and queued, the logger thread writes it.
+ */
+void logger_write(enum LogLevel msgLevel, const char* format, ... );
+
+/**
+ * Start the logger thread, so that logging never blocks the caller on stdio.
+ * Messages left are written at exit or by logger_stop.
+ * @return 0 upon success, negative value otherwise (messages are then written directly)
+ */
+int logger_start(void);
+
+/**
+ * Write the messages left and stop the logger thread. Messages are then written directly again.
+ */
+void logger_stop(void);
+
+#endif /*__LOGGER_H__*/
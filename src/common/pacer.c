@@ -0,0 +1,331 @@
+/*
+ *  This file is part of vban.
+ *  Copyright (c) 2015 by Benoît Quiniou <quiniouben@yahoo.fr>
+ *
+ *  vban is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  vban is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with vban.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include "pacer.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include "common/logger.h"
+#include "common/ringbuffer.h"
+#include "common/thread.h"
+
+/** read-ahead depth, in milliseconds of audio */
+#define PACER_READ_AHEAD_MS     500
+
+/** when the send timeline is late by more than this, it is restarted instead of sending a burst to catch up */
+#define PACER_LATE_MAX_NS       100000000LL
+
+#define NS_PER_S                1000000000LL
+
+/** how long the read-ahead thread waits for an idle source before checking if it has to stop */
+#define PACER_POLL_TIMEOUT_MS   100
+
+struct pacer_t
+{
+    audio_handle_t          audio;
+    ringbuffer_handle_t     ring_buffer;
+    size_t                  frame_size;
+    size_t                  packet_size;
+    unsigned int            sample_rate;
+
+    pthread_t               thread;
+    int                     thread_started;
+    int                     stop;
+    int                     end;
+    int                     end_status;
+    sem_t                   data_ready;
+    sem_t                   space_ready;
+    /* last device latency reported by the backend, set by the read-ahead thread */
+    unsigned long           device_latency_us;
+    int                     has_device_latency;
+
+    /* send timeline */
+    long long               start_ns;
+    unsigned long long      frames_released;
+    char*                   bounce;
+};
+
+static long long pacer_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((long long)ts.tv_sec * NS_PER_S) + ts.tv_nsec;
+}
+
+static void pacer_sleep_until(long long deadline_ns)
+{
+    struct timespec ts;
+
+    ts.tv_sec   = deadline_ns / NS_PER_S;
+    ts.tv_nsec  = deadline_ns % NS_PER_S;
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0) == EINTR)
+    {
+    }
+}
+
+/* wait for the source to have something to read, at most PACER_POLL_TIMEOUT_MS so that a stop is seen */
+static void pacer_wait_source(struct pacer_t* pacer)
+{
+    struct pollfd fds[AUDIO_POLL_FDS_MAX];
+    int nb_fds = audio_get_poll_fds(pacer->audio, fds, AUDIO_POLL_FDS_MAX);
+
+    /* a source that can not be polled is retried after the timeout */
+    poll(fds, (nb_fds > 0) ? nb_fds : 0, PACER_POLL_TIMEOUT_MS);
+}
+
+static void* pacer_read_ahead(void* arg)
+{
+    struct pacer_t* const pacer = (struct pacer_t*)arg;
+    struct ringbuffer_data_t vec[2];
+    unsigned long latency_us = 0;
+    int ret = 0;
+
+    while (!__atomic_load_n(&pacer->stop, __ATOMIC_ACQUIRE))
+    {
+        ringbuffer_get_write_vector(pacer->ring_buffer, vec);
+        if ((vec[0].len + vec[1].len) < pacer->packet_size)
+        {
+            sem_wait(&pacer->space_ready);
+            continue;
+        }
+
+        /* read straight into the ring buffer, unless the packet would wrap */
+        if (vec[0].len >= pacer->packet_size)
+        {
+            ret = audio_read(pacer->audio, vec[0].buf, pacer->packet_size);
+            if (ret > 0)
+            {
+                ringbuffer_write_advance(pacer->ring_buffer, ret);
+            }
+        }
+        else
+        {
+            ret = audio_read(pacer->audio, pacer->bounce, pacer->packet_size);
+            if (ret > 0)
+            {
+                ringbuffer_write(pacer->ring_buffer, pacer->bounce, ret);
+            }
+        }
+
+        if (ret == -EAGAIN)
+        {
+            pacer_wait_source(pacer);
+            continue;
+        }
+
+        if (ret <= 0)
+        {
+            break;
+        }
+
+        if (audio_get_latency(pacer->audio, &latency_us) == 0)
+        {
+            __atomic_store_n(&pacer->device_latency_us, latency_us, __ATOMIC_RELAXED);
+            __atomic_store_n(&pacer->has_device_latency, 1, __ATOMIC_RELEASE);
+        }
+
+        sem_post(&pacer->data_ready);
+    }
+
+    pacer->end_status = ret;
+    __atomic_store_n(&pacer->end, 1, __ATOMIC_RELEASE);
+    sem_post(&pacer->data_ready);
+
+    return 0;
+}
+
+int pacer_init(pacer_handle_t* handle, audio_handle_t audio, struct stream_config_t const* config, size_t packet_size)
+{
+    int ret = 0;
+    struct pacer_t* pacer = 0;
+    size_t ring_size;
+
+    if ((handle == 0) || (audio == 0) || (config == 0))
+    {
+        logger_log(LOG_FATAL, "%s: null pointer argument", __func__);
+        return -EINVAL;
+    }
+
+    pacer = calloc(1, sizeof(struct pacer_t));
+    if (pacer == 0)
+    {
+        logger_log(LOG_FATAL, "%s: could not allocate memory", __func__);
+        return -ENOMEM;
+    }
+
+    pacer->audio        = audio;
+    pacer->frame_size   = VBanBitResolutionSize[config->bit_fmt] * config->nb_channels;
+    pacer->sample_rate  = config->sample_rate;
+    pacer->packet_size  = packet_size - (packet_size % pacer->frame_size);
+
+    if ((pacer->frame_size == 0) || (pacer->sample_rate == 0) || (pacer->packet_size == 0))
+    {
+        logger_log(LOG_ERROR, "%s: invalid stream config", __func__);
+        free(pacer);
+        return -EINVAL;
+    }
+
+    ring_size = ((size_t)config->sample_rate * PACER_READ_AHEAD_MS / 1000) * pacer->frame_size;
+    ring_size = (ring_size > (4 * pacer->packet_size)) ? ring_size : (4 * pacer->packet_size);
+
+    pacer->bounce = malloc(pacer->packet_size);
+    ret = (pacer->bounce != 0) ? ringbuffer_init(&pacer->ring_buffer, ring_size) : -ENOMEM;
+    if (ret != 0)
+    {
+        logger_log(LOG_FATAL, "%s: could not allocate memory", __func__);
+        free(pacer->bounce);
+        free(pacer);
+        return ret;
+    }
+
+    sem_init(&pacer->data_ready, 0, 0);
+    sem_init(&pacer->space_ready, 0, 0);
+
+    ret = thread_start(&pacer->thread, pacer_read_ahead, pacer);
+    if (ret != 0)
+    {
+        logger_log(LOG_FATAL, "%s: could not create read-ahead thread", __func__);
+        *handle = pacer;
+        pacer_release(handle);
+        return ret;
+    }
+    pacer->thread_started = 1;
+
+    logger_log(LOG_INFO, "%s: %lu bytes read-ahead, %lu frames per packet", __func__,
+        (unsigned long)ring_size, (unsigned long)(pacer->packet_size / pacer->frame_size));
+
+    *handle = pacer;
+
+    return 0;
+}
+
+int pacer_release(pacer_handle_t* handle)
+{
+    if (handle == 0)
+    {
+        logger_log(LOG_FATAL, "%s: null handle pointer", __func__);
+        return -EINVAL;
+    }
+
+    if (*handle == 0)
+    {
+        return 0;
+    }
+
+    if ((*handle)->thread_started)
+    {
+        /* a non blocking source (an idle fifo) is polled with a timeout, so the thread sees the flag */
+        __atomic_store_n(&(*handle)->stop, 1, __ATOMIC_RELEASE);
+        sem_post(&(*handle)->space_ready);
+        pthread_join((*handle)->thread, 0);
+    }
+
+    sem_destroy(&(*handle)->data_ready);
+    sem_destroy(&(*handle)->space_ready);
+    ringbuffer_release(&(*handle)->ring_buffer);
+    free((*handle)->bounce);
+    free(*handle);
+    *handle = 0;
+
+    return 0;
+}
+
+int pacer_read(pacer_handle_t handle, char* data, size_t size)
+{
+    long long deadline_ns;
+    long long now_ns;
+    size_t ret;
+
+    if ((handle == 0) || (data == 0))
+    {
+        logger_log(LOG_FATAL, "%s: null pointer argument", __func__);
+        return -EINVAL;
+    }
+
+    size -= size % handle->frame_size;
+
+    /* wait for the data first: read-ahead latency at startup is not part of the timeline */
+    while ((ringbuffer_read_space(handle->ring_buffer) < size) && !__atomic_load_n(&handle->end, __ATOMIC_ACQUIRE))
+    {
+        if ((sem_wait(&handle->data_ready) != 0) && (errno == EINTR))
+        {
+            /* signal received, let the caller check if it has to stop */
+            return -EINTR;
+        }
+    }
+
+    now_ns = pacer_now();
+    if (handle->start_ns == 0)
+    {
+        handle->start_ns = now_ns;
+    }
+
+    /* split, so that frames_released * NS_PER_S does not overflow in long runs */
+    deadline_ns = handle->start_ns + (long long)(((handle->frames_released / handle->sample_rate) * NS_PER_S)
+        + (((handle->frames_released % handle->sample_rate) * NS_PER_S) / handle->sample_rate));
+    if ((now_ns - deadline_ns) > PACER_LATE_MAX_NS)
+    {
+        logger_log(LOG_WARNING, "%s: source is late by %lld ms, restarting timeline", __func__, (now_ns - deadline_ns) / 1000000);
+        handle->start_ns = now_ns;
+        handle->frames_released = 0;
+        deadline_ns = now_ns;
+    }
+
+    pacer_sleep_until(deadline_ns);
+
+    ret = ringbuffer_read(handle->ring_buffer, data, size);
+    sem_post(&handle->space_ready);
+
+    if ((ret == 0) && __atomic_load_n(&handle->end, __ATOMIC_ACQUIRE))
+    {
+        return handle->end_status;
+    }
+
+    handle->frames_released += ret / handle->frame_size;
+
+    return ret;
+}
+
+size_t pacer_get_depth(pacer_handle_t handle)
+{
+    return ringbuffer_read_space(handle->ring_buffer);
+}
+
+int pacer_get_latency(pacer_handle_t handle, unsigned long* latency_us)
+{
+    if ((handle == 0) || (latency_us == 0))
+    {
+        logger_log(LOG_FATAL, "%s: null pointer argument", __func__);
+        return -EINVAL;
+    }
+
+    if (!__atomic_load_n(&handle->has_device_latency, __ATOMIC_ACQUIRE))
+    {
+        return -ENOTSUP;
+    }
+
+    *latency_us = __atomic_load_n(&handle->device_latency_us, __ATOMIC_RELAXED);
+
+    return 0;
+}
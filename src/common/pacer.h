@@ -0,0 +1,78 @@
+/*
+ *  This file is part of vban.
+ *  Copyright (c) 2015 by Benoît Quiniou <quiniouben@yahoo.fr>
+ *
+ *  vban is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  vban is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with vban.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __PACER_H__
+#define __PACER_H__
+
+#include <stddef.h>
+#include "common/audio.h"
+
+/**
+ * Clock paced audio source.
+ * A read-ahead thread reads the audio device as fast as it can into a buffer, and pacer_read
+ * gives the samples back at the stream sample rate, one call per packet. Deadlines are absolute,
+ * computed from the number of frames released since the first call, so they do not drift.
+ * Used by vban_emitter for sources that are not clocked themselves (file, pipe, wav backends).
+ */
+struct pacer_t;
+typedef struct pacer_t* pacer_handle_t;
+
+/**
+ * Create the pacer and start its read-ahead thread
+ * @param handle handle pointer that will be allocated
+ * @param audio audio object to read from. It must not be read by anybody else afterwards.
+ *        It should be non blocking (audio_config_t nonblock), or the read-ahead thread only stops once a read returns
+ * @param config stream configuration, as returned by audio_get_stream_config
+ * @param packet_size size of the packet payload that will be asked to pacer_read
+ * @return 0 upon success, negative value otherwise
+ */
+int pacer_init(pacer_handle_t* handle, audio_handle_t audio, struct stream_config_t const* config, size_t packet_size);
+
+/**
+ * Stop the read-ahead thread and release the pacer
+ * @param handle handle pointer that will be released
+ * @return 0 upon success, negative value otherwise
+ */
+int pacer_release(pacer_handle_t* handle);
+
+/**
+ * Wait for the deadline of the next packet and read it
+ * @param handle object handle
+ * @param data buffer to fill
+ * @param size size of the buffer
+ * @return size read (0 at the end of the source), negative value otherwise
+ */
+int pacer_read(pacer_handle_t handle, char* data, size_t size);
+
+/**
+ * Get the number of bytes read ahead and not given by pacer_read yet
+ * @param handle object handle
+ * @return number of bytes
+ */
+size_t pacer_get_depth(pacer_handle_t handle);
+
+/**
+ * Get the latency of the audio device itself, as last reported by the backend to the read-ahead thread.
+ * It does not include the read-ahead, see pacer_get_depth.
+ * @param handle object handle
+ * @param latency_us latency in microseconds
+ * @return 0 upon success, -ENOTSUP if the backend did not tell, negative value otherwise
+ */
+int pacer_get_latency(pacer_handle_t handle, unsigned long* latency_us);
+
+#endif /*__PACER_H__*/
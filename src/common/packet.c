@@ -22,10 +22,13 @@
 #include <string.h>
 #include "common/logger.h"
 
-static int packet_pcm_check(char const* buffer, size_t size);
+static int packet_pcm_check(char const* buffer, size_t size, enum packet_invalid* reason);
 static size_t vban_sr_from_value(unsigned int value);
 
-int packet_check(char const* streamname, char const* buffer, size_t size)
+#define PACKET_REJECT(_reason_ptr, _reason) \
+    do { if ((_reason_ptr) != 0) *(_reason_ptr) = (_reason); return -EINVAL; } while (0)
+
+int packet_check(char const* streamname, char const* buffer, size_t size, enum packet_invalid* reason)
 {
     struct VBanHeader const* const hdr = PACKET_HEADER_PTR(buffer);
     enum VBanProtocol protocol = VBAN_PROTOCOL_UNDEFINED_4;
@@ -40,26 +43,26 @@ int packet_check(char const* streamname, char const* buffer, size_t size)
     if (size <= VBAN_HEADER_SIZE)
     {
         logger_log(LOG_WARNING, "%s: packet too small", __func__);
-        return -EINVAL;
+        PACKET_REJECT(reason, PACKET_INVALID_SIZE);
     }
 
     if (hdr->vban != VBAN_HEADER_FOURC)
     {
         logger_log(LOG_WARNING, "%s: invalid vban magic fourc", __func__);
-        return -EINVAL;
+        PACKET_REJECT(reason, PACKET_INVALID_MAGIC);
     }
 
     if (strncmp(streamname, hdr->streamname, VBAN_STREAM_NAME_SIZE))
     {
         logger_log(LOG_DEBUG, "%s: different streamname", __func__);
-        return -EINVAL;
+        PACKET_REJECT(reason, PACKET_INVALID_STREAM);
     }
 
     /** check the reserved bit : it must be 0 */
     if (hdr->format_bit & VBAN_RESERVED_MASK)
     {
         logger_log(LOG_WARNING, "%s: reserved format bit invalid value", __func__);
-        return -EINVAL;
+        PACKET_REJECT(reason, PACKET_INVALID_FORMAT);
     }
 
     /** check protocol and codec */
@@ -69,7 +72,11 @@ int packet_check(char const* streamname, char const* buffer, size_t size)
     switch (protocol)
     {
         case VBAN_PROTOCOL_AUDIO:
-            return (codec == VBAN_CODEC_PCM) ? packet_pcm_check(buffer, size) : -EINVAL;
+            if (codec != VBAN_CODEC_PCM)
+            {
+                PACKET_REJECT(reason, PACKET_INVALID_PROTOCOL);
+            }
+            return packet_pcm_check(buffer, size, reason);
 
         case VBAN_PROTOCOL_SERIAL:
         case VBAN_PROTOCOL_TXT:
@@ -78,15 +85,15 @@ int packet_check(char const* streamname, char const* buffer, size_t size)
         case VBAN_PROTOCOL_UNDEFINED_3:
         case VBAN_PROTOCOL_UNDEFINED_4:
             /** not supported yet */
-            return -EINVAL;
+            PACKET_REJECT(reason, PACKET_INVALID_PROTOCOL);
 
         default:
             logger_log(LOG_ERROR, "%s: packet with unknown protocol", __func__);
-            return -EINVAL;
+            PACKET_REJECT(reason, PACKET_INVALID_PROTOCOL);
     }
 }
 
-static int packet_pcm_check(char const* buffer, size_t size)
+static int packet_pcm_check(char const* buffer, size_t size, enum packet_invalid* reason)
 {
     /** the packet is already a valid vban packet and buffer already checked before */
 
@@ -104,13 +111,13 @@ static int packet_pcm_check(char const* buffer, size_t size)
     if (bit_resolution >= VBAN_BIT_RESOLUTION_MAX)
     {
         logger_log(LOG_WARNING, "%s: invalid bit resolution", __func__);
-        return -EINVAL;
+        PACKET_REJECT(reason, PACKET_INVALID_FORMAT);
     }
 
     if (sample_rate >= VBAN_SR_MAXNUMBER)
     {
         logger_log(LOG_WARNING, "%s: invalid sample rate", __func__);
-        return -EINVAL;
+        PACKET_REJECT(reason, PACKET_INVALID_FORMAT);
     }
 
     sample_size = VBanBitResolutionSize[bit_resolution];
@@ -119,7 +126,7 @@ static int packet_pcm_check(char const* buffer, size_t size)
     if (payload_size != (size - VBAN_HEADER_SIZE))
     {
         logger_log(LOG_WARNING, "%s: invalid payload size, expected %d, got %d", __func__, payload_size, (size - VBAN_HEADER_SIZE));
-        return -EINVAL;
+        PACKET_REJECT(reason, PACKET_INVALID_SIZE);
     }
     
     return 0;
@@ -167,6 +174,7 @@ int packet_get_stream_config(char const* buffer, struct stream_config_t* stream_
     stream_config->nb_channels  = hdr->format_nbc + 1;
     stream_config->sample_rate  = VBanSRList[hdr->format_SR & VBAN_SR_MASK];
     stream_config->bit_fmt      = hdr->format_bit & VBAN_BIT_RESOLUTION_MASK;
+    stream_config->nb_samples   = hdr->format_nbs + 1;
 
     return 0;
 }
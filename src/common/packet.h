@@ -23,14 +23,28 @@
 #include "vban/vban.h"
 #include "stream.h"
 
+/**
+ * Reasons for packet_check to reject a packet
+ */
+enum packet_invalid
+{
+    PACKET_INVALID_SIZE,        /* too small, or payload size not matching the header */
+    PACKET_INVALID_MAGIC,       /* not a vban packet */
+    PACKET_INVALID_STREAM,      /* other stream name */
+    PACKET_INVALID_FORMAT,      /* reserved bit set, unknown bit resolution or sample rate */
+    PACKET_INVALID_PROTOCOL,    /* not audio pcm */
+    PACKET_INVALID_MAX
+};
+
 /**
  * Check packet content and only return valid return value if this is an audio pcm packet
  * @param streamname string pointer holding streamname
  * @param buffer pointer to data to check
  * @param size of the data in buffer;
+ * @param reason filled with the reason of the rejection, if not null
  * @return 0 if packet is valid, negative value otherwise
  */
-int packet_check(char const* streamname, char const* buffer, size_t size);
+int packet_check(char const* streamname, char const* buffer, size_t size, enum packet_invalid* reason);
 
 /** Return VBanHeader pointer from buffer */
 #define PACKET_HEADER_PTR(_buffer) ((struct VBanHeader*)_buffer)
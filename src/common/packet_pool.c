@@ -0,0 +1,162 @@
+/*
+ *  This file is part of vban.
+ *  Copyright (c) 2015 by Benoît Quiniou <quiniouben@yahoo.fr>
+ *
+ *  vban is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  vban is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with vban.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "packet_pool.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include "common/logger.h"
+
+#define PACKET_POOL_PAD(_size)  ((PACKET_POOL_CACHE_LINE - ((_size) % PACKET_POOL_CACHE_LINE)) % PACKET_POOL_CACHE_LINE)
+
+/* the free stack head packs the index + 1 of the top packet (0 if empty) in its low half, and a tag
+   in its high half, incremented by each change: a thread that read the head before a packet was taken
+   and put back (ABA) fails its compare and swap */
+#define PACKET_POOL_INDEX_MASK  0xFFFFFFFFull
+#define PACKET_POOL_TAG_ONE     (PACKET_POOL_INDEX_MASK + 1)
+
+struct packet_pool_t
+{
+    uint64_t            head;
+    size_t              nb_packets;
+    size_t              stride;
+    char*               packets;
+    char*               memory;
+};
+
+#define PACKET_POOL_PACKET(_pool, _index)   ((struct packet_t*)((_pool)->packets + ((_index) * (_pool)->stride)))
+
+static unsigned int packet_pool_index(struct packet_pool_t const* pool, struct packet_t const* packet)
+{
+    return (unsigned int)(((char const*)packet - pool->packets) / pool->stride);
+}
+
+int packet_pool_init(packet_pool_handle_t* handle, size_t nb_packets)
+{
+    size_t index = 0;
+    struct packet_pool_t* pool = 0;
+
+    if (handle == 0)
+    {
+        logger_log(LOG_FATAL, "%s: null handle pointer", __func__);
+        return -EINVAL;
+    }
+
+    if ((nb_packets == 0) || (nb_packets >= PACKET_POOL_INDEX_MASK))
+    {
+        logger_log(LOG_ERROR, "%s: invalid number of packets %zu", __func__, nb_packets);
+        return -EINVAL;
+    }
+
+    pool = calloc(1, sizeof(struct packet_pool_t));
+    if (pool == 0)
+    {
+        logger_log(LOG_FATAL, "%s: could not allocate memory", __func__);
+        return -ENOMEM;
+    }
+
+    pool->stride = sizeof(struct packet_t) + PACKET_POOL_PAD(sizeof(struct packet_t));
+    pool->memory = calloc(1, (nb_packets * pool->stride) + PACKET_POOL_CACHE_LINE);
+    if (pool->memory == 0)
+    {
+        logger_log(LOG_FATAL, "%s: could not allocate memory", __func__);
+        free(pool);
+        return -ENOMEM;
+    }
+
+    pool->packets = pool->memory + PACKET_POOL_PAD((uintptr_t)pool->memory);
+    pool->nb_packets = nb_packets;
+
+    /* stack them all, first packet on top */
+    for (index = 0; index != nb_packets; ++index)
+    {
+        PACKET_POOL_PACKET(pool, index)->next = (index + 1 != nb_packets) ? (unsigned int)(index + 2) : 0;
+    }
+    pool->head = 1;
+
+    *handle = pool;
+
+    return 0;
+}
+
+int packet_pool_release(packet_pool_handle_t* handle)
+{
+    if (handle == 0)
+    {
+        logger_log(LOG_FATAL, "%s: null handle pointer", __func__);
+        return -EINVAL;
+    }
+
+    if (*handle != 0)
+    {
+        free((*handle)->memory);
+        free(*handle);
+        *handle = 0;
+    }
+
+    return 0;
+}
+
+struct packet_t* packet_pool_get(packet_pool_handle_t handle)
+{
+    uint64_t head = __atomic_load_n(&handle->head, __ATOMIC_ACQUIRE);
+    uint64_t new_head;
+    struct packet_t* packet;
+
+    do
+    {
+        if ((head & PACKET_POOL_INDEX_MASK) == 0)
+        {
+            return 0;
+        }
+
+        /* packet memory is never freed: reading a link that changed meanwhile is harmless, the tag makes the swap fail */
+        packet = PACKET_POOL_PACKET(handle, (head & PACKET_POOL_INDEX_MASK) - 1);
+        new_head = ((head & ~PACKET_POOL_INDEX_MASK) + PACKET_POOL_TAG_ONE) | __atomic_load_n(&packet->next, __ATOMIC_RELAXED);
+    }
+    while (!__atomic_compare_exchange_n(&handle->head, &head, new_head, 1, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+
+    __atomic_store_n(&packet->refcount, 1, __ATOMIC_RELAXED);
+
+    return packet;
+}
+
+void packet_pool_ref(struct packet_t* packet)
+{
+    __atomic_fetch_add(&packet->refcount, 1, __ATOMIC_RELAXED);
+}
+
+void packet_pool_put(packet_pool_handle_t handle, struct packet_t* packet)
+{
+    uint64_t head;
+    uint64_t new_head;
+    uint64_t const index = packet_pool_index(handle, packet) + 1;
+
+    if (__atomic_sub_fetch(&packet->refcount, 1, __ATOMIC_ACQ_REL) != 0)
+    {
+        return;
+    }
+
+    head = __atomic_load_n(&handle->head, __ATOMIC_RELAXED);
+    do
+    {
+        __atomic_store_n(&packet->next, (unsigned int)(head & PACKET_POOL_INDEX_MASK), __ATOMIC_RELAXED);
+        new_head = ((head & ~PACKET_POOL_INDEX_MASK) + PACKET_POOL_TAG_ONE) | index;
+    }
+    while (!__atomic_compare_exchange_n(&handle->head, &head, new_head, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
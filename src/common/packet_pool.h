@@ -0,0 +1,85 @@
+/*
+ *  This file is part of vban.
+ *  Copyright (c) 2015 by Benoît Quiniou <quiniouben@yahoo.fr>
+ *
+ *  vban is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  vban is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with vban.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __PACKET_POOL_H__
+#define __PACKET_POOL_H__
+
+#include <stddef.h>
+#include "vban/vban.h"
+
+/**
+ * Fixed pool of VBAN packets, allocated once at startup, so that packets flow from the socket to the
+ * audio device (or the other way round) without any allocation nor copy in the hot path.
+ * Free packets are kept in a lock free stack: any thread can get and put packets.
+ * A packet is reference counted, it goes back to the pool when its last reference is put.
+ * Packets start on a cache line boundary, so that 2 threads working on neighbour packets do not share one.
+ */
+#define PACKET_POOL_CACHE_LINE  64
+
+/**
+ * A packet. size, tag and the timestamps are free for the holder to fill (packet size and stream index for instance).
+ */
+struct packet_t
+{
+    size_t          size;
+    int             tag;
+    unsigned long long timestamp_ns;    /* when it entered the pipeline: received by the kernel, or captured */
+    unsigned long long stage_ns;        /* when it entered its current stage */
+    unsigned int    refcount;
+    unsigned int    next;       /* free stack link, index + 1 of the next free packet */
+    char            data[VBAN_PROTOCOL_MAX_SIZE];
+};
+
+/**
+ * Opaque handle type
+ */
+struct packet_pool_t;
+typedef struct packet_pool_t* packet_pool_handle_t;
+
+/**
+ * Allocate a pool
+ * @param handle handle pointer that will be allocated
+ * @param nb_packets number of packets
+ * @return 0 upon success, negative value otherwise
+ */
+int packet_pool_init(packet_pool_handle_t* handle, size_t nb_packets);
+
+/**
+ * Release the pool, along with the packets still held.
+ * @param handle handle pointer that will be released
+ * @return 0 upon success, negative value otherwise
+ */
+int packet_pool_release(packet_pool_handle_t* handle);
+
+/**
+ * Get a free packet, with one reference
+ * @return packet, 0 if the pool is empty
+ */
+struct packet_t* packet_pool_get(packet_pool_handle_t handle);
+
+/**
+ * Take one more reference on a packet, for another holder
+ */
+void packet_pool_ref(struct packet_t* packet);
+
+/**
+ * Put one reference back. The packet goes back to the pool with its last reference.
+ */
+void packet_pool_put(packet_pool_handle_t handle, struct packet_t* packet);
+
+#endif /*__PACKET_POOL_H__*/
@@ -0,0 +1,181 @@
+/*
+ *  This file is part of vban.
+ *  Copyright (c) 2015 by Benoît Quiniou <quiniouben@yahoo.fr>
+ *
+ *  vban is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  vban is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with vban.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "packet_ring.h"
+#include <stdlib.h>
+#include <errno.h>
+#include <semaphore.h>
+#include "common/logger.h"
+
+#define PACKET_RING_PAD(_size)  (PACKET_POOL_CACHE_LINE - ((_size) % PACKET_POOL_CACHE_LINE))
+
+/* each index is stored by its own side only, and runs freely (masked on access).
+   Each side keeps its last view of the other index on its own cache line, to read the shared
+   one only when the ring looks full (producer) or empty (consumer) */
+struct packet_ring_t
+{
+    char                        pad0[PACKET_POOL_CACHE_LINE];
+
+    /* producer */
+    size_t                      write_index;
+    size_t                      read_index_cache;
+    char                        pad1[PACKET_RING_PAD(2 * sizeof(size_t))];
+
+    /* consumer */
+    size_t                      read_index;
+    size_t                      write_index_cache;
+    int                         waiting;
+    char                        pad2[PACKET_RING_PAD(2 * sizeof(size_t) + sizeof(int))];
+
+    size_t                      mask;
+    struct packet_t**           packets;
+    sem_t                       ready;
+};
+
+int packet_ring_init(packet_ring_handle_t* handle, size_t nb_packets)
+{
+    size_t power = 1;
+    struct packet_ring_t* ring = 0;
+
+    if (handle == 0)
+    {
+        logger_log(LOG_FATAL, "%s: null handle pointer", __func__);
+        return -EINVAL;
+    }
+
+    while (power < nb_packets)
+    {
+        power <<= 1;
+    }
+
+    ring = calloc(1, sizeof(struct packet_ring_t));
+    if (ring == 0)
+    {
+        logger_log(LOG_FATAL, "%s: could not allocate memory", __func__);
+        return -ENOMEM;
+    }
+
+    ring->packets = calloc(power, sizeof(struct packet_t*));
+    if (ring->packets == 0)
+    {
+        logger_log(LOG_FATAL, "%s: could not allocate memory", __func__);
+        free(ring);
+        return -ENOMEM;
+    }
+
+    ring->mask = power - 1;
+    sem_init(&ring->ready, 0, 0);
+
+    *handle = ring;
+
+    return 0;
+}
+
+int packet_ring_release(packet_ring_handle_t* handle)
+{
+    if (handle == 0)
+    {
+        logger_log(LOG_FATAL, "%s: null handle pointer", __func__);
+        return -EINVAL;
+    }
+
+    if (*handle != 0)
+    {
+        sem_destroy(&(*handle)->ready);
+        free((*handle)->packets);
+        free(*handle);
+        *handle = 0;
+    }
+
+    return 0;
+}
+
+int packet_ring_push(packet_ring_handle_t handle, struct packet_t* packet)
+{
+    if ((handle->write_index - handle->read_index_cache) > handle->mask)
+    {
+        handle->read_index_cache = __atomic_load_n(&handle->read_index, __ATOMIC_ACQUIRE);
+        if ((handle->write_index - handle->read_index_cache) > handle->mask)
+        {
+            return -EAGAIN;
+        }
+    }
+
+    handle->packets[handle->write_index & handle->mask] = packet;
+
+    /* sequentially consistent, so that the consumer can not miss it after having said it waits */
+    __atomic_store_n(&handle->write_index, handle->write_index + 1, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&handle->waiting, __ATOMIC_SEQ_CST) && __atomic_exchange_n(&handle->waiting, 0, __ATOMIC_SEQ_CST))
+    {
+        sem_post(&handle->ready);
+    }
+
+    return 0;
+}
+
+struct packet_t* packet_ring_pop(packet_ring_handle_t handle)
+{
+    struct packet_t* packet;
+
+    if (handle->read_index == handle->write_index_cache)
+    {
+        handle->write_index_cache = __atomic_load_n(&handle->write_index, __ATOMIC_ACQUIRE);
+        if (handle->read_index == handle->write_index_cache)
+        {
+            return 0;
+        }
+    }
+
+    packet = handle->packets[handle->read_index & handle->mask];
+    __atomic_store_n(&handle->read_index, handle->read_index + 1, __ATOMIC_RELEASE);
+
+    return packet;
+}
+int packet_ring_wait(packet_ring_handle_t handle)
+{
+    __atomic_store_n(&handle->waiting, 1, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&handle->write_index, __ATOMIC_SEQ_CST) != handle->read_index)
+    {
+        /* committed in between: a stale post may be left, it only makes the next wait return early */
+        __atomic_store_n(&handle->waiting, 0, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    while (sem_wait(&handle->ready) != 0)
+    {
+        if (errno != EINTR)
+        {
+            return -errno;
+        }
+    }
+
+    return 0;
+}
+
+void packet_ring_wake(packet_ring_handle_t handle)
+{
+    __atomic_store_n(&handle->waiting, 0, __ATOMIC_SEQ_CST);
+    sem_post(&handle->ready);
+}
+
+size_t packet_ring_depth(packet_ring_handle_t handle)
+{
+    return __atomic_load_n(&handle->write_index, __ATOMIC_ACQUIRE) - __atomic_load_n(&handle->read_index, __ATOMIC_ACQUIRE);
+}
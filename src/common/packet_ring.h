@@ -0,0 +1,82 @@
+/*
+ *  This file is part of vban.
+ *  Copyright (c) 2015 by Benoît Quiniou <quiniouben@yahoo.fr>
+ *
+ *  vban is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  vban is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with vban.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __PACKET_RING_H__
+#define __PACKET_RING_H__
+
+#include <stddef.h>
+#include "common/packet_pool.h"
+
+/**
+ * Lock free single producer / single consumer ring of packets, to hand packets of a packet_pool
+ * from one thread to another. The reference of the producer goes with the packet to the consumer.
+ * Producer and consumer indexes live on their own cache lines. Pushing and popping never blocks
+ * nor makes a system call, except for waking up a consumer that waits in packet_ring_wait.
+ */
+
+/**
+ * Opaque handle type
+ */
+struct packet_ring_t;
+typedef struct packet_ring_t* packet_ring_handle_t;
+
+/**
+ * Allocate a ring
+ * @param handle handle pointer that will be allocated
+ * @param nb_packets minimum capacity, rounded up to a power of 2
+ * @return 0 upon success, negative value otherwise
+ */
+int packet_ring_init(packet_ring_handle_t* handle, size_t nb_packets);
+
+/**
+ * Release the ring. It does not put back the packets left in it.
+ * @param handle handle pointer that will be released
+ * @return 0 upon success, negative value otherwise
+ */
+int packet_ring_release(packet_ring_handle_t* handle);
+
+/**
+ * Producer side: queue a packet
+ * @return 0 upon success, -EAGAIN if the ring is full (the packet is still the caller's)
+ */
+int packet_ring_push(packet_ring_handle_t handle, struct packet_t* packet);
+
+/**
+ * Consumer side: take the oldest packet
+ * @return packet, 0 if the ring is empty
+ */
+struct packet_t* packet_ring_pop(packet_ring_handle_t handle);
+
+/**
+ * Consumer side: wait until a packet is pushed or packet_ring_wake is called.
+ * It may return earlier, the consumer has to check the ring again.
+ * @return 0 upon success, negative value otherwise
+ */
+int packet_ring_wait(packet_ring_handle_t handle);
+
+/**
+ * Wake up the consumer waiting in packet_ring_wait (e.g. to stop it)
+ */
+void packet_ring_wake(packet_ring_handle_t handle);
+
+/**
+ * Number of packets queued, from either side
+ */
+size_t packet_ring_depth(packet_ring_handle_t handle);
+
+#endif /*__PACKET_RING_H__*/
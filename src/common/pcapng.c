@@ -0,0 +1,676 @@
+/*
+ *  This file is part of vban.
+ *  Copyright (c) 2015 by Benoît Quiniou <quiniouben@yahoo.fr>
+ *
+ *  vban is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  vban is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with vban.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include "pcapng.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include "common/logger.h"
+#include "common/ringbuffer.h"
+#include "common/thread.h"
+
+#define PCAPNG_BLOCK_SHB            0x0A0D0D0A
+#define PCAPNG_BLOCK_IDB            0x00000001
+#define PCAPNG_BLOCK_EPB            0x00000006
+#define PCAPNG_BYTE_ORDER_MAGIC     0x1A2B3C4D
+#define PCAPNG_BYTE_ORDER_SWAPPED   0x4D3C2B1A
+#define PCAPNG_OPT_ENDOFOPT         0
+#define PCAPNG_OPT_SHB_USERAPPL     4
+#define PCAPNG_OPT_IF_TSRESOL       9
+
+#define PCAPNG_LINKTYPE_ETHERNET    1
+#define PCAPNG_LINKTYPE_RAW         101
+#define PCAPNG_LINKTYPE_LINUX_SLL   113
+#define PCAPNG_LINKTYPE_IPV4        228
+#define PCAPNG_LINKTYPE_LINUX_SLL2  276
+
+#define PCAPNG_ETHERTYPE_IPV4       0x0800
+#define PCAPNG_ETHERTYPE_VLAN       0x8100
+#define PCAPNG_IPPROTO_UDP          17
+#define PCAPNG_IPV4_HEADER_SIZE     20
+#define PCAPNG_UDP_HEADER_SIZE      8
+
+#define PCAPNG_SNAPLEN              65535
+#define PCAPNG_EPB_HEADER_SIZE      28
+#define PCAPNG_BLOCK_MAX_SIZE       (PCAPNG_EPB_HEADER_SIZE + PCAPNG_SNAPLEN + 8)
+#define PCAPNG_INTERFACES_MAX_NB    16
+#define PCAPNG_RING_SIZE            (4 * 1024 * 1024)
+#define PCAPNG_FLUSH_MS             100
+#define PCAPNG_PAD(_size)           (((_size) + 3) & ~(size_t)3)
+
+struct pcapng_interface_t
+{
+    unsigned int            linktype;
+    unsigned int            resolution;         /* timestamp unit is 10^-resolution s, or 2^-resolution s */
+    int                     binary;
+};
+
+struct pcapng_t
+{
+    FILE*                   file;
+    int                     writing;
+    /* block being built or read */
+    unsigned char*          block;
+
+    /* writer: the blocks go through the ring to the writer thread */
+    ringbuffer_handle_t     ring;
+    pthread_t               thread;
+    int                     started;
+    sem_t                   ready;
+    int                     waiting;
+    int                     stop;
+    unsigned long           nb_dropped;
+    unsigned char           source_ip[4];
+    unsigned short          port;
+    unsigned short          ip_id;
+
+    /* reader */
+    int                     swapped;
+    struct pcapng_interface_t interfaces[PCAPNG_INTERFACES_MAX_NB];
+    size_t                  nb_interfaces;
+};
+
+static void put_u16(unsigned char* ptr, unsigned int value)
+{
+    uint16_t const value16 = (uint16_t)value;
+    memcpy(ptr, &value16, sizeof(value16));
+}
+
+static void put_u32(unsigned char* ptr, unsigned long value)
+{
+    uint32_t const value32 = (uint32_t)value;
+    memcpy(ptr, &value32, sizeof(value32));
+}
+
+static void put_be16(unsigned char* ptr, unsigned int value)
+{
+    ptr[0] = (unsigned char)(value >> 8);
+    ptr[1] = (unsigned char)value;
+}
+
+static unsigned int get_u16(pcapng_handle_t handle, unsigned char const* ptr)
+{
+    uint16_t value;
+    memcpy(&value, ptr, sizeof(value));
+    return handle->swapped ? (uint16_t)((value >> 8) | (value << 8)) : value;
+}
+
+static unsigned long get_u32(pcapng_handle_t handle, unsigned char const* ptr)
+{
+    uint32_t value;
+    memcpy(&value, ptr, sizeof(value));
+    return handle->swapped
+        ? ((value >> 24) | ((value >> 8) & 0xFF00) | ((value << 8) & 0xFF0000) | (value << 24))
+        : value;
+}
+
+static unsigned int get_be16(unsigned char const* ptr)
+{
+    return ((unsigned int)ptr[0] << 8) | ptr[1];
+}
+
+static size_t pcapng_option(unsigned char* ptr, unsigned int code, void const* value, size_t size)
+{
+    put_u16(ptr, code);
+    put_u16(ptr + 2, size);
+    memcpy(ptr + 4, value, size);
+    memset(ptr + 4 + size, 0, PCAPNG_PAD(size) - size);
+    return 4 + PCAPNG_PAD(size);
+}
+
+static int pcapng_write_headers(pcapng_handle_t handle, char const* application)
+{
+    unsigned char block[256];
+    size_t const name_size = strnlen(application, 128);
+    unsigned char const resolution = 9;
+    size_t size;
+
+    /* section header: native byte order, unknown section length */
+    put_u32(block, PCAPNG_BLOCK_SHB);
+    put_u32(block + 8, PCAPNG_BYTE_ORDER_MAGIC);
+    put_u16(block + 12, 1);
+    put_u16(block + 14, 0);
+    memset(block + 16, 0xFF, 8);
+    size = 24;
+    size += pcapng_option(block + size, PCAPNG_OPT_SHB_USERAPPL, application, name_size);
+    size += pcapng_option(block + size, PCAPNG_OPT_ENDOFOPT, 0, 0);
+    put_u32(block + 4, size + 4);
+    put_u32(block + size, size + 4);
+    size += 4;
+    if (fwrite(block, 1, size, handle->file) != size)
+    {
+        return -EIO;
+    }
+
+    /* one IPv4 interface, timestamps in ns */
+    put_u32(block, PCAPNG_BLOCK_IDB);
+    put_u16(block + 8, PCAPNG_LINKTYPE_IPV4);
+    put_u16(block + 10, 0);
+    put_u32(block + 12, PCAPNG_SNAPLEN);
+    size = 16;
+    size += pcapng_option(block + size, PCAPNG_OPT_IF_TSRESOL, &resolution, 1);
+    size += pcapng_option(block + size, PCAPNG_OPT_ENDOFOPT, 0, 0);
+    put_u32(block + 4, size + 4);
+    put_u32(block + size, size + 4);
+    size += 4;
+    if (fwrite(block, 1, size, handle->file) != size)
+    {
+        return -EIO;
+    }
+
+    return (fflush(handle->file) == 0) ? 0 : -EIO;
+}
+
+static void pcapng_flush(pcapng_handle_t handle)
+{
+    struct ringbuffer_data_t vec[2];
+    size_t written = 0;
+
+    ringbuffer_get_read_vector(handle->ring, vec);
+    if (vec[0].len == 0)
+    {
+        return;
+    }
+
+    written += fwrite(vec[0].buf, 1, vec[0].len, handle->file);
+    if (vec[1].len != 0)
+    {
+        written += fwrite(vec[1].buf, 1, vec[1].len, handle->file);
+    }
+    if (written != vec[0].len + vec[1].len)
+    {
+        logger_log(LOG_ERROR, "%s: write error", __func__);
+    }
+    ringbuffer_read_advance(handle->ring, vec[0].len + vec[1].len);
+    fflush(handle->file);
+}
+
+static void* pcapng_writer_thread(void* arg)
+{
+    pcapng_handle_t const handle = (pcapng_handle_t)arg;
+    struct timespec deadline;
+
+    while (!__atomic_load_n(&handle->stop, __ATOMIC_ACQUIRE))
+    {
+        pcapng_flush(handle);
+
+        /* woken up early by pcapng_write when the ring fills up */
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += PCAPNG_FLUSH_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L)
+        {
+            deadline.tv_nsec -= 1000000000L;
+            ++deadline.tv_sec;
+        }
+        __atomic_store_n(&handle->waiting, 1, __ATOMIC_SEQ_CST);
+        sem_timedwait(&handle->ready, &deadline);
+        __atomic_store_n(&handle->waiting, 0, __ATOMIC_SEQ_CST);
+    }
+
+    return 0;
+}
+
+static int pcapng_alloc(pcapng_handle_t* handle, char const* path, char const* mode)
+{
+    *handle = calloc(1, sizeof(struct pcapng_t));
+    if (*handle == 0)
+    {
+        logger_log(LOG_FATAL, "%s: could not allocate memory", __func__);
+        return -ENOMEM;
+    }
+
+    (*handle)->block = malloc(PCAPNG_BLOCK_MAX_SIZE);
+    if ((*handle)->block == 0)
+    {
+        logger_log(LOG_FATAL, "%s: could not allocate memory", __func__);
+        free(*handle);
+        *handle = 0;
+        return -ENOMEM;
+    }
+
+    (*handle)->file = fopen(path, mode);
+    if ((*handle)->file == 0)
+    {
+        logger_log(LOG_ERROR, "%s: could not open %s: %s", __func__, path, strerror(errno));
+        free((*handle)->block);
+        free(*handle);
+        *handle = 0;
+        return -ENOENT;
+    }
+
+    return 0;
+}
+
+int pcapng_open_write(pcapng_handle_t* handle, char const* path, char const* application, char const* source_ip, unsigned short port)
+{
+    unsigned int ip[4];
+    int ret = 0;
+
+    if ((handle == 0) || (path == 0) || (application == 0) || (source_ip == 0))
+    {
+        logger_log(LOG_FATAL, "%s: null pointer argument", __func__);
+        return -EINVAL;
+    }
+
+    if ((sscanf(source_ip, "%u.%u.%u.%u", &ip[0], &ip[1], &ip[2], &ip[3]) != 4)
+        || (ip[0] > 255) || (ip[1] > 255) || (ip[2] > 255) || (ip[3] > 255))
+    {
+        logger_log(LOG_ERROR, "%s: invalid ip address %s", __func__, source_ip);
+        return -EINVAL;
+    }
+
+    ret = pcapng_alloc(handle, path, "wb");
+    if (ret != 0)
+    {
+        return ret;
+    }
+
+    (*handle)->writing = 1;
+    (*handle)->port = port;
+    (*handle)->source_ip[0] = (unsigned char)ip[0];
+    (*handle)->source_ip[1] = (unsigned char)ip[1];
+    (*handle)->source_ip[2] = (unsigned char)ip[2];
+    (*handle)->source_ip[3] = (unsigned char)ip[3];
+    sem_init(&(*handle)->ready, 0, 0);
+
+    ret = pcapng_write_headers(*handle, application);
+    if (ret != 0)
+    {
+        logger_log(LOG_ERROR, "%s: could not write to %s", __func__, path);
+    }
+    if (ret == 0)
+    {
+        ret = ringbuffer_init(&(*handle)->ring, PCAPNG_RING_SIZE);
+    }
+    if (ret == 0)
+    {
+        ret = thread_start(&(*handle)->thread, pcapng_writer_thread, *handle);
+    }
+
+    if (ret != 0)
+    {
+        pcapng_release(handle);
+        return ret;
+    }
+
+    (*handle)->started = 1;
+    logger_log(LOG_INFO, "%s: recording to %s", __func__, path);
+
+    return 0;
+}
+
+int pcapng_open_read(pcapng_handle_t* handle, char const* path)
+{
+    if ((handle == 0) || (path == 0))
+    {
+        logger_log(LOG_FATAL, "%s: null pointer argument", __func__);
+        return -EINVAL;
+    }
+
+    return pcapng_alloc(handle, path, "rb");
+}
+
+int pcapng_release(pcapng_handle_t* handle)
+{
+    if (handle == 0)
+    {
+        logger_log(LOG_FATAL, "%s: null handle pointer", __func__);
+        return -EINVAL;
+    }
+
+    if (*handle == 0)
+    {
+        return 0;
+    }
+
+    if ((*handle)->writing)
+    {
+        if ((*handle)->started)
+        {
+            __atomic_store_n(&(*handle)->stop, 1, __ATOMIC_RELEASE);
+            sem_post(&(*handle)->ready);
+            pthread_join((*handle)->thread, 0);
+            pcapng_flush(*handle);
+        }
+        if ((*handle)->nb_dropped != 0)
+        {
+            logger_log(LOG_WARNING, "%s: %lu datagrams could not be recorded in time and were dropped", __func__, (*handle)->nb_dropped);
+        }
+        ringbuffer_release(&(*handle)->ring);
+        sem_destroy(&(*handle)->ready);
+    }
+
+    fclose((*handle)->file);
+    free((*handle)->block);
+    free(*handle);
+    *handle = 0;
+
+    return 0;
+}
+
+int pcapng_write(pcapng_handle_t handle, char const* data, size_t size, unsigned long long timestamp_ns)
+{
+    unsigned char* block;
+    unsigned char* ip;
+    unsigned char* udp;
+    size_t const packet_size = PCAPNG_IPV4_HEADER_SIZE + PCAPNG_UDP_HEADER_SIZE + size;
+    size_t const block_size = PCAPNG_EPB_HEADER_SIZE + PCAPNG_PAD(packet_size) + 4;
+    unsigned long checksum = 0;
+    size_t index;
+
+    if ((handle == 0) || (data == 0) || !handle->writing)
+    {
+        return -EINVAL;
+    }
+
+    if (packet_size > PCAPNG_SNAPLEN)
+    {
+        return -EMSGSIZE;
+    }
+
+    block   = handle->block;
+    ip      = block + PCAPNG_EPB_HEADER_SIZE;
+    udp     = ip + PCAPNG_IPV4_HEADER_SIZE;
+
+    if (ringbuffer_write_space(handle->ring) < block_size)
+    {
+        ++handle->nb_dropped;
+        return -ENOSPC;
+    }
+
+    put_u32(block, PCAPNG_BLOCK_EPB);
+    put_u32(block + 4, block_size);
+    put_u32(block + 8, 0);
+    put_u32(block + 12, timestamp_ns >> 32);
+    put_u32(block + 16, timestamp_ns & 0xFFFFFFFF);
+    put_u32(block + 20, packet_size);
+    put_u32(block + 24, packet_size);
+
+    /* IPv4 header, to the wildcard address the socket is bound to */
+    memset(ip, 0, PCAPNG_IPV4_HEADER_SIZE);
+    ip[0] = 0x45;
+    put_be16(ip + 2, packet_size);
+    put_be16(ip + 4, handle->ip_id++);
+    ip[8] = 64;
+    ip[9] = PCAPNG_IPPROTO_UDP;
+    memcpy(ip + 12, handle->source_ip, 4);
+    for (index = 0; index != PCAPNG_IPV4_HEADER_SIZE; index += 2)
+    {
+        checksum += get_be16(ip + index);
+    }
+    checksum = (checksum & 0xFFFF) + (checksum >> 16);
+    checksum += (checksum >> 16);
+    put_be16(ip + 10, ~checksum & 0xFFFF);
+
+    /* UDP header, without checksum */
+    put_be16(udp, handle->port);
+    put_be16(udp + 2, handle->port);
+    put_be16(udp + 4, PCAPNG_UDP_HEADER_SIZE + size);
+    put_be16(udp + 6, 0);
+
+    memcpy(udp + PCAPNG_UDP_HEADER_SIZE, data, size);
+    memset(ip + packet_size, 0, PCAPNG_PAD(packet_size) - packet_size);
+    put_u32(block + block_size - 4, block_size);
+
+    ringbuffer_write(handle->ring, (char const*)block, block_size);
+
+    if ((ringbuffer_read_space(handle->ring) >= PCAPNG_RING_SIZE / 4)
+        && __atomic_load_n(&handle->waiting, __ATOMIC_SEQ_CST) && __atomic_exchange_n(&handle->waiting, 0, __ATOMIC_SEQ_CST))
+    {
+        sem_post(&handle->ready);
+    }
+
+    return 0;
+}
+
+static unsigned long long pcapng_to_ns(struct pcapng_interface_t const* interface, unsigned long long timestamp)
+{
+    unsigned long long scale = 1;
+    unsigned int index;
+
+    if (interface->binary)
+    {
+        return (unsigned long long)((long double)timestamp * 1e9L / (long double)(1ull << (interface->resolution & 63)));
+    }
+
+    if (interface->resolution <= 9)
+    {
+        for (index = interface->resolution; index != 9; ++index)
+        {
+            scale *= 10;
+        }
+        return timestamp * scale;
+    }
+
+    for (index = 9; (index != interface->resolution) && (index != 28); ++index)
+    {
+        scale *= 10;
+    }
+    return timestamp / scale;
+}
+
+/** find the UDP payload of a captured packet, @return its size, negative if it is not an IPv4 UDP packet */
+static int pcapng_udp_payload(unsigned int linktype, unsigned char const* data, size_t size, unsigned char const** payload)
+{
+    size_t offset = 0;
+    unsigned int ethertype = PCAPNG_ETHERTYPE_IPV4;
+    size_t header_size;
+    size_t udp_size;
+
+    switch (linktype)
+    {
+        case PCAPNG_LINKTYPE_ETHERNET:
+            if (size < 14)
+                return -1;
+            ethertype = get_be16(data + 12);
+            offset = 14;
+            while ((ethertype == PCAPNG_ETHERTYPE_VLAN) && (size >= offset + 4))
+            {
+                ethertype = get_be16(data + offset + 2);
+                offset += 4;
+            }
+            break;
+
+        case PCAPNG_LINKTYPE_LINUX_SLL:
+            if (size < 16)
+                return -1;
+            ethertype = get_be16(data + 14);
+            offset = 16;
+            break;
+
+        case PCAPNG_LINKTYPE_LINUX_SLL2:
+            if (size < 20)
+                return -1;
+            ethertype = get_be16(data);
+            offset = 20;
+            break;
+
+        case PCAPNG_LINKTYPE_RAW:
+        case PCAPNG_LINKTYPE_IPV4:
+            break;
+
+        default:
+            return -1;
+    }
+
+    if ((ethertype != PCAPNG_ETHERTYPE_IPV4) || (size < offset + PCAPNG_IPV4_HEADER_SIZE))
+    {
+        return -1;
+    }
+
+    data += offset;
+    size -= offset;
+    header_size = (data[0] & 0x0F) * 4;
+
+    /* fragments would have to be put back together, VBAN datagrams never are */
+    if (((data[0] >> 4) != 4) || (header_size < PCAPNG_IPV4_HEADER_SIZE) || (data[9] != PCAPNG_IPPROTO_UDP)
+        || ((get_be16(data + 6) & 0x3FFF) != 0) || (size < header_size + PCAPNG_UDP_HEADER_SIZE))
+    {
+        return -1;
+    }
+
+    udp_size = get_be16(data + header_size + 4);
+    if (udp_size < PCAPNG_UDP_HEADER_SIZE)
+    {
+        return -1;
+    }
+    udp_size -= PCAPNG_UDP_HEADER_SIZE;
+    if (udp_size > size - header_size - PCAPNG_UDP_HEADER_SIZE)
+    {
+        udp_size = size - header_size - PCAPNG_UDP_HEADER_SIZE;
+    }
+
+    *payload = data + header_size + PCAPNG_UDP_HEADER_SIZE;
+    return (int)udp_size;
+}
+
+static void pcapng_read_interface(pcapng_handle_t handle, unsigned char const* block, size_t block_size)
+{
+    struct pcapng_interface_t* interface;
+    size_t offset = 16;
+    unsigned int code;
+    size_t size;
+
+    if (handle->nb_interfaces == PCAPNG_INTERFACES_MAX_NB)
+    {
+        logger_log(LOG_WARNING, "%s: too many interfaces, packets of the next ones are skipped", __func__);
+        return;
+    }
+
+    interface = &handle->interfaces[handle->nb_interfaces++];
+    interface->linktype     = get_u16(handle, block + 8);
+    interface->resolution   = 6;
+    interface->binary       = 0;
+
+    while (offset + 4 <= block_size - 4)
+    {
+        code = get_u16(handle, block + offset);
+        size = get_u16(handle, block + offset + 2);
+        if ((code == PCAPNG_OPT_ENDOFOPT) || (offset + 4 + size > block_size - 4))
+        {
+            break;
+        }
+        if ((code == PCAPNG_OPT_IF_TSRESOL) && (size == 1))
+        {
+            interface->resolution   = block[offset + 4] & 0x7F;
+            interface->binary       = (block[offset + 4] & 0x80) != 0;
+        }
+        offset += 4 + PCAPNG_PAD(size);
+    }
+}
+
+int pcapng_read(pcapng_handle_t handle, char* data, size_t size, unsigned long long* timestamp_ns)
+{
+    unsigned char* block;
+    unsigned long type;
+    unsigned long magic;
+    size_t block_size;
+    size_t captured;
+    unsigned long interface;
+    unsigned char const* payload;
+    int payload_size;
+
+    if ((handle == 0) || (data == 0) || (timestamp_ns == 0) || handle->writing)
+    {
+        return -EINVAL;
+    }
+
+    block = handle->block;
+
+    for (;;)
+    {
+        /* smallest block: type, length and trailing length */
+        if (fread(block, 1, 12, handle->file) != 12)
+        {
+            return 0;
+        }
+
+        type = get_u32(handle, block);
+        if (type == PCAPNG_BLOCK_SHB)
+        {
+            handle->swapped = 0;
+            magic = get_u32(handle, block + 8);
+            if (magic == PCAPNG_BYTE_ORDER_SWAPPED)
+            {
+                handle->swapped = 1;
+            }
+            else if (magic != PCAPNG_BYTE_ORDER_MAGIC)
+            {
+                logger_log(LOG_ERROR, "%s: not a pcapng file", __func__);
+                return -EINVAL;
+            }
+            handle->nb_interfaces = 0;
+        }
+
+        block_size = get_u32(handle, block + 4);
+        if ((block_size < 12) || (block_size > PCAPNG_BLOCK_MAX_SIZE) || (block_size % 4))
+        {
+            logger_log(LOG_ERROR, "%s: invalid block of size %zu", __func__, block_size);
+            return -EINVAL;
+        }
+        if (fread(block + 12, 1, block_size - 12, handle->file) != block_size - 12)
+        {
+            logger_log(LOG_WARNING, "%s: truncated block at the end of the file", __func__);
+            return 0;
+        }
+
+        if (type == PCAPNG_BLOCK_IDB)
+        {
+            if (block_size >= 20)
+            {
+                pcapng_read_interface(handle, block, block_size);
+            }
+            continue;
+        }
+
+        if ((type != PCAPNG_BLOCK_EPB) || (block_size < PCAPNG_EPB_HEADER_SIZE + 4))
+        {
+            continue;
+        }
+
+        interface = get_u32(handle, block + 8);
+        captured = get_u32(handle, block + 20);
+        if ((interface >= handle->nb_interfaces) || (captured > block_size - PCAPNG_EPB_HEADER_SIZE - 4))
+        {
+            continue;
+        }
+
+        payload_size = pcapng_udp_payload(handle->interfaces[interface].linktype, block + PCAPNG_EPB_HEADER_SIZE, captured, &payload);
+        if (payload_size < 0)
+        {
+            continue;
+        }
+
+        *timestamp_ns = pcapng_to_ns(&handle->interfaces[interface],
+            ((unsigned long long)get_u32(handle, block + 12) << 32) | get_u32(handle, block + 16));
+
+        if ((size_t)payload_size > size)
+        {
+            payload_size = (int)size;
+        }
+        memcpy(data, payload, payload_size);
+
+        return payload_size;
+    }
+}
@@ -0,0 +1,86 @@
+/*
+ *  This file is part of vban.
+ *  Copyright (c) 2015 by Benoît Quiniou <quiniouben@yahoo.fr>
+ *
+ *  vban is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  vban is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with vban.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __PCAPNG_H__
+#define __PCAPNG_H__
+
+#include <stddef.h>
+
+/**
+ * Capture files in pcapng format, readable by wireshark and tcpdump.
+ * Datagrams are written as IPv4 / UDP packets: the headers are rebuilt from the address of the emitter
+ * and the port listened to, the payload and the timestamp are the ones received.
+ * Writing never blocks nor makes a system call: blocks are copied to a ring buffer that a thread of
+ * the writer flushes to the file. When the ring buffer is full, datagrams are dropped and counted.
+ * Reading gives back the UDP payloads of the IPv4 packets of a file, with their timestamp, whatever
+ * wrote it (raw IP, ethernet and linux cooked captures are understood).
+ */
+
+/**
+ * Opaque handle type
+ */
+struct pcapng_t;
+typedef struct pcapng_t* pcapng_handle_t;
+
+/**
+ * Create a capture file and start its writer thread
+ * @param handle handle pointer that will be allocated
+ * @param path file to create, overwritten if it exists
+ * @param application name of the application writing it, recorded in the file
+ * @param source_ip ip address of the emitter, used as source of the packets
+ * @param port port the datagrams are received on, used as source and destination port
+ * @return 0 upon success, negative value otherwise
+ */
+int pcapng_open_write(pcapng_handle_t* handle, char const* path, char const* application, char const* source_ip, unsigned short port);
+
+/**
+ * Open a capture file to read it
+ * @param handle handle pointer that will be allocated
+ * @param path file to read
+ * @return 0 upon success, negative value otherwise
+ */
+int pcapng_open_read(pcapng_handle_t* handle, char const* path);
+
+/**
+ * Close the file. When writing, what is still in the ring buffer is written first.
+ * @param handle handle pointer that will be released
+ * @return 0 upon success, negative value otherwise
+ */
+int pcapng_release(pcapng_handle_t* handle);
+
+/**
+ * Record a datagram. Only one thread may write.
+ * @param handle object handle
+ * @param data datagram payload
+ * @param size size of the payload
+ * @param timestamp_ns reception time, in ns since the epoch
+ * @return 0 upon success, -ENOSPC if it was dropped, negative value otherwise
+ */
+int pcapng_write(pcapng_handle_t handle, char const* data, size_t size, unsigned long long timestamp_ns);
+
+/**
+ * Read the next UDP datagram of the file, packets of other protocols are skipped
+ * @param handle object handle
+ * @param data buffer to fill with the payload
+ * @param size size of the buffer, longer payloads are truncated
+ * @param timestamp_ns filled with the capture time, in ns since the epoch
+ * @return size of the payload, 0 at the end of the file, negative value otherwise
+ */
+int pcapng_read(pcapng_handle_t handle, char* data, size_t size, unsigned long long* timestamp_ns);
+
+#endif /*__PCAPNG_H__*/
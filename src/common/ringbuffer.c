@@ -0,0 +1,189 @@
+/*
+ *  This file is part of vban.
+ *  Copyright (c) 2015 by Benoît Quiniou <quiniouben@yahoo.fr>
+ *
+ *  vban is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  vban is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with vban.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "ringbuffer.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "common/logger.h"
+
+/* read and write indexes run freely, they are masked on access only: the ring can be
+   completely filled, and each index is only stored by its own side */
+struct ringbuffer_t
+{
+    size_t  size;
+    size_t  mask;
+    size_t  write_index;
+    size_t  read_index;
+    char*   buffer;
+};
+
+int ringbuffer_init(ringbuffer_handle_t* handle, size_t size)
+{
+    size_t power = 1;
+
+    if (handle == 0)
+    {
+        logger_log(LOG_FATAL, "%s: null handle pointer", __func__);
+        return -EINVAL;
+    }
+
+    while (power < size)
+    {
+        power <<= 1;
+    }
+
+    *handle = calloc(1, sizeof(struct ringbuffer_t));
+    if (*handle == 0)
+    {
+        logger_log(LOG_FATAL, "%s: could not allocate memory", __func__);
+        return -ENOMEM;
+    }
+
+    (*handle)->buffer = calloc(1, power);
+    if ((*handle)->buffer == 0)
+    {
+        logger_log(LOG_FATAL, "%s: could not allocate memory", __func__);
+        free(*handle);
+        *handle = 0;
+        return -ENOMEM;
+    }
+
+    (*handle)->size = power;
+    (*handle)->mask = power - 1;
+
+    return 0;
+}
+
+int ringbuffer_release(ringbuffer_handle_t* handle)
+{
+    if (handle == 0)
+    {
+        logger_log(LOG_FATAL, "%s: null handle pointer", __func__);
+        return -EINVAL;
+    }
+
+    if (*handle != 0)
+    {
+        free((*handle)->buffer);
+        free(*handle);
+        *handle = 0;
+    }
+
+    return 0;
+}
+
+size_t ringbuffer_read_space(ringbuffer_handle_t handle)
+{
+    return __atomic_load_n(&handle->write_index, __ATOMIC_ACQUIRE) - handle->read_index;
+}
+
+size_t ringbuffer_write_space(ringbuffer_handle_t handle)
+{
+    return handle->size - (handle->write_index - __atomic_load_n(&handle->read_index, __ATOMIC_ACQUIRE));
+}
+
+static void get_vector(ringbuffer_handle_t handle, size_t index, size_t len, struct ringbuffer_data_t* vec)
+{
+    size_t const offset = index & handle->mask;
+    size_t const first = handle->size - offset;
+
+    vec[0].buf = handle->buffer + offset;
+    if (len > first)
+    {
+        vec[0].len = first;
+        vec[1].buf = handle->buffer;
+        vec[1].len = len - first;
+    }
+    else
+    {
+        vec[0].len = len;
+        vec[1].buf = handle->buffer;
+        vec[1].len = 0;
+    }
+}
+
+void ringbuffer_get_read_vector(ringbuffer_handle_t handle, struct ringbuffer_data_t* vec)
+{
+    get_vector(handle, handle->read_index, ringbuffer_read_space(handle), vec);
+}
+
+void ringbuffer_get_write_vector(ringbuffer_handle_t handle, struct ringbuffer_data_t* vec)
+{
+    get_vector(handle, handle->write_index, ringbuffer_write_space(handle), vec);
+}
+
+void ringbuffer_read_advance(ringbuffer_handle_t handle, size_t size)
+{
+    __atomic_store_n(&handle->read_index, handle->read_index + size, __ATOMIC_RELEASE);
+}
+
+void ringbuffer_write_advance(ringbuffer_handle_t handle, size_t size)
+{
+    __atomic_store_n(&handle->write_index, handle->write_index + size, __ATOMIC_RELEASE);
+}
+
+size_t ringbuffer_read(ringbuffer_handle_t handle, char* data, size_t size)
+{
+    struct ringbuffer_data_t vec[2];
+
+    ringbuffer_get_read_vector(handle, vec);
+    if (size > (vec[0].len + vec[1].len))
+    {
+        size = vec[0].len + vec[1].len;
+    }
+
+    if (size <= vec[0].len)
+    {
+        memcpy(data, vec[0].buf, size);
+    }
+    else
+    {
+        memcpy(data, vec[0].buf, vec[0].len);
+        memcpy(data + vec[0].len, vec[1].buf, size - vec[0].len);
+    }
+
+    ringbuffer_read_advance(handle, size);
+
+    return size;
+}
+
+size_t ringbuffer_write(ringbuffer_handle_t handle, char const* data, size_t size)
+{
+    struct ringbuffer_data_t vec[2];
+
+    ringbuffer_get_write_vector(handle, vec);
+    if (size > (vec[0].len + vec[1].len))
+    {
+        size = vec[0].len + vec[1].len;
+    }
+
+    if (size <= vec[0].len)
+    {
+        memcpy(vec[0].buf, data, size);
+    }
+    else
+    {
+        memcpy(vec[0].buf, data, vec[0].len);
+        memcpy(vec[1].buf, data + vec[0].len, size - vec[0].len);
+    }
+
+    ringbuffer_write_advance(handle, size);
+
+    return size;
+}
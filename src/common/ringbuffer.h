@@ -0,0 +1,83 @@
+/*
+ *  This file is part of vban.
+ *  Copyright (c) 2015 by Benoît Quiniou <quiniouben@yahoo.fr>
+ *
+ *  vban is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  vban is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with vban.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __RINGBUFFER_H__
+#define __RINGBUFFER_H__
+
+#include <stddef.h>
+
+/**
+ * Lock free single producer / single consumer byte ring buffer.
+ * One thread writes, one thread reads, none of the functions below block, allocate or log
+ * (except init and release), so both sides can be a realtime audio callback.
+ */
+
+/**
+ * A contiguous part of the ring buffer
+ */
+struct ringbuffer_data_t
+{
+    char*   buf;
+    size_t  len;
+};
+
+/**
+ * Opaque handle type
+ */
+struct ringbuffer_t;
+typedef struct ringbuffer_t* ringbuffer_handle_t;
+
+/**
+ * Allocate a ring buffer
+ * @param handle handle pointer that will be allocated
+ * @param size minimum capacity in bytes, rounded up to a power of 2
+ * @return 0 upon success, negative value otherwise
+ */
+int ringbuffer_init(ringbuffer_handle_t* handle, size_t size);
+
+/**
+ * Release the ring buffer
+ * @param handle handle pointer that will be released
+ * @return 0 upon success, negative value otherwise
+ */
+int ringbuffer_release(ringbuffer_handle_t* handle);
+
+/**
+ * Number of bytes that can be read / written right now
+ */
+size_t ringbuffer_read_space(ringbuffer_handle_t handle);
+size_t ringbuffer_write_space(ringbuffer_handle_t handle);
+
+/**
+ * Get the readable / writable part of the ring buffer, as 2 segments (the second one is
+ * empty if the area does not wrap). Data is made available to the other side by the
+ * matching advance call.
+ */
+void ringbuffer_get_read_vector(ringbuffer_handle_t handle, struct ringbuffer_data_t* vec);
+void ringbuffer_get_write_vector(ringbuffer_handle_t handle, struct ringbuffer_data_t* vec);
+void ringbuffer_read_advance(ringbuffer_handle_t handle, size_t size);
+void ringbuffer_write_advance(ringbuffer_handle_t handle, size_t size);
+
+/**
+ * Copy out / in at most @p size bytes
+ * @return number of bytes copied
+ */
+size_t ringbuffer_read(ringbuffer_handle_t handle, char* data, size_t size);
+size_t ringbuffer_write(ringbuffer_handle_t handle, char const* data, size_t size);
+
+#endif /*__RINGBUFFER_H__*/
@@ -16,6 +16,7 @@
  *  along with vban.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
 #include "socket.h"
 #include <stdio.h>
 #include <stdlib.h>
@@ -26,6 +27,9 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/poll.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <time.h>
 #else // _WIN32
 #include <winsock2.h>
 #endif
@@ -40,6 +44,7 @@ struct socket_t
 #else // _WIN32
     SOCKET fd;
 #endif
+    int                     nonblock;
 };
 
 static int socket_open(socket_handle_t handle);
@@ -195,6 +200,15 @@ int socket_open(socket_handle_t handle)
             return WSAGetLastError();
 #endif
         }
+
+#ifdef SO_TIMESTAMPNS
+        /* receive time of each packet, to measure the latency from the network on */
+        optflag = 1;
+        if (setsockopt(handle->fd, SOL_SOCKET, SO_TIMESTAMPNS, &optflag, sizeof(optflag)) < 0)
+        {
+            logger_log(LOG_WARNING, "%s: unable to set timestamp option, network latency will not be measured", __func__);
+        }
+#endif
     }
     else
     {
@@ -252,11 +266,25 @@ int socket_close(socket_handle_t handle)
 }
 
 int socket_read(socket_handle_t handle, char* buffer, size_t size)
+{
+    return socket_read_timestamp(handle, buffer, size, 0);
+}
+
+int socket_read_timestamp(socket_handle_t handle, char* buffer, size_t size, unsigned long long* timestamp_ns)
 {
     int ret = 0;
     struct sockaddr_in si_other;
 #ifndef _WIN32
-    socklen_t slen = sizeof(si_other);
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr* cmsg;
+    struct timespec const* ts;
+    /* room for the timestamp, aligned for the control headers */
+    union
+    {
+        struct cmsghdr      header;
+        char                data[CMSG_SPACE(sizeof(struct timespec))];
+    } control;
 #else // _WIN32
     int slen = sizeof(si_other);
 #endif
@@ -282,10 +310,33 @@ int socket_read(socket_handle_t handle, char* buffer, size_t size)
     }
 
 again:
+    if (timestamp_ns != 0)
+    {
+        *timestamp_ns = 0;
+    }
+
+#ifndef _WIN32
+    iov.iov_base        = buffer;
+    iov.iov_len         = size;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name        = &si_other;
+    msg.msg_namelen     = sizeof(si_other);
+    msg.msg_iov         = &iov;
+    msg.msg_iovlen      = 1;
+    msg.msg_control     = control.data;
+    msg.msg_controllen  = sizeof(control.data);
+
+    ret = recvmsg(handle->fd, &msg, 0);
+#else // _WIN32
     ret = recvfrom(handle->fd, buffer, size, 0, (struct sockaddr *) &si_other, &slen);
+#endif
     if (ret < 0)
     {
-        if (errno != EINTR)
+        if (handle->nonblock && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+        {
+            return -EAGAIN;
+        }
+        else if (errno != EINTR)
         {
             logger_log(LOG_ERROR, "%s: recvfrom error %d %s", __func__, errno, strerror(errno));
         }
@@ -295,9 +346,28 @@ again:
     if (strncmp(handle->config.ip_address, inet_ntoa(si_other.sin_addr), SOCKET_IP_ADDRESS_SIZE))
     {
         logger_log(LOG_DEBUG, "%s: packet received from wrong ip", __func__);
+        if (handle->nonblock)
+        {
+            /* the caller goes back to its poll rather than waiting here for the right one */
+            return -EAGAIN;
+        }
         goto again;
     }
 
+#if !defined(_WIN32) && defined(SO_TIMESTAMPNS)
+    if (timestamp_ns != 0)
+    {
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != 0; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if ((cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_TIMESTAMPNS))
+            {
+                ts = (struct timespec const*)CMSG_DATA(cmsg);
+                *timestamp_ns = (unsigned long long)ts->tv_sec * 1000000000ull + ts->tv_nsec;
+            }
+        }
+    }
+#endif
+
     return ret;
 }
 
@@ -343,3 +413,51 @@ int socket_write(socket_handle_t handle, char const* buffer, size_t size)
     return ret;
 }
 
+int socket_get_fd(socket_handle_t handle)
+{
+    if (handle == 0)
+    {
+        logger_log(LOG_ERROR, "%s: handle is a null pointer", __func__);
+        return -EINVAL;
+    }
+
+    return (int)handle->fd;
+}
+
+int socket_set_nonblock(socket_handle_t handle, int nonblock)
+{
+    int ret = 0;
+#ifdef _WIN32
+    u_long mode = (nonblock != 0);
+#endif
+
+    if (handle == 0)
+    {
+        logger_log(LOG_FATAL, "%s: handle parameter is a null pointer", __func__);
+        return -EINVAL;
+    }
+
+#ifndef _WIN32
+    ret = fcntl(handle->fd, F_GETFL);
+    if (ret >= 0)
+    {
+        ret = fcntl(handle->fd, F_SETFL, nonblock ? (ret | O_NONBLOCK) : (ret & ~O_NONBLOCK));
+    }
+    if (ret < 0)
+    {
+        logger_log(LOG_ERROR, "%s: unable to set non blocking mode: %s", __func__, strerror(errno));
+        return -errno;
+    }
+#else // _WIN32
+    ret = ioctlsocket(handle->fd, FIONBIO, &mode);
+    if (ret == SOCKET_ERROR)
+    {
+        logger_log(LOG_ERROR, "%s: unable to set non blocking mode", __func__);
+        return -EINVAL;
+    }
+#endif
+
+    handle->nonblock = nonblock;
+
+    return 0;
+}
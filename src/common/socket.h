@@ -74,6 +74,16 @@ int socket_release(socket_handle_t* handle);
  */
 int socket_read(socket_handle_t handle, char* buffer, size_t size);
 
+/**
+ * Read data from the socket, along with the time the kernel received it
+ * @param handle object handle
+ * @param buffer pointer where to put the data read
+ * @param size size of @p buffer data
+ * @param timestamp_ns filled with the receive time in nanoseconds (CLOCK_REALTIME), 0 if the kernel did not give it
+ * @return size read upon success, negative value otherwise
+ */
+int socket_read_timestamp(socket_handle_t handle, char* buffer, size_t size, unsigned long long* timestamp_ns);
+
 /**
  * Write data to the socket
  * @param handle object handle
@@ -83,5 +93,22 @@ int socket_read(socket_handle_t handle, char* buffer, size_t size);
  */
 int socket_write(socket_handle_t handle, char const* buffer, size_t size);
 
+/**
+ * Get the underlying descriptor, to poll it along with other descriptors
+ * @param handle object handle
+ * @return descriptor upon success, negative value otherwise
+ */
+int socket_get_fd(socket_handle_t handle);
+
+/**
+ * Set the non blocking mode, to be called after socket_init.
+ * In this mode, socket_read and socket_read_timestamp return -EAGAIN instead of waiting,
+ * when there is no datagram or when the one read comes from another address
+ * @param handle object handle
+ * @param nonblock 1 for non blocking mode, 0 for blocking mode
+ * @return 0 upon success, negative value otherwise
+ */
+int socket_set_nonblock(socket_handle_t handle, int nonblock);
+
 #endif /*__SOCKET_H__*/
 
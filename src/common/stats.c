@@ -0,0 +1,638 @@
+/*
+ *  This file is part of vban.
+ *  Copyright (c) 2015 by Benoît Quiniou <quiniouben@yahoo.fr>
+ *
+ *  vban is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  vban is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with vban.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include "stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#ifndef _WIN32
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#endif
+#include "common/thread.h"
+#include "common/logger.h"
+
+/** frame counter jumps larger than this are a sender restart, not losses nor reorders */
+#define STATS_FRAME_WINDOW      65536
+
+#define STATS_REQUEST_SIZE      1024
+#define STATS_RESPONSE_SIZE     (256 * 1024)
+
+/** how often the server checks if it has to stop, and how long it waits for a request */
+#define STATS_POLL_TIMEOUT_MS   200
+#define STATS_REQUEST_TIMEOUT_MS 1000
+
+#define STATS_CONTENT_TYPE      "application/openmetrics-text; version=1.0.0; charset=utf-8"
+
+#define STATS_QUANTILES_NB      3
+
+static char const* const stats_stage_names[STATS_STAGE_MAX] =
+{
+    "network",
+    "queue",
+    "write",
+    "device",
+    "total",
+};
+
+static double const stats_quantiles[STATS_QUANTILES_NB] = {0.5, 0.99, 0.999};
+
+int stats_init(struct stats_t** stats)
+{
+    if (stats == 0)
+    {
+        logger_log(LOG_FATAL, "%s: null pointer argument", __func__);
+        return -EINVAL;
+    }
+
+    *stats = calloc(1, sizeof(struct stats_t));
+    if (*stats == 0)
+    {
+        logger_log(LOG_FATAL, "%s: could not allocate memory", __func__);
+        return -ENOMEM;
+    }
+
+    return 0;
+}
+
+int stats_release(struct stats_t** stats)
+{
+    if (stats == 0)
+    {
+        logger_log(LOG_FATAL, "%s: null pointer argument", __func__);
+        return -EINVAL;
+    }
+
+    free(*stats);
+    *stats = 0;
+
+    return 0;
+}
+
+void stats_log(struct stats_t const* stats)
+{
+    size_t stream;
+    size_t stage;
+    struct histogram_t const* histogram;
+
+    for (stream = 0; stream != stats->nb_streams; ++stream)
+    {
+        for (stage = 0; stage != STATS_STAGE_MAX; ++stage)
+        {
+            histogram = &stats->streams[stream].latency[stage];
+            if (histogram->count == 0)
+            {
+                continue;
+            }
+
+            logger_log(LOG_INFO, "%s: stream %s, %s latency over %lu packets: p50 %lu us, p99 %lu us, p999 %lu us", __func__,
+                stats->streams[stream].name, stats_stage_names[stage], histogram->count, histogram_quantile(histogram, 0.5),
+                histogram_quantile(histogram, 0.99), histogram_quantile(histogram, 0.999));
+        }
+    }
+}
+
+unsigned long long stats_now_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    return (unsigned long long)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+void stats_count_frame(struct stats_stream_t* stats, unsigned int frame)
+{
+    int const diff = (int)(frame - stats->last_frame);
+
+    if (!stats->has_last_frame || (diff > STATS_FRAME_WINDOW) || (diff < -STATS_FRAME_WINDOW))
+    {
+        stats->has_last_frame = 1;
+        stats->last_frame = frame;
+        return;
+    }
+
+    if (diff > 0)
+    {
+        if (diff > 1)
+        {
+            STATS_ADD(stats, lost, diff - 1);
+        }
+        stats->last_frame = frame;
+    }
+    else if (diff == 0)
+    {
+        STATS_ADD(stats, duplicates, 1);
+    }
+    else
+    {
+        /* most likely one of the gaps. lost is served as a counter and never goes down:
+           packets really lost are lost minus reordered. An older duplicate is counted as reordered too, the window is not kept */
+        STATS_ADD(stats, reordered, 1);
+    }
+}
+
+#ifndef _WIN32
+
+struct stats_server_t
+{
+    struct stats_t const*       stats;
+    int                         fd;
+    struct sockaddr_un          unix_address;
+    pthread_t                   thread;
+    int                         started;
+    int                         stop;
+    char                        request[STATS_REQUEST_SIZE];
+    char                        response[STATS_RESPONSE_SIZE];
+};
+
+/* families of the per stream values: counters get the _total suffix, gauges in microseconds are served in seconds */
+struct stats_family_t
+{
+    char const*                 name;
+    char const*                 type;
+    char const*                 help;
+    size_t                      offset;
+};
+
+static struct stats_family_t const stats_stream_families[] =
+{
+    {"vban_packets",            "counter",  "Valid audio packets received or sent",                     offsetof(struct stats_stream_t, packets)},
+    {"vban_bytes",              "counter",  "Bytes of the valid audio packets received or sent",        offsetof(struct stats_stream_t, bytes)},
+    {"vban_lost_packets",       "counter",  "Frame counter gaps, including packets received later as reordered", offsetof(struct stats_stream_t, lost)},
+    {"vban_reordered_packets",  "counter",  "Packets received after a more recent one",                 offsetof(struct stats_stream_t, reordered)},
+    {"vban_duplicate_packets",  "counter",  "Packets received twice in a row",                          offsetof(struct stats_stream_t, duplicates)},
+    {"vban_late_packets",       "counter",  "Packets dropped because the next stage was behind",        offsetof(struct stats_stream_t, late)},
+    {"vban_xruns",              "counter",  "Audio device underruns or overruns recovered from",        offsetof(struct stats_stream_t, xruns)},
+    {"vban_short_transfers",    "counter",  "Audio device writes or reads not done in full",            offsetof(struct stats_stream_t, short_transfers)},
+    {"vban_buffer_depth_seconds", "gauge",  "Audio buffered before the device, or captured and not read yet", offsetof(struct stats_stream_t, depth_us)},
+};
+
+static char const* const stats_invalid_reasons[PACKET_INVALID_MAX] =
+{
+    "size",
+    "magic",
+    "stream",
+    "format",
+    "protocol",
+};
+
+static int stats_append(char* buffer, size_t size, size_t* offset, char const* format, ...)
+{
+    va_list args;
+    int ret;
+
+    if (*offset >= size)
+    {
+        return -ENOSPC;
+    }
+
+    va_start(args, format);
+    ret = vsnprintf(buffer + *offset, size - *offset, format, args);
+    va_end(args);
+
+    if ((ret < 0) || ((size_t)ret >= size - *offset))
+    {
+        *offset = size;
+        return -ENOSPC;
+    }
+
+    *offset += ret;
+    return 0;
+}
+
+/* label values escape backslash, double quote and line feed */
+static void stats_escape(char* dst, char const* src, size_t src_size)
+{
+    size_t index;
+
+    for (index = 0; (index != src_size) && (src[index] != 0); ++index)
+    {
+        if ((src[index] == '\\') || (src[index] == '"'))
+        {
+            *dst++ = '\\';
+            *dst++ = src[index];
+        }
+        else if (src[index] == '\n')
+        {
+            *dst++ = '\\';
+            *dst++ = 'n';
+        }
+        else
+        {
+            *dst++ = src[index];
+        }
+    }
+    *dst = 0;
+}
+
+static void stats_append_value(char* buffer, size_t size, size_t* offset, struct stats_family_t const* family,
+    char const* stream, unsigned long value)
+{
+    if (strcmp(family->type, "counter") == 0)
+    {
+        stats_append(buffer, size, offset, "%s_total{stream=\"%s\"} %lu\n", family->name, stream, value);
+    }
+    else
+    {
+        stats_append(buffer, size, offset, "%s{stream=\"%s\"} %lu.%06lu\n", family->name, stream, value / 1000000, value % 1000000);
+    }
+}
+
+/* stages no packet went through are left out: their quantiles would be undefined */
+static void stats_append_latency(char* buffer, size_t size, size_t* offset, char const* stream, char const* stage,
+    struct histogram_t const* histogram)
+{
+    size_t quantile;
+    unsigned long value;
+    unsigned long const count = __atomic_load_n(&histogram->count, __ATOMIC_RELAXED);
+    unsigned long long const sum = __atomic_load_n(&histogram->sum, __ATOMIC_RELAXED);
+
+    if (count == 0)
+    {
+        return;
+    }
+
+    for (quantile = 0; quantile != STATS_QUANTILES_NB; ++quantile)
+    {
+        value = histogram_quantile(histogram, stats_quantiles[quantile]);
+        stats_append(buffer, size, offset, "vban_latency_seconds{stream=\"%s\",stage=\"%s\",quantile=\"%g\"} %lu.%06lu\n",
+            stream, stage, stats_quantiles[quantile], value / 1000000, value % 1000000);
+    }
+
+    stats_append(buffer, size, offset, "vban_latency_seconds_count{stream=\"%s\",stage=\"%s\"} %lu\n", stream, stage, count);
+    stats_append(buffer, size, offset, "vban_latency_seconds_sum{stream=\"%s\",stage=\"%s\"} %llu.%06llu\n", stream, stage,
+        sum / 1000000, sum % 1000000);
+}
+
+static size_t stats_render(struct stats_t const* stats, char* buffer, size_t size)
+{
+    size_t offset = 0;
+    size_t family;
+    size_t stream;
+    size_t reason;
+    size_t stage;
+    char name[2 * VBAN_STREAM_NAME_SIZE + 1];
+    size_t const nb_streams = (stats->nb_streams < STATS_STREAMS_MAX_NB) ? stats->nb_streams : STATS_STREAMS_MAX_NB;
+
+    for (family = 0; family != sizeof(stats_stream_families) / sizeof(stats_stream_families[0]); ++family)
+    {
+        stats_append(buffer, size, &offset, "# TYPE %s %s\n# HELP %s %s.\n", stats_stream_families[family].name,
+            stats_stream_families[family].type, stats_stream_families[family].name, stats_stream_families[family].help);
+
+        for (stream = 0; stream != nb_streams; ++stream)
+        {
+            stats_escape(name, stats->streams[stream].name, VBAN_STREAM_NAME_SIZE);
+            stats_append_value(buffer, size, &offset, &stats_stream_families[family], name,
+                __atomic_load_n((unsigned long const*)((char const*)&stats->streams[stream] + stats_stream_families[family].offset), __ATOMIC_RELAXED));
+        }
+    }
+
+    stats_append(buffer, size, &offset, "# TYPE vban_invalid_packets counter\n# HELP vban_invalid_packets Packets of the stream rejected, by reason.\n");
+    for (stream = 0; stream != nb_streams; ++stream)
+    {
+        stats_escape(name, stats->streams[stream].name, VBAN_STREAM_NAME_SIZE);
+        for (reason = 0; reason != PACKET_INVALID_MAX; ++reason)
+        {
+            stats_append(buffer, size, &offset, "vban_invalid_packets_total{stream=\"%s\",reason=\"%s\"} %lu\n", name,
+                stats_invalid_reasons[reason], __atomic_load_n(&stats->streams[stream].invalid[reason], __ATOMIC_RELAXED));
+        }
+    }
+
+    stats_append(buffer, size, &offset, "# TYPE vban_latency_seconds summary\n# HELP vban_latency_seconds Time spent by the packets in each stage of the pipeline.\n");
+    for (stream = 0; stream != nb_streams; ++stream)
+    {
+        stats_escape(name, stats->streams[stream].name, VBAN_STREAM_NAME_SIZE);
+        for (stage = 0; stage != STATS_STAGE_MAX; ++stage)
+        {
+            stats_append_latency(buffer, size, &offset, name, stats_stage_names[stage], &stats->streams[stream].latency[stage]);
+        }
+    }
+
+    stats_append(buffer, size, &offset, "# TYPE vban_unknown_packets counter\n# HELP vban_unknown_packets Packets of no configured stream.\n"
+        "vban_unknown_packets_total %lu\n", __atomic_load_n(&stats->unknown, __ATOMIC_RELAXED));
+    stats_append(buffer, size, &offset, "# TYPE vban_queue_depth_packets gauge\n# HELP vban_queue_depth_packets Packets waiting between the network and audio threads.\n"
+        "vban_queue_depth_packets %lu\n", __atomic_load_n(&stats->queue_depth, __ATOMIC_RELAXED));
+
+    if (stats_append(buffer, size, &offset, "# EOF\n") != 0)
+    {
+        logger_log(LOG_WARNING, "%s: statistics do not fit in %zu bytes, truncated", __func__, size);
+        return 0;
+    }
+
+    return offset;
+}
+
+static int stats_send(int fd, char const* buffer, size_t size)
+{
+    ssize_t ret;
+
+    while (size != 0)
+    {
+        ret = send(fd, buffer, size, MSG_NOSIGNAL);
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -errno;
+        }
+
+        buffer += ret;
+        size -= ret;
+    }
+
+    return 0;
+}
+
+static void stats_serve(stats_server_handle_t handle, int fd)
+{
+    size_t size = 0;
+    size_t body_size = 0;
+    ssize_t ret;
+    struct pollfd pfd;
+    char header[256];
+    char const* status = "200 OK";
+
+    pfd.fd      = fd;
+    pfd.events  = POLLIN;
+
+    /* the request line is all that matters, the headers are read only to be polite */
+    while ((size < STATS_REQUEST_SIZE - 1) && (strstr(handle->request, "\r\n\r\n") == 0))
+    {
+        if (poll(&pfd, 1, STATS_REQUEST_TIMEOUT_MS) <= 0)
+        {
+            return;
+        }
+
+        ret = recv(fd, handle->request + size, STATS_REQUEST_SIZE - 1 - size, 0);
+        if (ret <= 0)
+        {
+            return;
+        }
+        size += ret;
+        handle->request[size] = 0;
+    }
+
+    if (strncmp(handle->request, "GET ", 4) != 0)
+    {
+        status = "405 Method Not Allowed";
+    }
+    else if ((strncmp(handle->request + 4, "/metrics ", 9) != 0) && (strncmp(handle->request + 4, "/ ", 2) != 0))
+    {
+        status = "404 Not Found";
+    }
+    else
+    {
+        body_size = stats_render(handle->stats, handle->response, STATS_RESPONSE_SIZE);
+        if (body_size == 0)
+        {
+            status = "500 Internal Server Error";
+        }
+    }
+
+    snprintf(header, sizeof(header), "HTTP/1.0 %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+        status, STATS_CONTENT_TYPE, body_size);
+
+    if ((stats_send(fd, header, strlen(header)) == 0) && (body_size != 0))
+    {
+        stats_send(fd, handle->response, body_size);
+    }
+}
+
+static void* stats_server_thread(void* arg)
+{
+    stats_server_handle_t const handle = (stats_server_handle_t)arg;
+    struct pollfd pfd;
+    int fd;
+    int ret;
+
+    pfd.fd      = handle->fd;
+    pfd.events  = POLLIN;
+
+    while (!__atomic_load_n(&handle->stop, __ATOMIC_ACQUIRE))
+    {
+        ret = poll(&pfd, 1, STATS_POLL_TIMEOUT_MS);
+        if ((ret <= 0) || !(pfd.revents & POLLIN))
+        {
+            continue;
+        }
+
+        fd = accept(handle->fd, 0, 0);
+        if (fd < 0)
+        {
+            logger_log(LOG_WARNING, "%s: accept error %d %s", __func__, errno, strerror(errno));
+            continue;
+        }
+
+        handle->request[0] = 0;
+        stats_serve(handle, fd);
+        close(fd);
+    }
+
+    return 0;
+}
+
+static int stats_server_listen(stats_server_handle_t handle, char const* address)
+{
+    struct sockaddr_in inet_address;
+    char const* port = strrchr(address, ':');
+    char ip[INET_ADDRSTRLEN] = "127.0.0.1";
+    int optflag = 1;
+
+    if (strchr(address, '/') != 0)
+    {
+        struct stat info;
+
+        if (strlen(address) >= sizeof(handle->unix_address.sun_path))
+        {
+            logger_log(LOG_ERROR, "%s: unix socket path %s is too long", __func__, address);
+            return -EINVAL;
+        }
+
+        handle->unix_address.sun_family = AF_UNIX;
+        strncpy(handle->unix_address.sun_path, address, sizeof(handle->unix_address.sun_path) - 1);
+
+        /* left over by a previous run */
+        if ((stat(address, &info) == 0) && S_ISSOCK(info.st_mode))
+        {
+            unlink(address);
+        }
+
+        handle->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (handle->fd < 0)
+        {
+            logger_log(LOG_ERROR, "%s: could not create socket: %s", __func__, strerror(errno));
+            return -errno;
+        }
+
+        if (bind(handle->fd, (struct sockaddr*)&handle->unix_address, sizeof(handle->unix_address)) < 0)
+        {
+            logger_log(LOG_ERROR, "%s: could not bind to %s: %s", __func__, address, strerror(errno));
+            handle->unix_address.sun_path[0] = 0;
+            return -errno;
+        }
+    }
+    else
+    {
+        if (port != 0)
+        {
+            if ((size_t)(port - address) >= sizeof(ip))
+            {
+                logger_log(LOG_ERROR, "%s: invalid address %s", __func__, address);
+                return -EINVAL;
+            }
+            memcpy(ip, address, port - address);
+            ip[port - address] = 0;
+            ++port;
+        }
+        else
+        {
+            port = address;
+        }
+
+        memset(&inet_address, 0, sizeof(inet_address));
+        inet_address.sin_family = AF_INET;
+        inet_address.sin_port   = htons(atoi(port));
+        if ((inet_address.sin_port == 0) || (inet_aton(ip, &inet_address.sin_addr) == 0))
+        {
+            logger_log(LOG_ERROR, "%s: invalid address %s", __func__, address);
+            return -EINVAL;
+        }
+
+        handle->fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (handle->fd < 0)
+        {
+            logger_log(LOG_ERROR, "%s: could not create socket: %s", __func__, strerror(errno));
+            return -errno;
+        }
+
+        setsockopt(handle->fd, SOL_SOCKET, SO_REUSEADDR, &optflag, sizeof(optflag));
+
+        if (bind(handle->fd, (struct sockaddr*)&inet_address, sizeof(inet_address)) < 0)
+        {
+            logger_log(LOG_ERROR, "%s: could not bind to %s: %s", __func__, address, strerror(errno));
+            return -errno;
+        }
+    }
+
+    if (listen(handle->fd, 4) < 0)
+    {
+        logger_log(LOG_ERROR, "%s: could not listen on %s: %s", __func__, address, strerror(errno));
+        return -errno;
+    }
+
+    logger_log(LOG_INFO, "%s: statistics served on %s", __func__, address);
+
+    return 0;
+}
+
+int stats_server_init(stats_server_handle_t* handle, char const* address, struct stats_t const* stats)
+{
+    int ret = 0;
+
+    if ((handle == 0) || (address == 0) || (stats == 0))
+    {
+        logger_log(LOG_FATAL, "%s: null pointer argument", __func__);
+        return -EINVAL;
+    }
+
+    *handle = calloc(1, sizeof(struct stats_server_t));
+    if (*handle == 0)
+    {
+        logger_log(LOG_FATAL, "%s: could not allocate memory", __func__);
+        return -ENOMEM;
+    }
+
+    (*handle)->stats    = stats;
+    (*handle)->fd       = -1;
+
+    ret = stats_server_listen(*handle, address);
+    if (ret == 0)
+    {
+        ret = thread_start(&(*handle)->thread, stats_server_thread, *handle);
+    }
+
+    if (ret != 0)
+    {
+        stats_server_release(handle);
+        return ret;
+    }
+
+    (*handle)->started = 1;
+
+    return 0;
+}
+
+int stats_server_release(stats_server_handle_t* handle)
+{
+    if (handle == 0)
+    {
+        logger_log(LOG_FATAL, "%s: null handle pointer", __func__);
+        return -EINVAL;
+    }
+
+    if (*handle != 0)
+    {
+        if ((*handle)->started)
+        {
+            __atomic_store_n(&(*handle)->stop, 1, __ATOMIC_RELEASE);
+            pthread_join((*handle)->thread, 0);
+        }
+
+        if ((*handle)->fd >= 0)
+        {
+            close((*handle)->fd);
+        }
+
+        if ((*handle)->unix_address.sun_path[0] != 0)
+        {
+            unlink((*handle)->unix_address.sun_path);
+        }
+
+        free(*handle);
+        *handle = 0;
+    }
+
+    return 0;
+}
+
+#else // _WIN32
+
+int stats_server_init(stats_server_handle_t* handle, char const* address, struct stats_t const* stats)
+{
+    logger_log(LOG_ERROR, "%s: statistics server is not supported on this platform", __func__);
+    return -ENOTSUP;
+}
+
+int stats_server_release(stats_server_handle_t* handle)
+{
+    return 0;
+}
+
+#endif // _WIN32
@@ -0,0 +1,159 @@
+/*
+ *  This file is part of vban.
+ *  Copyright (c) 2015 by Benoît Quiniou <quiniouben@yahoo.fr>
+ *
+ *  vban is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  vban is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with vban.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stddef.h>
+#include "vban/vban.h"
+#include "common/packet.h"
+#include "common/histogram.h"
+
+/**
+ * Maximum number of streams counted
+ */
+#define STATS_STREAMS_MAX_NB    32
+
+/**
+ * Maximum number of characters of the address the statistics are served on
+ */
+#define STATS_ADDRESS_SIZE      108
+
+/**
+ * Stages of the pipeline a packet goes through, each with a latency histogram per stream.
+ * Receptor: kernel receive timestamp, packet validated, taken by the audio thread, written to the device, played.
+ * Emitter: sound captured, packet read from the device, taken by the send thread, sent.
+ */
+enum stats_stage
+{
+    STATS_STAGE_NETWORK,    /* kernel receive timestamp to packet validated (receptor only) */
+    STATS_STAGE_QUEUE,      /* handed over to the other thread, to taken by it */
+    STATS_STAGE_WRITE,      /* taken, to fully written to the device (receptor) or the socket (emitter) */
+    STATS_STAGE_DEVICE,     /* device delay: to be played once written (receptor), or since captured when read (emitter) */
+    STATS_STAGE_TOTAL,      /* all of the above, for each packet */
+    STATS_STAGE_MAX
+};
+
+/**
+ * Counters and gauges of a stream.
+ * They are updated by the threads handling the stream with STATS_ADD / STATS_SET, and only read by the server.
+ */
+struct stats_stream_t
+{
+    char                        name[VBAN_STREAM_NAME_SIZE];
+    unsigned long               packets;            /* valid packets received, or sent */
+    unsigned long               bytes;
+    unsigned long               invalid[PACKET_INVALID_MAX];
+    unsigned long               lost;               /* frame counter gaps, including the ones a reordered packet filled since */
+    unsigned long               reordered;          /* received after a more recent one */
+    unsigned long               duplicates;
+    unsigned long               late;               /* dropped because the next stage was behind */
+    unsigned long               xruns;              /* device under / overruns it recovered from */
+    unsigned long               short_transfers;    /* device writes or reads not done in full */
+    unsigned long               depth_us;           /* gauge: audio buffered before the device (playback) or not read yet (capture) */
+    struct histogram_t          latency[STATS_STAGE_MAX];
+
+    /* frame counter tracking, network thread only */
+    unsigned int                last_frame;
+    int                         has_last_frame;
+};
+
+/**
+ * Statistics of a tool
+ */
+struct stats_t
+{
+    unsigned long               unknown;            /* packets of no configured stream */
+    unsigned long               queue_depth;        /* gauge: packets waiting between the two threads */
+    size_t                      nb_streams;
+    struct stats_stream_t       streams[STATS_STREAMS_MAX_NB];
+};
+
+/**
+ * Allocate zeroed statistics. The histograms make them too big for the stack.
+ * @param stats pointer that will be allocated
+ * @return 0 upon success, negative value otherwise
+ */
+int stats_init(struct stats_t** stats);
+
+/**
+ * Release statistics
+ * @param stats pointer that will be released
+ * @return 0 upon success, negative value otherwise
+ */
+int stats_release(struct stats_t** stats);
+
+/**
+ * Log the latency percentiles of each stream and stage, at LOG_INFO
+ */
+void stats_log(struct stats_t const* stats);
+
+/**
+ * Current time in nanoseconds, on the clock of the kernel receive timestamps (CLOCK_REALTIME)
+ */
+unsigned long long stats_now_ns(void);
+
+/**
+ * Record the latency of a stage, from @p start_ns to @p end_ns. Only one thread may record a given stage of a stream.
+ */
+#define STATS_LATENCY(_stats, _stage, _start_ns, _end_ns) \
+    histogram_record(&(_stats)->latency[_stage], ((_end_ns) > (_start_ns)) ? (unsigned long)(((_end_ns) - (_start_ns)) / 1000) : 0)
+
+/**
+ * Add to a counter. Relaxed atomics: no fence nor ordering, the counters are independent.
+ * @p _stats may be null, then nothing is counted.
+ */
+#define STATS_ADD(_stats, _counter, _value) \
+    do { if ((_stats) != 0) __atomic_add_fetch(&(_stats)->_counter, (_value), __ATOMIC_RELAXED); } while (0)
+
+/**
+ * Set a gauge, with the same rules as STATS_ADD
+ */
+#define STATS_SET(_stats, _gauge, _value) \
+    do { if ((_stats) != 0) __atomic_store_n(&(_stats)->_gauge, (_value), __ATOMIC_RELAXED); } while (0)
+
+/**
+ * Count losses, reorders and duplicates from the frame counter of a valid packet.
+ * @param stats stream statistics
+ * @param frame nuFrame of the packet
+ */
+void stats_count_frame(struct stats_stream_t* stats, unsigned int frame);
+
+/**
+ * Opaque handle definition
+ */
+struct stats_server_t;
+typedef struct stats_server_t* stats_server_handle_t;
+
+/**
+ * Start serving @p stats in OpenMetrics text format, over http, from a thread of its own.
+ * @param handle object pointer initialized
+ * @param address where to listen: PORT (on localhost), IP:PORT, or the path of a unix socket
+ * @param stats statistics to serve, must outlive the server
+ * @return 0 upon success, negative value otherwise
+ */
+int stats_server_init(stats_server_handle_t* handle, char const* address, struct stats_t const* stats);
+
+/**
+ * Stop the server and release it
+ * @param handle pointer to the objet handle
+ * @return 0 upon success, negative value otherwise
+ */
+int stats_server_release(stats_server_handle_t* handle);
+
+#endif /*__STATS_H__*/
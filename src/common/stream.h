@@ -30,6 +30,8 @@ struct stream_config_t
     unsigned int            nb_channels;
     unsigned int            sample_rate;
     enum VBanBitResolution  bit_fmt;
+    /* samples per packet, 0 if not known: lets a device size its period on the packets */
+    unsigned int            nb_samples;
 };
 
 /**
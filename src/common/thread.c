@@ -0,0 +1,243 @@
+/*
+ *  This file is part of vban.
+ *  Copyright (c) 2015 by Benoît Quiniou <quiniouben@yahoo.fr>
+ *
+ *  vban is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  vban is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with vban.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include "thread.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <sched.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+#include "common/logger.h"
+
+/** stack touched by a realtime thread before it starts working */
+#define THREAD_STACK_PREFAULT_SIZE  (256 * 1024)
+#define THREAD_PAGE_SIZE            4096
+
+/** MXCSR flush to zero and denormals are zero bits */
+#define THREAD_MXCSR_FTZ_DAZ        0x8040
+/** FPCR flush to zero bit */
+#define THREAD_FPCR_FZ              (1ull << 24)
+
+void thread_config_init(struct thread_config_t* config)
+{
+    config->priority    = 0;
+    config->cpu         = THREAD_CPU_ANY;
+    config->realtime    = 0;
+}
+
+void thread_config_set_realtime(struct thread_config_t* config, int priority)
+{
+    config->realtime = 1;
+    if (config->priority == 0)
+    {
+        config->priority = priority;
+    }
+}
+
+int thread_parse_list(int* values, size_t nb_values, char const* arg)
+{
+    size_t index = 0;
+    char* end = 0;
+    long value = 0;
+
+    if ((values == 0) || (arg == 0) || (nb_values == 0))
+    {
+        logger_log(LOG_FATAL, "%s: null pointer argument", __func__);
+        return -EINVAL;
+    }
+
+    while ((index != nb_values) && (*arg != '\0'))
+    {
+        value = strtol(arg, &end, 10);
+        if ((end == arg) || ((*end != ',') && (*end != '\0')) || (value < -1))
+        {
+            logger_log(LOG_FATAL, "%s: invalid value list %s", __func__, arg);
+            return -EINVAL;
+        }
+
+        values[index++] = (int)value;
+        arg = (*end == ',') ? end + 1 : end;
+    }
+
+    if (index == 0)
+    {
+        logger_log(LOG_FATAL, "%s: empty value list", __func__);
+        return -EINVAL;
+    }
+
+    for (; index != nb_values; ++index)
+    {
+        values[index] = values[index - 1];
+    }
+
+    return 0;
+}
+
+int thread_realtime_init(void)
+{
+    int ret = 0;
+
+#ifdef __GLIBC__
+    /* freed memory stays in the heap, locked, instead of being unmapped and faulted in again */
+    mallopt(M_TRIM_THRESHOLD, -1);
+    mallopt(M_MMAP_MAX, 0);
+#endif
+
+#ifndef _WIN32
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+    {
+        ret = -errno;
+        logger_log(LOG_WARNING, "%s: could not lock memory: %s, pages may be faulted in while running (see ulimit -l)", __func__, strerror(errno));
+        return ret;
+    }
+
+    logger_log(LOG_INFO, "%s: memory locked", __func__);
+#else
+    logger_log(LOG_WARNING, "%s: memory locking not supported on this system", __func__);
+    ret = -ENOTSUP;
+#endif
+
+    return ret;
+}
+
+static void thread_prefault_stack(void)
+{
+    volatile char stack[THREAD_STACK_PREFAULT_SIZE];
+    size_t index;
+
+    for (index = 0; index < sizeof(stack); index += THREAD_PAGE_SIZE)
+    {
+        stack[index] = 0;
+    }
+}
+
+static void thread_set_flush_to_zero(void)
+{
+    /* denormal floats are slow to compute on most cpus, and inaudible */
+#if defined(__SSE__)
+    _mm_setcsr(_mm_getcsr() | THREAD_MXCSR_FTZ_DAZ);
+#elif defined(__aarch64__)
+    unsigned long long fpcr;
+
+    __asm__ __volatile__ ("mrs %0, fpcr" : "=r" (fpcr));
+    __asm__ __volatile__ ("msr fpcr, %0" : : "r" (fpcr | THREAD_FPCR_FZ));
+#endif
+}
+
+int thread_start(pthread_t* thread, void* (*routine)(void*), void* arg)
+{
+    int ret = 0;
+#ifndef _WIN32
+    sigset_t mask;
+    sigset_t old_mask;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+#endif
+
+    ret = pthread_create(thread, 0, routine, arg);
+
+#ifndef _WIN32
+    pthread_sigmask(SIG_SETMASK, &old_mask, 0);
+#endif
+
+    if (ret != 0)
+    {
+        logger_log(LOG_FATAL, "%s: could not create thread: %s", __func__, strerror(ret));
+        return -ret;
+    }
+
+    return 0;
+}
+
+void thread_setup(struct thread_config_t const* config, char const* name)
+{
+    int ret = 0;
+    int applied = 1;
+    struct sched_param param;
+
+    if (config->realtime)
+    {
+        thread_prefault_stack();
+        thread_set_flush_to_zero();
+    }
+
+#ifdef __linux__
+    pthread_setname_np(pthread_self(), name);
+
+    if (config->cpu != THREAD_CPU_ANY)
+    {
+        cpu_set_t set;
+
+        CPU_ZERO(&set);
+        CPU_SET(config->cpu, &set);
+        ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (ret != 0)
+        {
+            logger_log(LOG_WARNING, "%s: could not pin %s thread to cpu %d: %s", __func__, name, config->cpu, strerror(ret));
+            applied = 0;
+        }
+    }
+#else
+    if (config->cpu != THREAD_CPU_ANY)
+    {
+        logger_log(LOG_WARNING, "%s: cpu affinity not supported on this system, %s thread not pinned", __func__, name);
+        applied = 0;
+    }
+#endif
+
+    if (config->priority > 0)
+    {
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = config->priority;
+        if (param.sched_priority < sched_get_priority_min(SCHED_FIFO))
+        {
+            param.sched_priority = sched_get_priority_min(SCHED_FIFO);
+        }
+        else if (param.sched_priority > sched_get_priority_max(SCHED_FIFO))
+        {
+            param.sched_priority = sched_get_priority_max(SCHED_FIFO);
+        }
+
+        ret = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (ret != 0)
+        {
+            logger_log(LOG_WARNING, "%s: could not give %s thread realtime priority %d: %s, keeping default scheduling", __func__,
+                name, param.sched_priority, strerror(ret));
+            applied = 0;
+        }
+    }
+
+    if (applied)
+    {
+        logger_log(LOG_INFO, "%s: %s thread priority %d, cpu %d%s", __func__, name, config->priority, config->cpu,
+            config->realtime ? ", realtime profile" : "");
+    }
+}
@@ -0,0 +1,92 @@
+/*
+ *  This file is part of vban.
+ *  Copyright (c) 2015 by Benoît Quiniou <quiniouben@yahoo.fr>
+ *
+ *  vban is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  vban is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with vban.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __THREAD_H__
+#define __THREAD_H__
+
+#include <stddef.h>
+#include <pthread.h>
+
+/**
+ * Thread scheduling helpers, for the tools that split network and audio work in several threads.
+ * Failing to apply a setting is never fatal: it is logged and the thread keeps the default scheduling.
+ */
+
+#define THREAD_CPU_ANY  -1
+
+/**
+ * SCHED_FIFO priorities given by the realtime profile when none is asked:
+ * the thread talking to the audio device above the one talking to the network
+ */
+#define THREAD_PRIORITY_AUDIO       80
+#define THREAD_PRIORITY_NETWORK     70
+
+/**
+ * Scheduling of one thread
+ */
+struct thread_config_t
+{
+    int     priority;   /* SCHED_FIFO priority, 0 to keep the default scheduling */
+    int     cpu;        /* CPU to pin the thread to, THREAD_CPU_ANY not to pin it */
+    int     realtime;   /* prefault the stack and flush denormal floats to zero */
+};
+
+/**
+ * Default config: no realtime priority, not pinned
+ */
+void thread_config_init(struct thread_config_t* config);
+
+/**
+ * Switch a config to the realtime profile, with @p priority unless a priority was already set
+ */
+void thread_config_set_realtime(struct thread_config_t* config, int priority);
+
+/**
+ * Parse a comma separated list of integers, one per thread. When the list is shorter than
+ * @p nb_values, its last value is used for the remaining threads.
+ * @param values array to fill
+ * @param nb_values number of threads
+ * @param arg command line parameter
+ * @return 0 upon success, negative value otherwise
+ */
+int thread_parse_list(int* values, size_t nb_values, char const* arg);
+
+/**
+ * Realtime profile for the whole process, to be called before the threads start: lock all current and
+ * future memory so that it is never paged out nor faulted in while running, and keep freed heap memory.
+ * @return 0 upon success, negative value if memory could not be locked (the process can go on without)
+ */
+int thread_realtime_init(void);
+
+/**
+ * Start a thread. Termination signals are blocked in it, so that they keep being handled by the main thread.
+ * @param thread thread to start
+ * @param routine thread function
+ * @param arg argument of @p routine
+ * @return 0 upon success, negative value otherwise
+ */
+int thread_start(pthread_t* thread, void* (*routine)(void*), void* arg);
+
+/**
+ * Apply a scheduling config to the calling thread and name it.
+ * @param config scheduling to apply
+ * @param name thread name, for logs and system tools
+ */
+void thread_setup(struct thread_config_t const* config, char const* name);
+
+#endif /*__THREAD_H__*/
@@ -26,8 +26,18 @@
 #include "common/audio.h"
 #include "common/logger.h"
 #include "common/packet.h"
+#include "common/pacer.h"
+#include "common/packet_pool.h"
+#include "common/packet_ring.h"
+#include "common/stats.h"
+#include "common/thread.h"
 #include "common/backend/audio_backend.h"
 
+/** packets waiting for the send thread, beyond that the capture drops them */
+#define RING_SLOTS_NB   64
+/** the ring full, plus the packet being captured and the one being sent */
+#define POOL_PACKETS_NB (RING_SLOTS_NB + 2)
+
 struct config_t
 {
     struct socket_config_t      socket;
@@ -35,13 +45,45 @@ struct config_t
     struct stream_config_t      stream;
     struct audio_map_config_t   map;
     char                        stream_name[VBAN_STREAM_NAME_SIZE];
+    int                         paced;
+    struct thread_config_t      capture_thread;
+    struct thread_config_t      send_thread;
+    int                         realtime;
+    char                        stats_address[STATS_ADDRESS_SIZE];
 };
 
+/* counters of a pipeline stage. The depth of its input queue is sampled for each packet going through */
+struct stage_stats_t
+{
+    unsigned long               nb_packets;
+    unsigned long               nb_dropped;
+    unsigned long               nb_samples;
+    unsigned long               depth_max;
+    unsigned long long          depth_sum;
+};
+
+/* the main thread captures the packets into the pool and hands them to the send thread through the ring,
+   so that a stalled send never delays the capture */
 struct main_t
 {
+    struct config_t const*      config;
     socket_handle_t             socket;
     audio_handle_t              audio;
+    pacer_handle_t              pacer;
+    packet_pool_handle_t        pool;
+    packet_ring_handle_t        ring;
+    pthread_t                   send_thread;
+    int                         stop;
+    struct stats_t*             stats;
+    stats_server_handle_t       stats_server;
+
+    /* header of the next packet, and payload captured while the pool is empty */
     char                        buffer[VBAN_PROTOCOL_MAX_SIZE];
+    int                         dropping;
+    struct stream_config_t      stream;
+    /* capture queue is the device buffer, or the pacer read-ahead, in microseconds, send queue is the ring in packets */
+    struct stage_stats_t        capture_stats;
+    struct stage_stats_t        send_stats;
 };
 
 static int MainRun = 1;
@@ -57,13 +99,17 @@ void usage()
     printf("-p, --port=PORT         : MANDATORY. port to use\n");
     printf("-s, --streamname=NAME   : MANDATORY. streamname to use\n");
     printf("-b, --backend=TYPE      : audio backend to use. %s\n", audio_backend_get_help());
-    printf("-d, --device=NAME       : Audio device name. This is file name for file backend, server name for jack backend, device for alsa, stream_name for pulseaudio.\n");
-    printf("-r, --rate=VALUE        : Audio device sample rate. default 44100\n");
+    printf("-d, --device=NAME       : Audio device name. This is file name for file and wav backends, server name for jack backend, device for alsa, stream_name for pulseaudio, target node for pipewire, shared memory object for shm.\n");
+    printf("-r, --rate=VALUE        : Audio device sample rate. default 44100. -r, -n and -f are taken from the file header with wav backend\n");
     printf("-n, --nbchannels=VALUE  : Audio device number of channels. default 2\n");
     printf("-f, --format=VALUE      : Audio device sample format (see below). default is 16I (16bits integer)\n");
     printf("-c, --channels=LIST     : channels from the audio device to use. LIST is of form x,y,z,... default is to forward the stream as it is\n");
     printf("-x, --bufsize=VALUE     : Audio device buffer size. default 1024\n");
-
+    printf("-t, --paced             : send packets at the stream sample rate, reading the device ahead in a separate thread. For sources that are not clocked (file, pipe, wav backends)\n");
+    printf("-a, --affinity=LIST     : CPUs to pin the capture and send threads to, of form capture,send (one value for both). default is not to pin them\n");
+    printf("-P, --priority=LIST     : SCHED_FIFO priorities of the capture and send threads, of form capture,send (one value for both). 0 keeps default scheduling. default is 0\n");
+    printf("-R, --realtime          : realtime profile: lock memory, prefault stacks, flush denormals to zero, and SCHED_FIFO priorities %d,%d unless -P is given\n", THREAD_PRIORITY_AUDIO, THREAD_PRIORITY_NETWORK);
+    printf("-m, --metrics=ADDRESS   : serve stream statistics in OpenMetrics format over http, on PORT (localhost), IP:PORT or the path of a unix socket. default is not to serve them\n");
     printf("-l, --loglevel=LEVEL    : Log level, from 0 (FATAL) to 4 (DEBUG). default is 1 (ERROR)\n");
     printf("-h, --help              : display this message\n\n");
     printf("%s\n\n", stream_bit_fmt_help());
@@ -73,6 +119,7 @@ int get_options(struct config_t* config, int argc, char* const* argv)
 {
     int c = 0;
     int ret = 0;
+    int values[2];
 
     static const struct option options[] =
     {
@@ -86,6 +133,11 @@ int get_options(struct config_t* config, int argc, char* const* argv)
         {"format",      required_argument,  0, 'f'},
         {"channels",    required_argument,  0, 'c'},
         {"bufsize",     optional_argument,  0, 'x'},
+        {"paced",       no_argument,        0, 't'},
+        {"affinity",    required_argument,  0, 'a'},
+        {"priority",    required_argument,  0, 'P'},
+        {"realtime",    no_argument,        0, 'R'},
+        {"metrics",     required_argument,  0, 'm'},
         {"loglevel",    required_argument,  0, 'l'},
         {"help",        no_argument,        0, 'h'},
         {0,             0,                  0,  0 }
@@ -98,11 +150,13 @@ int get_options(struct config_t* config, int argc, char* const* argv)
     config->audio.buffer_size   = 1024; /*XXX Why ?*/
 
     config->socket.direction    = SOCKET_OUT;
+    thread_config_init(&config->capture_thread);
+    thread_config_init(&config->send_thread);
 
     /* yes, I assume config is not 0 */
     while (1)
     {
-        c = getopt_long(argc, argv, "i:p:s:b:d:r:n:f:x:c:l:h", options, 0);
+        c = getopt_long(argc, argv, "i:p:s:b:d:r:n:f:x:c:ta:P:Rm:l:h", options, 0);
         if (c == -1)
             break;
 
@@ -148,6 +202,30 @@ int get_options(struct config_t* config, int argc, char* const* argv)
                 config->audio.buffer_size = atoi(optarg);
                 break;
 
+            case 't':
+                config->paced = 1;
+                break;
+
+            case 'a':
+                ret = thread_parse_list(values, 2, optarg);
+                config->capture_thread.cpu = values[0];
+                config->send_thread.cpu = values[1];
+                break;
+
+            case 'P':
+                ret = thread_parse_list(values, 2, optarg);
+                config->capture_thread.priority = values[0];
+                config->send_thread.priority = values[1];
+                break;
+
+            case 'R':
+                config->realtime = 1;
+                break;
+
+            case 'm':
+                strncpy(config->stats_address, optarg, STATS_ADDRESS_SIZE-1);
+                break;
+
             case 'l':
                 logger_set_output_level(atoi(optarg));
                 break;
@@ -164,6 +242,12 @@ int get_options(struct config_t* config, int argc, char* const* argv)
         }
     }
 
+    if (config->realtime)
+    {
+        thread_config_set_realtime(&config->capture_thread, THREAD_PRIORITY_AUDIO);
+        thread_config_set_realtime(&config->send_thread, THREAD_PRIORITY_NETWORK);
+    }
+
     /** check if we got all arguments */
     if ((config->socket.ip_address[0] == 0)
         || (config->socket.port == 0)
@@ -174,15 +258,170 @@ int get_options(struct config_t* config, int argc, char* const* argv)
         return 1;
     }
 
-    if (!strncmp(config->audio.backend_name, "jack", AUDIO_BACKEND_NAME_SIZE))
+    return 0;
+}
+
+static void stage_stats_sample(struct stage_stats_t* stats, unsigned long depth)
+{
+    ++stats->nb_samples;
+    stats->depth_sum += depth;
+    if (depth > stats->depth_max)
     {
-        logger_log(LOG_FATAL, "Sorry jack backend is not ready for emitter yet");
-        return 1;
+        stats->depth_max = depth;
+    }
+}
+
+static void stage_stats_log(char const* name, char const* unit, struct stage_stats_t const* stats)
+{
+    logger_log(LOG_INFO, "%s stage: %lu packets, %lu dropped", name, stats->nb_packets, stats->nb_dropped);
+    if (stats->nb_samples != 0)
+    {
+        logger_log(LOG_INFO, "%s stage: queue depth average %.1f, max %lu %s", name,
+            (double)stats->depth_sum / (double)stats->nb_samples, stats->depth_max, unit);
+    }
+}
+
+static void* send_thread(void* arg)
+{
+    struct main_t* const main_s = (struct main_t*)arg;
+    struct packet_t* packet;
+    size_t size;
+    unsigned long long now;
+    unsigned long long sent;
+    int ret = 0;
+
+    thread_setup(&main_s->config->send_thread, "vban_send");
+
+    /* what was captured before the end of the source is still sent */
+    while (1)
+    {
+        packet = packet_ring_pop(main_s->ring);
+        if (packet == 0)
+        {
+            if (__atomic_load_n(&main_s->stop, __ATOMIC_ACQUIRE))
+            {
+                break;
+            }
+
+            ret = packet_ring_wait(main_s->ring);
+            if (ret < 0)
+            {
+                break;
+            }
+            continue;
+        }
+
+        now = stats_now_ns();
+        STATS_LATENCY(&main_s->stats->streams[0], STATS_STAGE_QUEUE, packet->stage_ns, now);
+        size = packet->size;
+        ret = socket_write(main_s->socket, packet->data, size);
+
+        sent = stats_now_ns();
+        STATS_LATENCY(&main_s->stats->streams[0], STATS_STAGE_WRITE, now, sent);
+        STATS_LATENCY(&main_s->stats->streams[0], STATS_STAGE_TOTAL, packet->timestamp_ns, sent);
+        packet_pool_put(main_s->pool, packet);
+        if (ret < 0)
+        {
+            ++main_s->send_stats.nb_dropped;
+            __atomic_store_n(&MainRun, 0, __ATOMIC_RELEASE);
+            break;
+        }
+
+        ++main_s->send_stats.nb_packets;
+        STATS_ADD(&main_s->stats->streams[0], packets, 1);
+        STATS_ADD(&main_s->stats->streams[0], bytes, size);
     }
 
     return 0;
 }
 
+static int capture_packet(struct main_t* main_s, int max_size)
+{
+    int size = 0;
+    struct packet_t* const packet = packet_pool_get(main_s->pool);
+    char* const buffer = (packet != 0) ? packet->data : main_s->buffer;
+    size_t const frame_size = VBanBitResolutionSize[main_s->stream.bit_fmt] * main_s->stream.nb_channels;
+    struct stats_stream_t* const stats = &main_s->stats->streams[0];
+    unsigned long latency_us = 0;
+    unsigned long depth_us = 0;
+    unsigned long long now;
+
+    /* captured straight into a packet of the pool, when there is one */
+    if (main_s->pacer != 0)
+    {
+        /* what is read ahead is buffered, not delayed by the device */
+        depth_us = (unsigned long)(((unsigned long long)(pacer_get_depth(main_s->pacer) / frame_size) * 1000000) / main_s->stream.sample_rate);
+        stage_stats_sample(&main_s->capture_stats, depth_us);
+        STATS_SET(stats, depth_us, depth_us);
+        if (pacer_get_latency(main_s->pacer, &latency_us) != 0)
+        {
+            latency_us = 0;
+        }
+        size = pacer_read(main_s->pacer, PACKET_PAYLOAD_PTR(buffer), max_size);
+    }
+    else
+    {
+        if (audio_get_latency(main_s->audio, &latency_us) == 0)
+        {
+            stage_stats_sample(&main_s->capture_stats, latency_us);
+            STATS_SET(stats, depth_us, latency_us);
+        }
+        size = audio_read(main_s->audio, PACKET_PAYLOAD_PTR(buffer), max_size);
+    }
+
+    if (size <= 0)
+    {
+        if (packet != 0)
+        {
+            packet_pool_put(main_s->pool, packet);
+        }
+        return size;
+    }
+
+    ++main_s->capture_stats.nb_packets;
+    packet_set_new_content(main_s->buffer, size);
+
+    /* the device delay is how long the first sample of the packet waited to be read */
+    now = stats_now_ns();
+    if (latency_us != 0)
+    {
+        histogram_record(&stats->latency[STATS_STAGE_DEVICE], latency_us);
+    }
+
+    if (packet != 0)
+    {
+        memcpy(packet->data, main_s->buffer, sizeof(struct VBanHeader));
+        packet->size            = size + sizeof(struct VBanHeader);
+        packet->timestamp_ns    = now - (latency_us * 1000ull);
+        packet->stage_ns        = now;
+        if (packet_check(main_s->config->stream_name, packet->data, packet->size, 0) != 0)
+        {
+            logger_log(LOG_ERROR, "%s: packet prepared is invalid", __func__);
+            packet_pool_put(main_s->pool, packet);
+            return -EINVAL;
+        }
+
+        stage_stats_sample(&main_s->send_stats, packet_ring_depth(main_s->ring));
+        STATS_SET(main_s->stats, queue_depth, packet_ring_depth(main_s->ring));
+        if (packet_ring_push(main_s->ring, packet) == 0)
+        {
+            main_s->dropping = 0;
+            return size;
+        }
+
+        packet_pool_put(main_s->pool, packet);
+    }
+
+    if (!main_s->dropping)
+    {
+        logger_log(LOG_WARNING, "%s: network is late, dropping packets", __func__);
+    }
+    main_s->dropping = 1;
+    ++main_s->capture_stats.nb_dropped;
+    STATS_ADD(stats, late, 1);
+
+    return size;
+}
 
 int main(int argc, char* const* argv)
 {
@@ -190,6 +429,7 @@ int main(int argc, char* const* argv)
     int size = 0;
     struct config_t config;
     struct stream_config_t stream_config;
+    struct audio_caps_t caps;
     struct main_t   main_s;
     int max_size = 0;
 
@@ -197,6 +437,11 @@ int main(int argc, char* const* argv)
 
     memset(&config, 0, sizeof(struct config_t));
     memset(&main_s, 0, sizeof(struct main_t));
+    main_s.config = &config;
+
+    /* stop the main loop and release the audio device properly */
+    signal(SIGINT, signalHandler);
+    signal(SIGTERM, signalHandler);
 
     ret = get_options(&config, argc, argv);
     if (ret != 0)
@@ -204,12 +449,24 @@ int main(int argc, char* const* argv)
         return ret;
     }
 
+    /* from here on, logging never blocks the audio and network threads on stdio */
+    logger_start();
+
+    if (config.realtime)
+    {
+        /* not fatal, the warning says what is missing */
+        thread_realtime_init();
+    }
+
     ret = socket_init(&main_s.socket, &config.socket);
     if (ret != 0)
     {
         return ret;
     }
 
+    snprintf(config.audio.stream_name, sizeof(config.audio.stream_name), "%s", config.stream_name);
+    /* lets the pacer read-ahead thread poll an idle source, and stop */
+    config.audio.nonblock = config.paced;
     ret = audio_init(&main_s.audio, &config.audio);
     if (ret != 0)
     {
@@ -222,6 +479,49 @@ int main(int argc, char* const* argv)
         return ret;
     }
 
+    ret = stats_init(&main_s.stats);
+    if (ret != 0)
+    {
+        return ret;
+    }
+
+    snprintf(main_s.stats->streams[0].name, sizeof(main_s.stats->streams[0].name), "%s", config.stream_name);
+    main_s.stats->nb_streams = 1;
+    audio_set_stats(main_s.audio, &main_s.stats->streams[0]);
+
+    if (config.stats_address[0] != 0)
+    {
+        ret = stats_server_init(&main_s.stats_server, config.stats_address, main_s.stats);
+        if (ret != 0)
+        {
+            return ret;
+        }
+    }
+
+    /* a file to read knows its own format better than the command line */
+    ret = audio_probe_stream_config(main_s.audio, &config.stream);
+    if (ret == 0)
+    {
+        logger_log(LOG_INFO, "%s: using device stream config: nb channels %d, sample rate %d, bit_fmt %s", __func__,
+            config.stream.nb_channels, config.stream.sample_rate, stream_print_bit_fmt(config.stream.bit_fmt));
+    }
+    else if (ret != -ENOTSUP)
+    {
+        return ret;
+    }
+
+    /* the device is read one packet at a time, on the channels actually sent */
+    stream_config = config.stream;
+    if (config.map.nb_channels != 0)
+    {
+        stream_config.nb_channels = config.map.nb_channels;
+    }
+    if ((stream_config.nb_channels != 0) && (VBanBitResolutionSize[stream_config.bit_fmt] != 0))
+    {
+        packet_init_header(main_s.buffer, &stream_config, config.stream_name);
+        config.stream.nb_samples = packet_get_max_payload_size(main_s.buffer) / (VBanBitResolutionSize[stream_config.bit_fmt] * stream_config.nb_channels);
+    }
+
     ret = audio_set_stream_config(main_s.audio, &config.stream);
     if (ret != 0)
     {
@@ -229,35 +529,73 @@ int main(int argc, char* const* argv)
     }
 
     audio_get_stream_config(main_s.audio, &stream_config);
+    main_s.stream = stream_config;
     packet_init_header(main_s.buffer, &stream_config, config.stream_name);
     max_size = packet_get_max_payload_size(main_s.buffer);
 
-    while (MainRun)
+    if (!config.paced && (audio_get_caps(main_s.audio, &caps) == 0) && !caps.has_clock)
     {
-        size = audio_read(main_s.audio, PACKET_PAYLOAD_PTR(main_s.buffer), max_size);
-        if (size < 0)
+        logger_log(LOG_WARNING, "%s: audio source is not clocked and will be read as fast as possible, use -t to send it at the stream rate", __func__);
+    }
+
+    if (config.paced)
+    {
+        ret = pacer_init(&main_s.pacer, main_s.audio, &stream_config, max_size);
+        if (ret != 0)
         {
-            MainRun = 0;
-            break;
+            return ret;
         }
+    }
 
-        packet_set_new_content(main_s.buffer, size);
-        ret = packet_check(config.stream_name, main_s.buffer, size + sizeof(struct VBanHeader));
-        if (ret != 0)
+    ret = packet_pool_init(&main_s.pool, POOL_PACKETS_NB);
+    if (ret != 0)
+    {
+        return ret;
+    }
+
+    ret = packet_ring_init(&main_s.ring, RING_SLOTS_NB);
+    if (ret != 0)
+    {
+        return ret;
+    }
+
+    ret = thread_start(&main_s.send_thread, send_thread, &main_s);
+    if (ret != 0)
+    {
+        return ret;
+    }
+
+    thread_setup(&config.capture_thread, "vban_capture");
+
+    while (__atomic_load_n(&MainRun, __ATOMIC_ACQUIRE))
+    {
+        size = capture_packet(&main_s, max_size);
+        if (size < 0)
         {
-            logger_log(LOG_ERROR, "%s: packet prepared is invalid", __func__);
             break;
         }
-
-        ret = socket_write(main_s.socket, main_s.buffer, size + sizeof(struct VBanHeader));
-        if (ret < 0)
+        else if (size == 0)
         {
-            MainRun = 0;
+            logger_log(LOG_INFO, "%s: end of audio source", __func__);
+            ret = 0;
             break;
         }
     }
 
+    __atomic_store_n(&main_s.stop, 1, __ATOMIC_RELEASE);
+    packet_ring_wake(main_s.ring);
+    pthread_join(main_s.send_thread, 0);
+
+    stage_stats_log((main_s.pacer != 0) ? "read-ahead" : "capture", "us", &main_s.capture_stats);
+    stage_stats_log("send", "packets", &main_s.send_stats);
+
+    stats_log(main_s.stats);
+    stats_server_release(&main_s.stats_server);
+    pacer_release(&main_s.pacer);
+    packet_ring_release(&main_s.ring);
+    packet_pool_release(&main_s.pool);
     audio_release(&main_s.audio);
+    stats_release(&main_s.stats);
     socket_release(&main_s.socket);
 
     return ret;
@@ -0,0 +1,662 @@
+/*
+ *  This file is part of vban.
+ *  Copyright (c) 2015 by Benoît Quiniou <quiniouben@yahoo.fr>
+ *
+ *  vban is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  vban is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with vban.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <getopt.h>
+#include <errno.h>
+#include <time.h>
+#ifndef _WIN32
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#endif
+#include "vban/vban.h"
+#include "common/version.h"
+#include "common/audio.h"
+#include "common/logger.h"
+#include "common/packet.h"
+#include "common/socket.h"
+#include "common/stream.h"
+
+#define LOADGEN_STREAMS_MAX_NB      256
+#define LOADGEN_RUNS_MAX_NB         32
+#define LOADGEN_PATH_SIZE           256
+#define LOADGEN_STARTUP_MS          500
+#define LOADGEN_DRAIN_MS            200
+
+struct config_t
+{
+    struct socket_config_t      socket;
+    /* room left for the stream number */
+    char                        stream_prefix[VBAN_STREAM_NAME_SIZE - 5];
+    struct stream_config_t      stream;
+    size_t                      nb_frames;
+    size_t                      runs[LOADGEN_RUNS_MAX_NB];
+    size_t                      nb_runs;
+    unsigned int                duration;
+    unsigned int                port_step;
+    char                        receptor[LOADGEN_PATH_SIZE];
+    int                         loglevel;
+};
+
+/** one synthetic stream, and the receptor it drives in companion mode */
+struct loadgen_stream_t
+{
+    char                        name[VBAN_STREAM_NAME_SIZE];
+    audio_handle_t              audio;
+    socket_handle_t             socket;
+    char                        buffer[VBAN_PROTOCOL_MAX_SIZE];
+    unsigned long               nb_errors;
+
+    int                         pid;
+    char                        log_path[LOADGEN_PATH_SIZE];
+    double                      cpu_s;
+    unsigned long long          nb_frames_checked;
+    unsigned long long          nb_frames_lost;
+    unsigned long               nb_corrupted;
+    int                         verified;
+};
+
+struct run_t
+{
+    size_t                      nb_streams;
+    struct loadgen_stream_t*    streams;
+    size_t                      payload_size;
+    unsigned long long          nb_ticks;
+    unsigned long               nb_late_ticks;
+    unsigned long long          nb_packets;
+    unsigned long long          nb_bytes;
+    double                      elapsed_s;
+    double                      cpu_s;
+};
+
+static int MainRun = 1;
+void signalHandler(int signum)
+{
+    (void)signum;
+    MainRun = 0;
+}
+
+void usage()
+{
+    printf("\nUsage: vban_loadgen [OPTIONS]...\n\n");
+    printf("-i, --ipaddress=IP      : ipaddress to send the streams to. default 127.0.0.1\n");
+    printf("-p, --port=PORT         : port of the first stream. default 6980\n");
+    printf("-P, --portstep=VALUE    : port increment from one stream to the next. default 0 (all streams on the same port), 1 with -e\n");
+    printf("-s, --streamname=NAME   : prefix of the stream names, followed by the stream number from 1. default Load\n");
+    printf("-N, --streams=LIST      : number of streams, or comma separated list of numbers of streams to run one after the other. default 1\n");
+    printf("-r, --rate=VALUE        : sample rate. default 48000\n");
+    printf("-n, --nbchannels=VALUE  : number of channels. default 2\n");
+    printf("-f, --format=VALUE      : sample format (see below). default is 16I (16bits integer)\n");
+    printf("-k, --frames=VALUE      : frames per packet. default is as many as fit in a packet (256 at most)\n");
+    printf("-d, --duration=VALUE    : duration of each run in seconds. default 10\n");
+    printf("-e, --receptor=PATH     : companion mode: start one vban_receptor from PATH per stream, on the loopback with the null backend verifying the payloads, and report the loss and cpu of each\n");
+    printf("-l, --loglevel=LEVEL    : Log level, from 0 (FATAL) to 4 (DEBUG). default is 1 (ERROR)\n");
+    printf("-h, --help              : display this message\n\n");
+    printf("%s\n\n", stream_bit_fmt_help());
+}
+
+static int parse_runs(struct config_t* config, char* argv)
+{
+    char* token;
+    int value;
+
+    config->nb_runs = 0;
+
+    for (token = strtok(argv, ","); token != 0; token = strtok(0, ","))
+    {
+        value = atoi(token);
+        if ((value <= 0) || (value > LOADGEN_STREAMS_MAX_NB) || (config->nb_runs == LOADGEN_RUNS_MAX_NB))
+        {
+            logger_log(LOG_FATAL, "invalid number of streams %s, maximum is %d", token, LOADGEN_STREAMS_MAX_NB);
+            return 1;
+        }
+        config->runs[config->nb_runs++] = value;
+    }
+
+    return 0;
+}
+
+int get_options(struct config_t* config, int argc, char* const* argv)
+{
+    int c = 0;
+    int ret = 0;
+    int port_step = -1;
+
+    static const struct option options[] =
+    {
+        {"ipaddress",   required_argument,  0, 'i'},
+        {"port",        required_argument,  0, 'p'},
+        {"portstep",    required_argument,  0, 'P'},
+        {"streamname",  required_argument,  0, 's'},
+        {"streams",     required_argument,  0, 'N'},
+        {"rate",        required_argument,  0, 'r'},
+        {"nbchannels",  required_argument,  0, 'n'},
+        {"format",      required_argument,  0, 'f'},
+        {"frames",      required_argument,  0, 'k'},
+        {"duration",    required_argument,  0, 'd'},
+        {"receptor",    required_argument,  0, 'e'},
+        {"loglevel",    required_argument,  0, 'l'},
+        {"help",        no_argument,        0, 'h'},
+        {0,             0,                  0,  0 }
+    };
+
+    // default values
+    strcpy(config->socket.ip_address, "127.0.0.1");
+    config->socket.port         = 6980;
+    config->socket.direction    = SOCKET_OUT;
+    strcpy(config->stream_prefix, "Load");
+    config->stream.sample_rate  = 48000;
+    config->stream.nb_channels  = 2;
+    config->stream.bit_fmt      = VBAN_BITFMT_16_INT;
+    config->runs[0]             = 1;
+    config->nb_runs             = 1;
+    config->duration            = 10;
+    config->loglevel            = LOG_ERROR;
+
+    while (1)
+    {
+        c = getopt_long(argc, argv, "i:p:P:s:N:r:n:f:k:d:e:l:h", options, 0);
+        if (c == -1)
+            break;
+
+        switch (c)
+        {
+            case 'i':
+                strncpy(config->socket.ip_address, optarg, SOCKET_IP_ADDRESS_SIZE-1);
+                break;
+
+            case 'p':
+                config->socket.port = atoi(optarg);
+                break;
+
+            case 'P':
+                port_step = atoi(optarg);
+                break;
+
+            case 's':
+                strncpy(config->stream_prefix, optarg, sizeof(config->stream_prefix)-1);
+                break;
+
+            case 'N':
+                ret = parse_runs(config, optarg);
+                break;
+
+            case 'r':
+                config->stream.sample_rate = atoi(optarg);
+                break;
+
+            case 'n':
+                config->stream.nb_channels = atoi(optarg);
+                break;
+
+            case 'f':
+                config->stream.bit_fmt = stream_parse_bit_fmt(optarg);
+                break;
+
+            case 'k':
+                config->nb_frames = atoi(optarg);
+                break;
+
+            case 'd':
+                config->duration = atoi(optarg);
+                break;
+
+            case 'e':
+                strncpy(config->receptor, optarg, LOADGEN_PATH_SIZE-1);
+                break;
+
+            case 'l':
+                config->loglevel = atoi(optarg);
+                logger_set_output_level(config->loglevel);
+                break;
+
+            case 'h':
+            default:
+                usage();
+                return 1;
+        }
+
+        if (ret)
+        {
+            return ret;
+        }
+    }
+
+    /* in companion mode each receptor listens on its own port */
+    config->port_step = (port_step >= 0) ? (unsigned int)port_step : (config->receptor[0] != 0);
+
+    if ((config->socket.port <= 0) || (config->duration == 0)
+        || (config->stream.nb_channels == 0) || (config->stream.nb_channels > VBAN_CHANNELS_MAX_NB)
+        || (config->stream.bit_fmt == VBAN_BIT_RESOLUTION_MAX) || (config->nb_frames > VBAN_SAMPLES_MAX_NB))
+    {
+        logger_log(LOG_FATAL, "invalid parameters");
+        usage();
+        return 1;
+    }
+
+#ifdef _WIN32
+    if (config->receptor[0] != 0)
+    {
+        logger_log(LOG_FATAL, "companion mode is not available on this platform");
+        return 1;
+    }
+#endif
+
+    return 0;
+}
+
+static double loadgen_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static double loadgen_cpu()
+{
+#ifndef _WIN32
+    struct rusage usage;
+
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+    {
+        return (double)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec)
+            + (double)(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+    }
+#endif
+    return 0.0;
+}
+
+static void loadgen_sleep_ms(unsigned int ms)
+{
+    struct timespec ts;
+
+    ts.tv_sec   = ms / 1000;
+    ts.tv_nsec  = (long)(ms % 1000) * 1000000;
+    while ((nanosleep(&ts, &ts) != 0) && (errno == EINTR) && MainRun)
+    {
+    }
+}
+
+#ifndef _WIN32
+/** receptor listening on the port of the stream, dropping the audio after having verified it */
+static int receptor_start(struct config_t const* config, struct loadgen_stream_t* stream, unsigned int port)
+{
+    char port_str[16];
+    char* args[] = {(char*)config->receptor, "-i", "127.0.0.1", "-p", port_str, "-s", stream->name, "-b", "null", "-d", "verify", "-l", "3", 0};
+    FILE* log;
+    int pid;
+
+    snprintf(port_str, sizeof(port_str), "%u", port);
+    snprintf(stream->log_path, LOADGEN_PATH_SIZE, "/tmp/vban_loadgen_%d_%s.log", (int)getpid(), stream->name);
+
+    log = fopen(stream->log_path, "w");
+    if (log == 0)
+    {
+        logger_log(LOG_ERROR, "%s: could not create %s", __func__, stream->log_path);
+        return -errno;
+    }
+
+    pid = fork();
+    if (pid < 0)
+    {
+        logger_log(LOG_ERROR, "%s: fork failed", __func__);
+        fclose(log);
+        return -errno;
+    }
+
+    if (pid == 0)
+    {
+        dup2(fileno(log), STDOUT_FILENO);
+        dup2(fileno(log), STDERR_FILENO);
+        execv(config->receptor, args);
+        fprintf(stderr, "could not execute %s\n", config->receptor);
+        _exit(127);
+    }
+
+    fclose(log);
+    stream->pid = pid;
+
+    return 0;
+}
+
+/** stop the receptor, and get its cpu time and the verification summary it logs on exit */
+static void receptor_stop(struct loadgen_stream_t* stream)
+{
+    struct rusage usage;
+    char line[LOGGER_MESSAGE_SIZE + 16];
+    char const* summary;
+    FILE* log;
+    int status;
+
+    if (stream->pid <= 0)
+    {
+        return;
+    }
+
+    kill(stream->pid, SIGINT);
+    if (wait4(stream->pid, &status, 0, &usage) == stream->pid)
+    {
+        stream->cpu_s = (double)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec)
+            + (double)(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+    }
+    stream->pid = 0;
+
+    log = fopen(stream->log_path, "r");
+    if (log == 0)
+    {
+        return;
+    }
+
+    while (fgets(line, sizeof(line), log) != 0)
+    {
+        summary = strstr(line, "verified ");
+        if ((summary != 0) && (sscanf(summary, "verified %llu frames, %*u discontinuities (%llu frames lost), %lu corrupted frames",
+            &stream->nb_frames_checked, &stream->nb_frames_lost, &stream->nb_corrupted) == 3))
+        {
+            stream->verified = 1;
+        }
+    }
+
+    fclose(log);
+    unlink(stream->log_path);
+}
+#endif
+
+static int stream_init(struct config_t const* config, struct loadgen_stream_t* stream, size_t index)
+{
+    struct audio_config_t audio_config;
+    struct socket_config_t socket_config = config->socket;
+    int ret;
+
+    snprintf(stream->name, VBAN_STREAM_NAME_SIZE, "%s%hu", config->stream_prefix, (unsigned short)(index + 1));
+    socket_config.port = config->socket.port + index * config->port_step;
+
+    /* the synth seq signal puts a frame counter in every frame, that the null backend of the receptor can verify */
+    memset(&audio_config, 0, sizeof(struct audio_config_t));
+    audio_config.direction      = AUDIO_IN;
+    audio_config.buffer_size    = 8 * VBAN_PROTOCOL_MAX_SIZE;
+    strcpy(audio_config.backend_name, "synth");
+    strcpy(audio_config.device_name, "seq");
+    strncpy(audio_config.stream_name, stream->name, VBAN_STREAM_NAME_SIZE-1);
+
+    ret = audio_init(&stream->audio, &audio_config);
+    if (ret == 0)
+    {
+        ret = audio_set_stream_config(stream->audio, &config->stream);
+    }
+    if (ret == 0)
+    {
+        ret = socket_init(&stream->socket, &socket_config);
+    }
+    if (ret != 0)
+    {
+        logger_log(LOG_ERROR, "%s: could not set up stream %s", __func__, stream->name);
+        return ret;
+    }
+
+    ret = packet_init_header(stream->buffer, &config->stream, stream->name);
+    if (ret != 0)
+    {
+        logger_log(LOG_ERROR, "%s: invalid stream config", __func__);
+        return ret;
+    }
+
+#ifndef _WIN32
+    if (config->receptor[0] != 0)
+    {
+        ret = receptor_start(config, stream, socket_config.port);
+    }
+#endif
+
+    return ret;
+}
+
+static void stream_release(struct loadgen_stream_t* stream)
+{
+#ifndef _WIN32
+    receptor_stop(stream);
+#endif
+    if (stream->socket != 0)
+    {
+        socket_release(&stream->socket);
+    }
+    if (stream->audio != 0)
+    {
+        audio_release(&stream->audio);
+    }
+}
+
+/** send one packet of every stream per packet period, on absolute deadlines */
+static void run_send(struct config_t const* config, struct run_t* run)
+{
+    double const period = (double)(run->payload_size / (VBanBitResolutionSize[config->stream.bit_fmt] * config->stream.nb_channels))
+        / (double)config->stream.sample_rate;
+    struct loadgen_stream_t* stream;
+    struct timespec deadline;
+    double start;
+    double cpu_start;
+    double next;
+    double now;
+    size_t index;
+    int size;
+
+    start = loadgen_now();
+    cpu_start = loadgen_cpu();
+    now = start;
+
+    while (MainRun && ((now - start) < (double)config->duration))
+    {
+        for (index = 0; index != run->nb_streams; ++index)
+        {
+            stream = &run->streams[index];
+
+            size = audio_read(stream->audio, PACKET_PAYLOAD_PTR(stream->buffer), run->payload_size);
+            if (size <= 0)
+            {
+                ++stream->nb_errors;
+                continue;
+            }
+            packet_set_new_content(stream->buffer, size);
+
+            if (socket_write(stream->socket, stream->buffer, VBAN_HEADER_SIZE + size) < 0)
+            {
+                ++stream->nb_errors;
+                continue;
+            }
+            ++run->nb_packets;
+            run->nb_bytes += VBAN_HEADER_SIZE + size;
+        }
+
+        ++run->nb_ticks;
+        next = start + (double)run->nb_ticks * period;
+        now = loadgen_now();
+        if (now > next)
+        {
+            /* no sleep, to catch up */
+            ++run->nb_late_ticks;
+            continue;
+        }
+
+        /* monotonic clock deadline, same origin as loadgen_now */
+        deadline.tv_sec     = (time_t)next;
+        deadline.tv_nsec    = (long)((next - (double)deadline.tv_sec) * 1e9);
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, 0);
+        now = loadgen_now();
+    }
+
+    run->elapsed_s  = now - start;
+    run->cpu_s      = loadgen_cpu() - cpu_start;
+}
+
+static void run_report(struct config_t const* config, struct run_t const* run)
+{
+    double const expected = (double)(run->nb_ticks * run->nb_streams);
+    size_t const frame_size = VBanBitResolutionSize[config->stream.bit_fmt] * config->stream.nb_channels;
+    unsigned long long const frames_per_stream = run->nb_ticks * (run->payload_size / frame_size);
+    struct loadgen_stream_t const* stream;
+    unsigned long long lost;
+    unsigned long nb_errors = 0;
+    double loss;
+    double cpu;
+    double max_cpu = 0.0;
+    double sum_cpu = 0.0;
+    double max_loss = 0.0;
+    double sum_loss = 0.0;
+    size_t index;
+
+    for (index = 0; index != run->nb_streams; ++index)
+    {
+        nb_errors += run->streams[index].nb_errors;
+    }
+
+    printf("%zu streams: %.0f packets/s (%.1f%% of target), %.2f Mbit/s, %lu late periods, %lu send errors, sender cpu %.1f%%\n",
+        run->nb_streams, (double)run->nb_packets / run->elapsed_s, (expected != 0.0) ? 100.0 * (double)run->nb_packets / expected : 0.0,
+        (double)run->nb_bytes * 8.0 / run->elapsed_s / 1e6, run->nb_late_ticks, nb_errors, 100.0 * run->cpu_s / run->elapsed_s);
+
+    if (config->receptor[0] == 0)
+    {
+        return;
+    }
+
+    for (index = 0; index != run->nb_streams; ++index)
+    {
+        stream = &run->streams[index];
+
+        /* what was never verified, lost by the network, the receptor or before it was ready */
+        lost = (stream->nb_frames_checked < frames_per_stream) ? frames_per_stream - stream->nb_frames_checked : 0;
+        if (stream->nb_frames_lost > lost)
+        {
+            lost = stream->nb_frames_lost;
+        }
+        loss = (frames_per_stream != 0) ? 100.0 * (double)lost / (double)frames_per_stream : 0.0;
+        cpu = 100.0 * stream->cpu_s / run->elapsed_s;
+
+        printf("    %s: cpu %.2f%%, %llu frames verified, %llu lost (%.3f%%), %lu corrupted%s\n",
+            stream->name, cpu, stream->nb_frames_checked, lost, loss, stream->nb_corrupted, stream->verified ? "" : ", no verification summary");
+
+        sum_cpu += cpu;
+        sum_loss += loss;
+        max_cpu = (cpu > max_cpu) ? cpu : max_cpu;
+        max_loss = (loss > max_loss) ? loss : max_loss;
+    }
+
+    printf("    per receptor: cpu %.2f%% average, %.2f%% max, loss %.3f%% average, %.3f%% max\n",
+        sum_cpu / (double)run->nb_streams, max_cpu, sum_loss / (double)run->nb_streams, max_loss);
+}
+
+static int run(struct config_t const* config, size_t nb_streams)
+{
+    struct run_t run_s;
+    size_t index;
+    int max_size;
+    int ret = 0;
+
+    memset(&run_s, 0, sizeof(struct run_t));
+    run_s.nb_streams = nb_streams;
+    run_s.streams = (struct loadgen_stream_t*)calloc(nb_streams, sizeof(struct loadgen_stream_t));
+    if (run_s.streams == 0)
+    {
+        logger_log(LOG_FATAL, "%s: could not allocate memory", __func__);
+        return -ENOMEM;
+    }
+
+    for (index = 0; (ret == 0) && (index != nb_streams); ++index)
+    {
+        ret = stream_init(config, &run_s.streams[index], index);
+    }
+
+    if (ret == 0)
+    {
+        max_size = packet_get_max_payload_size(run_s.streams[0].buffer);
+        run_s.payload_size = (config->nb_frames != 0)
+            ? config->nb_frames * VBanBitResolutionSize[config->stream.bit_fmt] * config->stream.nb_channels
+            : (size_t)max_size;
+        if (run_s.payload_size > (size_t)max_size)
+        {
+            logger_log(LOG_FATAL, "%s: %zu frames do not fit in a packet", __func__, config->nb_frames);
+            ret = -EINVAL;
+        }
+    }
+
+    if (ret == 0)
+    {
+
+        if (config->receptor[0] != 0)
+        {
+            loadgen_sleep_ms(LOADGEN_STARTUP_MS);
+        }
+
+        run_send(config, &run_s);
+
+        if (config->receptor[0] != 0)
+        {
+            loadgen_sleep_ms(LOADGEN_DRAIN_MS);
+        }
+    }
+
+    for (index = 0; index != nb_streams; ++index)
+    {
+        stream_release(&run_s.streams[index]);
+    }
+
+    if (ret == 0)
+    {
+        run_report(config, &run_s);
+    }
+
+    free(run_s.streams);
+
+    return ret;
+}
+
+int main(int argc, char* const* argv)
+{
+    int ret = 0;
+    struct config_t config;
+    size_t index;
+
+    printf("%s version %s\n\n", argv[0], VBAN_VERSION);
+
+    memset(&config, 0, sizeof(struct config_t));
+
+    ret = get_options(&config, argc, argv);
+    if (ret != 0)
+    {
+        return ret;
+    }
+
+    signal(SIGINT, signalHandler);
+    signal(SIGTERM, signalHandler);
+
+    for (index = 0; MainRun && (index != config.nb_runs); ++index)
+    {
+        ret = run(&config, config.runs[index]);
+        if (ret != 0)
+        {
+            break;
+        }
+    }
+
+    return (ret != 0) ? 1 : 0;
+}
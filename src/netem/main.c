@@ -0,0 +1,806 @@
+/*
+ *  This file is part of vban.
+ *  Copyright (c) 2015 by Benoît Quiniou <quiniouben@yahoo.fr>
+ *
+ *  vban is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  vban is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with vban.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <getopt.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#ifndef _WIN32
+#include <poll.h>
+#else
+#include <winsock2.h>
+#define poll WSAPoll
+#endif
+#include "vban/vban.h"
+#include "common/version.h"
+#include "common/logger.h"
+#include "common/socket.h"
+
+#define NETEM_PACKETS_MAX_NB    4096
+#define NETEM_STREAMS_MAX_NB    32
+#define NETEM_PATH_SIZE         256
+#define NETEM_SPEC_SIZE         64
+#define NETEM_POLL_TIMEOUT_MS   200
+#define NETEM_PARETO_ALPHA      1.5
+
+enum netem_loss
+{
+    LOSS_NONE,
+    LOSS_BERNOULLI,
+    LOSS_GILBERT_ELLIOTT,
+};
+
+enum netem_jitter
+{
+    JITTER_UNIFORM,
+    JITTER_NORMAL,
+    JITTER_EXPONENTIAL,
+    JITTER_PARETO,
+};
+
+/** what happened to a datagram, as written to the log */
+enum netem_action
+{
+    ACTION_SENT,
+    ACTION_DUPLICATE,
+    ACTION_LOST,
+    ACTION_QUEUE_DROP,
+    ACTION_OVERFLOW,
+};
+
+static char const* const NetemActionNames[] = {"sent", "duplicate", "lost", "queue_drop", "overflow"};
+
+struct config_t
+{
+    struct socket_config_t      socket_in;
+    struct socket_config_t      socket_out;
+
+    enum netem_loss             loss;
+    double                      loss_p;             /* Bernoulli loss, or Gilbert-Elliott good to bad transition */
+    double                      loss_r;             /* Gilbert-Elliott bad to good transition */
+    double                      loss_bad;           /* Gilbert-Elliott loss in bad state */
+    double                      loss_good;          /* Gilbert-Elliott loss in good state */
+
+    double                      delay_ms;
+    enum netem_jitter           jitter;
+    double                      jitter_ms;
+    double                      reorder;
+    double                      reorder_gap_ms;
+    double                      duplicate;
+    double                      rate_kbps;
+    double                      queue_ms;
+
+    unsigned long long          seed;
+    char                        log_path[NETEM_PATH_SIZE];
+};
+
+/** datagram waiting for its departure time */
+struct netem_packet_t
+{
+    unsigned long long          departure_ns;
+    unsigned long long          order;
+    unsigned long               id;
+    size_t                      size;
+    char                        data[VBAN_PROTOCOL_MAX_SIZE];
+};
+
+struct netem_stream_t
+{
+    char                        name[VBAN_STREAM_NAME_SIZE];
+    unsigned long               last_frame;
+    int                         has_last_frame;
+};
+
+struct main_t
+{
+    struct config_t const*      config;
+    socket_handle_t             socket_in;
+    socket_handle_t             socket_out;
+    FILE*                       log;
+    unsigned long long          start_ns;
+    unsigned long long          random_state;
+    int                         bad_state;
+    unsigned long long          link_free_ns;
+    unsigned long long          order;
+    unsigned long               next_id;
+
+    /* min heap of the waiting packets on departure time, then arrival order */
+    struct netem_packet_t*      packets;
+    size_t                      heap[NETEM_PACKETS_MAX_NB];
+    size_t                      free_slots[NETEM_PACKETS_MAX_NB];
+    size_t                      nb_waiting;
+    size_t                      nb_free;
+
+    struct netem_stream_t       streams[NETEM_STREAMS_MAX_NB];
+    size_t                      nb_streams;
+
+    /* ground truth */
+    unsigned long               nb_received;
+    unsigned long               nb_actions[ACTION_OVERFLOW + 1];
+    unsigned long               nb_reordered;
+    unsigned long               nb_sent;
+    double                      delay_sum_ms;
+    double                      delay_max_ms;
+};
+
+static int MainRun = 1;
+void signalHandler(int signum)
+{
+    (void)signum;
+    MainRun = 0;
+}
+
+void usage()
+{
+    printf("\nUsage: vban_netem [OPTIONS]...\n\n");
+    printf("Relay VBAN datagrams from an emitter to a receptor, impairing them like a bad link would\n\n");
+    printf("-i, --ipaddress=IP      : MANDATORY. ipaddress of the emitter to get datagrams from\n");
+    printf("-p, --port=PORT         : MANDATORY. port to listen to\n");
+    printf("-d, --destination=IP:PORT : MANDATORY. ipaddress and port of the receptor to relay datagrams to\n");
+    printf("-L, --loss=SPEC         : loss model. PERCENT for independent (Bernoulli) loss, or ge:P,R[,BAD[,GOOD]] for Gilbert-Elliott loss:\n");
+    printf("                          P and R are the percent chances to go from good to bad state and back on each datagram, BAD and GOOD the loss percent in each state (default 100 and 0). default is no loss\n");
+    printf("-D, --delay=MS          : fixed delay added to all datagrams. default 0\n");
+    printf("-J, --jitter=[DIST:]MS  : random delay variation. DIST is uniform (between -MS and +MS), normal (standard deviation MS), exp or pareto (mean MS, added). default uniform. The total delay never goes below 0. default is no jitter\n");
+    printf("-r, --reorder=PERCENT[,MS] : percent of datagrams held back MS milliseconds more than the others, so that the next ones overtake them. default MS is 10\n");
+    printf("-u, --duplicate=PERCENT : percent of datagrams sent twice. default 0\n");
+    printf("-b, --rate=KBIT         : bandwidth of the link in kbit/s, datagrams queue at the link before the delay. default is no limit\n");
+    printf("-Q, --queue=MS          : with -b, datagrams that would wait more than MS milliseconds in the link queue are dropped. default 100\n");
+    printf("-S, --seed=VALUE        : seed of the random generator, the same seed and input give the same impairments. default 1\n");
+    printf("-w, --log=FILE          : write what happened to every datagram to FILE, as csv, to check receptor statistics against. default is not to write it\n");
+    printf("-l, --loglevel=LEVEL    : Log level, from 0 (FATAL) to 4 (DEBUG). default is 1 (ERROR)\n");
+    printf("-h, --help              : display this message\n\n");
+}
+
+static int parse_destination(struct socket_config_t* socket, char const* arg)
+{
+    char const* const colon = strrchr(arg, ':');
+    size_t const size = (colon != 0) ? (size_t)(colon - arg) : 0;
+
+    if ((colon == 0) || (size == 0) || (size >= SOCKET_IP_ADDRESS_SIZE) || (atoi(colon + 1) <= 0))
+    {
+        logger_log(LOG_FATAL, "invalid destination %s, should be IP:PORT", arg);
+        return 1;
+    }
+
+    memcpy(socket->ip_address, arg, size);
+    socket->ip_address[size] = 0;
+    socket->port = atoi(colon + 1);
+
+    return 0;
+}
+
+static int parse_loss(struct config_t* config, char const* arg)
+{
+    int nb;
+
+    if (strncmp(arg, "ge:", 3) == 0)
+    {
+        config->loss_bad    = 100.0;
+        config->loss_good   = 0.0;
+        nb = sscanf(arg + 3, "%lf,%lf,%lf,%lf", &config->loss_p, &config->loss_r, &config->loss_bad, &config->loss_good);
+        if (nb < 2)
+        {
+            logger_log(LOG_FATAL, "invalid Gilbert-Elliott loss %s, should be ge:P,R[,BAD[,GOOD]]", arg);
+            return 1;
+        }
+        config->loss = LOSS_GILBERT_ELLIOTT;
+    }
+    else
+    {
+        config->loss_p  = atof(arg);
+        config->loss    = LOSS_BERNOULLI;
+    }
+
+    return 0;
+}
+
+static int parse_jitter(struct config_t* config, char const* arg)
+{
+    char const* const colon = strchr(arg, ':');
+    static struct
+    {
+        char const*         name;
+        enum netem_jitter   jitter;
+    } const distributions[] =
+    {
+        {"uniform", JITTER_UNIFORM},
+        {"normal",  JITTER_NORMAL},
+        {"exp",     JITTER_EXPONENTIAL},
+        {"pareto",  JITTER_PARETO},
+    };
+    size_t index;
+
+    config->jitter = JITTER_UNIFORM;
+    if (colon == 0)
+    {
+        config->jitter_ms = atof(arg);
+        return 0;
+    }
+
+    for (index = 0; index != sizeof(distributions) / sizeof(distributions[0]); ++index)
+    {
+        if ((strlen(distributions[index].name) == (size_t)(colon - arg)) && !strncmp(arg, distributions[index].name, colon - arg))
+        {
+            config->jitter      = distributions[index].jitter;
+            config->jitter_ms   = atof(colon + 1);
+            return 0;
+        }
+    }
+
+    logger_log(LOG_FATAL, "unknown jitter distribution %s", arg);
+    return 1;
+}
+
+int get_options(struct config_t* config, int argc, char* const* argv)
+{
+    int c = 0;
+    int ret = 0;
+
+    static const struct option options[] =
+    {
+        {"ipaddress",   required_argument,  0, 'i'},
+        {"port",        required_argument,  0, 'p'},
+        {"destination", required_argument,  0, 'd'},
+        {"loss",        required_argument,  0, 'L'},
+        {"delay",       required_argument,  0, 'D'},
+        {"jitter",      required_argument,  0, 'J'},
+        {"reorder",     required_argument,  0, 'r'},
+        {"duplicate",   required_argument,  0, 'u'},
+        {"rate",        required_argument,  0, 'b'},
+        {"queue",       required_argument,  0, 'Q'},
+        {"seed",        required_argument,  0, 'S'},
+        {"log",         required_argument,  0, 'w'},
+        {"loglevel",    required_argument,  0, 'l'},
+        {"help",        no_argument,        0, 'h'},
+        {0,             0,                  0,  0 }
+    };
+
+    // default values
+    config->socket_in.direction     = SOCKET_IN;
+    config->socket_out.direction    = SOCKET_OUT;
+    config->reorder_gap_ms          = 10.0;
+    config->queue_ms                = 100.0;
+    config->seed                    = 1;
+
+    while (1)
+    {
+        c = getopt_long(argc, argv, "i:p:d:L:D:J:r:u:b:Q:S:w:l:h", options, 0);
+        if (c == -1)
+            break;
+
+        switch (c)
+        {
+            case 'i':
+                strncpy(config->socket_in.ip_address, optarg, SOCKET_IP_ADDRESS_SIZE-1);
+                break;
+
+            case 'p':
+                config->socket_in.port = atoi(optarg);
+                break;
+
+            case 'd':
+                ret = parse_destination(&config->socket_out, optarg);
+                break;
+
+            case 'L':
+                ret = parse_loss(config, optarg);
+                break;
+
+            case 'D':
+                config->delay_ms = atof(optarg);
+                break;
+
+            case 'J':
+                ret = parse_jitter(config, optarg);
+                break;
+
+            case 'r':
+                sscanf(optarg, "%lf,%lf", &config->reorder, &config->reorder_gap_ms);
+                break;
+
+            case 'u':
+                config->duplicate = atof(optarg);
+                break;
+
+            case 'b':
+                config->rate_kbps = atof(optarg);
+                break;
+
+            case 'Q':
+                config->queue_ms = atof(optarg);
+                break;
+
+            case 'S':
+                config->seed = strtoull(optarg, 0, 0);
+                break;
+
+            case 'w':
+                strncpy(config->log_path, optarg, NETEM_PATH_SIZE-1);
+                break;
+
+            case 'l':
+                logger_set_output_level(atoi(optarg));
+                break;
+
+            case 'h':
+            default:
+                usage();
+                return 1;
+        }
+
+        if (ret)
+        {
+            return ret;
+        }
+    }
+
+    /** check if we got all arguments */
+    if ((config->socket_in.ip_address[0] == 0) || (config->socket_in.port == 0) || (config->socket_out.port == 0))
+    {
+        logger_log(LOG_FATAL, "Missing ip address, port or destination");
+        usage();
+        return 1;
+    }
+
+    if ((config->loss_p < 0.0) || (config->loss_p > 100.0) || (config->loss_r < 0.0) || (config->loss_r > 100.0)
+        || (config->loss_bad < 0.0) || (config->loss_bad > 100.0) || (config->loss_good < 0.0) || (config->loss_good > 100.0)
+        || (config->delay_ms < 0.0) || (config->jitter_ms < 0.0) || (config->reorder < 0.0) || (config->reorder_gap_ms < 0.0)
+        || (config->duplicate < 0.0) || (config->rate_kbps < 0.0) || (config->queue_ms < 0.0))
+    {
+        logger_log(LOG_FATAL, "Invalid impairment parameters");
+        usage();
+        return 1;
+    }
+
+    return 0;
+}
+
+static unsigned long long netem_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/** splitmix64: the impairments only depend on the seed and the input, not on the libc */
+static double netem_random(struct main_t* main_s)
+{
+    unsigned long long z = (main_s->random_state += 0x9E3779B97F4A7C15ull);
+
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    z ^= z >> 31;
+
+    /* 53 bits in [0, 1[ */
+    return (double)(z >> 11) / 9007199254740992.0;
+}
+
+static int netem_chance(struct main_t* main_s, double percent)
+{
+    return (percent > 0.0) && ((netem_random(main_s) * 100.0) < percent);
+}
+
+static int netem_is_lost(struct main_t* main_s)
+{
+    struct config_t const* const config = main_s->config;
+
+    switch (config->loss)
+    {
+        case LOSS_BERNOULLI:
+            return netem_chance(main_s, config->loss_p);
+
+        case LOSS_GILBERT_ELLIOTT:
+            /* state transition first, then loss in the new state */
+            main_s->bad_state = main_s->bad_state ? !netem_chance(main_s, config->loss_r) : netem_chance(main_s, config->loss_p);
+            return netem_chance(main_s, main_s->bad_state ? config->loss_bad : config->loss_good);
+
+        case LOSS_NONE:
+        default:
+            return 0;
+    }
+}
+
+static double netem_jitter_ms(struct main_t* main_s)
+{
+    struct config_t const* const config = main_s->config;
+    double u;
+
+    if (config->jitter_ms == 0.0)
+    {
+        return 0.0;
+    }
+
+    switch (config->jitter)
+    {
+        case JITTER_NORMAL:
+            /* Box-Muller */
+            u = 1.0 - netem_random(main_s);
+            return config->jitter_ms * sqrt(-2.0 * log(u)) * cos(2.0 * M_PI * netem_random(main_s));
+
+        case JITTER_EXPONENTIAL:
+            return -config->jitter_ms * log(1.0 - netem_random(main_s));
+
+        case JITTER_PARETO:
+            /* scale chosen for a mean of jitter_ms */
+            return config->jitter_ms * (NETEM_PARETO_ALPHA - 1.0) / NETEM_PARETO_ALPHA
+                * pow(1.0 - netem_random(main_s), -1.0 / NETEM_PARETO_ALPHA);
+
+        case JITTER_UNIFORM:
+        default:
+            return config->jitter_ms * (2.0 * netem_random(main_s) - 1.0);
+    }
+}
+
+static int heap_before(struct main_t const* main_s, size_t a, size_t b)
+{
+    struct netem_packet_t const* const pa = &main_s->packets[main_s->heap[a]];
+    struct netem_packet_t const* const pb = &main_s->packets[main_s->heap[b]];
+
+    return (pa->departure_ns < pb->departure_ns) || ((pa->departure_ns == pb->departure_ns) && (pa->order < pb->order));
+}
+
+static void heap_swap(struct main_t* main_s, size_t a, size_t b)
+{
+    size_t const slot = main_s->heap[a];
+    main_s->heap[a] = main_s->heap[b];
+    main_s->heap[b] = slot;
+}
+
+static void heap_push(struct main_t* main_s, size_t slot)
+{
+    size_t index = main_s->nb_waiting++;
+
+    main_s->heap[index] = slot;
+    while ((index != 0) && heap_before(main_s, index, (index - 1) / 2))
+    {
+        heap_swap(main_s, index, (index - 1) / 2);
+        index = (index - 1) / 2;
+    }
+}
+
+static size_t heap_pop(struct main_t* main_s)
+{
+    size_t const slot = main_s->heap[0];
+    size_t index = 0;
+    size_t child;
+
+    main_s->heap[0] = main_s->heap[--main_s->nb_waiting];
+    for (;;)
+    {
+        child = 2 * index + 1;
+        if (child >= main_s->nb_waiting)
+            break;
+        if ((child + 1 < main_s->nb_waiting) && heap_before(main_s, child + 1, child))
+            ++child;
+        if (!heap_before(main_s, child, index))
+            break;
+        heap_swap(main_s, index, child);
+        index = child;
+    }
+
+    return slot;
+}
+
+/** stream name and frame counter of a datagram, for the log and the reordering count */
+static struct netem_stream_t* netem_stream(struct main_t* main_s, char const* data, size_t size, unsigned long* frame)
+{
+    struct VBanHeader const* const hdr = (struct VBanHeader const*)data;
+    size_t index;
+
+    if ((size < sizeof(struct VBanHeader)) || (hdr->vban != VBAN_HEADER_FOURC))
+    {
+        return 0;
+    }
+
+    *frame = hdr->nuFrame;
+    for (index = 0; index != main_s->nb_streams; ++index)
+    {
+        if (!strncmp(main_s->streams[index].name, hdr->streamname, VBAN_STREAM_NAME_SIZE))
+        {
+            return &main_s->streams[index];
+        }
+    }
+
+    if (main_s->nb_streams == NETEM_STREAMS_MAX_NB)
+    {
+        return 0;
+    }
+
+    memcpy(main_s->streams[main_s->nb_streams].name, hdr->streamname, VBAN_STREAM_NAME_SIZE);
+    return &main_s->streams[main_s->nb_streams++];
+}
+
+static void netem_log(struct main_t* main_s, unsigned long id, enum netem_action action, char const* data, size_t size,
+    unsigned long long arrival_ns, double delay_ms)
+{
+    struct netem_stream_t* stream;
+    unsigned long frame = 0;
+
+    ++main_s->nb_actions[action];
+
+    if (main_s->log == 0)
+    {
+        return;
+    }
+
+    stream = netem_stream(main_s, data, size, &frame);
+    fprintf(main_s->log, "%lu,%.6f,%.*s,%lu,%zu,%s,%.3f\n", id, (double)(arrival_ns - main_s->start_ns) / 1e9,
+        VBAN_STREAM_NAME_SIZE, (stream != 0) ? stream->name : "", frame, size, NetemActionNames[action], delay_ms);
+}
+
+static void netem_enqueue(struct main_t* main_s, unsigned long id, char const* data, size_t size,
+    unsigned long long arrival_ns, unsigned long long departure_ns, enum netem_action action)
+{
+    struct netem_packet_t* packet;
+    double const delay_ms = (double)(departure_ns - arrival_ns) / 1e6;
+    size_t slot;
+
+    if (main_s->nb_free == 0)
+    {
+        netem_log(main_s, id, ACTION_OVERFLOW, data, size, arrival_ns, 0.0);
+        return;
+    }
+
+    slot = main_s->free_slots[--main_s->nb_free];
+    packet = &main_s->packets[slot];
+    packet->departure_ns    = departure_ns;
+    packet->order           = main_s->order++;
+    packet->id              = id;
+    packet->size            = size;
+    memcpy(packet->data, data, size);
+    heap_push(main_s, slot);
+
+    main_s->delay_sum_ms += delay_ms;
+    if (delay_ms > main_s->delay_max_ms)
+    {
+        main_s->delay_max_ms = delay_ms;
+    }
+
+    netem_log(main_s, id, action, data, size, arrival_ns, delay_ms);
+}
+
+/** decide the fate of a received datagram */
+static void netem_receive(struct main_t* main_s, char const* data, size_t size, unsigned long long arrival_ns)
+{
+    struct config_t const* const config = main_s->config;
+    unsigned long const id = main_s->next_id++;
+    unsigned long long ready_ns = arrival_ns;
+    unsigned long long tx_ns;
+    double delay_ms;
+
+    ++main_s->nb_received;
+
+    if (netem_is_lost(main_s))
+    {
+        netem_log(main_s, id, ACTION_LOST, data, size, arrival_ns, 0.0);
+        return;
+    }
+
+    /* bottleneck link: serialized at the rate, after the datagrams still queued */
+    if (config->rate_kbps > 0.0)
+    {
+        tx_ns = (unsigned long long)((double)size * 8.0 * 1e6 / config->rate_kbps);
+        if (main_s->link_free_ns < arrival_ns)
+        {
+            main_s->link_free_ns = arrival_ns;
+        }
+        if ((double)(main_s->link_free_ns - arrival_ns) > config->queue_ms * 1e6)
+        {
+            netem_log(main_s, id, ACTION_QUEUE_DROP, data, size, arrival_ns, 0.0);
+            return;
+        }
+        main_s->link_free_ns += tx_ns;
+        ready_ns = main_s->link_free_ns;
+    }
+
+    delay_ms = config->delay_ms + netem_jitter_ms(main_s);
+    if (netem_chance(main_s, config->reorder))
+    {
+        delay_ms += config->reorder_gap_ms;
+    }
+    if (delay_ms < 0.0)
+    {
+        delay_ms = 0.0;
+    }
+    ready_ns += (unsigned long long)(delay_ms * 1e6);
+
+    netem_enqueue(main_s, id, data, size, arrival_ns, ready_ns, ACTION_SENT);
+    if (netem_chance(main_s, config->duplicate))
+    {
+        netem_enqueue(main_s, id, data, size, arrival_ns, ready_ns, ACTION_DUPLICATE);
+    }
+}
+
+/** send the datagrams whose time has come, @return time to wait for the next one in ms, -1 if none */
+static int netem_send(struct main_t* main_s)
+{
+    struct netem_packet_t* packet;
+    struct netem_stream_t* stream;
+    unsigned long long const now = netem_now();
+    unsigned long frame;
+    size_t slot;
+
+    while (main_s->nb_waiting != 0)
+    {
+        packet = &main_s->packets[main_s->heap[0]];
+        if (packet->departure_ns > now)
+        {
+            return (int)((packet->departure_ns - now + 999999) / 1000000);
+        }
+
+        slot = heap_pop(main_s);
+        socket_write(main_s->socket_out, packet->data, packet->size);
+        ++main_s->nb_sent;
+
+        /* what the receptor should count as reordered: an older frame after a newer one */
+        stream = netem_stream(main_s, packet->data, packet->size, &frame);
+        if (stream != 0)
+        {
+            if (stream->has_last_frame && ((long)(frame - stream->last_frame) < 0))
+            {
+                ++main_s->nb_reordered;
+            }
+            else
+            {
+                stream->last_frame = frame;
+                stream->has_last_frame = 1;
+            }
+        }
+
+        main_s->free_slots[main_s->nb_free++] = slot;
+    }
+
+    return -1;
+}
+
+static void netem_report(struct main_t const* main_s)
+{
+    printf("received %lu, sent %lu: %lu lost, %lu dropped by the link queue, %lu dropped by the relay queue, %lu duplicated, %lu reordered, %zu still queued\n",
+        main_s->nb_received, main_s->nb_sent, main_s->nb_actions[ACTION_LOST], main_s->nb_actions[ACTION_QUEUE_DROP],
+        main_s->nb_actions[ACTION_OVERFLOW], main_s->nb_actions[ACTION_DUPLICATE], main_s->nb_reordered, main_s->nb_waiting);
+
+    if (main_s->nb_actions[ACTION_SENT] + main_s->nb_actions[ACTION_DUPLICATE] != 0)
+    {
+        printf("delay: mean %.3f ms, max %.3f ms\n",
+            main_s->delay_sum_ms / (double)(main_s->nb_actions[ACTION_SENT] + main_s->nb_actions[ACTION_DUPLICATE]), main_s->delay_max_ms);
+    }
+}
+
+int main(int argc, char* const* argv)
+{
+    int ret = 0;
+    struct config_t config;
+    struct main_t main_s;
+    struct pollfd fd;
+    char buffer[VBAN_PROTOCOL_MAX_SIZE];
+    int timeout;
+    int size;
+    size_t slot;
+
+    printf("%s version %s\n\n", argv[0], VBAN_VERSION);
+
+    memset(&config, 0, sizeof(struct config_t));
+    memset(&main_s, 0, sizeof(struct main_t));
+
+    ret = get_options(&config, argc, argv);
+    if (ret != 0)
+    {
+        return ret;
+    }
+
+    main_s.config       = &config;
+    main_s.random_state = config.seed;
+
+    main_s.packets = calloc(NETEM_PACKETS_MAX_NB, sizeof(struct netem_packet_t));
+    if (main_s.packets == 0)
+    {
+        logger_log(LOG_FATAL, "%s: could not allocate memory", __func__);
+        return 1;
+    }
+    for (slot = 0; slot != NETEM_PACKETS_MAX_NB; ++slot)
+    {
+        main_s.free_slots[slot] = NETEM_PACKETS_MAX_NB - 1 - slot;
+    }
+    main_s.nb_free = NETEM_PACKETS_MAX_NB;
+
+    if (config.log_path[0] != 0)
+    {
+        main_s.log = fopen(config.log_path, "w");
+        if (main_s.log == 0)
+        {
+            logger_log(LOG_FATAL, "%s: could not open %s", __func__, config.log_path);
+            return 1;
+        }
+        fprintf(main_s.log, "id,arrival_s,stream,frame,size,action,delay_ms\n");
+    }
+
+    signal(SIGINT, signalHandler);
+    signal(SIGTERM, signalHandler);
+
+    ret = socket_init(&main_s.socket_in, &config.socket_in);
+    if (ret != 0)
+    {
+        return 1;
+    }
+
+    ret = socket_init(&main_s.socket_out, &config.socket_out);
+    if (ret != 0)
+    {
+        return 1;
+    }
+
+    /* a datagram from another address must not hold the departures in the read */
+    ret = socket_set_nonblock(main_s.socket_in, 1);
+    if (ret != 0)
+    {
+        return 1;
+    }
+
+    main_s.start_ns = netem_now();
+    fd.fd       = socket_get_fd(main_s.socket_in);
+    fd.events   = POLLIN;
+
+    while (MainRun)
+    {
+        timeout = netem_send(&main_s);
+        if ((timeout < 0) || (timeout > NETEM_POLL_TIMEOUT_MS))
+        {
+            timeout = NETEM_POLL_TIMEOUT_MS;
+        }
+
+        ret = poll(&fd, 1, timeout);
+        if ((ret < 0) && (errno != EINTR))
+        {
+            logger_log(LOG_ERROR, "%s: poll error %d %s", __func__, errno, strerror(errno));
+            break;
+        }
+
+        if ((ret <= 0) || !(fd.revents & POLLIN))
+        {
+            continue;
+        }
+
+        size = socket_read(main_s.socket_in, buffer, VBAN_PROTOCOL_MAX_SIZE);
+        if ((size == -EAGAIN) || ((size < 0) && (errno == EINTR)))
+        {
+            continue;
+        }
+        else if (size < 0)
+        {
+            break;
+        }
+        netem_receive(&main_s, buffer, size, netem_now());
+    }
+
+    netem_report(&main_s);
+
+    if (main_s.log != 0)
+    {
+        fclose(main_s.log);
+    }
+    socket_release(&main_s.socket_out);
+    socket_release(&main_s.socket_in);
+    free(main_s.packets);
+
+    return 0;
+}
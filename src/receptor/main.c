@@ -26,22 +26,82 @@
 #include "common/audio.h"
 #include "common/logger.h"
 #include "common/packet.h"
+#include "common/packet_pool.h"
+#include "common/packet_ring.h"
+#include "common/pcapng.h"
+#include "common/stats.h"
+#include "common/thread.h"
 #include "common/version.h"
 #include "common/backend/audio_backend.h"
 
+#ifdef _WIN32
+#define poll WSAPoll
+#endif
+
+#define STREAMS_MAX_NB  STATS_STREAMS_MAX_NB
+
+/** packets waiting for the audio thread, beyond that the network thread drops them */
+#define RING_SLOTS_NB   64
+/** packets of a stream waiting for its device, beyond that the audio thread drops them */
+#define STREAM_QUEUE_NB 4
+/** the ring full, the queues of the streams full, plus the packet being received */
+#define POOL_PACKETS_NB (RING_SLOTS_NB + (STREAMS_MAX_NB * STREAM_QUEUE_NB) + 1)
+
+/** how often the threads check if they have to stop while waiting */
+#define POLL_TIMEOUT_MS 200
+/** how long the audio thread waits for the devices of the waiting streams before checking the ring again */
+#define DEVICE_POLL_TIMEOUT_MS  1
+
+#define RECORD_PATH_SIZE    256
+
 struct config_t
 {
     struct socket_config_t      socket;
     struct audio_config_t       audio;
     struct audio_map_config_t   map;
-    char                        stream_name[VBAN_STREAM_NAME_SIZE];
+    char                        stream_names[STREAMS_MAX_NB][VBAN_STREAM_NAME_SIZE];
+    int                         nb_streams;
+    struct thread_config_t      net_thread;
+    struct thread_config_t      audio_thread;
+    int                         realtime;
+    char                        stats_address[STATS_ADDRESS_SIZE];
+    char                        record_path[RECORD_PATH_SIZE];
+};
+
+/* audio thread: packets of a stream that its non blocking device did not fully accept yet.
+   Each stream has its own, so that a stream waiting for its device never holds the others back */
+struct stream_queue_t
+{
+    struct packet_t*            packets[STREAM_QUEUE_NB];
+    size_t                      first;
+    size_t                      count;
+    /* bytes of the first packet already written */
+    size_t                      offset;
 };
 
+/* the main thread receives the packets from the pool and hands them to the audio thread through the ring,
+   so that a device that blocks or wakes up late never delays the socket */
 struct main_t
 {
+    struct config_t const*      config;
     socket_handle_t             socket;
-    audio_handle_t              audio;
+    audio_handle_t              audio[STREAMS_MAX_NB];
+    packet_pool_handle_t        pool;
+    packet_ring_handle_t        ring;
+    pthread_t                   audio_thread;
+    int                         stop;
+    struct stats_t*             stats;
+    stats_server_handle_t       stats_server;
+    pcapng_handle_t             record;
+
+    /* network thread: packet received while the pool is empty */
     char                        buffer[VBAN_PROTOCOL_MAX_SIZE];
+    unsigned long               nb_dropped;
+    int                         dropping;
+
+    /* audio thread: streams waiting for their device, and the descriptors of these devices */
+    struct stream_queue_t       queues[STREAMS_MAX_NB];
+    struct pollfd               fds[STREAMS_MAX_NB * AUDIO_POLL_FDS_MAX];
 };
 
 static int MainRun = 1;
@@ -55,12 +115,17 @@ void usage()
     printf("\nUsage: vban_receptor [OPTIONS]...\n\n");
     printf("-i, --ipaddress=IP      : MANDATORY. ipaddress to get stream from\n");
     printf("-p, --port=PORT         : MANDATORY. port to listen to\n");
-    printf("-s, --streamname=NAME   : MANDATORY. streamname to play\n");
+    printf("-s, --streamname=NAME   : MANDATORY. streamname to play. can be repeated (up to %d) to play several streams from the same port\n", STREAMS_MAX_NB);
     printf("-b, --backend=TYPE      : audio backend to use. %s\n", audio_backend_get_help());
     printf("-q, --quality=ID        : network quality indicator from 0 (low latency) to 4. This also have interaction with jack buffer size. default is 1\n");
     printf("-c, --channels=LIST     : channels from the stream to use. LIST is of form x,y,z,... default is to forward the stream as it is\n");
     printf("-o, --output=NAME       : DEPRECATED. please use -d\n");
-    printf("-d, --device=NAME       : Audio device name. This is file name for file backend, server name for jack backend, device for alsa, stream_name for pulseaudio.\n");
+    printf("-d, --device=NAME       : Audio device name. This is file name for file and wav backends, server name for jack backend, device for alsa, stream_name for pulseaudio, target node for pipewire, shared memory object for shm.\n");
+    printf("-a, --affinity=LIST     : CPUs to pin the network and audio threads to, of form net,audio (one value for both). default is not to pin them\n");
+    printf("-P, --priority=LIST     : SCHED_FIFO priorities of the network and audio threads, of form net,audio (one value for both). 0 keeps default scheduling. default is 0\n");
+    printf("-R, --realtime          : realtime profile: lock memory, prefault stacks, flush denormals to zero, and SCHED_FIFO priorities %d,%d unless -P is given\n", THREAD_PRIORITY_NETWORK, THREAD_PRIORITY_AUDIO);
+    printf("-m, --metrics=ADDRESS   : serve per stream statistics in OpenMetrics format over http, on PORT (localhost), IP:PORT or the path of a unix socket. default is not to serve them\n");
+    printf("-w, --record=FILE       : record the datagrams received from the ipaddress, with their kernel receive timestamp, to FILE in pcapng format (see vban_replay). default is not to record them\n");
     printf("-l, --loglevel=LEVEL    : Log level, from 0 (FATAL) to 4 (DEBUG). default is 1 (ERROR)\n");
     printf("-h, --help              : display this message\n\n");
 }
@@ -111,6 +176,7 @@ int get_options(struct config_t* config, int argc, char* const* argv)
     int c = 0;
     int quality = 1;
     int ret = 0;
+    int values[2];
 
     static const struct option options[] =
     {
@@ -122,15 +188,23 @@ int get_options(struct config_t* config, int argc, char* const* argv)
         {"channels",    required_argument,  0, 'c'},
         {"output",      required_argument,  0, 'o'},
         {"device",      required_argument,  0, 'd'},
+        {"affinity",    required_argument,  0, 'a'},
+        {"priority",    required_argument,  0, 'P'},
+        {"realtime",    no_argument,        0, 'R'},
+        {"metrics",     required_argument,  0, 'm'},
+        {"record",      required_argument,  0, 'w'},
         {"loglevel",    required_argument,  0, 'l'},
         {"help",        no_argument,        0, 'h'},
         {0,             0,                  0,  0 }
     };
 
+    thread_config_init(&config->net_thread);
+    thread_config_init(&config->audio_thread);
+
     /* yes, I assume config is not 0 */
     while (1)
     {
-        c = getopt_long(argc, argv, "i:p:s:b:q:c:o:d:l:h", options, 0);
+        c = getopt_long(argc, argv, "i:p:s:b:q:c:o:d:a:P:Rm:w:l:h", options, 0);
         if (c == -1)
             break;
 
@@ -145,7 +219,12 @@ int get_options(struct config_t* config, int argc, char* const* argv)
                 break;
 
             case 's':
-                strncpy(config->stream_name, optarg, VBAN_STREAM_NAME_SIZE -1);
+                if (config->nb_streams == STREAMS_MAX_NB)
+                {
+                    logger_log(LOG_FATAL, "Too many streams, maximum is %d", STREAMS_MAX_NB);
+                    return 1;
+                }
+                strncpy(config->stream_names[config->nb_streams++], optarg, VBAN_STREAM_NAME_SIZE -1);
                 break;
 
             case 'b':
@@ -165,6 +244,30 @@ int get_options(struct config_t* config, int argc, char* const* argv)
                 strncpy(config->audio.device_name, optarg, AUDIO_DEVICE_NAME_SIZE-1);
                 break;
 
+            case 'a':
+                ret = thread_parse_list(values, 2, optarg);
+                config->net_thread.cpu = values[0];
+                config->audio_thread.cpu = values[1];
+                break;
+
+            case 'P':
+                ret = thread_parse_list(values, 2, optarg);
+                config->net_thread.priority = values[0];
+                config->audio_thread.priority = values[1];
+                break;
+
+            case 'R':
+                config->realtime = 1;
+                break;
+
+            case 'm':
+                strncpy(config->stats_address, optarg, STATS_ADDRESS_SIZE-1);
+                break;
+
+            case 'w':
+                strncpy(config->record_path, optarg, RECORD_PATH_SIZE-1);
+                break;
+
             case 'l':
                 logger_set_output_level(atoi(optarg));
                 break;
@@ -181,14 +284,21 @@ int get_options(struct config_t* config, int argc, char* const* argv)
         }
     }
 
+    if (config->realtime)
+    {
+        thread_config_set_realtime(&config->net_thread, THREAD_PRIORITY_NETWORK);
+        thread_config_set_realtime(&config->audio_thread, THREAD_PRIORITY_AUDIO);
+    }
+
     config->audio.direction     = AUDIO_OUT;
     config->audio.buffer_size   = computeSize(quality);
+    config->audio.nonblock      = 1;
     config->socket.direction    = SOCKET_IN;
 
     /** check if we got all arguments */
     if ((config->socket.ip_address[0] == 0)
         || (config->socket.port == 0)
-        || (config->stream_name[0] == 0))
+        || (config->nb_streams == 0))
     {
         logger_log(LOG_FATAL, "Missing ip address, port or stream name");
         usage();
@@ -198,18 +308,333 @@ int get_options(struct config_t* config, int argc, char* const* argv)
     return 0;
 }
 
-int main(int argc, char* const* argv)
+static int find_stream(struct config_t const* config, char const* buffer, size_t size)
+{
+    struct VBanHeader const* const hdr = PACKET_HEADER_PTR(buffer);
+    int stream;
+
+    if (size < sizeof(struct VBanHeader))
+    {
+        return -1;
+    }
+
+    for (stream = 0; stream != config->nb_streams; ++stream)
+    {
+        if (strncmp(config->stream_names[stream], hdr->streamname, VBAN_STREAM_NAME_SIZE) == 0)
+        {
+            return stream;
+        }
+    }
+
+    return -1;
+}
+
+static int play_packet(struct main_t* main_s, struct packet_t* packet, size_t offset)
+{
+    int ret;
+    struct stream_config_t stream_config;
+    int const payload_size = PACKET_PAYLOAD_SIZE(packet->size);
+
+    if (offset == 0)
+    {
+        packet_get_stream_config(packet->data, &stream_config);
+
+        ret = audio_set_stream_config(main_s->audio[packet->tag], &stream_config);
+        if (ret < 0)
+        {
+            return ret;
+        }
+
+        audio_set_frame(main_s->audio[packet->tag], PACKET_HEADER_PTR(packet->data)->nuFrame);
+    }
+
+    ret = audio_write(main_s->audio[packet->tag], PACKET_PAYLOAD_PTR(packet->data) + offset, payload_size - offset);
+
+    return (ret == -EAGAIN) ? 0 : ret;
+}
+
+/* the packet is fully written to the device: it only has the device delay left before being played */
+static void record_written(struct main_t* main_s, struct packet_t* packet)
+{
+    struct stats_stream_t* const stats = &main_s->stats->streams[packet->tag];
+    unsigned long long const now = stats_now_ns();
+    unsigned long latency_us = 0;
+
+    if (audio_get_latency(main_s->audio[packet->tag], &latency_us) == 0)
+    {
+        STATS_SET(stats, depth_us, latency_us);
+        histogram_record(&stats->latency[STATS_STAGE_DEVICE], latency_us);
+    }
+
+    STATS_LATENCY(stats, STATS_STAGE_WRITE, packet->stage_ns, now);
+    histogram_record(&stats->latency[STATS_STAGE_TOTAL],
+        ((now > packet->timestamp_ns) ? (unsigned long)((now - packet->timestamp_ns) / 1000) : 0) + latency_us);
+}
+
+/* plays the queue of the stream as far as its device takes it, what is left waits for the device */
+static int play_stream(struct main_t* main_s, int stream)
+{
+    int ret;
+    struct stream_queue_t* const queue = &main_s->queues[stream];
+    struct pollfd fds[AUDIO_POLL_FDS_MAX];
+    struct packet_t* packet;
+    size_t payload_size;
+
+    while (queue->count != 0)
+    {
+        packet = queue->packets[queue->first];
+        payload_size = PACKET_PAYLOAD_SIZE(packet->size);
+
+        ret = play_packet(main_s, packet, queue->offset);
+        if (ret < 0)
+        {
+            return ret;
+        }
+
+        queue->offset += ret;
+        if (queue->offset < payload_size)
+        {
+            if (audio_get_poll_fds(main_s->audio[stream], fds, AUDIO_POLL_FDS_MAX) > 0)
+            {
+                return 0;
+            }
+
+            /* blocking device: nothing better to do than to drop the rest */
+            logger_log(LOG_WARNING, "%s: wrote %zu bytes, expected %zu bytes", __func__, queue->offset, payload_size);
+        }
+
+        record_written(main_s, packet);
+        packet_pool_put(main_s->pool, packet);
+        queue->first = (queue->first + 1) % STREAM_QUEUE_NB;
+        --queue->count;
+        queue->offset = 0;
+    }
+
+    return 0;
+}
+
+static int queue_packet(struct main_t* main_s, struct packet_t* packet)
+{
+    struct stream_queue_t* const queue = &main_s->queues[packet->tag];
+
+    if (queue->count == STREAM_QUEUE_NB)
+    {
+        /* the device of this stream is late, the other streams go on */
+        STATS_ADD(&main_s->stats->streams[packet->tag], late, 1);
+        packet_pool_put(main_s->pool, packet);
+        return 0;
+    }
+
+    queue->packets[(queue->first + queue->count) % STREAM_QUEUE_NB] = packet;
+    ++queue->count;
+
+    /* behind packets still waiting for the device, it only goes with them */
+    return (queue->count == 1) ? play_stream(main_s, packet->tag) : 0;
+}
+
+/* polls the devices of the streams that wait for them, then plays what they take.
+   Returns the number of streams that were waiting */
+static int play_waiting(struct main_t* main_s, int timeout_ms)
+{
+    int ret;
+    int stream;
+    int nb_waiting = 0;
+    int nb_fds = 0;
+
+    for (stream = 0; stream != main_s->config->nb_streams; ++stream)
+    {
+        if (main_s->queues[stream].count != 0)
+        {
+            ret = audio_get_poll_fds(main_s->audio[stream], main_s->fds + nb_fds, AUDIO_POLL_FDS_MAX);
+            nb_fds += (ret > 0) ? ret : 0;
+            ++nb_waiting;
+        }
+    }
+
+    if (nb_waiting == 0)
+    {
+        return 0;
+    }
+
+    ret = poll(main_s->fds, nb_fds, timeout_ms);
+    if ((ret < 0) && (errno != EINTR))
+    {
+        logger_log(LOG_ERROR, "%s: poll error %d %s", __func__, errno, strerror(errno));
+        return ret;
+    }
+
+    if ((ret <= 0) && (timeout_ms == 0))
+    {
+        return nb_waiting;
+    }
+
+    for (stream = 0; stream != main_s->config->nb_streams; ++stream)
+    {
+        ret = play_stream(main_s, stream);
+        if (ret < 0)
+        {
+            return ret;
+        }
+    }
+
+    return nb_waiting;
+}
+
+static void* audio_thread(void* arg)
 {
+    struct main_t* const main_s = (struct main_t*)arg;
+    struct packet_t* packet;
+    unsigned long long now;
     int ret = 0;
+
+    thread_setup(&main_s->config->audio_thread, "vban_audio");
+
+    while (!__atomic_load_n(&main_s->stop, __ATOMIC_ACQUIRE))
+    {
+        packet = packet_ring_pop(main_s->ring);
+        if (packet != 0)
+        {
+            now = stats_now_ns();
+            STATS_LATENCY(&main_s->stats->streams[packet->tag], STATS_STAGE_QUEUE, packet->stage_ns, now);
+            packet->stage_ns = now;
+
+            ret = queue_packet(main_s, packet);
+            if (ret >= 0)
+            {
+                /* streams waiting for their device go on as soon as it is ready */
+                ret = play_waiting(main_s, 0);
+            }
+        }
+        else
+        {
+            /* nothing new: wait for the devices of the waiting streams, or for the ring when there are none */
+            ret = play_waiting(main_s, DEVICE_POLL_TIMEOUT_MS);
+            if (ret == 0)
+            {
+                ret = packet_ring_wait(main_s->ring);
+            }
+        }
+
+        if (ret < 0)
+        {
+            break;
+        }
+    }
+
+    if (ret < 0)
+    {
+        logger_log(LOG_ERROR, "%s: audio error %d, stopping", __func__, ret);
+        __atomic_store_n(&MainRun, 0, __ATOMIC_RELEASE);
+    }
+
+    return 0;
+}
+
+static int receive_packet(struct main_t* main_s)
+{
     int size = 0;
+    int stream = 0;
+    enum packet_invalid reason;
+    struct stats_stream_t* stats;
+    unsigned long long received_ns = 0;
+    unsigned long long now;
+    struct packet_t* const packet = packet_pool_get(main_s->pool);
+    char* const buffer = (packet != 0) ? packet->data : main_s->buffer;
+
+    /* received straight into a packet of the pool, when there is one */
+    size = socket_read_timestamp(main_s->socket, buffer, VBAN_PROTOCOL_MAX_SIZE, &received_ns);
+    if (size < 0)
+    {
+        if (packet != 0)
+        {
+            packet_pool_put(main_s->pool, packet);
+        }
+        return size;
+    }
+
+    /* everything the emitter sent, as it came, before any check */
+    if (main_s->record != 0)
+    {
+        pcapng_write(main_s->record, buffer, size, (received_ns != 0) ? received_ns : stats_now_ns());
+    }
+
+    stream = find_stream(main_s->config, buffer, size);
+    if (stream < 0)
+    {
+        STATS_ADD(main_s->stats, unknown, 1);
+    }
+    else if (packet_check(main_s->config->stream_names[stream], buffer, size, &reason) != 0)
+    {
+        STATS_ADD(&main_s->stats->streams[stream], invalid[reason], 1);
+        stream = -1;
+    }
+
+    if (stream < 0)
+    {
+        if (packet != 0)
+        {
+            packet_pool_put(main_s->pool, packet);
+        }
+        return 0;
+    }
+
+    stats = &main_s->stats->streams[stream];
+    STATS_ADD(stats, packets, 1);
+    STATS_ADD(stats, bytes, size);
+    stats_count_frame(stats, PACKET_HEADER_PTR(buffer)->nuFrame);
+
+    /* without kernel timestamp, the pipeline starts here */
+    now = stats_now_ns();
+    if (received_ns != 0)
+    {
+        STATS_LATENCY(stats, STATS_STAGE_NETWORK, received_ns, now);
+    }
+
+    if (packet != 0)
+    {
+        packet->size            = size;
+        packet->tag             = stream;
+        packet->timestamp_ns    = (received_ns != 0) ? received_ns : now;
+        packet->stage_ns        = now;
+        if (packet_ring_push(main_s->ring, packet) == 0)
+        {
+            STATS_SET(main_s->stats, queue_depth, packet_ring_depth(main_s->ring));
+            main_s->dropping = 0;
+            return 0;
+        }
+
+        packet_pool_put(main_s->pool, packet);
+    }
+
+    if (!main_s->dropping)
+    {
+        logger_log(LOG_WARNING, "%s: audio is late, dropping packets", __func__);
+    }
+    main_s->dropping = 1;
+    ++main_s->nb_dropped;
+    STATS_ADD(stats, late, 1);
+
+    return 0;
+}
+
+int main(int argc, char* const* argv)
+{
+    int ret = 0;
+    int stream = 0;
     struct config_t config;
-    struct stream_config_t stream_config;
+    struct audio_config_t audio_config;
     struct main_t   main_s;
+    struct pollfd   fd;
 
     printf("vban_receptor version %s\n\n", VBAN_VERSION);
 
     memset(&config, 0, sizeof(struct config_t));
     memset(&main_s, 0, sizeof(struct main_t));
+    main_s.config = &config;
+
+    /* stop the main loop and release the audio device properly */
+    signal(SIGINT, signalHandler);
+    signal(SIGTERM, signalHandler);
 
     ret = get_options(&config, argc, argv);
     if (ret != 0)
@@ -217,60 +642,132 @@ int main(int argc, char* const* argv)
         return ret;
     }
 
+    /* from here on, logging never blocks the audio and network threads on stdio */
+    logger_start();
+
+    if (config.realtime)
+    {
+        /* not fatal, the warning says what is missing */
+        thread_realtime_init();
+    }
+
     ret = socket_init(&main_s.socket, &config.socket);
     if (ret != 0)
     {
         return ret;
     }
 
-    ret = audio_init(&main_s.audio, &config.audio);
+    ret = stats_init(&main_s.stats);
+    if (ret != 0)
+    {
+        return ret;
+    }
+
+    for (stream = 0; stream != config.nb_streams; ++stream)
+    {
+        /* each stream has its own audio output, named after the stream */
+        audio_config = config.audio;
+        strncpy(audio_config.stream_name, config.stream_names[stream], VBAN_STREAM_NAME_SIZE-1);
+
+        ret = audio_init(&main_s.audio[stream], &audio_config);
+        if (ret != 0)
+        {
+            return ret;
+        }
+
+        ret = audio_set_map_config(main_s.audio[stream], &config.map);
+        if (ret != 0)
+        {
+            return ret;
+        }
+
+        snprintf(main_s.stats->streams[stream].name, sizeof(main_s.stats->streams[stream].name), "%s", config.stream_names[stream]);
+        audio_set_stats(main_s.audio[stream], &main_s.stats->streams[stream]);
+    }
+    main_s.stats->nb_streams = config.nb_streams;
+
+    if (config.stats_address[0] != 0)
+    {
+        ret = stats_server_init(&main_s.stats_server, config.stats_address, main_s.stats);
+        if (ret != 0)
+        {
+            return ret;
+        }
+    }
+
+    if (config.record_path[0] != 0)
+    {
+        ret = pcapng_open_write(&main_s.record, config.record_path, "vban_receptor " VBAN_VERSION, config.socket.ip_address, config.socket.port);
+        if (ret != 0)
+        {
+            return ret;
+        }
+    }
+
+    ret = packet_pool_init(&main_s.pool, POOL_PACKETS_NB);
+    if (ret != 0)
+    {
+        return ret;
+    }
+
+    ret = packet_ring_init(&main_s.ring, RING_SLOTS_NB);
     if (ret != 0)
     {
         return ret;
     }
 
-    ret = audio_set_map_config(main_s.audio, &config.map);
+    ret = thread_start(&main_s.audio_thread, audio_thread, &main_s);
     if (ret != 0)
     {
         return ret;
     }
 
-    while (MainRun)
+    thread_setup(&config.net_thread, "vban_net");
+
+    fd.fd       = socket_get_fd(main_s.socket);
+    fd.events   = POLLIN;
+
+    while (__atomic_load_n(&MainRun, __ATOMIC_ACQUIRE))
     {
-        size = socket_read(main_s.socket, main_s.buffer, VBAN_PROTOCOL_MAX_SIZE);
-        if (size < 0)
+        ret = poll(&fd, 1, POLL_TIMEOUT_MS);
+        if ((ret < 0) && (errno != EINTR))
         {
-            MainRun = 0;
+            logger_log(LOG_ERROR, "%s: poll error %d %s", __func__, errno, strerror(errno));
             break;
         }
 
-        if (packet_check(config.stream_name, main_s.buffer, size) == 0)
+        if ((ret <= 0) || !(fd.revents & POLLIN))
         {
-            packet_get_stream_config(main_s.buffer, &stream_config);
-
-            ret = audio_set_stream_config(main_s.audio, &stream_config);
-            if (ret < 0)
-            {
-                MainRun = 0;
-                break;
-            }
+            continue;
+        }
 
-            ret = audio_write(main_s.audio, PACKET_PAYLOAD_PTR(main_s.buffer), PACKET_PAYLOAD_SIZE(size));
-            if (ret != PACKET_PAYLOAD_SIZE(size))
-            {
-                logger_log(LOG_WARNING, "%s: wrote %d bytes, expected %d bytes", __func__, ret, PACKET_PAYLOAD_SIZE(size));
-            }
-            else if (ret < 0)
-            {
-                MainRun = 0;
-                break;
-            }
+        ret = receive_packet(&main_s);
+        if (ret < 0)
+        {
+            break;
         }
     }
 
-    audio_release(&main_s.audio);
+    __atomic_store_n(&main_s.stop, 1, __ATOMIC_RELEASE);
+    packet_ring_wake(main_s.ring);
+    pthread_join(main_s.audio_thread, 0);
+
+    if (main_s.nb_dropped != 0)
+    {
+        logger_log(LOG_INFO, "%s: %lu packets dropped while audio was late", __func__, main_s.nb_dropped);
+    }
+
+    stats_log(main_s.stats);
+    stats_server_release(&main_s.stats_server);
+    pcapng_release(&main_s.record);
+    for (stream = 0; stream != config.nb_streams; ++stream)
+    {
+        audio_release(&main_s.audio[stream]);
+    }
+    packet_ring_release(&main_s.ring);
+    packet_pool_release(&main_s.pool);
+    stats_release(&main_s.stats);
     socket_release(&main_s.socket);
 
     return 0;
 }
-
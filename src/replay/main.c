@@ -0,0 +1,335 @@
+/*
+ *  This file is part of vban.
+ *  Copyright (c) 2015 by Benoît Quiniou <quiniouben@yahoo.fr>
+ *
+ *  vban is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  vban is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with vban.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <getopt.h>
+#include <time.h>
+#include "vban/vban.h"
+#include "common/version.h"
+#include "common/logger.h"
+#include "common/pcapng.h"
+#include "common/socket.h"
+
+#define REPLAY_PATH_SIZE    256
+/** datagrams sent later than that after their deadline are counted as late */
+#define REPLAY_LATE_NS      1e6
+
+struct config_t
+{
+    struct socket_config_t      socket;
+    char                        stream_name[VBAN_STREAM_NAME_SIZE];
+    char                        path[REPLAY_PATH_SIZE];
+    double                      speed;
+    double                      jitter_ms;
+    unsigned int                seed;
+    unsigned int                loops;
+};
+
+struct main_t
+{
+    socket_handle_t             socket;
+    pcapng_handle_t             capture;
+    char                        buffer[VBAN_PROTOCOL_MAX_SIZE];
+    unsigned int                random_state;
+
+    unsigned long               nb_packets;
+    unsigned long               nb_late;
+    double                      max_late_ns;
+};
+
+static int MainRun = 1;
+void signalHandler(int signum)
+{
+    (void)signum;
+    MainRun = 0;
+}
+
+void usage()
+{
+    printf("\nUsage: vban_replay [OPTIONS] FILE\n\n");
+    printf("Send again the VBAN datagrams of a pcapng capture (as recorded by vban_receptor -w, or by tcpdump / wireshark), with their original timing\n\n");
+    printf("-i, --ipaddress=IP      : MANDATORY. ipaddress to send the datagrams to\n");
+    printf("-p, --port=PORT         : MANDATORY. port to use\n");
+    printf("-s, --streamname=NAME   : only replay the datagrams of this stream. default is to replay all of them\n");
+    printf("-t, --speed=FACTOR      : time scale: 2 replays twice as fast, 0.5 twice as slow, 0 as fast as possible. default 1\n");
+    printf("-j, --jitter=MS         : delay each datagram by a random time between 0 and MS milliseconds. The order of the datagrams is kept. default 0\n");
+    printf("-S, --seed=VALUE        : seed of the jitter random generator, the same seed gives the same timing. default 1\n");
+    printf("-n, --loops=VALUE       : number of times the capture is replayed, 0 for ever. default 1\n");
+    printf("-l, --loglevel=LEVEL    : Log level, from 0 (FATAL) to 4 (DEBUG). default is 1 (ERROR)\n");
+    printf("-h, --help              : display this message\n\n");
+}
+
+int get_options(struct config_t* config, int argc, char* const* argv)
+{
+    int c = 0;
+
+    static const struct option options[] =
+    {
+        {"ipaddress",   required_argument,  0, 'i'},
+        {"port",        required_argument,  0, 'p'},
+        {"streamname",  required_argument,  0, 's'},
+        {"speed",       required_argument,  0, 't'},
+        {"jitter",      required_argument,  0, 'j'},
+        {"seed",        required_argument,  0, 'S'},
+        {"loops",       required_argument,  0, 'n'},
+        {"loglevel",    required_argument,  0, 'l'},
+        {"help",        no_argument,        0, 'h'},
+        {0,             0,                  0,  0 }
+    };
+
+    // default values
+    config->speed               = 1.0;
+    config->jitter_ms           = 0.0;
+    config->seed                = 1;
+    config->loops               = 1;
+    config->socket.direction    = SOCKET_OUT;
+
+    while (1)
+    {
+        c = getopt_long(argc, argv, "i:p:s:t:j:S:n:l:h", options, 0);
+        if (c == -1)
+            break;
+
+        switch (c)
+        {
+            case 'i':
+                strncpy(config->socket.ip_address, optarg, SOCKET_IP_ADDRESS_SIZE-1);
+                break;
+
+            case 'p':
+                config->socket.port = atoi(optarg);
+                break;
+
+            case 's':
+                strncpy(config->stream_name, optarg, VBAN_STREAM_NAME_SIZE-1);
+                break;
+
+            case 't':
+                config->speed = atof(optarg);
+                break;
+
+            case 'j':
+                config->jitter_ms = atof(optarg);
+                break;
+
+            case 'S':
+                config->seed = (unsigned int)strtoul(optarg, 0, 0);
+                break;
+
+            case 'n':
+                config->loops = atoi(optarg);
+                break;
+
+            case 'l':
+                logger_set_output_level(atoi(optarg));
+                break;
+
+            case 'h':
+            default:
+                usage();
+                return 1;
+        }
+    }
+
+    /** check if we got all arguments */
+    if ((config->socket.ip_address[0] == 0) || (config->socket.port == 0) || (optind != argc - 1))
+    {
+        logger_log(LOG_FATAL, "Missing ip address, port or file");
+        usage();
+        return 1;
+    }
+
+    if ((config->speed < 0.0) || (config->jitter_ms < 0.0))
+    {
+        logger_log(LOG_FATAL, "Invalid speed or jitter");
+        usage();
+        return 1;
+    }
+
+    strncpy(config->path, argv[optind], REPLAY_PATH_SIZE-1);
+
+    return 0;
+}
+
+static double replay_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static void replay_sleep_until(double deadline)
+{
+    struct timespec ts;
+
+    ts.tv_sec   = (time_t)(deadline / 1e9);
+    ts.tv_nsec  = (long)(deadline - (double)ts.tv_sec * 1e9);
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0);
+}
+
+/** xorshift32: the jitter only depends on the seed, not on the libc */
+static double replay_random(struct main_t* main_s)
+{
+    main_s->random_state ^= main_s->random_state << 13;
+    main_s->random_state ^= main_s->random_state >> 17;
+    main_s->random_state ^= main_s->random_state << 5;
+    return (double)main_s->random_state / 4294967296.0;
+}
+
+/**
+ * Send the capture once. Deadlines are computed from the first datagram so that the timing does not drift:
+ * the original offset scaled by the speed, plus the jitter. Datagrams are sent in order, so a deadline
+ * that the jitter puts before the previous one is moved right after it
+ */
+static int replay_once(struct config_t const* config, struct main_t* main_s, double start, double* duration)
+{
+    struct VBanHeader const* const hdr = (struct VBanHeader const*)main_s->buffer;
+    unsigned long long first_ns = 0;
+    unsigned long long timestamp_ns = 0;
+    double offset = 0.0;
+    double deadline;
+    double previous = 0.0;
+    double now;
+    int size;
+    int ret;
+
+    ret = pcapng_open_read(&main_s->capture, config->path);
+    if (ret != 0)
+    {
+        return ret;
+    }
+
+    while (MainRun)
+    {
+        size = pcapng_read(main_s->capture, main_s->buffer, VBAN_PROTOCOL_MAX_SIZE, &timestamp_ns);
+        if (size <= 0)
+        {
+            ret = size;
+            break;
+        }
+
+        if ((config->stream_name[0] != 0)
+            && ((size < (int)sizeof(struct VBanHeader)) || (hdr->vban != VBAN_HEADER_FOURC)
+                || strncmp(hdr->streamname, config->stream_name, VBAN_STREAM_NAME_SIZE)))
+        {
+            continue;
+        }
+
+        if (first_ns == 0)
+        {
+            first_ns = timestamp_ns;
+        }
+        offset = (timestamp_ns >= first_ns) ? (double)(timestamp_ns - first_ns) : 0.0;
+
+        if (config->speed != 0.0)
+        {
+            deadline = start + offset / config->speed + replay_random(main_s) * config->jitter_ms * 1e6;
+            deadline = (deadline < previous) ? previous : deadline;
+            previous = deadline;
+            now = replay_now();
+            if (now < deadline)
+            {
+                replay_sleep_until(deadline);
+            }
+            else
+            {
+                main_s->nb_late += ((now - deadline) > REPLAY_LATE_NS);
+                if (now - deadline > main_s->max_late_ns)
+                {
+                    main_s->max_late_ns = now - deadline;
+                }
+            }
+        }
+
+        if (socket_write(main_s->socket, main_s->buffer, size) < 0)
+        {
+            ret = -1;
+            break;
+        }
+        ++main_s->nb_packets;
+    }
+
+    pcapng_release(&main_s->capture);
+
+    *duration = (config->speed != 0.0) ? offset / config->speed : 0.0;
+
+    return ret;
+}
+
+int main(int argc, char* const* argv)
+{
+    int ret = 0;
+    struct config_t config;
+    struct main_t main_s;
+    unsigned int loop;
+    double start;
+    double loop_start;
+    double duration = 0.0;
+
+    printf("%s version %s\n\n", argv[0], VBAN_VERSION);
+
+    memset(&config, 0, sizeof(struct config_t));
+    memset(&main_s, 0, sizeof(struct main_t));
+
+    ret = get_options(&config, argc, argv);
+    if (ret != 0)
+    {
+        return ret;
+    }
+
+    signal(SIGINT, signalHandler);
+    signal(SIGTERM, signalHandler);
+
+    main_s.random_state = (config.seed != 0) ? config.seed : 1;
+
+    ret = socket_init(&main_s.socket, &config.socket);
+    if (ret != 0)
+    {
+        return ret;
+    }
+
+    start = replay_now();
+    loop_start = start;
+    for (loop = 0; MainRun && ((config.loops == 0) || (loop != config.loops)); ++loop)
+    {
+        ret = replay_once(&config, &main_s, loop_start, &duration);
+        if (ret != 0)
+        {
+            break;
+        }
+        /* next loop starts where this one ended */
+        loop_start += duration;
+        if (main_s.nb_packets == 0)
+        {
+            logger_log(LOG_ERROR, "%s: no datagram to replay in %s", __func__, config.path);
+            ret = 1;
+            break;
+        }
+    }
+
+    printf("%lu datagrams sent in %.3f s, %lu late (%.3f ms at most)\n",
+        main_s.nb_packets, (replay_now() - start) / 1e9, main_s.nb_late, main_s.max_late_ns / 1e6);
+
+    socket_release(&main_s.socket);
+
+    return (ret != 0) ? 1 : 0;
+}